@@ -0,0 +1,86 @@
+/* Code to compare the naive and blocked CPU matrix multiplications
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Number of times to repeat each multiplication
+#define NSTATS 3
+
+// Average time in seconds of a CPU matrix multiplication 
+template<typename T>
+double time_mat_mult(
+        void (*mat_mult)(T*, T*, T*, size_t, size_t, size_t),
+        T* A, T* B, T* C, 
+        size_t N1_A, size_t N0_C, size_t N1_C) {
+
+    double total = 0.0;
+    for (int s=0; s<NSTATS; s++) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        mat_mult(A, B, C, N1_A, N0_C, N1_C);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        total += std::chrono::duration<double>(t2-t1).count();
+    }
+    return total/(double)NSTATS;
+}
+
+// Compare the two implementations for one size
+template<typename T>
+void benchmark(const char* type_name, size_t N1_A, size_t N0_C, size_t N1_C) {
+
+    T* A = (T*)calloc(N0_C*N1_A, sizeof(T));
+    T* B = (T*)calloc(N1_A*N1_C, sizeof(T));
+    T* C_naive = (T*)calloc(N0_C*N1_C, sizeof(T));
+    T* C_blocked = (T*)calloc(N0_C*N1_C, sizeof(T));
+
+    m_random(A, N0_C, N1_A);
+    m_random(B, N1_A, N1_C);
+
+    // Number of floating point operations
+    double nflops = 2.0*(double)N0_C*(double)N1_C*(double)N1_A;
+
+    double naive_s = time_mat_mult(m_mat_mult_naive<T>, A, B, C_naive, N1_A, N0_C, N1_C);
+    double blocked_s = time_mat_mult(m_mat_mult<T>, A, B, C_blocked, N1_A, N0_C, N1_C);
+
+    std::printf("%-6s (%5zu,%5zu)x(%5zu,%5zu): naive %8.2f GFLOP/s, blocked %8.2f GFLOP/s, speedup %6.1fx, ",
+        type_name, N0_C, N1_A, N1_A, N1_C,
+        1.0e-9*nflops/naive_s, 1.0e-9*nflops/blocked_s, naive_s/blocked_s);
+
+    // Check the blocked answer against the naive one
+    m_max_error(C_blocked, C_naive, N0_C, N1_C);
+
+    free(A);
+    free(B);
+    free(C_naive);
+    free(C_blocked);
+}
+
+int main(int argc, char** argv) {
+
+    // Square sizes, and an awkward size used in the lessons
+    const size_t nsizes = 5;
+    const size_t sizes[nsizes][3] = {
+        {128, 128, 128},
+        {256, 256, 256},
+        {512, 512, 512},
+        {1024, 1024, 1024},
+        {1032, 520, 1032}
+    };
+
+    for (size_t n=0; n<nsizes; n++) {
+        benchmark<float>("float", sizes[n][0], sizes[n][1], sizes[n][2]);
+    }
+
+    for (size_t n=0; n<nsizes; n++) {
+        benchmark<double>("double", sizes[n][0], sizes[n][1], sizes[n][2]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+/* Code to compare allocation latency of a buffer pool against clCreateBuffer
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Number of allocations to time
+#define NALLOCS 2000
+
+// Number of buffers held at once, like the buffers of a loop iteration
+#define NLIVE 4
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+
+    // Do we enable out-of-order execution
+    cl_bool ordering = CL_FALSE;
+
+    // Do we enable profiling?
+    cl_bool profiling = CL_FALSE;
+
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+
+    // Report on the device in use
+    h_report_on_device(device);
+
+    // Sizes of the allocations to cycle through, in bytes
+    const size_t nsizes = 5;
+    const size_t sizes[nsizes] = { 1024, 65536, 1000000, 4194304, 20971520 };
+
+    // Buffers that are alive at the same time
+    cl_mem buffers[NLIVE];
+
+    // Value to fill with, this makes sure memory is backed on the device
+    float_type zero = 0.0f;
+
+    //// Time raw clCreateBuffer and clReleaseMemObject ////
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    for (size_t n=0; n<NALLOCS; n++) {
+        size_t slot = n % NLIVE;
+        if (n >= NLIVE) {
+            H_ERRCHK(clReleaseMemObject(buffers[slot]));
+        }
+
+        buffers[slot] = clCreateBuffer(
+            context,
+            CL_MEM_READ_WRITE,
+            sizes[n % nsizes],
+            NULL,
+            &errcode
+        );
+        H_ERRCHK(errcode);
+
+        H_ERRCHK(
+            clEnqueueFillBuffer(
+                command_queue,
+                buffers[slot],
+                &zero,
+                sizeof(float_type),
+                0,
+                sizeof(float_type),
+                0,
+                NULL,
+                NULL
+            )
+        );
+    }
+    H_ERRCHK(clFinish(command_queue));
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    for (size_t n=0; n<NLIVE; n++) {
+        H_ERRCHK(clReleaseMemObject(buffers[n]));
+    }
+
+    cl_double raw_us = (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count();
+
+    //// Time the buffer pool ////
+
+    // Slabs of 64 MB
+    h_buffer_pool_t* pool = h_create_buffer_pool(
+        context,
+        device,
+        CL_MEM_READ_WRITE,
+        (size_t)1 << 26
+    );
+
+    t1 = std::chrono::high_resolution_clock::now();
+
+    for (size_t n=0; n<NALLOCS; n++) {
+        size_t slot = n % NLIVE;
+        if (n >= NLIVE) {
+            h_buffer_pool_release(pool, buffers[slot]);
+        }
+
+        buffers[slot] = h_buffer_pool_acquire(pool, sizes[n % nsizes]);
+
+        H_ERRCHK(
+            clEnqueueFillBuffer(
+                command_queue,
+                buffers[slot],
+                &zero,
+                sizeof(float_type),
+                0,
+                sizeof(float_type),
+                0,
+                NULL,
+                NULL
+            )
+        );
+    }
+    H_ERRCHK(clFinish(command_queue));
+
+    t2 = std::chrono::high_resolution_clock::now();
+
+    for (size_t n=0; n<NLIVE; n++) {
+        h_buffer_pool_release(pool, buffers[n]);
+    }
+
+    cl_double pool_us = (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count();
+
+    // Report the results
+    std::printf("clCreateBuffer: %.3f us per allocation\n", raw_us/(cl_double)NALLOCS);
+    std::printf("Buffer pool:    %.3f us per allocation\n", pool_us/(cl_double)NALLOCS);
+    std::printf("Speedup:        %.2fx\n", raw_us/pool_us);
+    h_report_buffer_pool(pool);
+
+    // Clean up the pool
+    h_release_buffer_pool(pool);
+
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues,
+        num_command_queues
+    );
+
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
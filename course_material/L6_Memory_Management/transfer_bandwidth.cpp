@@ -0,0 +1,221 @@
+/* Code to compare host <-> device bandwidth for pageable, pinned, and mapped transfers
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Number of times to repeat each transfer
+#define NSTATS 10
+
+// Number of slots in the staging ring, and the size of each slot
+#define NSLOTS 4
+#define SLOT_BYTES 4194304
+
+// Time since t1 in milliseconds
+cl_double elapsed_ms(std::chrono::high_resolution_clock::time_point t1) {
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+
+    // Do we enable out-of-order execution
+    cl_bool ordering = CL_FALSE;
+
+    // Do we enable profiling?
+    cl_bool profiling = CL_FALSE;
+
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+
+    // Report on the device in use
+    h_report_on_device(device);
+
+    // Largest transfer to try, limited by the maximum allocation size
+    cl_ulong max_alloc_bytes;
+    H_ERRCHK(
+        clGetDeviceInfo(
+            device,
+            CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+            sizeof(cl_ulong),
+            &max_alloc_bytes,
+            NULL
+        )
+    );
+    size_t max_bytes = std::min((size_t)1 << 28, (size_t)max_alloc_bytes/2);
+
+    // Pageable host memory for the source and destination of transfers
+    char* src_h = (char*)h_alloc(max_bytes);
+    char* dst_h = (char*)h_alloc(max_bytes);
+    for (size_t n=0; n<max_bytes; n++) {
+        src_h[n] = (char)(n % 251);
+    }
+
+    // Device buffer for plain and staged transfers
+    cl_mem buffer_d = clCreateBuffer(
+        context,
+        CL_MEM_READ_WRITE,
+        max_bytes,
+        NULL,
+        &errcode
+    );
+    H_ERRCHK(errcode);
+
+    // Device buffer backed by host-accessible memory for mapped transfers
+    cl_mem mapped_d = clCreateBuffer(
+        context,
+        CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+        max_bytes,
+        NULL,
+        &errcode
+    );
+    H_ERRCHK(errcode);
+
+    // Ring of pinned staging buffers
+    h_staging_ring_t* ring = h_create_staging_ring(
+        context,
+        command_queue,
+        NSLOTS,
+        SLOT_BYTES
+    );
+
+    std::printf("%12s %14s %14s %14s %14s %14s %14s\n", "bytes",
+        "pageable up", "pageable down",
+        "pinned up", "pinned down",
+        "mapped up", "mapped down");
+
+    // Loop over transfer sizes, from 64 KB upwards
+    for (size_t nbytes=(size_t)1 << 16; nbytes<=max_bytes; nbytes*=4) {
+
+        // Times in milliseconds for each path
+        cl_double times_ms[6] = {0.0};
+
+        for (int s=0; s<NSTATS; s++) {
+
+            // Pageable upload and download
+            auto t1 = std::chrono::high_resolution_clock::now();
+            H_ERRCHK(clEnqueueWriteBuffer(command_queue, buffer_d, CL_TRUE,
+                0, nbytes, src_h, 0, NULL, NULL));
+            times_ms[0] += elapsed_ms(t1);
+
+            t1 = std::chrono::high_resolution_clock::now();
+            H_ERRCHK(clEnqueueReadBuffer(command_queue, buffer_d, CL_TRUE,
+                0, nbytes, dst_h, 0, NULL, NULL));
+            times_ms[1] += elapsed_ms(t1);
+
+            // Pinned upload and download through the staging ring
+            t1 = std::chrono::high_resolution_clock::now();
+            h_staging_write(ring, command_queue, buffer_d, 0, src_h, nbytes);
+            H_ERRCHK(clFinish(command_queue));
+            times_ms[2] += elapsed_ms(t1);
+
+            t1 = std::chrono::high_resolution_clock::now();
+            h_staging_read(ring, command_queue, buffer_d, 0, dst_h, nbytes);
+            times_ms[3] += elapsed_ms(t1);
+
+            // Mapped upload
+            t1 = std::chrono::high_resolution_clock::now();
+            void* ptr = clEnqueueMapBuffer(command_queue, mapped_d, CL_TRUE,
+                CL_MAP_WRITE_INVALIDATE_REGION, 0, nbytes, 0, NULL, NULL, &errcode);
+            H_ERRCHK(errcode);
+            std::memcpy(ptr, src_h, nbytes);
+            H_ERRCHK(clEnqueueUnmapMemObject(command_queue, mapped_d, ptr, 0, NULL, NULL));
+            H_ERRCHK(clFinish(command_queue));
+            times_ms[4] += elapsed_ms(t1);
+
+            // Mapped download
+            t1 = std::chrono::high_resolution_clock::now();
+            ptr = clEnqueueMapBuffer(command_queue, mapped_d, CL_TRUE,
+                CL_MAP_READ, 0, nbytes, 0, NULL, NULL, &errcode);
+            H_ERRCHK(errcode);
+            std::memcpy(dst_h, ptr, nbytes);
+            H_ERRCHK(clEnqueueUnmapMemObject(command_queue, mapped_d, ptr, 0, NULL, NULL));
+            H_ERRCHK(clFinish(command_queue));
+            times_ms[5] += elapsed_ms(t1);
+        }
+
+        // Make sure the data made the round trip
+        assert(std::memcmp(src_h, dst_h, nbytes)==0);
+
+        std::printf("%12zu", nbytes);
+        for (int p=0; p<6; p++) {
+            cl_double avg_ms = times_ms[p]/(cl_double)NSTATS;
+            std::printf(" %9.1f MB/s", h_get_io_rate_MBs(avg_ms, nbytes));
+        }
+        std::printf("\n");
+    }
+
+    // Clean up
+    h_release_staging_ring(ring);
+    H_ERRCHK(clReleaseMemObject(buffer_d));
+    H_ERRCHK(clReleaseMemObject(mapped_d));
+    free(src_h);
+    free(dst_h);
+
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues,
+        num_command_queues
+    );
+
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
@@ -21,6 +21,10 @@ class Exp:
         self.cmds[0] = os.path.join(os.getcwd(), self.cmds[0]) 
 
 ### Modify this section
+
+# benchmark_runner.exe measures the same kernels natively with warmup,
+# confidence intervals, and GFLOP/s, and writes JSON in the same format.
+# Compare two result files with benchmark_runner.exe --diff=base.json,new.json
                 
 output_file = "benchmark.json"
                 
@@ -40,11 +44,24 @@ experiments = {
     "Transpose A" : "mat_mult_AT.exe",
     "Tile local AB" : "mat_mult_tile_local_AB.exe",
     "Tile local AB vector" : "mat_mult_tile_local_AB_vector.exe",
+    "Tile local AB register" : "mat_mult_tile_local_AB_register.exe",
+    "Tile local AB half" : "mat_mult_tile_local_AB_half.exe",
+    "Tile local AB vector half" : "mat_mult_tile_local_AB_vector_half.exe",
     "Tile local A" : "mat_mult_tile_local_A.exe",
     "Tile local A vector" : "mat_mult_tile_local_A_vector.exe",
     "Tile local B" : "mat_mult_tile_local_B.exe",
     "Tile local B vector" : "mat_mult_tile_local_B_vector.exe",
-    "CLBlast" : "mat_mult_clblast.exe"
+    "CLBlast" : "mat_mult_clblast.exe",
+    # Awkward sizes (520x1027)x(1027x1032) without padding
+    "Tile local AB ragged" : "mat_mult_tile_local_AB_ragged.exe",
+    "Tile local AB vector ragged" : "mat_mult_tile_local_AB_vector_ragged.exe",
+    "Tile local AB register ragged" : "mat_mult_tile_local_AB_register_ragged.exe",
+    "Tile local AB half ragged" : "mat_mult_tile_local_AB_half_ragged.exe",
+    "Tile local AB vector half ragged" : "mat_mult_tile_local_AB_vector_half_ragged.exe",
+    "Tile local A ragged" : "mat_mult_tile_local_A_ragged.exe",
+    "Tile local A vector ragged" : "mat_mult_tile_local_A_vector_ragged.exe",
+    "Tile local B ragged" : "mat_mult_tile_local_B_ragged.exe",
+    "Tile local B vector ragged" : "mat_mult_tile_local_B_vector_ragged.exe"
 }
 
 # Make up the input specification
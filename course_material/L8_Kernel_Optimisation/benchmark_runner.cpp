@@ -0,0 +1,580 @@
+/* Native benchmark runner for the matrix multiply kernels. Each kernel is
+warmed up, then repeated until the 95% confidence interval of its mean time
+converges, for every local size in the sweep. Results are written as JSON
+that LocalOpt can import, with GFLOP/s and GB/s for the fastest local size.
+
+    benchmark_runner.exe [-gpu|-cpu] [index] [--output=file.json] [--baseline=file.json]
+        [--filter=text] [--max-local=N] [--threshold=fraction]
+    benchmark_runner.exe --diff=base.json,new.json [--threshold=fraction]
+
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <map>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the generated GEMM kernels
+#include "gemm_helper.hpp"
+
+// Bring in the benchmark runner
+#include "bench_helper.hpp"
+
+// Tiling of mat_mult_tile_local_AB_register.cpp, passed to its kernel with -D
+#define WPT0 4
+#define WPT1 4
+#define TSK 16
+
+// Set the size of a local memory argument from the local size
+struct local_arg_t {
+    // Argument index, dimension of the local size, and bytes per work-item
+    cl_uint index;
+    size_t dim;
+    size_t nbytes_line;
+};
+
+cl_int prep_local_arg(cl_kernel kernel, 
+                 size_t* local_size,
+                 size_t* global_size,
+                 size_t ndim,
+                 void* data) {
+    local_arg_t* arg = (local_arg_t*)data;
+    return clSetKernelArg(kernel, arg->index, local_size[arg->dim]*arg->nbytes_line, NULL);
+}
+
+// Arguments of the "Tile local" kernels that depend on the local size
+struct tile_arg_t {
+    // Which of A and B are staged in local memory
+    bool local_A;
+    bool local_B;
+    // Elements of the inner dimension in each chunk, and bytes of local memory per line
+    cl_uint chunk_len;
+    size_t nbytes_line;
+    cl_uint N1_A;
+    cl_uint N0_C;
+    cl_uint N1_C;
+};
+
+cl_int prep_tile_arg(cl_kernel kernel, 
+                 size_t* local_size,
+                 size_t* global_size,
+                 size_t ndim,
+                 void* data) {
+    tile_arg_t* arg = (tile_arg_t*)data;
+    cl_int errcode = CL_SUCCESS;
+    cl_uint index = 3;
+
+    // shared_A is of size (local_size[1], chunk_len), shared_B of size (local_size[0], chunk_len)
+    if (arg->local_A) {
+        errcode = errcode | clSetKernelArg(kernel, index++, local_size[1]*arg->nbytes_line, NULL);
+    }
+    if (arg->local_B) {
+        errcode = errcode | clSetKernelArg(kernel, index++, local_size[0]*arg->nbytes_line, NULL);
+    }
+
+    // Every chunk of the inner dimension, the kernels handle a ragged last chunk
+    cl_uint start_chunk_id = 0;
+    cl_uint end_chunk_id = arg->N1_A/arg->chunk_len + ((arg->N1_A % arg->chunk_len) ? 1 : 0);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &arg->N1_A);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &arg->N0_C);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &arg->N1_C);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &arg->chunk_len);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &start_chunk_id);
+    errcode = errcode | clSetKernelArg(kernel, index++, sizeof(cl_uint), &end_chunk_id);
+    return errcode;
+}
+
+cl_int prep_register_arg(cl_kernel kernel, 
+                 size_t* local_size,
+                 size_t* global_size,
+                 size_t ndim,
+                 void* data) {
+    tile_arg_t* arg = (tile_arg_t*)data;
+    cl_int errcode = CL_SUCCESS;
+
+    // Two tiles of A of size (local_size[1]*WPT0, TSK), two of B of size (TSK, local_size[0]*WPT1)
+    errcode = errcode | clSetKernelArg(kernel, 3, 2*local_size[1]*WPT0*TSK*sizeof(cl_float), NULL);
+    errcode = errcode | clSetKernelArg(kernel, 4, 2*TSK*local_size[0]*WPT1*sizeof(cl_float), NULL);
+    errcode = errcode | clSetKernelArg(kernel, 5, sizeof(cl_uint), &arg->N1_A);
+    errcode = errcode | clSetKernelArg(kernel, 6, sizeof(cl_uint), &arg->N0_C);
+    errcode = errcode | clSetKernelArg(kernel, 7, sizeof(cl_uint), &arg->N1_C);
+    return errcode;
+}
+
+// Kernel source from a file. The lesson drivers embed their kernels in a raw 
+// string literal, so for a .cpp file only the text inside R"( and )" is kept
+std::string read_kernel_source(const char* filename) {
+    size_t nbytes = 0;
+    char* buffer = (char*)h_read_binary(filename, &nbytes);
+    std::string text(buffer, nbytes);
+    free(buffer);
+
+    size_t start = text.find("R\"(");
+    if ((std::strstr(filename, ".cpp") == NULL) || (start == std::string::npos)) {
+        return text;
+    }
+    start += 3;
+    size_t end = text.find(")\";", start);
+    if (end == std::string::npos) {
+        std::printf("Error, no end to the kernel source in %s\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    return text.substr(start, end-start);
+}
+
+int main(int argc, char** argv) {
+
+    // Options for the runner
+    const char* output_file = "benchmark_native.json";
+    const char* baseline_file = NULL;
+    const char* filter = NULL;
+    std::string diff_files;
+    size_t max_local = 512;
+    cl_double threshold = 0.05;
+    for (int n=1; n<argc; n++) {
+        if (std::strncmp(argv[n], "--output=", 9)==0) output_file = argv[n]+9;
+        if (std::strncmp(argv[n], "--baseline=", 11)==0) baseline_file = argv[n]+11;
+        if (std::strncmp(argv[n], "--filter=", 9)==0) filter = argv[n]+9;
+        if (std::strncmp(argv[n], "--diff=", 7)==0) diff_files = argv[n]+7;
+        if (std::strncmp(argv[n], "--max-local=", 12)==0) max_local = std::atol(argv[n]+12);
+        if (std::strncmp(argv[n], "--threshold=", 12)==0) threshold = std::atof(argv[n]+12);
+    }
+
+    // Only compare two existing files, no device needed
+    if (diff_files.size() > 0) {
+        size_t comma = diff_files.find(',');
+        if (comma == std::string::npos) {
+            std::printf("Usage: --diff=base.json,new.json\n");
+            exit(EXIT_FAILURE);
+        }
+        std::string base_file = diff_files.substr(0, comma);
+        std::string new_file = diff_files.substr(comma+1);
+        size_t nregressions = h_bench_diff(base_file.c_str(), new_file.c_str(), threshold);
+        return (nregressions > 0) ? 1 : 0;
+    }
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    // Labels follow benchmark.py, so results can be compared with its files
+    cl_device_type device_type;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &device_type, NULL)
+    );
+    std::string suffix = std::string((device_type & CL_DEVICE_TYPE_GPU) ? " (GPU)" : " (CPU)")
+        + "[" + std::to_string(dev_index) + "]";
+
+    //// Step 4. Prepare matrices and buffers ////
+
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+    size_t nelements_A = (size_t)N0_C*N1_A;
+    size_t nelements_B = (size_t)N1_A*N1_C;
+    size_t nelements_C = (size_t)N0_C*N1_C;
+
+    cl_float* A_h = (cl_float*)h_alloc(nelements_A*sizeof(cl_float));
+    cl_float* B_h = (cl_float*)h_alloc(nelements_B*sizeof(cl_float));
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+
+    // The transposed kernels get the same buffers since only timing 
+    // matters here, the double precision operands are zero
+    cl_mem A_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nelements_A*sizeof(cl_float), A_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nelements_B*sizeof(cl_float), B_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+        nelements_C*sizeof(cl_double), NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem A_double_d = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+        nelements_A*sizeof(cl_double), NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_double_d = clCreateBuffer(context, CL_MEM_READ_ONLY, 
+        nelements_B*sizeof(cl_double), NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_double zero = 0.0;
+    H_ERRCHK(clEnqueueFillBuffer(command_queue, A_double_d, &zero, sizeof(cl_double),
+        0, nelements_A*sizeof(cl_double), 0, NULL, NULL));
+    H_ERRCHK(clEnqueueFillBuffer(command_queue, B_double_d, &zero, sizeof(cl_double),
+        0, nelements_B*sizeof(cl_double), 0, NULL, NULL));
+
+    //// Step 5. Register the kernels ////
+
+    // Half precision copies for the "Tile local AB half" kernel
+    cl_half* A_half_h = (cl_half*)h_alloc(nelements_A*sizeof(cl_half));
+    cl_half* B_half_h = (cl_half*)h_alloc(nelements_B*sizeof(cl_half));
+    m_to_half(A_h, A_half_h, N0_C, N1_A);
+    m_to_half(B_h, B_half_h, N1_A, N1_C);
+    cl_mem A_half_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nelements_A*sizeof(cl_half), A_half_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_half_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nelements_B*sizeof(cl_half), B_half_h, &errcode);
+    H_ERRCHK(errcode);
+
+    // Chunk lengths along N1_A follow the drivers, from the cache line size
+    cl_uint cache_line_bytes = 64;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,
+            sizeof(cl_uint), &cache_line_bytes, NULL)
+    );
+    cache_line_bytes = std::max(cache_line_bytes, (cl_uint)64);
+    cl_uint chunk_len = 4*cache_line_bytes/sizeof(cl_float);
+    cl_uint chunk_len_vector = h_lcm(8*cache_line_bytes/sizeof(cl_float), 8);
+    cl_uint chunk_len_half = 4*cache_line_bytes/sizeof(cl_half);
+    cl_uint chunk_len_vector_half = h_lcm(chunk_len_half, 8);
+
+    // Read half values natively when the device supports cl_khr_fp16
+    char extensions[4096] = {0};
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, sizeof(extensions)-1, extensions, NULL)
+    );
+    const char* half_options = (std::strstr(extensions, "cl_khr_fp16") != NULL) ? "-DUSE_FP16" : "";
+    std::string register_options = "-DWPT0=" + std::to_string(WPT0)
+        + " -DWPT1=" + std::to_string(WPT1)
+        + " -DTSK=" + std::to_string(TSK);
+
+    // Work per run, every element of A, B, and C moves at least once
+    cl_double flops = 2.0*(cl_double)N0_C*(cl_double)N1_C*(cl_double)N1_A;
+    cl_double bytes_float = (cl_double)(nelements_A+nelements_B+nelements_C)*sizeof(cl_float);
+    cl_double bytes_half = (cl_double)(nelements_A+nelements_B)*sizeof(cl_half)
+        + (cl_double)nelements_C*sizeof(cl_float);
+
+    // Local memory of N1_A floats per row or column of the work-group
+    local_arg_t local_A = {3, 1, N1_A*sizeof(cl_float)};
+    local_arg_t local_B = {3, 0, N1_A*sizeof(cl_float)};
+
+    // Chunked local memory for the "Tile local" kernels
+    tile_arg_t tile_AB = {true, true, chunk_len, chunk_len*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_A = {true, false, chunk_len, chunk_len*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_B = {false, true, chunk_len, chunk_len*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_AB_vector = {true, true, chunk_len_vector, 
+        chunk_len_vector*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_A_vector = {true, false, chunk_len_vector, 
+        chunk_len_vector*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_B_vector = {false, true, chunk_len_vector, 
+        chunk_len_vector*sizeof(cl_float), N1_A, N0_C, N1_C};
+    // Half values are widened to float in local memory
+    tile_arg_t tile_AB_half = {true, true, chunk_len_half, 
+        chunk_len_half*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_AB_vector_half = {true, true, chunk_len_vector_half, 
+        chunk_len_vector_half*sizeof(cl_float), N1_A, N0_C, N1_C};
+    tile_arg_t tile_AB_register = {true, true, TSK, 0, N1_A, N0_C, N1_C};
+
+    // Time the transposes that mat_mult_BT.cpp and mat_mult_AT.cpp run 
+    // before their multiply, benchmark.py reports the sum of both
+    cl_program program = h_build_program(
+        read_kernel_source("kernels_mat_mult.c").c_str(), context, device, NULL);
+    cl_mem T_d = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+        std::max(nelements_A, nelements_B)*sizeof(cl_float), NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_kernel kernel_transpose = clCreateKernel(program, "transpose", &errcode);
+    H_ERRCHK(errcode);
+
+    h_bench_config_t config = h_bench_default_config();
+    cl_double transpose_ms[2] = {0.0, 0.0};
+    cl_mem transpose_src[2] = {B_d, A_d};
+    cl_uint transpose_shape[2][2] = {{N1_A, N1_C}, {N0_C, N1_A}};
+    for (int t=0; t<2; t++) {
+        cl_uint N0_src = transpose_shape[t][0], N1_src = transpose_shape[t][1];
+        H_ERRCHK(clSetKernelArg(kernel_transpose, 0, sizeof(cl_mem), &transpose_src[t]));
+        H_ERRCHK(clSetKernelArg(kernel_transpose, 1, sizeof(cl_mem), &T_d));
+        H_ERRCHK(clSetKernelArg(kernel_transpose, 2, sizeof(cl_uint), &N0_src));
+        H_ERRCHK(clSetKernelArg(kernel_transpose, 3, sizeof(cl_uint), &N1_src));
+
+        h_bench_t bench;
+        bench.kernel = kernel_transpose;
+        bench.ndim = 2;
+        bench.global_size[0] = N1_src;
+        bench.global_size[1] = N0_src;
+        bench.prep_kernel = NULL;
+        bench.prep_data = NULL;
+        bench.offset_ms = 0.0;
+        size_t local_size[] = {std::min((size_t)16, (size_t)N1_src), 
+            std::min((size_t)16, (size_t)N0_src), 1};
+        h_bench_stats_t stats;
+        if (h_bench_measure(command_queue, &bench, local_size, &config, &stats)) {
+            transpose_ms[t] = stats.mean_ms;
+        }
+    }
+
+    enum operand_t { OPERAND_FLOAT, OPERAND_DOUBLE, OPERAND_HALF };
+
+    struct entry_t {
+        const char* label;
+        // Sources ending in .cpp are lesson drivers with an embedded kernel
+        const char* source_file;
+        const char* kernel_name;
+        const char* options;
+        operand_t operand;
+        // Sets local memory and any arguments that depend on the local size
+        cl_int (*prep_kernel)(cl_kernel, size_t*, size_t*, size_t, void*);
+        void* prep_data;
+        // Elements of C computed by each work-item along each dimension
+        size_t work0;
+        size_t work1;
+        cl_double offset_ms;
+    };
+    entry_t entries[] = {
+        {"Double precision", "kernels_mat_mult.c", "mat_mult_double", "", 
+            OPERAND_DOUBLE, NULL, NULL, 1, 1, 0.0},
+        {"Single precision", "kernels_mat_mult.c", "mat_mult_float", "", 
+            OPERAND_FLOAT, NULL, NULL, 1, 1, 0.0},
+        {"Prefetch on A", "kernels_mat_mult.c", "mat_mult_prefetch", "", 
+            OPERAND_FLOAT, NULL, NULL, 1, 1, 0.0},
+        {"Local A", "kernels_mat_mult.c", "mat_mult_local_A", "", 
+            OPERAND_FLOAT, prep_local_arg, &local_A, 1, 1, 0.0},
+        {"Local B", "kernels_mat_mult.c", "mat_mult_local_B", "", 
+            OPERAND_FLOAT, prep_local_arg, &local_B, 1, 1, 0.0},
+        {"Transpose B", "kernels_mat_mult.c", "mat_mult_BT", "", 
+            OPERAND_FLOAT, NULL, NULL, 1, 1, transpose_ms[0]},
+        {"Transpose A", "kernels_mat_mult.c", "mat_mult_AT", "", 
+            OPERAND_FLOAT, NULL, NULL, 1, 1, transpose_ms[1]},
+        {"Tile local AB", "mat_mult_tile_local_AB.cpp", "mat_mult_tile_local_AB", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_AB, 1, 1, 0.0},
+        {"Tile local AB vector", "mat_mult_tile_local_AB_vector.cpp", 
+            "mat_mult_tile_local_AB_vector", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_AB_vector, 1, 1, 0.0},
+        {"Tile local AB register", "mat_mult_tile_local_AB_register.cpp", 
+            "mat_mult_tile_local_AB_register", register_options.c_str(), 
+            OPERAND_FLOAT, prep_register_arg, &tile_AB_register, WPT1, WPT0, 0.0},
+        {"Tile local AB half", "mat_mult_tile_local_AB_half.cpp", 
+            "mat_mult_tile_local_AB_half", half_options, 
+            OPERAND_HALF, prep_tile_arg, &tile_AB_half, 1, 1, 0.0},
+        {"Tile local AB vector half", "mat_mult_tile_local_AB_vector_half.cpp", 
+            "mat_mult_tile_local_AB_vector_half", half_options, 
+            OPERAND_HALF, prep_tile_arg, &tile_AB_vector_half, 1, 1, 0.0},
+        {"Tile local A", "mat_mult_tile_local_A.cpp", "mat_mult_tile_local_A", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_A, 1, 1, 0.0},
+        {"Tile local A vector", "mat_mult_tile_local_A_vector.cpp", 
+            "mat_mult_tile_local_A_vector", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_A_vector, 1, 1, 0.0},
+        {"Tile local B", "mat_mult_tile_local_B.cpp", "mat_mult_tile_local_B", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_B, 1, 1, 0.0},
+        {"Tile local B vector", "mat_mult_tile_local_B_vector.cpp", 
+            "mat_mult_tile_local_B_vector", "", 
+            OPERAND_FLOAT, prep_tile_arg, &tile_B_vector, 1, 1, 0.0}
+    };
+
+    // One program per source file and set of options
+    std::map<std::string, cl_program> sources;
+    sources["kernels_mat_mult.c "] = program;
+
+    std::vector<h_bench_t> benches;
+    std::vector<cl_kernel> kernels;
+    std::vector<cl_program> programs;
+    std::vector<size_t> sweep = h_bench_powers_of_two(max_local);
+
+    for (entry_t& entry : entries) {
+        h_bench_t bench;
+        bench.label = entry.label + suffix;
+        if ((filter != NULL) && (bench.label.find(filter) == std::string::npos)) continue;
+
+        std::string key = std::string(entry.source_file) + " " + entry.options;
+        if (sources.count(key) == 0) {
+            sources[key] = h_build_program(
+                read_kernel_source(entry.source_file).c_str(), context, device, entry.options);
+            programs.push_back(sources[key]);
+        }
+        bench.kernel = clCreateKernel(sources[key], entry.kernel_name, &errcode);
+        H_ERRCHK(errcode);
+        kernels.push_back(bench.kernel);
+
+        // Matrices and, where no prep function sets them, the sizes are set once
+        cl_mem A_arg = A_d, B_arg = B_d;
+        if (entry.operand == OPERAND_DOUBLE) {
+            A_arg = A_double_d;
+            B_arg = B_double_d;
+        } else if (entry.operand == OPERAND_HALF) {
+            A_arg = A_half_d;
+            B_arg = B_half_d;
+        }
+        H_ERRCHK(clSetKernelArg(bench.kernel, 0, sizeof(cl_mem), &A_arg));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 1, sizeof(cl_mem), &B_arg));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 2, sizeof(cl_mem), &C_d));
+        if ((entry.prep_kernel == NULL) || (entry.prep_kernel == prep_local_arg)) {
+            cl_uint offset = (entry.prep_kernel != NULL) ? 1 : 0;
+            H_ERRCHK(clSetKernelArg(bench.kernel, 3+offset, sizeof(cl_uint), &N1_A));
+            H_ERRCHK(clSetKernelArg(bench.kernel, 4+offset, sizeof(cl_uint), &N0_C));
+            H_ERRCHK(clSetKernelArg(bench.kernel, 5+offset, sizeof(cl_uint), &N1_C));
+        }
+
+        bench.ndim = 2;
+        bench.global_size[0] = N1_C/entry.work0 + ((N1_C % entry.work0) ? 1 : 0);
+        bench.global_size[1] = N0_C/entry.work1 + ((N0_C % entry.work1) ? 1 : 0);
+        bench.local0 = sweep;
+        bench.local1 = sweep;
+        bench.local2 = std::vector<size_t>(1, 1);
+        bench.prep_kernel = entry.prep_kernel;
+        bench.prep_data = entry.prep_data;
+        bench.flops = flops;
+        bench.bytes = bytes_float;
+        if (entry.operand == OPERAND_DOUBLE) bench.bytes = 2.0*bytes_float;
+        if (entry.operand == OPERAND_HALF) bench.bytes = bytes_half;
+        bench.offset_ms = entry.offset_ms;
+        benches.push_back(bench);
+    }
+
+    // Generated variants have a fixed work-group size and tile their own global size
+    cl_ulong local_mem_bytes;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, 
+            sizeof(cl_ulong), &local_mem_bytes, NULL)
+    );
+    for (size_t v=0; v<h_gemm_gen_nvariants; v++) {
+        const h_gemm_gen_t* gen = &h_gemm_gen_variants[v];
+        h_bench_t bench;
+        bench.label = "Generated " + std::string(gen->name) + suffix;
+        if ((filter != NULL) && (bench.label.find(filter) == std::string::npos)) continue;
+        if (h_gemm_gen_local_bytes(gen) > local_mem_bytes) continue;
+
+        cl_program gen_program;
+        bench.kernel = h_gemm_gen_build(context, device, gen, NULL, &gen_program);
+        kernels.push_back(bench.kernel);
+        programs.push_back(gen_program);
+
+        H_ERRCHK(clSetKernelArg(bench.kernel, 0, sizeof(cl_mem), &A_d));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 1, sizeof(cl_mem), &B_d));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 2, sizeof(cl_mem), &C_d));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 3, sizeof(cl_uint), &N1_A));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 4, sizeof(cl_uint), &N0_C));
+        H_ERRCHK(clSetKernelArg(bench.kernel, 5, sizeof(cl_uint), &N1_C));
+
+        bench.ndim = 2;
+        bench.global_size[0] = h_gemm_round_up(N1_C, H_GEMM_TILE*gen->reg1)/gen->reg1;
+        bench.global_size[1] = h_gemm_round_up(N0_C, H_GEMM_TILE*gen->reg0)/gen->reg0;
+        bench.local0 = std::vector<size_t>(1, H_GEMM_TILE);
+        bench.local1 = std::vector<size_t>(1, H_GEMM_TILE);
+        bench.local2 = std::vector<size_t>(1, 1);
+        bench.prep_kernel = NULL;
+        bench.prep_data = NULL;
+        bench.flops = flops;
+        bench.bytes = bytes_float;
+        bench.offset_ms = 0.0;
+        benches.push_back(bench);
+    }
+
+    //// Step 6. Run the benchmarks and write the results ////
+
+    std::vector<h_bench_result_t> results;
+    for (h_bench_t& bench : benches) {
+        results.push_back(h_bench_run(command_queue, device, &bench, &config));
+        h_bench_report(&results.back());
+    }
+    h_bench_write_json(output_file, results);
+    std::printf("Wrote %zu results to %s\n", results.size(), output_file);
+
+    // Compare with earlier results
+    size_t nregressions = 0;
+    if (baseline_file != NULL) {
+        nregressions = h_bench_diff(baseline_file, output_file, threshold);
+    }
+
+    //// Step 7. Clean up ////
+
+    for (cl_kernel kernel : kernels) {
+        H_ERRCHK(clReleaseKernel(kernel));
+    }
+    H_ERRCHK(clReleaseKernel(kernel_transpose));
+    for (cl_program entry_program : programs) {
+        H_ERRCHK(clReleaseProgram(entry_program));
+    }
+    H_ERRCHK(clReleaseProgram(program));
+
+    cl_mem buffers[] = {A_d, B_d, C_d, A_double_d, B_double_d, A_half_d, B_half_d, T_d};
+    for (cl_mem buffer : buffers) {
+        H_ERRCHK(clReleaseMemObject(buffer));
+    }
+    free(A_h);
+    free(B_h);
+    free(A_half_h);
+    free(B_half_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return (nregressions > 0) ? 1 : 0;
+}
@@ -406,3 +406,29 @@ __kernel void transpose (__global float* src,
         dest[i1*N0_src+i0]=src[i0*N1_src+i1];
     }
 }
+
+// Elementwise matrix multiply kernel
+__kernel void mat_elementwise (
+                        __global float* D, 
+                        __global float* E,
+                        __global float* F, 
+                        unsigned int N0_F,
+                        unsigned int N1_F) { 
+            
+    // F is of size (N0_F, N1_F)
+    
+    // i0 and i1 represent the coordinates in Matrix F 
+    // We assume row-major ordering for the matrices 
+    size_t i0=get_global_id(1); 
+    size_t i1=get_global_id(0); 
+
+    // Guard mechanism to make sure we do not go
+    // outside the boundaries of matrix F 
+    if ((i0<N0_F) && (i1<N1_F)) {
+        
+        // Create an offset
+        size_t offset = i0*N1_F+i1;
+        
+        F[offset]=D[offset]*E[offset];
+    }
+}
@@ -0,0 +1,310 @@
+/* Code to compare batched matrix multiplication against one launch per product
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the GEMM kernels
+#include "gemm_helper.hpp"
+
+typedef cl_float float_type;
+
+// Number of times to repeat each experiment
+#define NSTATS 5
+
+// Time since t1 in milliseconds
+cl_double elapsed_ms(std::chrono::high_resolution_clock::time_point t1) {
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_FALSE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    //// Step 4. Build the kernels ////
+
+    // Batched kernels
+    h_gemm_t* gemm = h_create_gemm(context, device, NULL);
+
+    // Single product kernel
+    size_t nbytes_src = 0;
+    char* kernel_source = (char*)h_read_binary("kernels_mat_mult.c", &nbytes_src);
+    cl_program program = h_build_program(kernel_source, context, device, NULL);
+    cl_kernel kernel = clCreateKernel(program, "mat_mult_float", &errcode);
+    H_ERRCHK(errcode);
+
+    // Sub-buffers must start on this alignment
+    cl_uint align_bits;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+            sizeof(cl_uint), &align_bits, NULL)
+    );
+    size_t align_elements = std::max((size_t)align_bits/(8*sizeof(float_type)), (size_t)1);
+
+    //// Step 5. Sweep over matrix size and batch count ////
+
+    const size_t nsizes = 4;
+    const cl_uint sizes[nsizes] = {8, 16, 32, 64};
+    const size_t nbatches = 4;
+    const cl_uint batches[nbatches] = {1, 16, 256, 4096};
+
+    std::printf("%6s %6s %14s %14s %14s %10s %10s\n", "size", "batch", 
+        "loop (ms)", "strided (ms)", "offsets (ms)", "speedup", "max error");
+
+    for (size_t s=0; s<nsizes; s++) {
+        for (size_t b=0; b<nbatches; b++) {
+            
+            // Square matrices for simplicity
+            cl_uint N1_A = sizes[s], N0_C = sizes[s], N1_C = sizes[s];
+            cl_uint batch = batches[b];
+
+            // Stride between matrices, padded so each matrix can be a sub-buffer
+            size_t nelements = (size_t)N0_C*N1_A;
+            size_t stride = ((nelements+align_elements-1)/align_elements)*align_elements;
+            size_t nbytes = batch*stride*sizeof(float_type);
+
+            float_type* A_h = (float_type*)h_alloc(nbytes);
+            float_type* B_h = (float_type*)h_alloc(nbytes);
+            float_type* C_h = (float_type*)h_alloc(nbytes);
+            float_type* C_loop_h = (float_type*)h_alloc(nbytes);
+            m_random(A_h, batch, stride);
+            m_random(B_h, batch, stride);
+
+            cl_mem A_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                nbytes, A_h, &errcode);
+            H_ERRCHK(errcode);
+            cl_mem B_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                nbytes, B_h, &errcode);
+            H_ERRCHK(errcode);
+            cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, 
+                nbytes, NULL, &errcode);
+            H_ERRCHK(errcode);
+
+            // Sub-buffers for one launch per product
+            cl_mem* A_sub = (cl_mem*)calloc(batch, sizeof(cl_mem));
+            cl_mem* B_sub = (cl_mem*)calloc(batch, sizeof(cl_mem));
+            cl_mem* C_sub = (cl_mem*)calloc(batch, sizeof(cl_mem));
+            for (cl_uint n=0; n<batch; n++) {
+                cl_buffer_region region = {n*stride*sizeof(float_type), nelements*sizeof(float_type)};
+                A_sub[n] = clCreateSubBuffer(A_d, CL_MEM_READ_ONLY, 
+                    CL_BUFFER_CREATE_TYPE_REGION, &region, &errcode);
+                H_ERRCHK(errcode);
+                B_sub[n] = clCreateSubBuffer(B_d, CL_MEM_READ_ONLY, 
+                    CL_BUFFER_CREATE_TYPE_REGION, &region, &errcode);
+                H_ERRCHK(errcode);
+                C_sub[n] = clCreateSubBuffer(C_d, CL_MEM_READ_WRITE, 
+                    CL_BUFFER_CREATE_TYPE_REGION, &region, &errcode);
+                H_ERRCHK(errcode);
+            }
+
+            // Independent offset tables for A, B, and C, product n of the batch 
+            // is C[index_C[n]] = A[index_A[n]]*B[index_B[n]]
+            cl_uint* index_h[3];
+            cl_ulong* offsets_h[3];
+            cl_mem offsets_d[3];
+            for (int k=0; k<3; k++) {
+                index_h[k] = (cl_uint*)calloc(batch, sizeof(cl_uint));
+                offsets_h[k] = (cl_ulong*)calloc(batch, sizeof(cl_ulong));
+                for (cl_uint n=0; n<batch; n++) {
+                    if (k==0) index_h[k][n] = batch-1-n;
+                    if (k==1) index_h[k][n] = (n+1)%batch;
+                    if (k==2) index_h[k][n] = (n+batch/2)%batch;
+                    offsets_h[k][n] = (cl_ulong)index_h[k][n]*stride;
+                }
+                offsets_d[k] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    batch*sizeof(cl_ulong), offsets_h[k], &errcode);
+                H_ERRCHK(errcode);
+            }
+
+            size_t local_size[] = {8, 8};
+            size_t global_size[] = {N1_C, N0_C};
+            cl_double loop_ms = 0.0, strided_ms = 0.0, offsets_ms = 0.0;
+
+            for (int r=0; r<NSTATS; r++) {
+
+                // One launch per product
+                auto t1 = std::chrono::high_resolution_clock::now();
+                for (cl_uint n=0; n<batch; n++) {
+                    H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A_sub[n]));
+                    H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B_sub[n]));
+                    H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C_sub[n]));
+                    H_ERRCHK(clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A));
+                    H_ERRCHK(clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C));
+                    H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C));
+                    H_ERRCHK(h_enqueue_kernel(command_queue, kernel, local_size, global_size,
+                        2, 0, NULL, NULL));
+                }
+                H_ERRCHK(clFinish(command_queue));
+                loop_ms += elapsed_ms(t1);
+
+                // One strided launch for the batch
+                t1 = std::chrono::high_resolution_clock::now();
+                H_ERRCHK(h_gemm_batched_strided(gemm, command_queue, A_d, B_d, C_d,
+                    N1_A, N0_C, N1_C, batch, stride, stride, stride, 0, NULL, NULL));
+                H_ERRCHK(clFinish(command_queue));
+                strided_ms += elapsed_ms(t1);
+            }
+
+            for (int r=0; r<NSTATS; r++) {
+                // One launch with offset tables
+                auto t1 = std::chrono::high_resolution_clock::now();
+                H_ERRCHK(h_gemm_batched_offsets(gemm, command_queue, A_d, B_d, C_d,
+                    N1_A, N0_C, N1_C, batch, offsets_d[0], offsets_d[1], offsets_d[2], 0, NULL, NULL));
+                H_ERRCHK(clFinish(command_queue));
+                offsets_ms += elapsed_ms(t1);
+            }
+
+            H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+                0, nbytes, C_h, 0, NULL, NULL));
+
+            // The loop with the same tables gives the answer to check against
+            H_ERRCHK(clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A));
+            H_ERRCHK(clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C));
+            H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C));
+            for (cl_uint n=0; n<batch; n++) {
+                H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A_sub[index_h[0][n]]));
+                H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B_sub[index_h[1][n]]));
+                H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C_sub[index_h[2][n]]));
+                H_ERRCHK(h_enqueue_kernel(command_queue, kernel, local_size, global_size,
+                    2, 0, NULL, NULL));
+            }
+            H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+                0, nbytes, C_loop_h, 0, NULL, NULL));
+
+            // Check every product against the loop, and the first against the host
+            float_type max_err = 0.0;
+            for (size_t p=0; p<batch; p++) {
+                for (size_t n=0; n<nelements; n++) {
+                    max_err = std::fmax(max_err, 
+                        std::fabs(C_h[p*stride+n]-C_loop_h[p*stride+n]));
+                }
+            }
+            float_type* C_answer_h = (float_type*)calloc(nelements, sizeof(float_type));
+            m_mat_mult(&A_h[offsets_h[0][0]], &B_h[offsets_h[1][0]], C_answer_h, N1_A, N0_C, N1_C);
+            for (size_t n=0; n<nelements; n++) {
+                max_err = std::fmax(max_err, std::fabs(C_h[offsets_h[2][0]+n]-C_answer_h[n]));
+            }
+            free(C_answer_h);
+
+            std::printf("%6u %6u %14.3f %14.3f %14.3f %9.1fx %10.2e\n", N0_C, batch,
+                loop_ms/NSTATS, strided_ms/NSTATS, offsets_ms/NSTATS, 
+                loop_ms/strided_ms, max_err);
+
+            // Clean up this experiment
+            for (cl_uint n=0; n<batch; n++) {
+                H_ERRCHK(clReleaseMemObject(A_sub[n]));
+                H_ERRCHK(clReleaseMemObject(B_sub[n]));
+                H_ERRCHK(clReleaseMemObject(C_sub[n]));
+            }
+            H_ERRCHK(clReleaseMemObject(A_d));
+            H_ERRCHK(clReleaseMemObject(B_d));
+            H_ERRCHK(clReleaseMemObject(C_d));
+            for (int k=0; k<3; k++) {
+                H_ERRCHK(clReleaseMemObject(offsets_d[k]));
+                free(index_h[k]);
+                free(offsets_h[k]);
+            }
+            free(A_sub);
+            free(B_sub);
+            free(C_sub);
+            free(A_h);
+            free(B_h);
+            free(C_h);
+            free(C_loop_h);
+        }
+    }
+
+    //// Step 6. Clean up ////
+
+    h_release_gemm(gemm);
+    H_ERRCHK(clReleaseKernel(kernel));
+    H_ERRCHK(clReleaseProgram(program));
+    free(kernel_source);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
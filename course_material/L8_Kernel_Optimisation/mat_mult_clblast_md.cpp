@@ -48,8 +48,9 @@ int main(int argc, char** argv) {
     // Pointer to an array of contexts
     cl_context *contexts = NULL;
     
-    // Helper function to acquire devices
-    h_acquire_devices(target_device,
+    // Helper function to acquire devices, 
+    // devices in the same platform share a context
+    h_acquire_devices_shared(target_device,
                      &platforms,
                      &num_platforms,
                      &devices,
@@ -113,27 +114,43 @@ int main(int argc, char** argv) {
         // Report on the device
         h_report_on_device(devices[n]);
         
-        // Create buffers for A
-        As_d[n] = clCreateBuffer(
-            contexts[n], 
-            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
-            nbytes_A, 
-            (void*)A_h, 
-            &errcode
-        );
-        H_ERRCHK(errcode);
-
-        // Create buffers for B        
-        Bs_d[n] = clCreateBuffer(
-            contexts[n], 
-            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
-            nbytes_B, 
-            (void*)B_h, 
-            &errcode
-        );
-        H_ERRCHK(errcode);
+        // First device to use this context
+        cl_uint owner = h_context_owner(contexts, n);
+        
+        if (owner == n) {
+            // Create buffers for A, only once per context
+            As_d[n] = clCreateBuffer(
+                contexts[n], 
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+                nbytes_A, 
+                (void*)A_h, 
+                &errcode
+            );
+            H_ERRCHK(errcode);
+
+            // Create buffers for B, only once per context
+            Bs_d[n] = clCreateBuffer(
+                contexts[n], 
+                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+                nbytes_B, 
+                (void*)B_h, 
+                &errcode
+            );
+            H_ERRCHK(errcode);
+        } else {
+            // Share the buffers of the owning device
+            As_d[n] = As_d[owner];
+            Bs_d[n] = Bs_d[owner];
+            H_ERRCHK(clRetainMemObject(As_d[n]));
+            H_ERRCHK(clRetainMemObject(Bs_d[n]));
+        }
+        
+        // Migrate A and B to the device ahead of time
+        cl_mem inputs_d[] = { As_d[n], Bs_d[n] };
+        h_migrate_buffers(command_queues[n], inputs_d, 2, 0, 0, NULL, NULL);
 
-        // Create buffers for C
+        // Create buffers for C, one per device 
+        // because devices write to it concurrently
         Cs_d[n] = clCreateBuffer(
             contexts[n], 
             CL_MEM_READ_WRITE, 
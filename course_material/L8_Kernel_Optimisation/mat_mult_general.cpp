@@ -0,0 +1,321 @@
+/* Code to compare a fused general matrix multiply against separate
+transpose, multiply, and elementwise kernels
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the GEMM kernels
+#include "gemm_helper.hpp"
+
+typedef cl_float float_type;
+
+// Time for an event in milliseconds, releasing the event afterwards
+cl_double event_ms(cl_event event) {
+    cl_double elapsed = h_get_event_time_ms(&event, NULL, NULL);
+    H_ERRCHK(clReleaseEvent(event));
+    return elapsed;
+}
+
+// Host answer for alpha*op(A)*op(B) + beta*C followed by an epilogue
+void host_gemm(h_gemm_op_t trans_A, h_gemm_op_t trans_B,
+        float_type* A, float_type* B, float_type* C,
+        cl_uint N1_A, cl_uint N0_C, cl_uint N1_C,
+        float_type alpha, float_type beta, cl_uint epilogue,
+        float_type* bias, float_type* scale) {
+
+    // Bring the operands back to their untransposed layout
+    float_type* A_n = (float_type*)calloc((size_t)N0_C*N1_A, sizeof(float_type));
+    float_type* B_n = (float_type*)calloc((size_t)N1_A*N1_C, sizeof(float_type));
+    float_type* AB = (float_type*)calloc((size_t)N0_C*N1_C, sizeof(float_type));
+    if (trans_A==H_GEMM_T) {
+        m_transpose(A, A_n, N1_A, N0_C);
+    } else {
+        std::memcpy(A_n, A, (size_t)N0_C*N1_A*sizeof(float_type));
+    }
+    if (trans_B==H_GEMM_T) {
+        m_transpose(B, B_n, N1_C, N1_A);
+    } else {
+        std::memcpy(B_n, B, (size_t)N1_A*N1_C*sizeof(float_type));
+    }
+    m_mat_mult(A_n, B_n, AB, N1_A, N0_C, N1_C);
+
+    for (size_t i0=0; i0<N0_C; i0++) {
+        for (size_t i1=0; i1<N1_C; i1++) {
+            size_t offset = i0*N1_C+i1;
+            float_type value = alpha*AB[offset];
+            if (beta!=0.0f) value += beta*C[offset];
+            if (epilogue & H_GEMM_BIAS) value += bias[i1];
+            if (epilogue & H_GEMM_SCALE) value *= scale[offset];
+            if (epilogue & H_GEMM_RELU) value = std::fmax(value, 0.0f);
+            C[offset] = value;
+        }
+    }
+
+    free(A_n);
+    free(B_n);
+    free(AB);
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    //// Step 4. Prepare matrices on the host ////
+
+    // A and B are stored transposed, AT is (N1_A, N0_C) and BT is (N1_C, N1_A)
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+    size_t nbytes_A = (size_t)N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = (size_t)N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = (size_t)N0_C*N1_C*sizeof(float_type);
+    size_t nbytes_bias = (size_t)N1_C*sizeof(float_type);
+
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    float_type* C0_h = (float_type*)h_alloc(nbytes_C);
+    float_type* C_h = (float_type*)h_alloc(nbytes_C);
+    float_type* C_answer_h = (float_type*)h_alloc(nbytes_C);
+    float_type* scale_h = (float_type*)h_alloc(nbytes_C);
+    float_type* bias_h = (float_type*)h_alloc(nbytes_bias);
+    m_random(A_h, N1_A, N0_C);
+    m_random(B_h, N1_C, N1_A);
+    m_random(C0_h, N0_C, N1_C);
+    m_random(scale_h, N0_C, N1_C);
+    m_random(bias_h, (size_t)1, (size_t)N1_C);
+
+    // Shift the bias so that ReLU has something to clip
+    for (size_t n=0; n<N1_C; n++) bias_h[n] -= 0.125f*N1_A;
+
+    //// Step 5. Allocate OpenCL buffers ////
+
+    cl_mem A_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_A, A_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_B, B_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem scale_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_C, scale_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem bias_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_bias, bias_h, &errcode);
+    H_ERRCHK(errcode);
+
+    // Scratch buffers for the unfused path
+    cl_mem A_n_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_A, NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_n_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_B, NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem AB_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+
+    //// Step 6. Build the kernels ////
+
+    h_gemm_t* gemm = h_create_gemm(context, device, NULL);
+
+    size_t nbytes_src = 0;
+    char* kernel_source = (char*)h_read_binary("kernels_mat_mult.c", &nbytes_src);
+    cl_program program = h_build_program(kernel_source, context, device, NULL);
+    cl_kernel kernel_transp = clCreateKernel(program, "transpose", &errcode);
+    H_ERRCHK(errcode);
+    cl_kernel kernel_elementwise = clCreateKernel(program, "mat_elementwise", &errcode);
+    H_ERRCHK(errcode);
+
+    //// Step 7. Check every transpose combination against the host ////
+
+    cl_float alpha = 0.5f, beta = 2.0f;
+    cl_uint epilogue = H_GEMM_BIAS | H_GEMM_SCALE | H_GEMM_RELU;
+    h_gemm_op_t ops[] = {H_GEMM_N, H_GEMM_T};
+
+    for (int a=0; a<2; a++) {
+        for (int b=0; b<2; b++) {
+            H_ERRCHK(clEnqueueWriteBuffer(command_queue, C_d, CL_TRUE, 
+                0, nbytes_C, C0_h, 0, NULL, NULL));
+            H_ERRCHK(h_gemm(gemm, command_queue, ops[a], ops[b], A_d, B_d, C_d,
+                N1_A, N0_C, N1_C, alpha, beta, epilogue, bias_d, scale_d, 0, NULL, NULL));
+            H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+                0, nbytes_C, C_h, 0, NULL, NULL));
+
+            // Untransposed operands reuse the same data in the natural layout
+            std::memcpy(C_answer_h, C0_h, nbytes_C);
+            host_gemm(ops[a], ops[b], A_h, B_h, C_answer_h, N1_A, N0_C, N1_C,
+                alpha, beta, epilogue, bias_h, scale_h);
+
+            std::printf("op(A)=%c op(B)=%c: ", a ? 'T' : 'N', b ? 'T' : 'N');
+            m_max_error(C_h, C_answer_h, N0_C, N1_C);
+        }
+    }
+
+    //// Step 8. Time C = (AT)T*(BT)T .* scale, unfused and fused ////
+
+    size_t local_size[] = {16, 16};
+    size_t nstats = NSTATS;
+    cl_double unfused_ms = 0.0, fused_ms = 0.0;
+
+    for (size_t s=0; s<nstats; s++) {
+        cl_event events[4];
+
+        // Transpose A and B back to their natural layout
+        size_t global_A[] = {N0_C, N1_A};
+        H_ERRCHK(clSetKernelArg(kernel_transp, 0, sizeof(cl_mem), &A_d));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 1, sizeof(cl_mem), &A_n_d));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 2, sizeof(cl_uint), &N1_A));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 3, sizeof(cl_uint), &N0_C));
+        H_ERRCHK(h_enqueue_kernel(command_queue, kernel_transp, local_size, global_A, 
+            2, 0, NULL, &events[0]));
+
+        size_t global_B[] = {N1_A, N1_C};
+        H_ERRCHK(clSetKernelArg(kernel_transp, 0, sizeof(cl_mem), &B_d));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 1, sizeof(cl_mem), &B_n_d));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 2, sizeof(cl_uint), &N1_C));
+        H_ERRCHK(clSetKernelArg(kernel_transp, 3, sizeof(cl_uint), &N1_A));
+        H_ERRCHK(h_enqueue_kernel(command_queue, kernel_transp, local_size, global_B, 
+            2, 0, NULL, &events[1]));
+
+        // Multiply with the same tiled kernel as the fused path, so
+        // the comparison measures fusion rather than tiling
+        size_t global_C[] = {N1_C, N0_C};
+        H_ERRCHK(h_gemm(gemm, command_queue, H_GEMM_N, H_GEMM_N, A_n_d, B_n_d, AB_d,
+            N1_A, N0_C, N1_C, 1.0f, 0.0f, H_GEMM_NONE, NULL, NULL, 0, NULL, &events[2]));
+
+        // Elementwise scale
+        H_ERRCHK(clSetKernelArg(kernel_elementwise, 0, sizeof(cl_mem), &AB_d));
+        H_ERRCHK(clSetKernelArg(kernel_elementwise, 1, sizeof(cl_mem), &scale_d));
+        H_ERRCHK(clSetKernelArg(kernel_elementwise, 2, sizeof(cl_mem), &C_d));
+        H_ERRCHK(clSetKernelArg(kernel_elementwise, 3, sizeof(cl_uint), &N0_C));
+        H_ERRCHK(clSetKernelArg(kernel_elementwise, 4, sizeof(cl_uint), &N1_C));
+        H_ERRCHK(h_enqueue_kernel(command_queue, kernel_elementwise, local_size, global_C, 
+            2, 0, NULL, &events[3]));
+
+        for (int e=0; e<4; e++) {
+            unfused_ms += event_ms(events[e]);
+        }
+
+        // Everything in one launch
+        cl_event event;
+        H_ERRCHK(h_gemm(gemm, command_queue, H_GEMM_T, H_GEMM_T, A_d, B_d, AB_d,
+            N1_A, N0_C, N1_C, 1.0f, 0.0f, H_GEMM_SCALE, NULL, scale_d, 0, NULL, &event));
+        fused_ms += event_ms(event);
+    }
+
+    // Both paths should agree
+    H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 0, nbytes_C, C_answer_h, 0, NULL, NULL));
+    H_ERRCHK(clEnqueueReadBuffer(command_queue, AB_d, CL_TRUE, 0, nbytes_C, C_h, 0, NULL, NULL));
+    std::printf("Fused against unfused: ");
+    m_max_error(C_h, C_answer_h, N0_C, N1_C);
+
+    std::printf("Unfused (2 x transpose, h_gemm, elementwise):   %.3f ms\n", unfused_ms/nstats);
+    std::printf("Fused (mat_mult_general):                       %.3f ms\n", fused_ms/nstats);
+    std::printf("Speedup:                                        %.2fx\n", unfused_ms/fused_ms);
+
+    //// Step 9. Clean up ////
+
+    h_release_gemm(gemm);
+    H_ERRCHK(clReleaseKernel(kernel_transp));
+    H_ERRCHK(clReleaseKernel(kernel_elementwise));
+    H_ERRCHK(clReleaseProgram(program));
+    free(kernel_source);
+
+    cl_mem buffers[] = {A_d, B_d, scale_d, bias_d, A_n_d, B_n_d, AB_d, C_d};
+    for (cl_mem buffer : buffers) {
+        H_ERRCHK(clReleaseMemObject(buffer));
+    }
+    free(A_h);
+    free(B_h);
+    free(C0_h);
+    free(C_h);
+    free(C_answer_h);
+    free(scale_h);
+    free(bias_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
@@ -0,0 +1,250 @@
+/* Code to benchmark and regression-test generated matrix multiply kernels.
+Select variants with --variant=name (repeatable), list them with --list,
+and print the generated source with --dump
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the GEMM kernels and the kernel generator
+#include "gemm_helper.hpp"
+
+typedef cl_float float_type;
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Variants to run, all of them if none are named
+    std::vector<const h_gemm_gen_t*> variants;
+    bool dump = false;
+    for (int n=1; n<argc; n++) {
+        if (std::strncmp(argv[n], "--variant=", 10)==0) {
+            const h_gemm_gen_t* gen = h_gemm_gen_find(argv[n]+10);
+            if (gen == NULL) {
+                std::printf("Unknown variant %s, use --list to see the variants\n", argv[n]+10);
+                exit(EXIT_FAILURE);
+            }
+            variants.push_back(gen);
+        } else if (std::strcmp(argv[n], "--list")==0) {
+            for (size_t v=0; v<h_gemm_gen_nvariants; v++) {
+                std::printf("%s\n", h_gemm_gen_variants[v].name);
+            }
+            exit(EXIT_SUCCESS);
+        } else if (std::strcmp(argv[n], "--dump")==0) {
+            dump = true;
+        }
+    }
+    if (variants.size() == 0) {
+        for (size_t v=0; v<h_gemm_gen_nvariants; v++) {
+            variants.push_back(&h_gemm_gen_variants[v]);
+        }
+    }
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    // Local memory available to a work-group
+    cl_ulong local_mem_bytes;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, 
+            sizeof(cl_ulong), &local_mem_bytes, NULL)
+    );
+
+    //// Step 4. Prepare matrices and the answer ////
+
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+    size_t nbytes_A = (size_t)N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = (size_t)N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = (size_t)N0_C*N1_C*sizeof(float_type);
+
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    float_type* AT_h = (float_type*)h_alloc(nbytes_A);
+    float_type* BT_h = (float_type*)h_alloc(nbytes_B);
+    float_type* C_h = (float_type*)h_alloc(nbytes_C);
+    float_type* C_answer_h = (float_type*)h_alloc(nbytes_C);
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+    m_transpose(A_h, AT_h, N0_C, N1_A);
+    m_transpose(B_h, BT_h, N1_A, N1_C);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    // Buffers for both layouts of A and B, variants pick the layout they want
+    cl_mem A_d[2], B_d[2];
+    float_type* A_layouts[] = {A_h, AT_h};
+    float_type* B_layouts[] = {B_h, BT_h};
+    for (int n=0; n<2; n++) {
+        A_d[n] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            nbytes_A, A_layouts[n], &errcode);
+        H_ERRCHK(errcode);
+        B_d[n] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            nbytes_B, B_layouts[n], &errcode);
+        H_ERRCHK(errcode);
+    }
+    cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+
+    //// Step 5. Build, check, and time each variant ////
+
+    float_type tolerance = 1.0e-5f*(float_type)N1_A;
+    cl_double flops = 2.0*(cl_double)N0_C*(cl_double)N1_C*(cl_double)N1_A;
+    size_t nfailed = 0;
+
+    std::printf("%-28s %10s %10s %10s %10s %12s %6s\n", 
+        "variant", "local (B)", "build (ms)", "time (ms)", "GFLOP/s", "max error", "check");
+
+    for (const h_gemm_gen_t* gen : variants) {
+
+        if (dump) {
+            std::printf("%s\n", h_gemm_generate(gen).c_str());
+        }
+
+        // Skip variants that need more local memory than the device has
+        size_t local_bytes = h_gemm_gen_local_bytes(gen);
+        if (local_bytes > local_mem_bytes) {
+            std::printf("%-28s %10zu %10s\n", gen->name, local_bytes, "skipped");
+            continue;
+        }
+
+        auto t1 = std::chrono::high_resolution_clock::now();
+        cl_program program;
+        cl_kernel kernel = h_gemm_gen_build(context, device, gen, NULL, &program);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        cl_double build_ms = 
+            (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+
+        // Clear C so a kernel that writes nothing cannot pass
+        float_type zero = 0.0f;
+        H_ERRCHK(clEnqueueFillBuffer(command_queue, C_d, &zero, sizeof(float_type), 
+            0, nbytes_C, 0, NULL, NULL));
+
+        cl_double time_ms = 0.0;
+        for (size_t s=0; s<NSTATS; s++) {
+            cl_event event;
+            H_ERRCHK(h_gemm_gen_enqueue(command_queue, kernel, gen, 
+                A_d[gen->layout_A], B_d[gen->layout_B], C_d, N1_A, N0_C, N1_C, 0, NULL, &event));
+            time_ms += h_get_event_time_ms(&event, NULL, NULL);
+            H_ERRCHK(clReleaseEvent(event));
+        }
+        time_ms /= (cl_double)NSTATS;
+
+        H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+            0, nbytes_C, C_h, 0, NULL, NULL));
+        float_type max_err = 0.0f;
+        for (size_t n=0; n<(size_t)N0_C*N1_C; n++) {
+            max_err = std::fmax(max_err, std::fabs(C_h[n]-C_answer_h[n]));
+        }
+        bool passed = (max_err <= tolerance);
+        if (!passed) nfailed++;
+
+        std::printf("%-28s %10zu %10.1f %10.3f %10.1f %12.2e %6s\n", gen->name, local_bytes, 
+            build_ms, time_ms, flops/(time_ms*1.0e6), max_err, passed ? "pass" : "FAIL");
+
+        H_ERRCHK(clReleaseKernel(kernel));
+        H_ERRCHK(clReleaseProgram(program));
+    }
+
+    std::printf("%zu of %zu variants failed\n", nfailed, variants.size());
+
+    //// Step 6. Clean up ////
+
+    for (int n=0; n<2; n++) {
+        H_ERRCHK(clReleaseMemObject(A_d[n]));
+        H_ERRCHK(clReleaseMemObject(B_d[n]));
+    }
+    H_ERRCHK(clReleaseMemObject(C_d));
+    free(A_h);
+    free(B_h);
+    free(AT_h);
+    free(BT_h);
+    free(C_h);
+    free(C_answer_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    // A failed variant is a regression
+    return (nfailed > 0) ? 1 : 0;
+}
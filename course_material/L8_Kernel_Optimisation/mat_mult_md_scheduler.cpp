@@ -0,0 +1,136 @@
+/* Code to perform a Matrix multiplication across all devices 
+with the tiled, work-stealing multi-device GEMM scheduler
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Include the size of arrays to be computed
+#include "mat_size.hpp"
+
+// Bring in the matrix helper library
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the GEMM kernels and scheduler
+#include "gemm_helper.hpp"
+
+typedef cl_float float_type;
+
+int main(int argc, char** argv) {
+   
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    h_parse_args(argc, argv, &target_device);
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    // Helper function to acquire devices, 
+    // devices in the same platform share a context
+    h_acquire_devices_shared(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Report on the devices
+    for (cl_uint n=0; n<num_devices; n++) {
+        h_report_on_device(devices[n]);
+    }
+    
+    // A is of size (N0_C, N1_A)
+    // B is of size (N1_A, N1_C)
+    // C is of size (N0_C, N1_C)
+    
+    //// Prepare matrices A, B, and C on the Host ////
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+
+    // Number of bytes in each array
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    // Allocate memory for matrices A, B, and C on the host
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    float_type* C_h = (float_type*)h_alloc(nbytes_C);
+
+    // Fill A_h and B_h with random numbers 
+    // using the matrix helper library
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+
+    //// Create the scheduler, tile sizes of 0 are chosen from the problem ////
+    h_md_gemm_t* md = h_create_md_gemm(contexts, devices, num_devices, 0, 0);
+
+    // A warm-up run measures device speeds, then at 
+    // least one run is timed even when NSTATS is 1
+    h_md_gemm(md, A_h, B_h, C_h, N1_A, N0_C, N1_C);
+    const size_t nstats=std::max((size_t)NSTATS, (size_t)1);
+    cl_double avg_time_ms=0.0;
+    
+    for (size_t n=0; n<nstats; n++) {
+        h_md_gemm(md, A_h, B_h, C_h, N1_A, N0_C, N1_C);
+        avg_time_ms += md->wall_ms;
+    }
+    avg_time_ms /= (cl_double)nstats;
+
+    // Report on the last run
+    h_md_gemm_report(md);
+    std::printf("Average time over %zu runs: %.3f ms, %.1f GFLOP/s\n", 
+        nstats, avg_time_ms, 
+        2.0*(cl_double)N0_C*(cl_double)N1_C*(cl_double)N1_A/(avg_time_ms*1.0e6));
+
+    // Compute the serial solution using the matrix helper library
+    float_type* C_answer_h = (float_type*)calloc(nbytes_C, 1);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    // Print the maximum error between matrices. Tiles may be 
+    // blocked along the inner dimension, so allow for rounding 
+    // that grows with its length
+    float_type max_err = m_max_error(C_h, C_answer_h, N0_C, N1_C);
+    float_type tolerance = 1.0e-5f*(float_type)N1_A;
+
+    // Write out the host arrays to file
+    h_write_binary(A_h, "array_A.dat", nbytes_A);
+    h_write_binary(B_h, "array_B.dat", nbytes_B);
+    h_write_binary(C_h, "array_C.dat", nbytes_C);
+
+    // Clean up the scheduler
+    h_release_md_gemm(md);
+    
+    // Clean up memory that was allocated on the read   
+    free(A_h);
+    free(B_h);
+    free(C_h);
+    free(C_answer_h);
+    
+    // Clean up devices and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    // Fail if the answer is wrong
+    return (max_err <= tolerance) ? 0 : 1;
+}
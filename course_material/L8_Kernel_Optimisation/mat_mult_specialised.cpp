@@ -0,0 +1,432 @@
+/* Code to compare generic and specialised builds of a tiled, 
+vectorised matrix multiplication. Specialised builds get the 
+problem size, vector width, chunk length, and local size as -D options
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+const char* kernel_source = R"(
+
+// Vector length must be known at compile time
+#ifndef VECTOR_LEN
+#define VECTOR_LEN 8
+#endif
+
+// Make vector types and functions from the vector length
+#define H_CAT(a, b) a##b
+#define H_XCAT(a, b) H_CAT(a, b)
+#define floatn H_XCAT(float, VECTOR_LEN)
+#define vloadn H_XCAT(vload, VECTOR_LEN)
+
+// Each SPEC_ definition replaces a kernel argument with a constant
+#ifdef SPEC_N1_A
+#define K_N1_A SPEC_N1_A
+#else
+#define K_N1_A N1_A
+#endif
+
+#ifdef SPEC_N0_C
+#define K_N0_C SPEC_N0_C
+#else
+#define K_N0_C N0_C
+#endif
+
+#ifdef SPEC_N1_C
+#define K_N1_C SPEC_N1_C
+#else
+#define K_N1_C N1_C
+#endif
+
+#ifdef SPEC_CHUNK_LEN
+#define K_CHUNK_LEN SPEC_CHUNK_LEN
+#define K_END_CHUNK_ID ((K_N1_A+SPEC_CHUNK_LEN-1)/SPEC_CHUNK_LEN)
+#else
+#define K_CHUNK_LEN chunk_len
+#define K_END_CHUNK_ID end_chunk_id
+#endif
+
+// A fixed local size also lets the compiler size the work-group
+#if defined(SPEC_L0) && defined(SPEC_L1)
+#define K_L0 SPEC_L0
+#define K_L1 SPEC_L1
+#define K_ATTRIBUTES __attribute__((reqd_work_group_size(SPEC_L1, SPEC_L0, 1)))
+#else
+#define K_L0 get_local_size(1)
+#define K_L1 get_local_size(0)
+#define K_ATTRIBUTES
+#endif
+
+// When every chunk is full the inner loop has a constant trip count
+#if defined(SPEC_N1_A) && defined(SPEC_CHUNK_LEN)
+#if (SPEC_N1_A % SPEC_CHUNK_LEN) == 0
+#define K_FULL_CHUNKS
+#endif
+#endif
+
+// Stride for shared arrays, in vectors
+#define K_CHUNK_LEN_V (K_CHUNK_LEN/VECTOR_LEN)
+
+// Kernel function to get the start and end values
+// for filling a shared memory array
+void get_start_end(
+    // Number of work-items along a dimension of workgroup
+    size_t local_length,
+    // Number of items in the array
+    size_t array_length,
+    // Index of work item along dimension of workgroup
+    size_t local_index,
+    // Starting position of the copy
+    size_t *start,
+    // End position of the copy
+    size_t *end) {
+  
+    // Work out the jump size
+    size_t jump_size=array_length/local_length;
+    if (array_length%local_length) jump_size++;
+    
+    // Starting position for the copy
+    *start=local_index*jump_size;
+    // End position for the copy
+    *end=(local_index+1)*jump_size;
+    // Limit end so we don't go off the end
+    *end=min(*end,array_length);
+} 
+
+// Load vector n from a row with len valid elements,
+// elements past the end of the row are zero
+floatn vloadn_edge(size_t n, size_t len, __global float* row) {
+    if ((n+1)*VECTOR_LEN<=len) {
+        return vloadn(n, row);
+    }
+    floatn v=(floatn)0.0f;
+    float* v_f=(float*)&v;
+    for (size_t k=n*VECTOR_LEN; k<len; k++) {
+        v_f[k-n*VECTOR_LEN]=row[k];
+    }
+    return v;
+}
+
+// Load vector n from a column with len valid elements 
+// and stride between elements, elements past the end of the column are zero
+floatn vloadn_column_edge(size_t n, size_t len, __global float* column, size_t stride) {
+    floatn v=(floatn)0.0f;
+    float* v_f=(float*)&v;
+    size_t end=min((n+1)*VECTOR_LEN, len);
+    for (size_t k=n*VECTOR_LEN; k<end; k++) {
+        v_f[k-n*VECTOR_LEN]=column[k*stride];
+    }
+    return v;
+}
+
+// Matrix multiply kernel that uses local memory, 
+// the arguments are ignored where a SPEC_ definition replaces them
+__kernel void mat_mult_specialised (
+                        __global float* A, 
+                        __global float* B, 
+                        __global float* C,
+                        __local floatn* shared_A,
+                        __local floatn* shared_B,
+                        unsigned int N1_A, 
+                        unsigned int N0_C,
+                        unsigned int N1_C,
+                        unsigned int chunk_len,
+                        unsigned int start_chunk_id,
+                        unsigned int end_chunk_id) K_ATTRIBUTES { 
+    
+    // A is of size (N0_C, N1_A), (i0, n)
+    // B is of size (N1_A, N1_C), (n, i1)
+    // C is of size (N0_C, N1_C), (i0, i1)
+    
+    // i1 and i2 represent the coordinates in Matrix C 
+    // We assume row-major ordering for the matrices 
+    size_t i1=min(get_global_id(0), (size_t)K_N1_C-1); // Fastest dimension
+    size_t i0=min(get_global_id(1), (size_t)K_N0_C-1); 
+    
+    // index within local memory
+    size_t s0 = get_local_id(1); // Slowest dimension
+    size_t s1 = get_local_id(0); // fastest dimension
+    
+    // Positions within shared memory
+    __local floatn* shared_A_s0 = &shared_A[s0*K_CHUNK_LEN_V];
+    __local floatn* shared_B_s1 = &shared_B[s1*K_CHUNK_LEN_V];
+
+    // Scratch variable to accumulate the sum
+    floatn temp=(floatn)0.0f;
+
+    // Start and end positions to copy within a chunk
+    size_t start0, end0, start1, end1;
+    get_start_end(K_L1, K_CHUNK_LEN_V, s1, &start1, &end1);
+    get_start_end(K_L0, K_CHUNK_LEN_V, s0, &start0, &end0);
+
+    // Loop over the chunks
+    for (int chunk_id=start_chunk_id; chunk_id<K_END_CHUNK_ID; chunk_id++) {
+
+        // Number of valid elements in this chunk, the last chunk may be ragged,
+        // and the number of vectors needed to cover them
+#ifdef K_FULL_CHUNKS
+        const size_t chunk_valid = K_CHUNK_LEN;
+        const size_t chunk_valid_v = K_CHUNK_LEN_V;
+#else
+        size_t chunk_valid = min((size_t)K_CHUNK_LEN, (size_t)K_N1_A-chunk_id*K_CHUNK_LEN);
+        size_t chunk_valid_v = chunk_valid/VECTOR_LEN;
+        if (chunk_valid % VECTOR_LEN) chunk_valid_v++;
+#endif
+
+        // Starting positions for the copy
+        __global float* A_i0 = &A[i0*K_N1_A+chunk_id*K_CHUNK_LEN];
+        __global float* B_i1 = &B[chunk_id*K_CHUNK_LEN*K_N1_C+i1];
+          
+        // Fill the rows of shared_A from row i0 of A
+        for (size_t n = start1; n<end1; n++) {
+            shared_A_s0[n] = vloadn_edge(n, chunk_valid, A_i0);
+        }
+        
+        // Copy from column i1 of B   
+        for (size_t n = start0; n<end0; n++) {
+            shared_B_s1[n] = vloadn_column_edge(n, chunk_valid, B_i1, K_N1_C);
+        }
+              
+        // Enqueue a local barrier to ensure shared memory is filled
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        // Loop across row i0 of A and down column i1 of B
+#ifdef K_FULL_CHUNKS
+        #pragma unroll
+#endif
+        for (size_t n=0; n<chunk_valid_v; n++) {
+            temp+=shared_A_s0[n]*shared_B_s1[n];
+        }
+        
+        // Enqueue a local barrier to ensure all work items 
+        // are ready to tackle the next tile
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Sum the elements of the vector
+    float* temp_f = (float*)&temp;
+    float sum = 0.0f;
+    for (size_t k=0; k<VECTOR_LEN; k++) {
+        sum += temp_f[k];
+    }
+
+    // Put the accumulated value into position
+    C[i0*K_N1_C+i1]=sum;
+}
+)";
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    //// Step 4. Prepare matrices A, B, and C ////
+
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    float_type* C_h = (float_type*)h_alloc(nbytes_C);
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+
+    // Compute the serial solution using the matrix helper library
+    float_type* C_answer_h = (float_type*)calloc(nbytes_C, 1);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    cl_mem A_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_A, A_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        nbytes_B, B_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+
+    // Chunk length from the cache line size, as in the tiled examples
+    cl_uint cache_line_bytes=64;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHELINE_SIZE,
+            sizeof(cl_uint), &cache_line_bytes, NULL)
+    );
+    cache_line_bytes = std::max(cache_line_bytes, (cl_uint)64);
+    cl_uint chunk_len = 4*cache_line_bytes/sizeof(float_type);
+    cl_uint start_chunk_id = 0;
+    cl_uint end_chunk_id = N1_A/chunk_len;
+    if (N1_A % chunk_len) end_chunk_id++;
+
+    size_t local_size[] = {16, 16};
+    size_t global_size[] = {N1_C, N0_C};
+
+    //// Step 5. Build and time each variant through the variant cache ////
+
+    h_variant_cache_t* variants = h_create_variant_cache(context, device, kernel_source, NULL);
+
+    // The generic build only fixes the vector length, which was hard-coded before
+    const size_t nvariants = 4;
+    const char* names[nvariants] = {"generic", "specialised", "specialised", "specialised"};
+    const long vector_lens[nvariants] = {8, 4, 8, 16};
+
+    std::printf("%-12s %6s %12s %12s %10s %12s\n", 
+        "build", "vector", "time (ms)", "GFLOP/s", "speedup", "max error");
+    cl_double generic_ms = 0.0;
+
+    for (size_t v=0; v<nvariants; v++) {
+        h_defines_t defines;
+        defines["VECTOR_LEN"] = vector_lens[v];
+        if (v > 0) {
+            defines["SPEC_N1_A"] = N1_A;
+            defines["SPEC_N0_C"] = N0_C;
+            defines["SPEC_N1_C"] = N1_C;
+            defines["SPEC_CHUNK_LEN"] = chunk_len;
+            defines["SPEC_L0"] = (long)local_size[1];
+            defines["SPEC_L1"] = (long)local_size[0];
+        }
+
+        cl_double time_ms = 0.0;
+        for (size_t n=0; n<NSTATS; n++) {
+
+            // Only the first lookup builds, later ones come from the cache
+            cl_kernel kernel = h_get_variant(variants, "mat_mult_specialised", defines);
+
+            size_t nbytes_line = chunk_len*sizeof(float_type);
+            H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A_d));
+            H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B_d));
+            H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C_d));
+            H_ERRCHK(clSetKernelArg(kernel, 3, local_size[1]*nbytes_line, NULL));
+            H_ERRCHK(clSetKernelArg(kernel, 4, local_size[0]*nbytes_line, NULL));
+            H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_A));
+            H_ERRCHK(clSetKernelArg(kernel, 6, sizeof(cl_uint), &N0_C));
+            H_ERRCHK(clSetKernelArg(kernel, 7, sizeof(cl_uint), &N1_C));
+            H_ERRCHK(clSetKernelArg(kernel, 8, sizeof(cl_uint), &chunk_len));
+            H_ERRCHK(clSetKernelArg(kernel, 9, sizeof(cl_uint), &start_chunk_id));
+            H_ERRCHK(clSetKernelArg(kernel, 10, sizeof(cl_uint), &end_chunk_id));
+
+            cl_event kernel_event;
+            H_ERRCHK(h_enqueue_kernel(command_queue, kernel, local_size, global_size,
+                2, 0, NULL, &kernel_event));
+            time_ms += h_get_event_time_ms(&kernel_event, NULL, NULL);
+            H_ERRCHK(clReleaseEvent(kernel_event));
+        }
+        time_ms /= (cl_double)NSTATS;
+        if (v == 0) generic_ms = time_ms;
+
+        // Check the answer
+        H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+            0, nbytes_C, C_h, 0, NULL, NULL));
+        float_type max_err = 0.0f;
+        for (size_t n=0; n<(size_t)N0_C*N1_C; n++) {
+            max_err = std::fmax(max_err, std::fabs(C_h[n]-C_answer_h[n]));
+        }
+
+        std::printf("%-12s %6ld %12.3f %12.1f %9.2fx %12.2e\n", names[v], vector_lens[v], time_ms,
+            2.0*(cl_double)N0_C*(cl_double)N1_C*(cl_double)N1_A/(time_ms*1.0e6),
+            generic_ms/time_ms, max_err);
+    }
+
+    h_report_variant_cache(variants);
+
+    //// Step 6. Clean up ////
+
+    h_release_variant_cache(variants);
+    H_ERRCHK(clReleaseMemObject(A_d));
+    H_ERRCHK(clReleaseMemObject(B_d));
+    H_ERRCHK(clReleaseMemObject(C_d));
+    free(A_h);
+    free(B_h);
+    free(C_h);
+    free(C_answer_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
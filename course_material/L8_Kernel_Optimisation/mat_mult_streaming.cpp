@@ -0,0 +1,163 @@
+/* Code to perform an out-of-core Matrix multiplication using OpenCL, 
+A, B, and C are memory-mapped files and the device only ever 
+holds a capped working set of panels and tiles
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Bring in the GEMM kernels and scheduler
+#include "gemm_helper.hpp"
+
+typedef cl_float float_type;
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Cap on device memory in MB, --cap-mb=X, 
+    // by default a quarter of the size of A, B, and C together
+    cl_double cap_mb = 0.0;
+    for (int n=1; n<argc; n++) {
+        if (std::strncmp(argv[n], "--cap-mb=", 9)==0) cap_mb = std::atof(argv[n]+9);
+    }
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Choose the context and compute device to use
+    assert(dev_index < num_devices);
+    
+    // Report on the device in use
+    h_report_on_device(devices[dev_index]);
+
+    //// Step 3. Write A and B to disk, then map them back in ////
+
+    // A is of size (N0_C, N1_A)
+    // B is of size (N1_A, N1_C)
+    // C is of size (N0_C, N1_C)
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+
+    // Number of bytes in each array
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    // Make the inputs with the matrix helper library
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+    h_write_binary(A_h, "array_A.dat", nbytes_A);
+    h_write_binary(B_h, "array_B.dat", nbytes_B);
+
+    // Map the files, pages are only read when a panel is uploaded
+    size_t nbytes_A_file, nbytes_B_file;
+    float_type* A_map = (float_type*)h_map_binary("array_A.dat", &nbytes_A_file, false);
+    float_type* B_map = (float_type*)h_map_binary("array_B.dat", &nbytes_B_file, false);
+    assert((nbytes_A_file == nbytes_A) && (nbytes_B_file == nbytes_B));
+
+    // C is written straight into a mapped output file
+    size_t nbytes_C_file = nbytes_C;
+    float_type* C_map = (float_type*)h_map_binary("array_C.dat", &nbytes_C_file, true);
+
+    //// Step 4. Run the streaming multiplication under the memory cap ////
+
+    size_t cap_bytes = (cap_mb > 0.0) ? (size_t)(cap_mb*1.0e6) : (nbytes_A+nbytes_B+nbytes_C)/4;
+    std::printf("Operands take %.1f MB, the device working set is capped at %.1f MB\n",
+        (cl_double)(nbytes_A+nbytes_B+nbytes_C)/1.0e6, (cl_double)cap_bytes/1.0e6);
+
+    h_md_gemm_t* md = h_create_md_gemm(&contexts[dev_index], &devices[dev_index], 1, 0, 0);
+    md->max_device_bytes = cap_bytes;
+
+    const size_t nstats = NSTATS;
+    cl_double avg_time_ms = 0.0;
+    for (size_t n=0; n<nstats; n++) {
+        h_md_gemm(md, A_map, B_map, C_map, N1_A, N0_C, N1_C);
+        avg_time_ms += md->wall_ms;
+    }
+    avg_time_ms /= (cl_double)nstats;
+
+    h_md_gemm_report(md);
+    std::printf("Average time over %zu runs: %.3f ms, %.1f GFLOP/s\n", nstats, avg_time_ms,
+        2.0*(cl_double)N0_C*(cl_double)N1_C*(cl_double)N1_A/(avg_time_ms*1.0e6));
+
+    //// Step 5. Check the working set and the answer ////
+
+    // Sum the scratch buffers the scheduler actually allocated,
+    // every panel and tile is double-buffered
+    bool within_cap = true;
+    for (h_md_device_t& dev : md->devices) {
+        size_t allocated = 2*(dev.capacity_A+dev.capacity_B+dev.capacity_C);
+        within_cap = within_cap && (allocated <= cap_bytes);
+        std::printf("Device allocated %zu bytes, %s the cap\n", 
+            allocated, (allocated <= cap_bytes) ? "within" : "OVER");
+    }
+
+    // Compute the serial solution using the matrix helper library
+    float_type* C_answer_h = (float_type*)calloc(nbytes_C, 1);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    // The inner dimension is summed in blocks, 
+    // so allow for rounding that grows with its length
+    float_type max_err = m_max_error(C_map, C_answer_h, N0_C, N1_C);
+    float_type tolerance = 1.0e-5f*(float_type)N1_A;
+
+    //// Step 6. Clean up ////
+
+    h_release_md_gemm(md);
+    h_unmap_binary(A_map, nbytes_A);
+    h_unmap_binary(B_map, nbytes_B);
+    h_unmap_binary(C_map, nbytes_C);
+    free(A_h);
+    free(B_h);
+    free(C_answer_h);
+
+    // Clean up devices and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    // Fail if the cap was broken or the answer is wrong
+    return (within_cap && (max_err <= tolerance)) ? 0 : 1;
+}
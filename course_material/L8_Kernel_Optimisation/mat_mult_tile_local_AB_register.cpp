@@ -0,0 +1,454 @@
+/* Code to perform a Matrix multiplication using OpenCL,
+with register tiles of C and double-buffered local memory tiles of A and B
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Rows and columns of C computed by each work-item
+#define WPT0 4
+#define WPT1 4
+
+// Length of a tile along the inner dimension
+#define TSK 16
+
+const char* kernel_source = R"(
+
+// Tiling parameters are set at compile time
+#ifndef WPT0
+#define WPT0 4
+#endif
+
+#ifndef WPT1
+#define WPT1 4
+#endif
+
+#ifndef TSK
+#define TSK 16
+#endif
+
+// Matrix multiply kernel where each work-item computes 
+// a (WPT0, WPT1) tile of C in registers
+__kernel void mat_mult_tile_local_AB_register (
+                        __global float* A, 
+                        __global float* B, 
+                        __global float* C,
+                        __local float* shared_A,
+                        __local float* shared_B,
+                        unsigned int N1_A, 
+                        unsigned int N0_C,
+                        unsigned int N1_C) { 
+    
+    // A is of size (N0_C, N1_A), (i0, n)
+    // B is of size (N1_A, N1_C), (n, i1)
+    // C is of size (N0_C, N1_C), (i0, i1)
+
+    // Local size
+    size_t L0 = get_local_size(1); // Slowest dimension
+    size_t L1 = get_local_size(0); // Fastest dimension
+    
+    // Index within the workgroup
+    size_t s0 = get_local_id(1); // Slowest dimension
+    size_t s1 = get_local_id(0); // Fastest dimension
+
+    // Size of the tile of C computed by the workgroup
+    size_t TS0 = L0*WPT0;
+    size_t TS1 = L1*WPT1;
+
+    // Start of the tile of C for this workgroup
+    size_t start0 = get_group_id(1)*TS0;
+    size_t start1 = get_group_id(0)*TS1;
+    
+    // shared_A holds two tiles of A, each of size (TS0, TSK)
+    // shared_B holds two tiles of B, each of size (TSK, TS1)
+    size_t ntile_A = TS0*TSK;
+    size_t ntile_B = TSK*TS1;
+
+    // Number of work-items in the workgroup and this work-item's rank
+    size_t nitems = L0*L1;
+    size_t rank = s0*L1+s1;
+
+    // Accumulators for the tile of C
+    float acc[WPT0][WPT1];
+    for (int r=0; r<WPT0; r++) {
+        for (int c=0; c<WPT1; c++) {
+            acc[r][c] = 0.0f;
+        }
+    }
+
+    // Number of tiles along the inner dimension
+    size_t ntiles = N1_A/TSK;
+    if (N1_A % TSK) ntiles++;
+
+    // Load the first tiles of A and B into buffer 0,
+    // out of bounds elements are set to zero
+    for (size_t id=rank; id<ntile_A; id+=nitems) {
+        size_t i0 = start0 + id/TSK;
+        size_t n = id%TSK;
+        shared_A[id] = (i0<N0_C && n<N1_A) ? A[i0*N1_A+n] : 0.0f;
+    }
+    for (size_t id=rank; id<ntile_B; id+=nitems) {
+        size_t n = id/TS1;
+        size_t i1 = start1 + id%TS1;
+        shared_B[id] = (n<N1_A && i1<N1_C) ? B[n*N1_C+i1] : 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (size_t t=0; t<ntiles; t++) {
+
+        // Buffers to compute from and to fill
+        __local float* tile_A = &shared_A[(t%2)*ntile_A];
+        __local float* tile_B = &shared_B[(t%2)*ntile_B];
+
+        // Fill the other buffer with the next tiles
+        if (t+1<ntiles) {
+            __local float* next_A = &shared_A[((t+1)%2)*ntile_A];
+            __local float* next_B = &shared_B[((t+1)%2)*ntile_B];
+            size_t offset = (t+1)*TSK;
+
+            for (size_t id=rank; id<ntile_A; id+=nitems) {
+                size_t i0 = start0 + id/TSK;
+                size_t n = offset + id%TSK;
+                next_A[id] = (i0<N0_C && n<N1_A) ? A[i0*N1_A+n] : 0.0f;
+            }
+            for (size_t id=rank; id<ntile_B; id+=nitems) {
+                size_t n = offset + id/TS1;
+                size_t i1 = start1 + id%TS1;
+                next_B[id] = (n<N1_A && i1<N1_C) ? B[n*N1_C+i1] : 0.0f;
+            }
+        }
+
+        // Update the register tile, neighbouring work-items 
+        // read neighbouring elements of shared memory
+        for (int k=0; k<TSK; k++) {
+            float B_reg[WPT1];
+            for (int c=0; c<WPT1; c++) {
+                B_reg[c] = tile_B[k*TS1+s1+c*L1];
+            }
+            for (int r=0; r<WPT0; r++) {
+                float A_reg = tile_A[(s0+r*L0)*TSK+k];
+                for (int c=0; c<WPT1; c++) {
+                    acc[r][c] += A_reg*B_reg[c];
+                }
+            }
+        }
+
+        // One barrier per tile is enough, the next tiles are 
+        // complete and this buffer is free to be filled again
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Put the accumulated values into position
+    for (int r=0; r<WPT0; r++) {
+        size_t i0 = start0+s0+r*L0;
+        for (int c=0; c<WPT1; c++) {
+            size_t i1 = start1+s1+c*L1;
+            if (i0<N0_C && i1<N1_C) {
+                C[i0*N1_C+i1] = acc[r][c];
+            }
+        }
+    }
+}
+)";
+
+cl_int prep_mat_kernel(cl_kernel kernel, 
+                 size_t* local_size,
+                 size_t* global_size,
+                 size_t ndim,
+                 void* data) {
+    
+    cl_int errcode=CL_SUCCESS;
+
+    // Two tiles of A, each of size (local_size[1]*WPT0, TSK)
+    errcode = errcode | clSetKernelArg(kernel, 3, 2*local_size[1]*WPT0*TSK*sizeof(float_type), NULL);
+
+    // Two tiles of B, each of size (TSK, local_size[0]*WPT1)
+    errcode = errcode | clSetKernelArg(kernel, 4, 2*TSK*local_size[0]*WPT1*sizeof(float_type), NULL);
+    return errcode;
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Create handles to platforms, 
+    // devices, and contexts
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+
+    // Do we enable blocking IO?
+    cl_bool blocking = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the first available context
+    // and compute device to use
+    // Also make sure command line arguments are sane
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+    
+    // A is of size (N0_C, N1_A)
+    // B is of size (N1_A, N1_C)
+    // C is of size (N0_C, N1_C)
+    
+    //// Step 4. Prepare matrices A and B on the Host ////
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+
+    // Number of bytes in each array
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    // Allocate memory for matrices A and B on the host
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+
+    // Fill A_h and B_h with random numbers 
+    // using the matrix helper library
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+        
+    //// Step 5. Allocate OpenCL Buffers for matrices A, B, and C ////
+    
+    // The kernel handles ragged edges itself, so no padding is needed
+    cl_mem A_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_A, 
+        (void*)A_h, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+    
+    cl_mem B_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_B, 
+        (void*)B_h, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+   
+    // Allocate C from pinned host memory
+    cl_mem C_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, 
+        nbytes_C, 
+        NULL, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+
+    //// Step 6. Build the program from source for the chosen compute device ////
+
+    // Pass the tiling parameters to the kernel
+    std::string compiler_options = "-DWPT0=" + std::to_string(WPT0)
+        + " -DWPT1=" + std::to_string(WPT1)
+        + " -DTSK=" + std::to_string(TSK);
+    
+    // Turn this source code into a program
+    cl_program program = h_build_program(kernel_source, context, device, compiler_options.c_str());
+    
+    //// Step 7. Create a kernel from the compiled program and set arguments ////
+    
+    // Number of dimensions in the kernels
+    size_t work_dim=2;
+
+    // Desired local size
+    size_t local_size[]={ 16, 16 };
+
+    // Create the matrix multiplication kernel
+    cl_kernel kernel_mat_mult=clCreateKernel(
+        program, 
+        "mat_mult_tile_local_AB_register", 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+    
+    // Each work-item computes (WPT0, WPT1) elements of C,
+    // rounding up to a multiple of the local size gives whole tiles
+    size_t global_size_mat_mult[]={ 
+        N1_C/WPT1 + ((N1_C % WPT1) ? 1 : 0), 
+        N0_C/WPT0 + ((N0_C % WPT0) ? 1 : 0)
+    };
+
+    // Set arguments to the kernel (not thread safe)
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 0, sizeof(cl_mem), &A_d ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 1, sizeof(cl_mem), &B_d ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 2, sizeof(cl_mem), &C_d ));
+
+    // Prepare local memory arguments for execution
+    prep_mat_kernel(
+        kernel_mat_mult, 
+        local_size,
+        global_size_mat_mult,
+        work_dim,
+        NULL
+    );
+    
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 5, sizeof(cl_uint), &N1_A ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 6, sizeof(cl_uint), &N0_C ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 7, sizeof(cl_uint), &N1_C ));
+
+    // Number of statistical runs per experiment
+    size_t nstats=NSTATS;
+    
+    // Find the optimal local size
+    h_optimise_local(
+        argc,
+        argv,
+        command_queue,
+        kernel_mat_mult,
+        device,
+        // Desired global size of the problem
+        global_size_mat_mult,
+        // Desired local_size of the problem, use NULL for defaults
+        local_size,
+        // Number of dimensions in the kernel
+        work_dim,
+        // Number of times to run the kernel per experiment
+        nstats,
+        // Any pre-existing timing results
+        0.0,
+        // Function for prepping the kernel prior to execution
+        prep_mat_kernel,
+        NULL
+    );
+    
+    //// Step 8. Copy the Buffer for matrix C back to the host ////
+
+    // Map C_d back to C_h so we can write it to disk
+    float_type* C_h = (float_type*)clEnqueueMapBuffer(
+        command_queue,
+        C_d,
+        blocking,
+        CL_MAP_READ,
+        0,
+        nbytes_C,
+        0,
+        NULL,
+        NULL,
+        &errcode
+    );
+    H_ERRCHK(errcode);  
+
+    //// Step 9. Test the answer against a known solution
+    //// And write the contents of the matrices out to disk
+   
+    // Compute the serial solution using the matrix helper library
+    float* C_answer_h = (float*)calloc(nbytes_C, 1);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    // Print the maximum error between matrices
+    m_max_error(C_h, C_answer_h, N0_C, N1_C);
+
+    // Write out the host arrays to file
+    h_write_binary(A_h, "array_A.dat", nbytes_A);
+    h_write_binary(B_h, "array_B.dat", nbytes_B);
+    h_write_binary(C_h, "array_C.dat", nbytes_C);
+
+    //// Step 10. Clean up arrays and release resources
+
+    // Unmap C_d so we can release it
+    H_ERRCHK(
+        clEnqueueUnmapMemObject(
+            command_queue,
+            C_d,
+            C_h,
+            0,
+            NULL,
+            NULL
+        )
+    );
+    
+    // Free the OpenCL buffers
+    H_ERRCHK(clReleaseMemObject(A_d));
+    H_ERRCHK(clReleaseMemObject(B_d));
+    H_ERRCHK(clReleaseMemObject(C_d));
+    
+    // Clean up memory that was allocated on the read   
+    free(A_h);
+    free(B_h);
+    free(C_answer_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+}
@@ -0,0 +1,484 @@
+/* Code to autotune the local size, vector length, and chunk length 
+of a tiled matrix multiplication using OpenCL
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Largest chunk length the tuner may choose
+#define MAX_CHUNK_LEN 256
+
+const char* kernel_source = R"(
+
+// Vector length and chunk length are set at compile time
+#ifndef VECTOR_LEN
+#define VECTOR_LEN 8
+#endif
+
+#ifndef CHUNK_LEN
+#define CHUNK_LEN 128
+#endif
+
+// Make vector types and functions from the vector length
+#define H_CAT(a, b) a##b
+#define H_XCAT(a, b) H_CAT(a, b)
+#define floatn H_XCAT(float, VECTOR_LEN)
+#define vloadn H_XCAT(vload, VECTOR_LEN)
+
+// Stride for shared arrays, in vectors
+#define CHUNK_LEN_V (CHUNK_LEN/VECTOR_LEN)
+
+// Kernel function to get the start and end values
+// for filling a shared memory array
+void get_start_end(
+    // Number of work-items along a dimension of workgroup
+    size_t local_length,
+    // Number of items in the array
+    size_t array_length,
+    // Index of work item along dimension of workgroup
+    size_t local_index,
+    // Starting position of the copy
+    size_t *start,
+    // End position of the copy
+    size_t *end) {
+  
+    // Work out the jump size
+    size_t jump_size=array_length/local_length;
+    if (array_length%local_length) jump_size++;
+    
+    // Starting position for the copy
+    *start=local_index*jump_size;
+    // End position for the copy
+    *end=(local_index+1)*jump_size;
+    // Limit end so we don't go off the end
+    *end=min(*end,array_length);
+} 
+
+// Load vector n from a row with len valid elements,
+// elements past the end of the row are zero
+floatn vloadn_edge(size_t n, size_t len, __global float* row) {
+    if ((n+1)*VECTOR_LEN<=len) {
+        return vloadn(n, row);
+    }
+    floatn v=(floatn)0.0f;
+    float* v_f=(float*)&v;
+    for (size_t k=n*VECTOR_LEN; k<len; k++) {
+        v_f[k-n*VECTOR_LEN]=row[k];
+    }
+    return v;
+}
+
+// Load vector n from a column with len valid elements 
+// and stride between elements, elements past the end of the column are zero
+floatn vloadn_column_edge(size_t n, size_t len, __global float* column, size_t stride) {
+    floatn v=(floatn)0.0f;
+    float* v_f=(float*)&v;
+    size_t end=min((n+1)*VECTOR_LEN, len);
+    for (size_t k=n*VECTOR_LEN; k<end; k++) {
+        v_f[k-n*VECTOR_LEN]=column[k*stride];
+    }
+    return v;
+}
+
+// Matrix multiply kernel that uses local memory
+__kernel void mat_mult_tile_local_AB_vector_tuned (
+                        __global float* A, 
+                        __global float* B, 
+                        __global float* C,
+                        __local floatn* shared_A,
+                        __local floatn* shared_B,
+                        unsigned int N1_A, 
+                        unsigned int N0_C,
+                        unsigned int N1_C,
+                        unsigned int start_chunk_id,
+                        unsigned int end_chunk_id) { 
+    
+    // A is of size (N0_C, N1_A), (i0, n)
+    // B is of size (N1_A, N1_C), (n, i1)
+    // C is of size (N0_C, N1_C), (i0, i1)
+    
+    // i1 and i2 represent the coordinates in Matrix C 
+    // We assume row-major ordering for the matrices 
+    size_t i1=min(get_global_id(0), (size_t)N1_C-1); // Fastest dimension
+    size_t i0=min(get_global_id(1), (size_t)N0_C-1); 
+    
+    // shared_A is of size (L0, CHUNK_LEN) (s0, n)
+    // shared_B is of size (L1, CHUNK_LEN) (s1, n)
+    size_t L0 = get_local_size(1); // Slowest dimension
+    size_t L1 = get_local_size(0); // Fastest dimension
+    
+    // index within local memory
+    size_t s0 = get_local_id(1); // Slowest dimension
+    size_t s1 = get_local_id(0); // fastest dimension
+    
+    // Positions within shared memory
+    __local floatn* shared_A_s0 = &shared_A[s0*CHUNK_LEN_V];
+    __local floatn* shared_B_s1 = &shared_B[s1*CHUNK_LEN_V];
+
+    // Scratch variable to accumulate the sum
+    floatn temp=(floatn)0.0f;
+
+    // Start and end positions to copy within a chunk
+    size_t start0, end0, start1, end1;
+    get_start_end(L1, CHUNK_LEN_V, s1, &start1, &end1);
+    get_start_end(L0, CHUNK_LEN_V, s0, &start0, &end0);
+
+    // Loop over the chunks
+    for (int chunk_id=start_chunk_id; chunk_id<end_chunk_id; chunk_id++) {
+
+        // Number of valid elements in this chunk, the last chunk may be ragged,
+        // and the number of vectors needed to cover them
+        size_t chunk_valid = min((size_t)CHUNK_LEN, (size_t)N1_A-chunk_id*CHUNK_LEN);
+        size_t chunk_valid_v = chunk_valid/VECTOR_LEN;
+        if (chunk_valid % VECTOR_LEN) chunk_valid_v++;
+
+        // Starting positions for the copy
+        __global float* A_i0 = &A[i0*N1_A+chunk_id*CHUNK_LEN];
+        __global float* B_i1 = &B[chunk_id*CHUNK_LEN*N1_C+i1];
+          
+        // Fill the rows of shared_A from row i0 of A
+        for (size_t n = start1; n<end1; n++) {
+            shared_A_s0[n] = vloadn_edge(n, chunk_valid, A_i0);
+        }
+        
+        // Copy from column i1 of B   
+        for (size_t n = start0; n<end0; n++) {
+            shared_B_s1[n] = vloadn_column_edge(n, chunk_valid, B_i1, N1_C);
+        }
+              
+        // Enqueue a local barrier to ensure shared memory is filled
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        // Loop across row i0 of A and down column i1 of B
+        for (size_t n=0; n<chunk_valid_v; n++) {
+            temp+=shared_A_s0[n]*shared_B_s1[n];
+        }
+        
+        // Enqueue a local barrier to ensure all work items 
+        // are ready to tackle the next tile
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Sum the elements of the vector
+    float* temp_f = (float*)&temp;
+    float sum = 0.0f;
+    for (size_t k=0; k<VECTOR_LEN; k++) {
+        sum += temp_f[k];
+    }
+
+    // Put the accumulated value into position
+    C[i0*N1_C+i1]=sum;
+}
+)";
+
+// Data needed to prepare the kernel for a configuration
+struct prep_data_t {
+    cl_mem A_d;
+    cl_mem B_d;
+    cl_mem C_d;
+    cl_uint N1_A;
+    cl_uint N0_C;
+    cl_uint N1_C;
+};
+
+// Set the kernel arguments for a configuration from the tuner
+cl_int prep_tuned_kernel(cl_kernel kernel,
+                 const h_tune_config_t* config,
+                 size_t* global_size,
+                 void* data) {
+
+    prep_data_t* prep_data=(prep_data_t*)data;
+
+    // Chunk length is the second tuning parameter
+    cl_uint chunk_len = (cl_uint)config->values[1];
+    size_t nbytes_line = chunk_len*sizeof(float_type);
+
+    // Set start and end chunk indices
+    cl_uint start_chunk_id = 0;
+    cl_uint end_chunk_id = prep_data->N1_A/chunk_len;
+    if (prep_data->N1_A % chunk_len) end_chunk_id++;
+    
+    cl_int errcode=CL_SUCCESS;
+    errcode = errcode | clSetKernelArg(kernel, 0, sizeof(cl_mem), &prep_data->A_d);
+    errcode = errcode | clSetKernelArg(kernel, 1, sizeof(cl_mem), &prep_data->B_d);
+    errcode = errcode | clSetKernelArg(kernel, 2, sizeof(cl_mem), &prep_data->C_d);
+
+    // Local size of shared_A is going to be (local_size[1], chunk_len)
+    errcode = errcode | clSetKernelArg(kernel, 3, config->local_size[1]*nbytes_line, NULL);
+    // Local size of shared_B is going to be (local_size[0], chunk_len)
+    errcode = errcode | clSetKernelArg(kernel, 4, config->local_size[0]*nbytes_line, NULL);
+
+    errcode = errcode | clSetKernelArg(kernel, 5, sizeof(cl_uint), &prep_data->N1_A);
+    errcode = errcode | clSetKernelArg(kernel, 6, sizeof(cl_uint), &prep_data->N0_C);
+    errcode = errcode | clSetKernelArg(kernel, 7, sizeof(cl_uint), &prep_data->N1_C);
+    errcode = errcode | clSetKernelArg(kernel, 8, sizeof(cl_uint), &start_chunk_id);
+    errcode = errcode | clSetKernelArg(kernel, 9, sizeof(cl_uint), &end_chunk_id);
+
+    global_size[0] = prep_data->N1_C;
+    global_size[1] = prep_data->N0_C;
+    return errcode;
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Choose the search strategy and whether to reuse the tuning database
+    h_tune_strategy_t strategy = H_TUNE_HALVING;
+    cl_bool use_db = CL_TRUE;
+    for (int n=1; n<argc; n++) {
+        if (std::strcmp(argv[n], "--grid")==0) strategy = H_TUNE_GRID;
+        if (std::strcmp(argv[n], "--random")==0) strategy = H_TUNE_RANDOM;
+        if (std::strcmp(argv[n], "--halving")==0) strategy = H_TUNE_HALVING;
+        if (std::strcmp(argv[n], "--retune")==0) use_db = CL_FALSE;
+    }
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_TRUE;
+
+    // Do we enable blocking IO?
+    cl_bool blocking = CL_TRUE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+    
+    //// Step 4. Prepare matrices A and B on the Host ////
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+
+    // Number of bytes in each array
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    // Allocate memory for matrices A and B on the host
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+
+    // Fill A_h and B_h with random numbers 
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+
+    //// Step 5. Allocate OpenCL Buffers for matrices A, B, and C ////
+
+    // The kernel handles the ragged last chunk itself, 
+    // so A and B are copied straight from the host without padding
+    cl_mem A_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_A, 
+        (void*)A_h, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+    
+    cl_mem B_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_B, 
+        (void*)B_h, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+   
+    // Allocate C from pinned host memory
+    cl_mem C_d = clCreateBuffer(
+        context, 
+        CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, 
+        nbytes_C, 
+        NULL, 
+        &errcode
+    );
+    H_ERRCHK(errcode);
+
+    //// Step 6. Describe the search space ////
+
+    h_tune_space_t space;
+    space.ndim = 2;
+    space.local[0] = {2, 4, 8, 16, 32, 64};
+    space.local[1] = {2, 4, 8, 16, 32, 64};
+
+    // Kernel parameters, set with -D at compile time
+    h_tune_param_t vector_len = {"VECTOR_LEN", {4, 8, 16}};
+    h_tune_param_t chunk_len = {"CHUNK_LEN", {32, 64, 128, MAX_CHUNK_LEN}};
+    space.params.push_back(vector_len);
+    space.params.push_back(chunk_len);
+
+    prep_data_t prep_data = {A_d, B_d, C_d, N1_A, N0_C, N1_C};
+
+    //// Step 7. Tune the kernel ////
+
+    h_tuner_t* tuner = h_create_tuner(
+        context,
+        device,
+        command_queue,
+        kernel_source,
+        "mat_mult_tile_local_AB_vector_tuned",
+        NULL,
+        &space,
+        prep_tuned_kernel,
+        &prep_data
+    );
+
+    // The problem size is part of the key in the tuning database
+    std::string problem_key = std::to_string(N0_C) + "x" 
+        + std::to_string(N1_A) + "x" + std::to_string(N1_C);
+
+    h_tune_config_t best = h_tune(
+        tuner,
+        strategy,
+        // Number of times to run the best configurations
+        NSTATS,
+        // Most configurations to try with random sampling
+        64,
+        problem_key.c_str(),
+        use_db
+    );
+
+    //// Step 8. Run the best configuration ////
+
+    cl_kernel kernel = h_tuner_get_kernel(tuner, &best);
+    size_t global_size[H_MAX_WORK_DIM];
+    H_ERRCHK(prep_tuned_kernel(kernel, &best, global_size, &prep_data));
+    h_run_kernel(
+        command_queue,
+        kernel,
+        best.local_size,
+        global_size,
+        space.ndim,
+        CL_FALSE,
+        NULL,
+        NULL
+    );
+
+    //// Step 9. Copy the Buffer for matrix C back to the host ////
+
+    float_type* C_h = (float_type*)clEnqueueMapBuffer(
+        command_queue,
+        C_d,
+        blocking,
+        CL_MAP_READ,
+        0,
+        nbytes_C,
+        0,
+        NULL,
+        NULL,
+        &errcode
+    );
+    H_ERRCHK(errcode);  
+
+    //// Step 10. Test the answer against a known solution ////
+   
+    float* C_answer_h = (float*)calloc(nbytes_C, 1);
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+
+    // Print the maximum error between matrices
+    m_max_error(C_h, C_answer_h, N0_C, N1_C);
+
+    //// Step 11. Clean up arrays and release resources ////
+
+    H_ERRCHK(
+        clEnqueueUnmapMemObject(
+            command_queue,
+            C_d,
+            C_h,
+            0,
+            NULL,
+            NULL
+        )
+    );
+
+    h_release_tuner(tuner);
+    
+    // Free the OpenCL buffers
+    H_ERRCHK(clReleaseMemObject(A_d));
+    H_ERRCHK(clReleaseMemObject(B_d));
+    H_ERRCHK(clReleaseMemObject(C_d));
+    
+    // Clean up memory that was allocated on the read   
+    free(A_h);
+    free(B_h);
+    free(C_answer_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+}
@@ -47,13 +47,50 @@ void get_start_end(
     *end=min(*end,array_length);
 } 
 
+// Load vector n from a row with len valid elements,
+// elements past the end of the row are zero
+float8 vload8_edge(size_t n, size_t len, __global float* row) {
+    if ((n+1)*8<=len) {
+        return vload8(n, row);
+    }
+    float8 v=(float8)0.0f;
+    float* v_f=(float*)&v;
+    for (size_t k=n*8; k<len; k++) {
+        v_f[k-n*8]=row[k];
+    }
+    return v;
+}
+
+// Load vector n from a column with len valid elements 
+// and stride between elements, elements past the end of the column are zero
+float8 vload8_column_edge(size_t n, size_t len, __global float* column, size_t stride) {
+    float8 v=(float8)0.0f;
+    if ((n+1)*8<=len) {
+        size_t offset=n*8*stride;
+        v.s0 = column[offset+0*stride];
+        v.s1 = column[offset+1*stride];
+        v.s2 = column[offset+2*stride];
+        v.s3 = column[offset+3*stride];            
+        v.s4 = column[offset+4*stride];
+        v.s5 = column[offset+5*stride];
+        v.s6 = column[offset+6*stride];
+        v.s7 = column[offset+7*stride];
+    } else {
+        float* v_f=(float*)&v;
+        for (size_t k=n*8; k<len; k++) {
+            v_f[k-n*8]=column[k*stride];
+        }
+    }
+    return v;
+}
+
 // Matrix multiply kernel that uses local memory
 __kernel void mat_mult_tile_local_A_vector (
-                        __global float* A_star, 
-                        __global float* B_star, 
+                        __global float* A, 
+                        __global float* B, 
                         __global float* C,
-                        __local float8* shared_A_star,
-                        unsigned int N1_A_star, 
+                        __local float8* shared_A,
+                        unsigned int N1_A, 
                         unsigned int N0_C,
                         unsigned int N1_C,
                         unsigned int chunk_len,
@@ -64,8 +101,8 @@ __kernel void mat_mult_tile_local_A_vector (
     size_t vector_len = 8;
     size_t chunk_len_v = chunk_len / vector_len;
     
-    // A_star is of size (N0_C, N1_A_star), (i0, n)
-    // B_star is of size (N1_A_star, N1_C), (n, i1)
+    // A is of size (N0_C, N1_A), (i0, n)
+    // B is of size (N1_A, N1_C), (n, i1)
     // C is of size (N0_C, N1_C), (i0, i1)
     
     // i1 and i2 represent the coordinates in Matrix C 
@@ -73,8 +110,8 @@ __kernel void mat_mult_tile_local_A_vector (
     size_t i1=min(get_global_id(0), (size_t)N1_C-1); // Fastest dimension
     size_t i0=min(get_global_id(1), (size_t)N0_C-1); 
     
-    // shared_A_star is of size (L0, chunk_len) (s0, n)
-    // shared_B_star is of size (L1, chunk_len) (s1, n)
+    // shared_A is of size (L0, chunk_len) (s0, n)
+    // shared_B is of size (L1, chunk_len) (s1, n)
     size_t L0 = get_local_size(1); // Slowest dimension
     size_t L1 = get_local_size(0); // Fastest dimension
     
@@ -83,7 +120,7 @@ __kernel void mat_mult_tile_local_A_vector (
     size_t s1 = get_local_id(0); // fastest dimension
     
     // Positions within shared memory
-    __local float8* shared_A_star_s0 = &shared_A_star[s0*chunk_len_v];
+    __local float8* shared_A_s0 = &shared_A[s0*chunk_len_v];
 
     // Scratch variable to accumulate the sum
     float8 temp=(float8)0.0f, scratch=(float8)0.0f;
@@ -96,49 +133,48 @@ __kernel void mat_mult_tile_local_A_vector (
     // Loop over the chunks
     for (int chunk_id=start_chunk_id; chunk_id<end_chunk_id; chunk_id++) {
 
-        // Fetch local memory into shared_A_star and shared_B_star
+        // Fetch local memory into shared_A and shared_B
         
+        // Number of valid elements in this chunk,
+        // the last chunk is ragged when chunk_len doesn't divide N1_A
+        size_t chunk_valid = min((size_t)chunk_len, (size_t)N1_A-chunk_id*chunk_len);
+        // Number of vectors needed to cover the valid elements
+        size_t chunk_valid_v = chunk_valid/vector_len;
+        if (chunk_valid % vector_len) chunk_valid_v++;
+
         // Starting positions for the copy
-        __global float* A_star_i0 = &A_star[i0*N1_A_star+chunk_id*chunk_len];
-        __global float* B_star_i1 = &B_star[chunk_id*chunk_len*N1_C+i1];
+        __global float* A_i0 = &A[i0*N1_A+chunk_id*chunk_len];
+        __global float* B_i1 = &B[chunk_id*chunk_len*N1_C+i1];
           
-        // Fill the rows of shared_A_star and shared_B_star
-        // From row i0 of A_star
+        // Fill the rows of shared_A and shared_B
+        // From row i0 of A
         for (size_t n = start1; n<end1; n++) {
             // Use a vector load function to load data
-            shared_A_star_s0[n] = vload8(n, A_star_i0);
+            shared_A_s0[n] = vload8_edge(n, chunk_valid, A_i0);
             // Otherwise we do this
             //offset = n*vector_len;
-            //scratch.s0 = A_star_i0[0+offset]; 
-            //scratch.s1 = A_star_i0[1+offset]; 
-            //scratch.s2 = A_star_i0[2+offset]; 
-            //scratch.s3 = A_star_i0[3+offset]; 
-            //scratch.s4 = A_star_i0[4+offset]; 
-            //scratch.s5 = A_star_i0[5+offset]; 
-            //scratch.s6 = A_star_i0[6+offset]; 
-            //scratch.s7 = A_star_i0[7+offset];
-            //shared_A_star_s0[n]=scratch;
+            //scratch.s0 = A_i0[0+offset]; 
+            //scratch.s1 = A_i0[1+offset]; 
+            //scratch.s2 = A_i0[2+offset]; 
+            //scratch.s3 = A_i0[3+offset]; 
+            //scratch.s4 = A_i0[4+offset]; 
+            //scratch.s5 = A_i0[5+offset]; 
+            //scratch.s6 = A_i0[6+offset]; 
+            //scratch.s7 = A_i0[7+offset];
+            //shared_A_s0[n]=scratch;
         }
               
         // Enqueue a local barrier to ensure shared memory is filled
         barrier(CLK_LOCAL_MEM_FENCE);
         
-        // Dot product using shared_A_star and B 
-        for (size_t n=0; n<chunk_len_v; n++) {
-            // Offset into B_star_i1
-            offset=n*vector_len*N1_C;
-            scratch.s0 = B_star_i1[offset+0*N1_C];
-            scratch.s1 = B_star_i1[offset+1*N1_C];
-            scratch.s2 = B_star_i1[offset+2*N1_C];
-            scratch.s3 = B_star_i1[offset+3*N1_C];            
-            scratch.s4 = B_star_i1[offset+4*N1_C];
-            scratch.s5 = B_star_i1[offset+5*N1_C];
-            scratch.s6 = B_star_i1[offset+6*N1_C];
-            scratch.s7 = B_star_i1[offset+7*N1_C];
+        // Dot product using shared_A and B 
+        for (size_t n=0; n<chunk_valid_v; n++) {
+            // Load from B_i1
+            scratch = vload8_column_edge(n, chunk_valid, B_i1, N1_C);
             
             // Loop across row i0 of A
             // and down column i1 of B
-            temp+=shared_A_star_s0[n]*scratch;
+            temp+=shared_A_s0[n]*scratch;
         }
         
         // Enqueue a local barrier to ensure all work items 
@@ -298,38 +334,33 @@ int main(int argc, char** argv) {
     cl_uint nchunks = N1_A/chunk_len;
     // Increase the number of vectors if there is any remainder
     if (N1_A % chunk_len) nchunks++;
-    // Resized N1_A for allocation of B and A, may be larger than N1_A
-    cl_uint N1_A_star = nchunks*chunk_len;
 
     // Set start and end chunk indices
     cl_uint start_chunk_id = 0;
     cl_uint end_chunk_id = nchunks;
 
-    // Resized bytes due to enlarged N1_A_star
-    size_t nbytes_A_star = N0_C*N1_A_star*sizeof(float_type);
-    size_t nbytes_B_star = N1_C*N1_A_star*sizeof(float_type);    
-    
-    // A_star is of size (N0_C, N1_A_star)
-    // B_star is of size (N1_A_star, N1_C)
+    // A is of size (N0_C, N1_A)
+    // B is of size (N1_A, N1_C)
     // C is of size (N0_C, N1_C)
     
     //// Step 5. Prepare OpenCL Buffers for matrices A, B, and C ////
 
-    // Make A_star_d and B_star_d - the enlarged matrices
-    cl_mem A_star_d = clCreateBuffer(
+    // The kernel handles the ragged last chunk itself, 
+    // so A and B are copied straight from the host without padding
+    cl_mem A_d = clCreateBuffer(
         context, 
-        CL_MEM_READ_WRITE, 
-        nbytes_A_star, 
-        NULL, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_A, 
+        (void*)A_h, 
         &errcode
     );
     H_ERRCHK(errcode);
     
-    cl_mem B_star_d = clCreateBuffer(
+    cl_mem B_d = clCreateBuffer(
         context, 
-        CL_MEM_READ_WRITE, 
-        nbytes_B_star, 
-        NULL, 
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+        nbytes_B, 
+        (void*)B_h, 
         &errcode
     );
     H_ERRCHK(errcode);
@@ -344,112 +375,6 @@ int main(int argc, char** argv) {
     );
     H_ERRCHK(errcode);
 
-    // Zero out buffers A_star and B_star
-    float_type zero=0.0;
-    H_ERRCHK(
-        clEnqueueFillBuffer(
-            command_queue,
-            A_star_d,
-            &zero,
-            sizeof(float_type),
-            0,
-            nbytes_A_star,
-            0,
-            NULL,
-            NULL
-        )
-    );       
-    H_ERRCHK(
-        clEnqueueFillBuffer(
-            command_queue,
-            B_star_d,
-            &zero,
-            sizeof(float_type),
-            0,
-            nbytes_B_star,
-            0,
-            NULL,
-            NULL
-        )
-    );
- 
-    // Rectangular copies from A_h and B_h 
-    // to the enlarged arrays A_star_d and B_star_d
-    
-    // B is of size (N1_A, N1_C)
-    // Offset is in bytes, row_id and slice_id are indices
-    size_t offset=0, row_id=0, slice_id = 0;
-    
-    // Make up the origin for host and buffer, same for both
-    const size_t dest_origin[] = {offset, row_id, slice_id};
-    const size_t src_origin[] = {offset, row_id, slice_id};
-    
-    // Length of a row in the allocation (in bytes)
-    size_t dest_row_pitch = N1_A_star * sizeof(float_type); 
-    size_t src_row_pitch = N1_A * sizeof(float_type);
-    
-    // Number of bytes in a slice 
-    size_t dest_slice_pitch = N0_C * dest_row_pitch;
-    size_t src_slice_pitch = N0_C * src_row_pitch;        
-        
-    /// Size of the region to copy, of course we only copy 1 slice
-    size_t nrows = N0_C, nslices = 1;
-    const size_t region_A[] = {src_row_pitch, nrows, nslices};
-     
-    // Enqueue the rectangular copy of A_h to enlarged A_star_d
-    H_ERRCHK(
-        clEnqueueWriteBufferRect(
-            command_queue,
-            A_star_d,
-            blocking,
-            dest_origin,
-            src_origin,
-            region_A,
-            dest_row_pitch,
-            dest_slice_pitch,
-            src_row_pitch,
-            src_slice_pitch,
-            A_h,
-            0,
-            NULL,
-            NULL
-        )
-    );
-   
-    // Now copy B_h into enlarged B_star_d
-
-    // Length of a row (in bytes)
-    dest_row_pitch = N1_C * sizeof(float_type); 
-    src_row_pitch = dest_row_pitch;
-    
-    // Number of bytes in a slice 
-    dest_slice_pitch = N1_A_star * dest_row_pitch;
-    src_slice_pitch = N1_A * src_row_pitch;        
-        
-    /// Size of the region to copy, only copy N1_A rows
-    nrows = N1_A;
-    const size_t region_B[] = {src_row_pitch, nrows, nslices};
-     
-    // Enqueue the rectangular copy
-    H_ERRCHK(
-        clEnqueueWriteBufferRect(
-            command_queue,
-            B_star_d,
-            CL_TRUE,
-            dest_origin,
-            src_origin,
-            region_B,
-            dest_row_pitch,
-            dest_slice_pitch,
-            src_row_pitch,
-            src_slice_pitch,
-            B_h,
-            0,
-            NULL,
-            NULL
-        )
-    );
-
     //// Step 6. Build the program from source for the chosen compute device ////
     
     // Turn this source code into a program
@@ -477,8 +402,8 @@ int main(int argc, char** argv) {
     size_t global_size_mat_mult[]={ N1_C, N0_C };
 
     // Set arguments to the kernel (not thread safe)
-    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 0, sizeof(cl_mem), &A_star_d ));
-    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 1, sizeof(cl_mem), &B_star_d ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 0, sizeof(cl_mem), &A_d ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 1, sizeof(cl_mem), &B_d ));
     H_ERRCHK(clSetKernelArg(kernel_mat_mult, 2, sizeof(cl_mem), &C_d ));
 
     // data for local memory preparation kernel
@@ -493,7 +418,7 @@ int main(int argc, char** argv) {
         &prep_data
     );
     
-    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 4, sizeof(cl_uint), &N1_A_star ));
+    H_ERRCHK(clSetKernelArg(kernel_mat_mult, 4, sizeof(cl_uint), &N1_A ));
     H_ERRCHK(clSetKernelArg(kernel_mat_mult, 5, sizeof(cl_uint), &N0_C ));
     H_ERRCHK(clSetKernelArg(kernel_mat_mult, 6, sizeof(cl_uint), &N1_C ));
     H_ERRCHK(clSetKernelArg(kernel_mat_mult, 7, sizeof(cl_uint), &chunk_len ));
@@ -572,8 +497,8 @@ int main(int argc, char** argv) {
     );
     
     // Free the OpenCL buffers
-    H_ERRCHK(clReleaseMemObject(A_star_d));
-    H_ERRCHK(clReleaseMemObject(B_star_d));
+    H_ERRCHK(clReleaseMemObject(A_d));
+    H_ERRCHK(clReleaseMemObject(B_d));
     H_ERRCHK(clReleaseMemObject(C_d));
     
     // Clean up memory that was allocated on the read   
@@ -1,8 +1,19 @@
-// Define the size of the arrays to be computed
+// Define the size of the arrays to be computed,
+// these may be overridden at compile time
 
+#ifndef NCOLS_A
 #define NCOLS_A 768
+#endif
+
+#ifndef NROWS_C
 #define NROWS_C 768
+#endif
+
+#ifndef NCOLS_C
 #define NCOLS_C 768
+#endif
 
 // Number of statistical experiments to do
-#define NSTATS 10
\ No newline at end of file
+#ifndef NSTATS
+#define NSTATS 10
+#endif
@@ -0,0 +1,146 @@
+/* Code to measure program build times with and without the program binary cache
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Include the size of arrays to be computed
+#include "mat_size.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+// Time a single call to h_build_program in milliseconds
+cl_double time_build_ms(const char* source,
+                        cl_context context,
+                        cl_device_id device,
+                        const char* compiler_options) {
+
+    // Start the clock
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    // Build the program and make a kernel from it,
+    // some implementations defer work until kernel creation
+    cl_int errcode;
+    cl_program program = h_build_program(source, context, device, compiler_options);
+    cl_kernel kernel = clCreateKernel(program, "mat_mult_float", &errcode);
+    H_ERRCHK(errcode);
+
+    // Stop the clock
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    H_ERRCHK(clReleaseKernel(kernel));
+    H_ERRCHK(clReleaseProgram(program));
+
+    return (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+
+    //// Step 2. Discover resources ////
+
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Choose the context and compute device to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_device_id device = devices[dev_index];
+
+    // Report on the device in use
+    h_report_on_device(device);
+
+    //// Step 3. Read the kernel source ////
+
+    size_t nbytes_src = 0;
+    char* kernel_source = (char*)h_read_binary("kernels_mat_mult.c", &nbytes_src);
+    const char* compiler_options = "";
+
+    // Use the environment's cache directory if it is set
+    const char* cache_dir = h_program_cache_dir;
+    if (cache_dir == NULL) {
+        cache_dir = "program_cache";
+    }
+
+    //// Step 4. Time builds from source without the cache ////
+
+    const size_t nstats = NSTATS;
+
+    h_set_program_cache_dir(NULL);
+    cl_double source_ms = 0.0;
+    for (size_t n=0; n<nstats; n++) {
+        source_ms += time_build_ms(kernel_source, context, device, compiler_options);
+    }
+    source_ms /= (cl_double)nstats;
+
+    //// Step 5. Time a cold build, which populates the cache ////
+
+    h_set_program_cache_dir(cache_dir);
+
+    // Remove any stale entry so the first build is a miss
+    std::string cache_file = h_program_cache_file(
+        cache_dir, kernel_source, device, compiler_options
+    );
+    std::remove(cache_file.c_str());
+
+    cl_double cold_ms = time_build_ms(kernel_source, context, device, compiler_options);
+
+    //// Step 6. Time warm builds, which load the cached binary ////
+
+    cl_double warm_ms = 0.0;
+    for (size_t n=0; n<nstats; n++) {
+        warm_ms += time_build_ms(kernel_source, context, device, compiler_options);
+    }
+    warm_ms /= (cl_double)nstats;
+
+    //// Step 7. Report ////
+
+    std::printf("Cache file is %s\n", cache_file.c_str());
+    std::printf("Build from source (no cache): %.3f ms\n", source_ms);
+    std::printf("Cold build (miss and store):  %.3f ms\n", cold_ms);
+    std::printf("Warm build (cache hit):       %.3f ms\n", warm_ms);
+    std::printf("Warm speedup over source:     %.2fx\n", source_ms/warm_ms);
+    h_report_program_cache();
+
+    //// Step 8. Clean up ////
+
+    free(kernel_source);
+
+    // Clean up devices and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
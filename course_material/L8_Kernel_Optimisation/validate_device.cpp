@@ -0,0 +1,251 @@
+/* Code to compare validating a matrix on the host against validating it on the device
+Written by Dr Toby M. Potter
+*/
+
+//// Step 1. Setup headers and parse command line arguments ////
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Bring in the size of the matrices
+#include "mat_size.hpp"
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Time since t1 in milliseconds
+cl_double elapsed_ms(std::chrono::high_resolution_clock::time_point t1) {
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+}
+
+// Run a matrix multiplication kernel from kernels_mat_mult.c
+void run_mat_mult(cl_command_queue command_queue, 
+        cl_kernel kernel,
+        cl_mem A_d, cl_mem B_d, cl_mem C_d,
+        cl_uint N1_A, cl_uint N0_C, cl_uint N1_C) {
+
+    H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &A_d));
+    H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &B_d));
+    H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &C_d));
+    H_ERRCHK(clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A));
+    H_ERRCHK(clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C));
+    H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C));
+
+    size_t local_size[] = {8, 8};
+    size_t global_size[] = {N1_C, N0_C};
+    h_fit_global_size(global_size, local_size, 2);
+    H_ERRCHK(
+        clEnqueueNDRangeKernel(command_queue, kernel, 2, NULL,
+            global_size, local_size, 0, NULL, NULL)
+    );
+}
+
+int main(int argc, char** argv) {
+
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    //// Step 2. Discover resources ////
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+    
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+    
+    // Do we enable out-of-order execution 
+    cl_bool ordering = CL_FALSE;
+    
+    // Do we enable profiling?
+    cl_bool profiling = CL_FALSE;
+    
+    //// Step 3. Allocate command queues and choose a compute device ////
+    
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        ordering,
+        profiling
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+    
+    //// Step 4. Prepare matrices A and B on the Host ////
+    cl_uint N1_A = NCOLS_A, N0_C = NROWS_C, N1_C = NCOLS_C;
+
+    // Number of bytes in each array
+    size_t nbytes_A = N0_C*N1_A*sizeof(float_type);
+    size_t nbytes_B = N1_A*N1_C*sizeof(float_type);
+    size_t nbytes_C = N0_C*N1_C*sizeof(float_type);
+
+    float_type* A_h = (float_type*)h_alloc(nbytes_A);
+    float_type* B_h = (float_type*)h_alloc(nbytes_B);
+    float_type* C_h = (float_type*)h_alloc(nbytes_C);
+    float_type* C_answer_h = (float_type*)h_alloc(nbytes_C);
+
+    m_random(A_h, N0_C, N1_A);
+    m_random(B_h, N1_A, N1_C);
+
+    // Reference answer on the host, for the host-side check
+    m_mat_mult(A_h, B_h, C_answer_h, N1_A, N0_C, N1_C);
+    float_type* C_ref_h = (float_type*)h_alloc(nbytes_C);
+
+    //// Step 5. Make buffers and compute C with two kernels ////
+
+    cl_mem A_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+        nbytes_A, A_h, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem B_d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+        nbytes_B, B_h, &errcode);
+    H_ERRCHK(errcode);
+
+    // Result to check, and the reference computed on the device
+    cl_mem C_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem C_ref_d = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_C, NULL, &errcode);
+    H_ERRCHK(errcode);
+
+    size_t nbytes_src;
+    char* kernel_source = (char*)h_read_binary("kernels_mat_mult.c", &nbytes_src);
+    cl_program program = h_build_program(kernel_source, context, device, NULL);
+
+    // The reference never leaves the device, so the
+    // device path moves no full-size matrix at all
+    cl_kernel kernel_ref = clCreateKernel(program, "mat_mult_float", &errcode);
+    H_ERRCHK(errcode);
+    cl_kernel kernel_test = clCreateKernel(program, "mat_mult_prefetch", &errcode);
+    H_ERRCHK(errcode);
+
+    run_mat_mult(command_queue, kernel_ref, A_d, B_d, C_ref_d, N1_A, N0_C, N1_C);
+    run_mat_mult(command_queue, kernel_test, A_d, B_d, C_d, N1_A, N0_C, N1_C);
+    H_ERRCHK(clFinish(command_queue));
+
+    //// Step 6. Validate on the host, reading C back each time ////
+
+    h_validator_t* validator = h_create_validator(context, device);
+
+    cl_double host_ms = 0.0, device_ms = 0.0;
+    float_type host_err = 0.0;
+    cl_double device_err = 0.0;
+
+    for (int s=0; s<NSTATS; s++) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        H_ERRCHK(clEnqueueReadBuffer(command_queue, C_d, CL_TRUE, 
+            0, nbytes_C, C_h, 0, NULL, NULL));
+        host_err = m_max_error(C_h, C_answer_h, N0_C, N1_C);
+        host_ms += elapsed_ms(t1);
+    }
+
+    //// Step 7. Validate on the device ////
+
+    h_validation_t validation;
+    for (int s=0; s<NSTATS; s++) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        validation = h_validate(validator, command_queue, C_d, C_ref_d, N0_C*N1_C, CL_FALSE);
+        device_ms += elapsed_ms(t1);
+    }
+    device_err = h_max_error(validator, command_queue, C_d, C_ref_d, N0_C, N1_C, CL_FALSE);
+
+    //// Step 8. Report ////
+
+    size_t nbytes_partials = validator->num_groups*(3*sizeof(cl_float)+2*sizeof(cl_uint));
+    std::printf("Host validation:   %.3f ms, %zu bytes read back\n", host_ms/NSTATS, nbytes_C);
+    std::printf("Device validation: %.3f ms, %zu bytes read back\n", device_ms/NSTATS, nbytes_partials);
+    std::printf("Speedup:           %.2fx\n", host_ms/device_ms);
+    std::printf("Maximum error:     host %g, device %g\n", (cl_double)host_err, device_err);
+    std::printf("L2 error %g, relative L2 error %g, %llu NaN, %llu Inf\n",
+        validation.l2_error, 
+        validation.l2_error/validation.l2_reference,
+        (unsigned long long)validation.num_nan, 
+        (unsigned long long)validation.num_inf);
+
+    // The two references differ by rounding, so the two errors may differ 
+    // by at most the gap between the references. Reading the device 
+    // reference back is only for this check and is not timed
+    H_ERRCHK(clEnqueueReadBuffer(command_queue, C_ref_d, CL_TRUE, 
+        0, nbytes_C, C_ref_h, 0, NULL, NULL));
+    cl_double ref_gap = 0.0;
+    for (size_t i=0; i<(size_t)N0_C*N1_C; i++) {
+        ref_gap = std::fmax(ref_gap, std::fabs((cl_double)C_ref_h[i]-(cl_double)C_answer_h[i]));
+    }
+    cl_double tolerance = ref_gap + 1.0e-6*std::fmax(1.0, std::fabs((cl_double)host_err));
+    bool agree = (std::fabs((cl_double)host_err-device_err) <= tolerance);
+    if (!agree) {
+        std::printf("Device validation disagrees with m_max_error\n");
+    }
+
+    //// Step 9. Clean up ////
+
+    h_release_validator(validator);
+    H_ERRCHK(clReleaseKernel(kernel_ref));
+    H_ERRCHK(clReleaseKernel(kernel_test));
+    H_ERRCHK(clReleaseProgram(program));
+    H_ERRCHK(clReleaseMemObject(A_d));
+    H_ERRCHK(clReleaseMemObject(B_d));
+    H_ERRCHK(clReleaseMemObject(C_d));
+    H_ERRCHK(clReleaseMemObject(C_ref_d));
+
+    free(kernel_source);
+    free(A_h);
+    free(B_h);
+    free(C_h);
+    free(C_answer_h);
+    free(C_ref_h);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return agree ? 0 : 1;
+}
@@ -53,4 +53,332 @@ __kernel void wave2d_4o (
         U2[offset]+=(1.0f-2.0f*pi2fm2t2)*exp(-pi2fm2t2);
     }
     
-}
\ No newline at end of file
+}
+
+// Work-group shape and rows per work-item for wave2d_4o_tiled, 
+// a work-group updates a tile of (STENCIL_L0*STENCIL_ROWS, STENCIL_L1) points
+#ifndef STENCIL_L0
+#define STENCIL_L0 4
+#endif
+#ifndef STENCIL_L1
+#define STENCIL_L1 64
+#endif
+#ifndef STENCIL_ROWS
+#define STENCIL_ROWS 4
+#endif
+
+// Tile of U1 in local memory, with a halo of 2 on every side
+#define STENCIL_PAD 2
+#define STENCIL_T0 (STENCIL_L0*STENCIL_ROWS+2*STENCIL_PAD)
+#define STENCIL_T1 (STENCIL_L1+2*STENCIL_PAD)
+
+// Same update as wave2d_4o, U1 is staged in local memory and each
+// work-item streams down STENCIL_ROWS rows, keeping the five values 
+// of its column that the dimension 0 derivative needs in registers
+__kernel __attribute__((reqd_work_group_size(STENCIL_L1, STENCIL_L0, 1)))
+void wave2d_4o_tiled (
+        __global float* U0,
+        __global float* U1,
+        __global float* U2,
+        __global float* V,
+        unsigned int N0,
+        unsigned int N1,
+        float dt2,
+        float inv_dx02,
+        float inv_dx12,
+        // Position, frequency, and time for the
+        // wavelet injection
+        unsigned int P0,
+        unsigned int P1,
+        float pi2fm2t2) {    
+
+    // U2, U1, U0, V is of size (N0, N1)
+    __local float tile[STENCIL_T0][STENCIL_T1];
+
+    // Start of the tile in the grid, and position within the work-group
+    long b0=get_group_id(1)*(STENCIL_L0*STENCIL_ROWS);
+    long b1=get_group_id(0)*STENCIL_L1;
+    size_t s0=get_local_id(1);
+    size_t s1=get_local_id(0);
+    
+    // Coefficients for spatial finite difference
+    const int ncoeffs=5;
+    float coeffs[ncoeffs] = {-0.083333336f, 1.3333334f, -2.5f, 1.3333334f, -0.083333336f};
+
+    // Fill the tile and its halo, points outside the grid are zero
+    for (size_t idx=s0*STENCIL_L1+s1; idx<STENCIL_T0*STENCIL_T1; idx+=STENCIL_L0*STENCIL_L1) {
+        long t0=idx/STENCIL_T1, t1=idx%STENCIL_T1;
+        long j0=b0+t0-STENCIL_PAD, j1=b1+t1-STENCIL_PAD;
+        tile[t0][t1]=(j0>=0 && j0<N0 && j1>=0 && j1<N1) ? U1[j0*N1+j1] : 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Column within the tile, and the first row this work-item updates
+    size_t c=s1+STENCIL_PAD;
+    size_t r0=s0*STENCIL_ROWS+STENCIL_PAD;
+    size_t i1=b1+s1;
+
+    // Sliding window down the column, rows r-2 to r+2
+    float w[ncoeffs];
+    #pragma unroll
+    for (int n=0; n<ncoeffs-1; n++) {
+        w[n+1]=tile[r0-STENCIL_PAD+n][c];
+    }
+
+    #pragma unroll
+    for (int r=0; r<STENCIL_ROWS; r++) {
+        size_t i0=b0+s0*STENCIL_ROWS+r;
+
+        // Shift the window down one row
+        #pragma unroll
+        for (int n=0; n<ncoeffs-1; n++) {
+            w[n]=w[n+1];
+        }
+        w[ncoeffs-1]=tile[r0+r+STENCIL_PAD][c];
+
+        // Only points away from the boundary are updated
+        if (i0>=STENCIL_PAD && i0<N0-STENCIL_PAD && i1>=STENCIL_PAD && i1<N1-STENCIL_PAD) {
+            float temp0=0.0f, temp1=0.0f;
+            #pragma unroll
+            for (int n=0; n<ncoeffs; n++) {
+                temp0+=coeffs[n]*w[n];
+                temp1+=coeffs[n]*tile[r0+r][c+n-STENCIL_PAD];
+            }
+
+            long offset=i0*N1+i1;
+            float tempV=V[offset];
+            float u2=(2.0f*w[STENCIL_PAD])-U0[offset]+((dt2*tempV*tempV)*(temp0*inv_dx02+temp1*inv_dx12));
+    
+            // Inject the forcing term at coordinates (P0, P1)
+            if ((i0==P0) && (i1==P1)) {
+                u2+=(1.0f-2.0f*pi2fm2t2)*exp(-pi2fm2t2);
+            }
+            U2[offset]=u2;
+        }
+    }
+}
+
+// Steps per launch and tile of points written per work-group for 
+// wave2d_4o_temporal, each step needs a halo of 2 more points
+#ifndef TB_STEPS
+#define TB_STEPS 2
+#endif
+#ifndef TB_T0
+#define TB_T0 16
+#endif
+#ifndef TB_T1
+#define TB_T1 32
+#endif
+#define TB_HALO (2*TB_STEPS)
+#define TB_R0 (TB_T0+2*TB_HALO)
+#define TB_R1 (TB_T1+2*TB_HALO)
+
+// Advance the wavefield up to TB_STEPS timesteps in one launch. Overlapping 
+// tiles of U0, U1, and V with a halo of 2*TB_STEPS are held in local memory,
+// and the valid region shrinks by 2 points per step until only the tile is left.
+// U0_out and U1_out receive the last two timesteps and must not alias U0 or U1.
+__kernel void wave2d_4o_temporal (
+        __global float* U0,
+        __global float* U1,
+        __global float* U0_out,
+        __global float* U1_out,
+        __global float* V,
+        unsigned int N0,
+        unsigned int N1,
+        float dt2,
+        float inv_dx02,
+        float inv_dx12,
+        // Position of the wavelet injection
+        unsigned int P0,
+        unsigned int P1,
+        // pi^2 fm^2 t^2 for every timestep of the run
+        __global float* pi2fm2t2,
+        // First timestep of this launch and the number of steps to take
+        unsigned int step0,
+        unsigned int nsteps) {
+
+    // Three time levels and dt2*V^2 for the tile and its halo
+    __local float fields[3][TB_R0*TB_R1];
+    __local float vel2[TB_R0*TB_R1];
+
+    // Start of the tile and its halo in the grid
+    long b0=(long)get_group_id(1)*TB_T0-TB_HALO;
+    long b1=(long)get_group_id(0)*TB_T1-TB_HALO;
+    size_t lid=get_local_id(1)*get_local_size(0)+get_local_id(0);
+    size_t nthreads=get_local_size(0)*get_local_size(1);
+
+    // Coefficients for spatial finite difference
+    const int pad=2, ncoeffs=5;
+    float coeffs[ncoeffs] = {-0.083333336f, 1.3333334f, -2.5f, 1.3333334f, -0.083333336f};
+
+    // Load the tile and its halo, points outside the grid are zero
+    for (size_t idx=lid; idx<TB_R0*TB_R1; idx+=nthreads) {
+        long j0=b0+idx/TB_R1, j1=b1+idx%TB_R1;
+        bool inside=(j0>=0 && j0<N0 && j1>=0 && j1<N1);
+        long offset=j0*N1+j1;
+        float tempV=inside ? V[offset] : 0.0f;
+        fields[0][idx]=inside ? U0[offset] : 0.0f;
+        fields[1][idx]=inside ? U1[offset] : 0.0f;
+        vel2[idx]=dt2*tempV*tempV;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    __local float* prev=fields[0];
+    __local float* curr=fields[1];
+    __local float* next=fields[2];
+
+    for (unsigned int s=0; s<nsteps; s++) {
+        float p=pi2fm2t2[step0+s];
+        float source=(1.0f-2.0f*p)*exp(-p);
+
+        // Region of the tile that is still valid after this step
+        size_t lo=pad*(s+1);
+        size_t n0=TB_R0-2*lo, n1=TB_R1-2*lo;
+        for (size_t idx=lid; idx<n0*n1; idx+=nthreads) {
+            size_t r=lo+idx/n1, c=lo+idx%n1;
+            long j0=b0+r, j1=b1+c;
+            size_t k=r*TB_R1+c;
+
+            // Points on the boundary keep their value
+            float value=curr[k];
+            if (j0>=pad && j0<(long)N0-pad && j1>=pad && j1<(long)N1-pad) {
+                float temp0=0.0f, temp1=0.0f;
+                #pragma unroll
+                for (int n=0; n<ncoeffs; n++) {
+                    temp0+=coeffs[n]*curr[k+(n-pad)*TB_R1];
+                    temp1+=coeffs[n]*curr[k+n-pad];
+                }
+                value=(2.0f*curr[k])-prev[k]+(vel2[k]*(temp0*inv_dx02+temp1*inv_dx12));
+                if ((j0==P0) && (j1==P1)) {
+                    value+=source;
+                }
+            }
+            next[k]=value;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Rotate the time levels
+        __local float* temp=prev;
+        prev=curr;
+        curr=next;
+        next=temp;
+    }
+
+    // Write the last two time levels for the tile
+    for (size_t idx=lid; idx<TB_T0*TB_T1; idx+=nthreads) {
+        size_t r=TB_HALO+idx/TB_T1, c=TB_HALO+idx%TB_T1;
+        long j0=b0+r, j1=b1+c;
+        if (j0<N0 && j1<N1) {
+            long offset=j0*N1+j1;
+            U0_out[offset]=prev[r*TB_R1+c];
+            U1_out[offset]=curr[r*TB_R1+c];
+        }
+    }
+}
+
+// Same update as wave2d_4o, with the wavelet read from a table of
+// pi^2 fm^2 t^2 for every timestep. The work-item at the source advances
+// the step counter, so launches on an in-order queue need no new arguments
+__kernel void wave2d_4o_table (
+        __global float* U0,
+        __global float* U1,
+        __global float* U2,
+        __global float* V,
+        unsigned int N0,
+        unsigned int N1,
+        float dt2,
+        float inv_dx02,
+        float inv_dx12,
+        // Position of the wavelet injection
+        unsigned int P0,
+        unsigned int P1,
+        // pi^2 fm^2 t^2 for every timestep of the run
+        __global float* pi2fm2t2,
+        // Timestep of the next launch, of size (1)
+        __global unsigned int* step) {
+
+    // U2, U1, U0, V is of size (N0, N1)
+    size_t i0=get_global_id(1); // Slowest dimension
+    size_t i1=get_global_id(0); // Fastest dimension
+
+    // Only one work-item injects the wavelet and advances the step
+    bool source=((i0==P0) && (i1==P1));
+
+    // Required padding and coefficients for spatial finite difference
+    const int pad_l=2, pad_r=2, ncoeffs=5;
+    float coeffs[ncoeffs] = {-0.083333336f, 1.3333334f, -2.5f, 1.3333334f, -0.083333336f};
+
+    // Limit i0 and i1 to the region of U2 within the padding
+    i0=min(i0, (size_t)(N0-1-pad_r));
+    i1=min(i1, (size_t)(N1-1-pad_r));
+    i0=max((size_t)pad_l, i0);
+    i1=max((size_t)pad_l, i1);
+
+    // Position within the grid as a 1D offset
+    long offset=i0*N1+i1;
+
+    // Temporary storage
+    float temp0=0.0f, temp1=0.0f;
+    float tempV=V[offset];
+
+    // Calculate the Laplacian, the sum of spatial derivatives
+    #pragma unroll
+    for (long n=0; n<ncoeffs; n++) {
+        // Stride in dim0 is N1
+        temp0+=coeffs[n]*U1[offset+(n*(long)N1)-(pad_l*(long)N1)];
+        // Stride in dim1 is 1
+        temp1+=coeffs[n]*U1[offset+n-pad_l];
+    }
+
+    // Calculate the wavefield U2 at the next timestep
+    float u2=(2.0f*U1[offset])-U0[offset]+((dt2*tempV*tempV)*(temp0*inv_dx02+temp1*inv_dx12));
+
+    // Inject the forcing term at coordinates (P0, P1)
+    if (source) {
+        unsigned int s=step[0];
+        float p=pi2fm2t2[s];
+        u2+=(1.0f-2.0f*p)*exp(-p);
+        step[0]=s+1;
+    }
+    U2[offset]=u2;
+}
+
+// Gather a region of interest of U with strides into a compact snapshot
+// of size (n0_out, n1_out), so only the requested points are copied to the host
+__kernel void snapshot_decimate (
+        __global float* U,
+        __global float* snapshot,
+        unsigned int N1,
+        // Start of the region and the strides in each dimension
+        unsigned int roi0,
+        unsigned int roi1,
+        unsigned int stride0,
+        unsigned int stride1,
+        unsigned int n0_out,
+        unsigned int n1_out) {
+
+    size_t j0=get_global_id(1); // Slowest dimension
+    size_t j1=get_global_id(0); // Fastest dimension
+    if (j0<n0_out && j1<n1_out) {
+        size_t i0=roi0+j0*stride0;
+        size_t i1=roi1+j1*stride1;
+        snapshot[j0*n1_out+j1]=U[i0*N1+i1];
+    }
+}
+
+// Record a line of receivers along row of U into row level of a seismogram,
+// the seismogram is of size (NT, nrec) and stays on the device
+__kernel void receiver_line (
+        __global float* U,
+        __global float* seismogram,
+        unsigned int N1,
+        unsigned int row,
+        unsigned int stride1,
+        unsigned int nrec,
+        unsigned int level) {
+
+    size_t j=get_global_id(0);
+    if (j<nrec) {
+        seismogram[(size_t)level*nrec+j]=U[(size_t)row*N1+j*stride1];
+    }
+}
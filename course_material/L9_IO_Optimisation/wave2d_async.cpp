@@ -12,6 +12,9 @@ Written by Dr Toby M. Potter
 // Bring in helper header to manage boilerplate code
 #include "cl_helper.hpp"
 
+// Background writer for snapshots
+#include "io_helper.hpp"
+
 typedef cl_float float_type;
 
 int main(int argc, char** argv) {
@@ -19,6 +22,44 @@ int main(int argc, char** argv) {
     // Parse arguments and set the target device
     cl_device_type target_device;
     cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Output controls, by default every timestep of the whole grid is kept.
+    // --snap-every=N keeps every Nth timestep, --roi=i0,i1,n0,n1 keeps a region
+    // of the grid, --stride=s0,s1 keeps every s0th row and s1th column of the region,
+    // and --receivers=row,s1 records every s1th point of a row at every timestep.
+    // --write-slots=N sets how many snapshots can wait in host memory for the writer,
+    // and --direct asks the writer to bypass the page cache with O_DIRECT.
+    // --finish-each-step goes back to waiting on a copy queue and setting 
+    // buffer arguments at every step, for comparison
+    cl_uint snap_every=1;
+    cl_uint roi[4]={0, 0, N0, N1};
+    cl_uint stride[2]={1, 1};
+    cl_uint receiver_row=0, receiver_stride=0;
+    size_t write_slots=10;
+    bool direct=false;
+    bool finish_each_step=false;
+    for (int i=1; i<argc; i++) {
+        if (std::strncmp(argv[i], "--snap-every=", 13)==0) {
+            snap_every=(cl_uint)std::max(1, std::atoi(argv[i]+13));
+        } else if (std::strncmp(argv[i], "--roi=", 6)==0) {
+            int nread=std::sscanf(argv[i]+6, "%u,%u,%u,%u", &roi[0], &roi[1], &roi[2], &roi[3]);
+            assert(nread==4);
+        } else if (std::strncmp(argv[i], "--stride=", 9)==0) {
+            int nread=std::sscanf(argv[i]+9, "%u,%u", &stride[0], &stride[1]);
+            assert(nread==2);
+        } else if (std::strncmp(argv[i], "--receivers=", 12)==0) {
+            int nread=std::sscanf(argv[i]+12, "%u,%u", &receiver_row, &receiver_stride);
+            assert(nread==2);
+        } else if (std::strncmp(argv[i], "--write-slots=", 14)==0) {
+            write_slots=(size_t)std::max(1, std::atoi(argv[i]+14));
+        } else if (std::strcmp(argv[i], "--direct")==0) {
+            direct=true;
+        } else if (std::strcmp(argv[i], "--finish-each-step")==0) {
+            finish_each_step=true;
+        }
+    }
+    assert(roi[0]+roi[2]<=N0 && roi[1]+roi[3]<=N1 && roi[2]>0 && roi[3]>0);
+    assert(stride[0]>0 && stride[1]>0 && receiver_row<N0);
     
     // Useful for checking OpenCL errors
     cl_int errcode;
@@ -86,6 +127,15 @@ int main(int argc, char** argv) {
     // Report on the device in use
     h_report_on_device(device);
     
+    // Built-in profiler to record a timeline of all queues
+    h_profiler_t* profiler = h_create_profiler(device);
+    for (int i=0; i<nscratch; i++) {
+        std::string lane_name = "Copy queue " + std::to_string(i);
+        h_profiler_name_lane(profiler, i, lane_name.c_str());
+    }
+    h_profiler_name_lane(profiler, nscratch, "Compute queue");
+    h_profiler_name_lane(profiler, nscratch+1, "Host thread");
+    
     // We are going to do a simple array multiplication for this example, 
     // using raw binary files for input and output
     size_t nbytes_U=N0*N1*sizeof(float_type);
@@ -104,9 +154,24 @@ int main(int argc, char** argv) {
     // Use a grid crossing time at maximum velocity to get the number of timesteps
     int NT = (int)std::max(D0*N0, D1*N1)/(dt*Vmax);
     
-    // Make up the output array
-    size_t nbytes_out = NT*N0*N1*sizeof(cl_float);
-    cl_float* array_out = (cl_float*)h_alloc(nbytes_out);
+    // Snapshots are copied for timesteps 0 to NT-2, 
+    // the host only stages a few decimated snapshots at a time
+    size_t nsnap = (NT-2)/snap_every+1;
+    cl_uint n0_out = (roi[2]+stride[0]-1)/stride[0];
+    cl_uint n1_out = (roi[3]+stride[1]-1)/stride[1];
+    size_t nbytes_snap = (size_t)n0_out*n1_out*sizeof(cl_float);
+    size_t nbytes_out = nsnap*nbytes_snap;
+    printf("Writing %zu snapshots of (%u, %u) points, %.2f MB on disk, %.2f MB staged on the host\n",
+        nsnap, n0_out, n1_out, nbytes_out/1.0e6, write_slots*nbytes_snap/1.0e6);
+
+    // Strided snapshots are gathered on the device, a region 
+    // without strides is copied straight out of the wavefield
+    bool full_grid = (roi[2]==N0 && roi[3]==N1 && stride[0]==1 && stride[1]==1);
+    bool decimate = (stride[0]>1 || stride[1]>1);
+
+    // Receivers record every timestep on the device
+    cl_uint nrec = (receiver_stride>0) ? (N1+receiver_stride-1)/receiver_stride : 0;
+    size_t nbytes_seis = (size_t)NT*nrec*sizeof(cl_float);
     
     // Make Buffers on the compute device for matrices U0, U1, U2, V
     
@@ -120,8 +185,10 @@ int main(int argc, char** argv) {
     );
     H_ERRCHK(errcode);
     
-    // Make up events
-    cl_event events[nscratch];
+    // Events for the last command that wrote each scratch buffer, 
+    // and the last copy that read from each scratch buffer
+    cl_event wave_events[nscratch];
+    cl_event copy_events[nscratch] = {NULL};
     
     // Create scratch buffers for the computation
     // Use pinned memory to make asynchronous copies possible
@@ -148,11 +215,37 @@ int main(int argc, char** argv) {
                 nbytes_U,
                 0,
                 NULL,
-                &events[n]
+                &wave_events[n]
             )
         );
     }
     
+    // One compact snapshot per copy queue when decimating
+    cl_mem buffers_snap[nscratch] = {NULL};
+    if (decimate) {
+        for (int n=0; n<nscratch; n++) {
+            buffers_snap[n] = clCreateBuffer(
+                context, 
+                CL_MEM_ALLOC_HOST_PTR, 
+                nbytes_snap, 
+                NULL, 
+                &errcode
+            );
+            H_ERRCHK(errcode);
+        }
+    }
+
+    // Seismogram of (NT, nrec) that stays on the device until the end
+    cl_mem buffer_seis = NULL;
+    cl_event seis_fill_event = NULL;
+    if (nrec>0) {
+        buffer_seis = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_seis, NULL, &errcode);
+        H_ERRCHK(errcode);
+        float_type zero=0.0f;
+        H_ERRCHK(clEnqueueFillBuffer(compute_queue, buffer_seis, &zero, sizeof(float_type),
+            0, nbytes_seis, 0, NULL, &seis_fill_event));
+    }
+    
     // Now specify the kernel source and read it in
     size_t nbytes_src = 0;
     const char* kernel_source = (const char*)h_read_binary(
@@ -163,9 +256,19 @@ int main(int argc, char** argv) {
     // Turn this source code into a program
     cl_program program = h_build_program(kernel_source, context, device, NULL);
         
-    // Create a kernel from the built program
-    cl_kernel kernel=clCreateKernel(program, "wave2d_4o", &errcode);
-    H_ERRCHK(errcode);
+    // Create kernels from the built program, one for each rotation of the
+    // scratch buffers so that buffer arguments never change in the main loop
+    cl_kernel kernels[nscratch];
+    cl_kernel kernels_decimate[nscratch];
+    cl_kernel kernels_receivers[nscratch];
+    for (int r=0; r<nscratch; r++) {
+        kernels[r]=clCreateKernel(program, "wave2d_4o_table", &errcode);
+        H_ERRCHK(errcode);
+        kernels_decimate[r]=clCreateKernel(program, "snapshot_decimate", &errcode);
+        H_ERRCHK(errcode);
+        kernels_receivers[r]=clCreateKernel(program, "receiver_line", &errcode);
+        H_ERRCHK(errcode);
+    }
 
     // Set up arguments for the kernel
     cl_uint N0_k=N0, N1_k=N1;
@@ -179,7 +282,6 @@ int main(int argc, char** argv) {
     // Frequency of the Ricker Wavelet
     float_type fm=Vmax/(ppw*std::max(D0,D1));
     float_type pi=3.141592f;
-    float_type t=0.0f, pi2fm2t2=0.0f;
     // Min-to-min time of the wavelet
     float_type td=std::sqrt(6.0f)/(pi*fm);
     
@@ -188,16 +290,59 @@ int main(int argc, char** argv) {
     // Coordinates of the Ricker wavelet
     cl_uint P0=N0/2;
     cl_uint P1=N1/2;
-    
-    // Set arguments to the kernel (not thread safe)
-    H_ERRCHK(clSetKernelArg(kernel, 3, sizeof(cl_mem), &buffer_V ));
-    H_ERRCHK(clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_k ));
-    H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_k ));
-    H_ERRCHK(clSetKernelArg(kernel, 6, sizeof(cl_float), &dt2 ));
-    H_ERRCHK(clSetKernelArg(kernel, 7, sizeof(cl_float), &inv_dx02 ));
-    H_ERRCHK(clSetKernelArg(kernel, 8, sizeof(cl_float), &inv_dx12 ));
-    H_ERRCHK(clSetKernelArg(kernel, 9, sizeof(cl_uint), &P0 ));
-    H_ERRCHK(clSetKernelArg(kernel, 10, sizeof(cl_uint), &P1 ));
+
+    // pi^2 fm^2 t^2 for every timestep and a step counter on the device,
+    // so the main loop sets no kernel arguments
+    cl_float* array_pi2fm2t2 = (cl_float*)h_alloc(NT*sizeof(cl_float));
+    for (int n=0; n<NT; n++) {
+        float_type t = n*dt-2.0*td;
+        array_pi2fm2t2[n] = pi*pi*fm*fm*t*t;
+    }
+    cl_mem buffer_pi2fm2t2 = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        NT*sizeof(cl_float), array_pi2fm2t2, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem buffer_step = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &errcode);
+    H_ERRCHK(errcode);
+    cl_uint step0 = 0;
+    H_ERRCHK(clEnqueueFillBuffer(compute_queue, buffer_step, &step0, sizeof(cl_uint),
+        0, sizeof(cl_uint), 0, NULL, NULL));
+    
+    // Set arguments to the kernels (not thread safe), kernels[r] 
+    // computes into buffers_U[(r+2)%nscratch] from the two buffers before it
+    for (int r=0; r<nscratch; r++) {
+        H_ERRCHK(clSetKernelArg(kernels[r], 0, sizeof(cl_mem), &buffers_U[r] ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 1, sizeof(cl_mem), &buffers_U[(r+1)%nscratch] ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 2, sizeof(cl_mem), &buffers_U[(r+2)%nscratch] ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 3, sizeof(cl_mem), &buffer_V ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 4, sizeof(cl_uint), &N0_k ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 5, sizeof(cl_uint), &N1_k ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 6, sizeof(cl_float), &dt2 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 7, sizeof(cl_float), &inv_dx02 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 8, sizeof(cl_float), &inv_dx12 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 9, sizeof(cl_uint), &P0 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 10, sizeof(cl_uint), &P1 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 11, sizeof(cl_mem), &buffer_pi2fm2t2 ));
+        H_ERRCHK(clSetKernelArg(kernels[r], 12, sizeof(cl_mem), &buffer_step ));
+
+        // kernels_decimate[r] gathers buffers_U[r] into buffers_snap[r]
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 0, sizeof(cl_mem), &buffers_U[r] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 1, sizeof(cl_mem), &buffers_snap[r] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 2, sizeof(cl_uint), &N1_k ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 3, sizeof(cl_uint), &roi[0] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 4, sizeof(cl_uint), &roi[1] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 5, sizeof(cl_uint), &stride[0] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 6, sizeof(cl_uint), &stride[1] ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 7, sizeof(cl_uint), &n0_out ));
+        H_ERRCHK(clSetKernelArg(kernels_decimate[r], 8, sizeof(cl_uint), &n1_out ));
+
+        // kernels_receivers[r] records from buffers_U[r]
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 0, sizeof(cl_mem), &buffers_U[r] ));
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 1, sizeof(cl_mem), &buffer_seis ));
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 2, sizeof(cl_uint), &N1_k ));
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 3, sizeof(cl_uint), &receiver_row ));
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 4, sizeof(cl_uint), &receiver_stride ));
+        H_ERRCHK(clSetKernelArg(kernels_receivers[r], 5, sizeof(cl_uint), &nrec ));
+    }
     
     // Number of dimensions in the kernel
     size_t work_dim=2;
@@ -208,32 +353,59 @@ int main(int argc, char** argv) {
     // Desired global_size
     const size_t global_size[]={ N1, N0 };
     h_fit_global_size(global_size, local_size, work_dim);
+
+    // Sizes for decimation and receivers. Local sizes are clamped to small 
+    // outputs, the kernels guard against the work-items that pad the rest
+    const size_t local_snap[]={ std::min((size_t)64, (size_t)n1_out), std::min((size_t)4, (size_t)n0_out) };
+    const size_t global_snap[]={ n1_out, n0_out };
+    const size_t local_rec[]={ std::min((size_t)64, (size_t)std::max(nrec, (cl_uint)1)) };
+    const size_t global_rec[]={ nrec };
+    
+    // Snapshots stream to disk on a background thread as their copies complete
+    h_snap_header_t header = h_make_snap_header(nsnap, n0_out, n1_out, dt*snap_every,
+        roi[0], roi[1], stride[0], stride[1]);
+    h_snap_writer_t* writer = h_create_snap_writer(
+        "array_out.dat", &header, nbytes_snap, write_slots, direct, profiler);
+    h_profiler_name_lane(profiler, nscratch+2, "Writer thread");
     
     // Main loop
     cl_mem U0, U1, U2;
+
+    // Host time spent enqueueing each step, and blocked on staging slots
+    cl_ulong enqueue_ns=0, max_enqueue_ns=0, slot_ns=0;
     
     // Start the clock
     auto t1 = std::chrono::high_resolution_clock::now();
+    cl_ulong t1_ns = h_profiler_host_ns(profiler);
     
     for (int n=0; n<NT; n++) {
+
+        cl_ulong step_start_ns = h_profiler_host_ns(profiler);
+        cl_ulong step_slot_ns = 0, step_tag_ns = 0, tag_start_ns;
+
+        // Scratch buffers for this step, step n computes
+        // timestep n+2 from timesteps n and n+1
+        int b0 = n%nscratch, b2 = (n+2)%nscratch;
+        cl_kernel kernel = kernels[b0];
         
-        // Wait for the previous copy command to finish
-        H_ERRCHK(clFinish(command_queues[(n+2)%nscratch]));
-        
-        // Get the wavefields
-        U0 = buffers_U[n%nscratch];
-        U1 = buffers_U[(n+1)%nscratch];
-        U2 = buffers_U[(n+2)%nscratch];
-        
-        // Shifted time
-        t = n*dt-2.0*td;
-        pi2fm2t2 = pi*pi*fm*fm*t*t;
+        if (finish_each_step) {
+            // Wait for the previous copy command to finish
+            H_ERRCHK(clFinish(command_queues[b2]));
+            
+            // Get the wavefields and set them as kernel arguments
+            kernel = kernels[0];
+            U0 = buffers_U[b0];
+            U1 = buffers_U[(n+1)%nscratch];
+            U2 = buffers_U[b2];
+            H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &U0 ));
+            H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &U1 ));
+            H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &U2 ));
+        }
         
-        // Set kernel arguments
-        H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &U0 ));
-        H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &U1 ));
-        H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &U2 ));
-        H_ERRCHK(clSetKernelArg(kernel, 11, sizeof(cl_float), &pi2fm2t2 ));
+        // The output buffer must not be overwritten while it is still being copied,
+        // everything else is ordered by the in-order compute queue
+        cl_uint nwait = (copy_events[b2]!=NULL) ? 1 : 0;
+        cl_event wave_event;
         
         // Enqueue the wave solver    
         H_ERRCHK(
@@ -244,53 +416,192 @@ int main(int argc, char** argv) {
                 NULL,
                 global_size,
                 local_size,
-                0,
-                NULL,
-                &events[n%nscratch]
+                nwait,
+                (nwait>0) ? &copy_events[b2] : NULL,
+                &wave_event
             ) 
         );
+        tag_start_ns = h_profiler_host_ns(profiler);
+        h_profiler_tag(profiler, wave_event, "wave2d_4o_table", nscratch);
+        step_tag_ns += h_profiler_host_ns(profiler)-tag_start_ns;
+        
+        // The copy and the old wavefield are no longer needed
+        if (copy_events[b2]!=NULL) {
+            H_ERRCHK(clReleaseEvent(copy_events[b2]));
+            copy_events[b2]=NULL;
+        }
+        H_ERRCHK(clReleaseEvent(wave_events[b2]));
+        wave_events[b2]=wave_event;
+          
+        // Record the receivers for the new timestep on the device
+        if ((nrec>0) && (n+2<NT)) {
+            cl_uint level=n+2;
+            H_ERRCHK(clSetKernelArg(kernels_receivers[b2], 6, sizeof(cl_uint), &level ));
+            H_ERRCHK(h_enqueue_kernel(compute_queue, kernels_receivers[b2], local_rec, global_rec,
+                1, 0, NULL, NULL));
+        }
+        H_ERRCHK(clFlush(compute_queue));
           
-        // Read memory from the buffer to the host in an asynchronous manner
-        if (n>0) {
+        // Read memory from the buffer to the host in an asynchronous manner,
+        // only for the timesteps and points that were asked for
+        if ((n>0) && ((n-1)%snap_every==0)) {
             cl_int copy_index=n-1;
-            H_ERRCHK(
-                clEnqueueReadBuffer(
-                    command_queues[copy_index%nscratch],
-                    buffers_U[copy_index%nscratch],
-                    blocking,
-                    0,
-                    nbytes_U,
-                    &array_out[copy_index*N0*N1],
-                    1,
-                    &events[copy_index%nscratch],
-                    NULL
-                ) 
-            );
+            int bc=copy_index%nscratch;
+
+            // Blocks only when every staging slot is waiting on the writer
+            cl_ulong slot_start_ns = h_profiler_host_ns(profiler);
+            int slot=h_snap_writer_acquire(writer);
+            cl_float* dest=(cl_float*)h_snap_writer_data(writer, slot);
+            step_slot_ns = h_profiler_host_ns(profiler)-slot_start_ns;
+
+            cl_event copy_event;
+            if (full_grid) {
+                H_ERRCHK(
+                    clEnqueueReadBuffer(
+                        command_queues[bc],
+                        buffers_U[bc],
+                        blocking,
+                        0,
+                        nbytes_U,
+                        dest,
+                        1,
+                        &wave_events[bc],
+                        &copy_event
+                    ) 
+                );
+            } else if (!decimate) {
+                // Copy the rows of the region straight into place
+                size_t buffer_origin[]={ roi[1]*sizeof(cl_float), roi[0], 0 };
+                size_t host_origin[]={ 0, 0, 0 };
+                size_t region[]={ roi[3]*sizeof(cl_float), roi[2], 1 };
+                H_ERRCHK(
+                    clEnqueueReadBufferRect(
+                        command_queues[bc],
+                        buffers_U[bc],
+                        blocking,
+                        buffer_origin,
+                        host_origin,
+                        region,
+                        N1*sizeof(cl_float),
+                        0,
+                        n1_out*sizeof(cl_float),
+                        0,
+                        dest,
+                        1,
+                        &wave_events[bc],
+                        &copy_event
+                    )
+                );
+            } else {
+                // Gather the strided points on the device, then copy the compact snapshot.
+                // The last copy out of buffers_snap[bc] was waited on by an earlier
+                // wave step on the compute queue, so the gather can not overtake it
+                cl_event decimate_event;
+                H_ERRCHK(h_enqueue_kernel(compute_queue, kernels_decimate[bc], local_snap, global_snap,
+                    2, 0, NULL, &decimate_event));
+                tag_start_ns = h_profiler_host_ns(profiler);
+                h_profiler_tag(profiler, decimate_event, "Decimate U", nscratch);
+                step_tag_ns += h_profiler_host_ns(profiler)-tag_start_ns;
+                H_ERRCHK(clFlush(compute_queue));
+                H_ERRCHK(
+                    clEnqueueReadBuffer(
+                        command_queues[bc],
+                        buffers_snap[bc],
+                        blocking,
+                        0,
+                        nbytes_snap,
+                        dest,
+                        1,
+                        &decimate_event,
+                        &copy_event
+                    ) 
+                );
+                H_ERRCHK(clReleaseEvent(decimate_event));
+            }
+            tag_start_ns = h_profiler_host_ns(profiler);
+            h_profiler_tag(profiler, copy_event, "Read U", bc);
+            step_tag_ns += h_profiler_host_ns(profiler)-tag_start_ns;
+            H_ERRCHK(clFlush(command_queues[bc]));
+            h_snap_writer_submit(writer, slot, copy_index/snap_every, copy_event);
+            
+            // Keep the copy so the step that next overwrites buffers_U[bc] can wait on it
+            copy_events[bc]=copy_event;
         }
+
+        // Time spent enqueueing, not counting time blocked on the writer or tagging events
+        cl_ulong step_ns = h_profiler_host_ns(profiler)-step_start_ns-step_slot_ns-step_tag_ns;
+        enqueue_ns += step_ns;
+        max_enqueue_ns = std::max(max_enqueue_ns, step_ns);
+        slot_ns += step_slot_ns;
     }
 
     // Make sure all work is done on all queues
-    for (int i=0; i<nscratch; i++) {
+    for (int i=0; i<=nscratch; i++) {
         H_ERRCHK(clFinish(command_queues[i]));
     }
 
     // Stop the clock
     auto t2 = std::chrono::high_resolution_clock::now();    
     cl_double time_ms = (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
-    printf("The asynchronous calculation took %.0f milliseconds.", time_ms);
-    
-    // Write out the result to file
-    h_write_binary(array_out, "array_out.dat", nbytes_out);
+    printf("The asynchronous calculation took %.0f milliseconds.\n", time_ms);
+    printf("Host enqueue time per step (%s): mean %.2f us, max %.2f us, blocked on staging slots %.2f ms in total\n",
+        finish_each_step ? "clFinish each step" : "event pipeline",
+        enqueue_ns*1.0e-3/NT, max_enqueue_ns*1.0e-3, slot_ns*1.0e-6);
+    cl_ulong t2_ns = h_profiler_host_ns(profiler);
+    
+    // Wait for the last snapshots to reach the file, 
+    // errors in the writer thread surface here
+    int write_status = h_close_snap_writer(writer);
+    h_report_snap_writer(writer);
+    
+    // Write out a timeline that chrome://tracing or Perfetto can show
+    h_profiler_host_span(profiler, "Solver loop", nscratch+1, t1_ns, t2_ns);
+    h_profiler_host_span(profiler, "Drain writer", nscratch+1, t2_ns, h_profiler_host_ns(profiler));
+    h_snap_writer_trace(writer, profiler, nscratch+2);
+    h_profiler_write_chrome_trace(profiler, "trace_async_builtin.json");
+    h_release_profiler(profiler);
+    h_release_snap_writer(writer);
+
+    // The seismogram crosses the bus once, at the end
+    if (nrec>0) {
+        cl_float* array_seis = (cl_float*)h_alloc(nbytes_seis);
+        H_ERRCHK(clEnqueueReadBuffer(compute_queue, buffer_seis, CL_TRUE, 0, nbytes_seis,
+            array_seis, 0, NULL, NULL));
+        h_write_binary(array_seis, "seismogram.dat", nbytes_seis);
+        printf("Wrote a seismogram of (%d, %u) points\n", NT, nrec);
+        free(array_seis);
+    }
 
     // Free the OpenCL buffers
     H_ERRCHK(clReleaseMemObject(buffer_V));
+    H_ERRCHK(clReleaseMemObject(buffer_pi2fm2t2));
+    H_ERRCHK(clReleaseMemObject(buffer_step));
+    if (decimate) {
+        for (int n=0; n<nscratch; n++) {
+            H_ERRCHK(clReleaseMemObject(buffers_snap[n]));
+        }
+    }
+    if (nrec>0) {
+        H_ERRCHK(clReleaseEvent(seis_fill_event));
+        H_ERRCHK(clReleaseMemObject(buffer_seis));
+    }
+    for (int r=0; r<nscratch; r++) {
+        H_ERRCHK(clReleaseEvent(wave_events[r]));
+        if (copy_events[r]!=NULL) {
+            H_ERRCHK(clReleaseEvent(copy_events[r]));
+        }
+        H_ERRCHK(clReleaseKernel(kernels[r]));
+        H_ERRCHK(clReleaseKernel(kernels_decimate[r]));
+        H_ERRCHK(clReleaseKernel(kernels_receivers[r]));
+    }
+    H_ERRCHK(clReleaseProgram(program));
     for (int n=0; n<nscratch; n++) {
         H_ERRCHK(clReleaseMemObject(buffers_U[n]));
     }
     
     // Clean up memory that was allocated on the read   
     free(array_V);
-    free(array_out);
+    free(array_pi2fm2t2);
     
     // Clean up command queues
     h_release_command_queues(
@@ -306,6 +617,6 @@ int main(int argc, char** argv) {
         platforms
     );
 
-    return 0;
+    return (write_status == 0) ? 0 : 1;
 }
 
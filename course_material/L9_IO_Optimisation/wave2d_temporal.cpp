@@ -0,0 +1,321 @@
+/* Code to compare one timestep per launch of the wave solver against 
+temporal blocking, where each launch advances k timesteps in local memory.
+Use --k=N to try a single value of k instead of the sweep, 
+and --n0=X, --n1=Y, --steps=N to change the problem
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Include the size of arrays to be computed
+#include "mat_size.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Tile of points written per work-group by the temporally blocked kernel
+#define TB_T0 16
+#define TB_T1 32
+
+// Total time of a batch of profiled events in milliseconds
+cl_double batch_ms(h_event_batch_t* batch) {
+    size_t count = batch->count;
+    cl_double* times_ms = new cl_double[std::max(count, (size_t)1)];
+    h_event_batch_drain(batch, times_ms);
+    cl_double total_ms = 0.0;
+    for (size_t n=0; n<count; n++) {
+        total_ms += times_ms[n];
+    }
+    delete[] times_ms;
+    return total_ms;
+}
+
+int main(int argc, char** argv) {
+   
+    // Parse arguments and set the target device
+    cl_device_type target_device;
+    cl_uint dev_index = h_parse_args(argc, argv, &target_device);
+
+    // Grid size, number of steps, and steps per launch
+    cl_uint N0_k=N0, N1_k=N1;
+    int nsteps = 0;
+    std::vector<cl_uint> ks = {1, 2, 3, 4};
+    for (int n=1; n<argc; n++) {
+        if (std::strncmp(argv[n], "--n0=", 5)==0) N0_k = (cl_uint)std::atol(argv[n]+5);
+        if (std::strncmp(argv[n], "--n1=", 5)==0) N1_k = (cl_uint)std::atol(argv[n]+5);
+        if (std::strncmp(argv[n], "--steps=", 8)==0) nsteps = std::atoi(argv[n]+8);
+        if (std::strncmp(argv[n], "--k=", 4)==0) ks = {(cl_uint)std::atol(argv[n]+4)};
+    }
+    
+    // Useful for checking OpenCL errors
+    cl_int errcode;
+
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // Number of command queues to generate
+    cl_uint num_command_queues = num_devices;
+
+    // Create the command queues
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_command_queues,
+        CL_FALSE,
+        CL_TRUE
+    );
+
+    // Choose the context, device, and command queue to use
+    assert(dev_index < num_devices);
+    cl_context context = contexts[dev_index];
+    cl_command_queue command_queue = command_queues[dev_index];
+    cl_device_id device = devices[dev_index];
+    
+    // Report on the device in use
+    h_report_on_device(device);
+
+    // Velocity, timestep, and wavelet as in wave2d_async
+    size_t npoints = (size_t)N0_k*N1_k;
+    size_t nbytes_U = npoints*sizeof(float_type);
+    float_type* array_V = (float_type*)h_alloc(nbytes_U);
+    float_type Vmax = VEL;
+    for (size_t i=0; i<npoints; i++) {
+        array_V[i] = Vmax;
+    }
+    float_type dt = CFL*std::min(D0, D1)/Vmax;
+    if (nsteps == 0) {
+        nsteps = (int)(std::max(D0*N0_k, D1*N1_k)/(dt*Vmax));
+    }
+    float_type ppw=10;
+    float_type fm=Vmax/(ppw*std::max(D0,D1));
+    float_type pi=3.141592f;
+    float_type td=std::sqrt(6.0f)/(pi*fm);
+    cl_float dt2=dt*dt, inv_dx02=1.0/(D0*D0), inv_dx12=1.0/(D1*D1);
+    cl_uint P0=N0_k/2, P1=N1_k/2;
+
+    // The wavelet term for every step, so both solvers inject the same values
+    float_type* array_wavelet = (float_type*)h_alloc(nsteps*sizeof(float_type));
+    for (int n=0; n<nsteps; n++) {
+        float_type t = n*dt-2.0*td;
+        array_wavelet[n] = pi*pi*fm*fm*t*t;
+    }
+
+    //// Make buffers and kernels ////
+
+    cl_mem buffer_V = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+        nbytes_U, (void*)array_V, &errcode);
+    H_ERRCHK(errcode);
+    cl_mem buffer_wavelet = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+        nsteps*sizeof(float_type), (void*)array_wavelet, &errcode);
+    H_ERRCHK(errcode);
+
+    // Four buffers, the blocked solver reads one pair and writes the other
+    cl_mem buffers_U[4];
+    for (int n=0; n<4; n++) {
+        buffers_U[n] = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_U, NULL, &errcode);
+        H_ERRCHK(errcode);
+    }
+
+    // Each k is a separate build, the cache keeps them
+    size_t nbytes_src = 0;
+    char* kernel_source = (char*)h_read_binary("kernels.c", &nbytes_src);
+    std::string base_options = "-D TB_T0=" + std::to_string(TB_T0) 
+        + " -D TB_T1=" + std::to_string(TB_T1);
+    h_variant_cache_t* variants = h_create_variant_cache(context, device, 
+        kernel_source, base_options.c_str());
+
+    cl_ulong local_mem_bytes;
+    H_ERRCHK(
+        clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, 
+            sizeof(cl_ulong), &local_mem_bytes, NULL)
+    );
+
+    float_type* U_ref = (float_type*)h_alloc(nbytes_U);
+    float_type* U_blocked = (float_type*)h_alloc(nbytes_U);
+    float_type zero = 0.0f;
+
+    //// Reference, one step per launch ////
+
+    cl_kernel kernel = h_get_variant(variants, "wave2d_4o", h_defines_t());
+    H_ERRCHK(clSetKernelArg(kernel, 3, sizeof(cl_mem), &buffer_V ));
+    H_ERRCHK(clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_k ));
+    H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_k ));
+    H_ERRCHK(clSetKernelArg(kernel, 6, sizeof(cl_float), &dt2 ));
+    H_ERRCHK(clSetKernelArg(kernel, 7, sizeof(cl_float), &inv_dx02 ));
+    H_ERRCHK(clSetKernelArg(kernel, 8, sizeof(cl_float), &inv_dx12 ));
+    H_ERRCHK(clSetKernelArg(kernel, 9, sizeof(cl_uint), &P0 ));
+    H_ERRCHK(clSetKernelArg(kernel, 10, sizeof(cl_uint), &P1 ));
+
+    for (int n=0; n<3; n++) {
+        H_ERRCHK(clEnqueueFillBuffer(command_queue, buffers_U[n], &zero, 
+            sizeof(float_type), 0, nbytes_U, 0, NULL, NULL));
+    }
+
+    size_t local_ref[] = {64, 4};
+    size_t global_ref[] = {N1_k, N0_k};
+    h_event_batch_t* batch = h_create_event_batch(nsteps);
+    for (int n=0; n<nsteps; n++) {
+        H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffers_U[n%3] ));
+        H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &buffers_U[(n+1)%3] ));
+        H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &buffers_U[(n+2)%3] ));
+        H_ERRCHK(clSetKernelArg(kernel, 11, sizeof(cl_float), &array_wavelet[n] ));
+        cl_event event;
+        H_ERRCHK(h_enqueue_kernel(command_queue, kernel, local_ref, global_ref,
+            2, 0, NULL, &event));
+        h_event_batch_add(batch, event);
+    }
+    cl_double ref_ms = batch_ms(batch);
+    H_ERRCHK(clEnqueueReadBuffer(command_queue, buffers_U[(nsteps+1)%3], CL_TRUE,
+        0, nbytes_U, U_ref, 0, NULL, NULL));
+
+    // Points updated over the run, the boundary of 2 is fixed
+    cl_double nupdates = (cl_double)(N0_k-4)*(cl_double)(N1_k-4)*(cl_double)nsteps;
+
+    // Compulsory traffic of one step per launch: read U0, U1, and V, write U2
+    cl_double ref_bytes = 4.0*sizeof(float_type);
+
+    printf("Grid of (%u, %u) points for %d steps, tiles of (%d, %d)\n", 
+        N0_k, N1_k, nsteps, TB_T0, TB_T1);
+    printf("%4s %12s %12s %9s %14s %12s %10s %12s\n", "k", "time (ms)", "Mpoints/s", 
+        "speedup", "bytes/update", "traffic", "recompute", "max diff");
+    printf("%4s %12.3f %12.1f %9.2f %14.2f %12s %10s %12s\n", "ref", ref_ms, 
+        nupdates/(ref_ms*1.0e3), 1.0, ref_bytes, "1.00x", "1.00x", "-");
+
+    //// Temporal blocking, k steps per launch ////
+
+    for (cl_uint k : ks) {
+        
+        // Local memory holds three time levels and dt2*V^2
+        size_t R0 = TB_T0+4*k, R1 = TB_T1+4*k;
+        size_t nbytes_local = 4*R0*R1*sizeof(float_type);
+        if (nbytes_local > local_mem_bytes) {
+            printf("%4u needs %zu bytes of local memory, skipped\n", k, nbytes_local);
+            continue;
+        }
+
+        h_defines_t defines;
+        defines["TB_STEPS"] = k;
+        cl_kernel kernel_tb = h_get_variant(variants, "wave2d_4o_temporal", defines);
+        H_ERRCHK(clSetKernelArg(kernel_tb, 4, sizeof(cl_mem), &buffer_V ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 5, sizeof(cl_uint), &N0_k ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 6, sizeof(cl_uint), &N1_k ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 7, sizeof(cl_float), &dt2 ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 8, sizeof(cl_float), &inv_dx02 ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 9, sizeof(cl_float), &inv_dx12 ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 10, sizeof(cl_uint), &P0 ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 11, sizeof(cl_uint), &P1 ));
+        H_ERRCHK(clSetKernelArg(kernel_tb, 12, sizeof(cl_mem), &buffer_wavelet ));
+
+        for (int n=0; n<4; n++) {
+            H_ERRCHK(clEnqueueFillBuffer(command_queue, buffers_U[n], &zero, 
+                sizeof(float_type), 0, nbytes_U, 0, NULL, NULL));
+        }
+
+        // One work-group per tile
+        size_t local_tb[] = {32, 8};
+        size_t global_tb[] = {
+            ((N1_k+TB_T1-1)/TB_T1)*local_tb[0],
+            ((N0_k+TB_T0-1)/TB_T0)*local_tb[1]
+        };
+
+        h_event_batch_t* batch_tb = h_create_event_batch(nsteps/k+1);
+        int pair = 0;
+        for (cl_uint step0=0; step0<(cl_uint)nsteps; step0+=k) {
+            cl_uint nsteps_launch = std::min(k, (cl_uint)nsteps-step0);
+            H_ERRCHK(clSetKernelArg(kernel_tb, 0, sizeof(cl_mem), &buffers_U[2*pair] ));
+            H_ERRCHK(clSetKernelArg(kernel_tb, 1, sizeof(cl_mem), &buffers_U[2*pair+1] ));
+            H_ERRCHK(clSetKernelArg(kernel_tb, 2, sizeof(cl_mem), &buffers_U[2*(1-pair)] ));
+            H_ERRCHK(clSetKernelArg(kernel_tb, 3, sizeof(cl_mem), &buffers_U[2*(1-pair)+1] ));
+            H_ERRCHK(clSetKernelArg(kernel_tb, 13, sizeof(cl_uint), &step0 ));
+            H_ERRCHK(clSetKernelArg(kernel_tb, 14, sizeof(cl_uint), &nsteps_launch ));
+            cl_event event;
+            H_ERRCHK(h_enqueue_kernel(command_queue, kernel_tb, local_tb, global_tb,
+                2, 0, NULL, &event));
+            h_event_batch_add(batch_tb, event);
+            pair = 1-pair;
+        }
+        cl_double tb_ms = batch_ms(batch_tb);
+        h_release_event_batch(batch_tb);
+
+        // The newest time level is the second buffer of the last pair written
+        H_ERRCHK(clEnqueueReadBuffer(command_queue, buffers_U[2*pair+1], CL_TRUE,
+            0, nbytes_U, U_blocked, 0, NULL, NULL));
+        float_type max_diff = 0.0f;
+        for (size_t i=0; i<npoints; i++) {
+            max_diff = std::fmax(max_diff, std::fabs(U_ref[i]-U_blocked[i]));
+        }
+
+        // Compulsory traffic per launch and tile: read U0, U1, and V 
+        // over the tile and its halo, then write two time levels for the tile
+        cl_double tile_points = (cl_double)TB_T0*TB_T1;
+        cl_double tb_bytes = (3.0*R0*R1+2.0*tile_points)*sizeof(float_type)/(k*tile_points);
+
+        // Points computed per launch, the halo is computed more than once
+        cl_double computed = 0.0;
+        for (size_t s=1; s<=k; s++) {
+            computed += (cl_double)(R0-4*s)*(cl_double)(R1-4*s);
+        }
+
+        printf("%4u %12.3f %12.1f %9.2f %14.2f %11.2fx %9.2fx %12.3e\n", k, tb_ms, 
+            nupdates/(tb_ms*1.0e3), ref_ms/tb_ms, tb_bytes, ref_bytes/tb_bytes, 
+            computed/(k*tile_points), max_diff);
+    }
+
+    h_report_variant_cache(variants);
+
+    //// Clean up ////
+
+    h_release_event_batch(batch);
+    h_release_variant_cache(variants);
+    H_ERRCHK(clReleaseMemObject(buffer_V));
+    H_ERRCHK(clReleaseMemObject(buffer_wavelet));
+    for (int n=0; n<4; n++) {
+        H_ERRCHK(clReleaseMemObject(buffers_U[n]));
+    }
+    free(kernel_source);
+    free(array_V);
+    free(array_wavelet);
+    free(U_ref);
+    free(U_blocked);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_command_queues
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
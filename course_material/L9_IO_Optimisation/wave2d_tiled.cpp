@@ -0,0 +1,257 @@
+/* Code to compare the throughput of the wave2d_4o stencil kernel against
+a version that stages U1 in local memory and streams rows through registers.
+Every device of the chosen type is benchmarked, use --n0=X and --n1=Y 
+to change the grid size and --steps=N to change the number of timesteps
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+// Include the size of arrays to be computed
+#include "mat_size.hpp"
+
+// Bring in helper header to manage boilerplate code
+#include "cl_helper.hpp"
+
+typedef cl_float float_type;
+
+// Work-group shape and rows per work-item for the tiled kernel
+#define STENCIL_L0 4
+#define STENCIL_L1 64
+#define STENCIL_ROWS 4
+
+// Run nsteps timesteps of a wave kernel from a zero wavefield.
+// Returns the time spent in kernels and leaves the last wavefield in U_out
+cl_double run_wave(
+        cl_command_queue command_queue,
+        cl_kernel kernel,
+        cl_mem* buffers_U,
+        size_t* local_size,
+        size_t* global_size,
+        int nsteps,
+        float_type dt,
+        float_type fm,
+        float_type* U_out,
+        size_t nbytes_U) {
+
+    // Start from rest
+    float_type zero=0.0f;
+    for (int n=0; n<3; n++) {
+        H_ERRCHK(clEnqueueFillBuffer(command_queue, buffers_U[n], &zero, 
+            sizeof(float_type), 0, nbytes_U, 0, NULL, NULL));
+    }
+
+    float_type pi=3.141592f;
+    float_type td=std::sqrt(6.0f)/(pi*fm);
+
+    // Kernel events are collected and timed once at the end
+    h_event_batch_t* batch = h_create_event_batch(nsteps);
+    for (int n=0; n<nsteps; n++) {
+        cl_mem U0 = buffers_U[n%3];
+        cl_mem U1 = buffers_U[(n+1)%3];
+        cl_mem U2 = buffers_U[(n+2)%3];
+        float_type t = n*dt-2.0*td;
+        float_type pi2fm2t2 = pi*pi*fm*fm*t*t;
+        H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &U0 ));
+        H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &U1 ));
+        H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_mem), &U2 ));
+        H_ERRCHK(clSetKernelArg(kernel, 11, sizeof(cl_float), &pi2fm2t2 ));
+
+        cl_event event;
+        H_ERRCHK(h_enqueue_kernel(command_queue, kernel, local_size, global_size,
+            2, 0, NULL, &event));
+        h_event_batch_add(batch, event);
+    }
+
+    cl_double* times_ms = new cl_double[nsteps];
+    h_event_batch_drain(batch, times_ms);
+    h_release_event_batch(batch);
+    cl_double time_ms = 0.0;
+    for (int n=0; n<nsteps; n++) {
+        time_ms += times_ms[n];
+    }
+    delete[] times_ms;
+
+    // The last wavefield written
+    H_ERRCHK(clEnqueueReadBuffer(command_queue, buffers_U[(nsteps+1)%3], CL_TRUE,
+        0, nbytes_U, U_out, 0, NULL, NULL));
+    return time_ms;
+}
+
+int main(int argc, char** argv) {
+   
+    // Parse arguments and set the target device type
+    cl_device_type target_device;
+    h_parse_args(argc, argv, &target_device);
+
+    // Grid size and number of steps
+    cl_uint N0_k=N0, N1_k=N1;
+    int nsteps = 0;
+    for (int n=1; n<argc; n++) {
+        if (std::strncmp(argv[n], "--n0=", 5)==0) N0_k = (cl_uint)std::atol(argv[n]+5);
+        if (std::strncmp(argv[n], "--n1=", 5)==0) N1_k = (cl_uint)std::atol(argv[n]+5);
+        if (std::strncmp(argv[n], "--steps=", 8)==0) nsteps = std::atoi(argv[n]+8);
+    }
+    
+    // Number of platforms discovered
+    cl_uint num_platforms;
+
+    // Number of devices discovered
+    cl_uint num_devices;
+
+    // Pointer to an array of platforms
+    cl_platform_id *platforms = NULL;
+
+    // Pointer to an array of devices
+    cl_device_id *devices = NULL;
+
+    // Pointer to an array of contexts
+    cl_context *contexts = NULL;
+    
+    // Helper function to acquire devices
+    h_acquire_devices(target_device,
+                     &platforms,
+                     &num_platforms,
+                     &devices,
+                     &num_devices,
+                     &contexts);
+
+    // One profiling queue per device
+    cl_command_queue* command_queues = h_create_command_queues(
+        devices,
+        contexts,
+        num_devices,
+        num_devices,
+        CL_FALSE,
+        CL_TRUE
+    );
+
+    // Velocity, timestep, and wavelet as in wave2d_async
+    size_t npoints = (size_t)N0_k*N1_k;
+    size_t nbytes_U = npoints*sizeof(float_type);
+    float_type* array_V = (float_type*)h_alloc(nbytes_U);
+    float_type Vmax = VEL;
+    for (size_t i=0; i<npoints; i++) {
+        array_V[i] = Vmax;
+    }
+    float_type dt = CFL*std::min(D0, D1)/Vmax;
+    if (nsteps == 0) {
+        nsteps = (int)(std::max(D0*N0_k, D1*N1_k)/(dt*Vmax));
+    }
+    float_type ppw=10;
+    float_type fm=Vmax/(ppw*std::max(D0,D1));
+    cl_float dt2=dt*dt, inv_dx02=1.0/(D0*D0), inv_dx12=1.0/(D1*D1);
+    cl_uint P0=N0_k/2, P1=N1_k/2;
+
+    float_type* U_ref = (float_type*)h_alloc(nbytes_U);
+    float_type* U_tiled = (float_type*)h_alloc(nbytes_U);
+
+    // Points updated per step, the boundary of 2 is fixed
+    cl_double nupdates = (cl_double)(N0_k-4)*(cl_double)(N1_k-4)*(cl_double)nsteps;
+
+    // Compile-time shape of the tiled kernel
+    std::string options = "-D STENCIL_L0=" + std::to_string(STENCIL_L0)
+        + " -D STENCIL_L1=" + std::to_string(STENCIL_L1)
+        + " -D STENCIL_ROWS=" + std::to_string(STENCIL_ROWS);
+
+    size_t nbytes_src = 0;
+    char* kernel_source = (char*)h_read_binary("kernels.c", &nbytes_src);
+
+    printf("Grid of (%u, %u) points for %d steps\n", N0_k, N1_k, nsteps);
+    printf("%-48s %16s %16s %10s %12s\n", "device", "wave2d_4o", "wave2d_4o_tiled", 
+        "speedup", "max diff");
+
+    for (cl_uint d=0; d<num_devices; d++) {
+        cl_int errcode;
+        cl_context context = contexts[d];
+        cl_device_id device = devices[d];
+        cl_command_queue command_queue = command_queues[d];
+
+        // Name of the device for the report
+        char name[256] = {0};
+        H_ERRCHK(clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name)-1, name, NULL));
+
+        cl_mem buffer_V = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
+            nbytes_U, (void*)array_V, &errcode);
+        H_ERRCHK(errcode);
+        cl_mem buffers_U[3];
+        for (int n=0; n<3; n++) {
+            buffers_U[n] = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes_U, NULL, &errcode);
+            H_ERRCHK(errcode);
+        }
+
+        cl_program program = h_build_program(kernel_source, context, device, options.c_str());
+        cl_kernel kernels[2];
+        kernels[0] = clCreateKernel(program, "wave2d_4o", &errcode);
+        H_ERRCHK(errcode);
+        kernels[1] = clCreateKernel(program, "wave2d_4o_tiled", &errcode);
+        H_ERRCHK(errcode);
+
+        for (int k=0; k<2; k++) {
+            H_ERRCHK(clSetKernelArg(kernels[k], 3, sizeof(cl_mem), &buffer_V ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 4, sizeof(cl_uint), &N0_k ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 5, sizeof(cl_uint), &N1_k ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 6, sizeof(cl_float), &dt2 ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 7, sizeof(cl_float), &inv_dx02 ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 8, sizeof(cl_float), &inv_dx12 ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 9, sizeof(cl_uint), &P0 ));
+            H_ERRCHK(clSetKernelArg(kernels[k], 10, sizeof(cl_uint), &P1 ));
+        }
+
+        // wave2d_4o uses the same local size as wave2d_async, 
+        // the tiled kernel covers STENCIL_ROWS rows per work-item.
+        // Global sizes are whole work-groups so grids smaller than a 
+        // work-group still launch, both kernels guard the extra work-items
+        size_t local_ref[] = {64, 4};
+        size_t global_ref[] = {(N1_k+63)/64*64, (N0_k+3)/4*4};
+        size_t local_tiled[] = {STENCIL_L1, STENCIL_L0};
+        size_t ntiles0 = (N0_k+STENCIL_L0*STENCIL_ROWS-1)/(STENCIL_L0*STENCIL_ROWS);
+        size_t ntiles1 = (N1_k+STENCIL_L1-1)/STENCIL_L1;
+        size_t global_tiled[] = {ntiles1*STENCIL_L1, ntiles0*STENCIL_L0};
+
+        cl_double ref_ms = run_wave(command_queue, kernels[0], buffers_U, local_ref, global_ref,
+            nsteps, dt, fm, U_ref, nbytes_U);
+        cl_double tiled_ms = run_wave(command_queue, kernels[1], buffers_U, local_tiled, global_tiled,
+            nsteps, dt, fm, U_tiled, nbytes_U);
+
+        float_type max_diff = 0.0f;
+        for (size_t i=0; i<npoints; i++) {
+            max_diff = std::fmax(max_diff, std::fabs(U_ref[i]-U_tiled[i]));
+        }
+
+        printf("%-48.48s %10.1f Mpt/s %10.1f Mpt/s %9.2fx %12.3e\n", name, 
+            nupdates/(ref_ms*1.0e3), nupdates/(tiled_ms*1.0e3), ref_ms/tiled_ms, max_diff);
+
+        for (int k=0; k<2; k++) {
+            H_ERRCHK(clReleaseKernel(kernels[k]));
+        }
+        H_ERRCHK(clReleaseProgram(program));
+        H_ERRCHK(clReleaseMemObject(buffer_V));
+        for (int n=0; n<3; n++) {
+            H_ERRCHK(clReleaseMemObject(buffers_U[n]));
+        }
+    }
+
+    free(kernel_source);
+    free(array_V);
+    free(U_ref);
+    free(U_tiled);
+    
+    // Clean up command queues
+    h_release_command_queues(
+        command_queues, 
+        num_devices
+    );
+    
+    // Clean up devices, queues, and contexts
+    h_release_devices(
+        devices,
+        num_devices,
+        contexts,
+        platforms
+    );
+
+    return 0;
+}
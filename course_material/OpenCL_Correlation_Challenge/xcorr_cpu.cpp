@@ -0,0 +1,113 @@
+/* Code to compare CPU cross-correlation implementations
+Written by Dr Toby M. Potter
+*/
+
+#include <cassert>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+// Bring in the library to work with matrices
+#include "mat_helper.hpp"
+
+// Bring in the size of the images and the padding
+#include "mat_size.hpp"
+
+typedef float float_type;
+
+// Number of images in the stack, a subset of NIMAGES
+#define NBENCH_IMAGES 10
+
+// Time since t1 in milliseconds
+double elapsed_ms(std::chrono::high_resolution_clock::time_point t1) {
+    auto t2 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(t2-t1).count();
+}
+
+// Compare implementations for one image kernel
+void benchmark(const char* name, float_type* image_kernel, 
+        size_t pad0_l, size_t pad0_r, size_t pad1_l, size_t pad1_r,
+        float_type* images_in, float_type* images_naive, float_type* images_out) {
+
+    size_t nelements_image = N0*N1;
+    size_t nbytes_output = NBENCH_IMAGES*nelements_image*sizeof(float_type);
+
+    // Naive reference, one image at a time
+    std::memset(images_naive, 0, nbytes_output);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    for (size_t n=0; n<NBENCH_IMAGES; n++) {
+        m_xcorr_naive(
+            &images_naive[n*nelements_image], 
+            &images_in[n*nelements_image], 
+            image_kernel, N0, N1, pad0_l, pad0_r, pad1_l, pad1_r
+        );
+    }
+    double naive_ms = elapsed_ms(t1);
+
+    // Parallel version, one image at a time
+    std::memset(images_out, 0, nbytes_output);
+    t1 = std::chrono::high_resolution_clock::now();
+    for (size_t n=0; n<NBENCH_IMAGES; n++) {
+        m_xcorr(
+            &images_out[n*nelements_image], 
+            &images_in[n*nelements_image], 
+            image_kernel, N0, N1, pad0_l, pad0_r, pad1_l, pad1_r
+        );
+    }
+    double parallel_ms = elapsed_ms(t1);
+    std::printf("%s, m_xcorr: ", name);
+    m_max_error(images_out, images_naive, NBENCH_IMAGES*N0, N1);
+
+    // Batched version, the whole stack at once
+    std::memset(images_out, 0, nbytes_output);
+    t1 = std::chrono::high_resolution_clock::now();
+    m_xcorr_batch(images_out, images_in, image_kernel, 
+        NBENCH_IMAGES, N0, N1, pad0_l, pad0_r, pad1_l, pad1_r);
+    double batch_ms = elapsed_ms(t1);
+    std::printf("%s, m_xcorr_batch: ", name);
+    m_max_error(images_out, images_naive, NBENCH_IMAGES*N0, N1);
+
+    std::printf("%s, %d images of (%d, %d): naive %.2f ms, m_xcorr %.2f ms (%.1fx), m_xcorr_batch %.2f ms (%.1fx)\n\n",
+        name, NBENCH_IMAGES, N0, N1, 
+        naive_ms, parallel_ms, naive_ms/parallel_ms, batch_ms, naive_ms/batch_ms);
+}
+
+int main(int argc, char** argv) {
+
+    // Size of the image kernel
+    const size_t K0=L0+R0+1;
+    const size_t K1=L1+R1+1;
+
+    size_t nbytes_input = NBENCH_IMAGES*N0*N1*sizeof(float_type);
+    float_type* images_in = (float_type*)calloc(nbytes_input, 1);
+    float_type* images_naive = (float_type*)calloc(nbytes_input, 1);
+    float_type* images_out = (float_type*)calloc(nbytes_input, 1);
+    m_random(images_in, NBENCH_IMAGES*N0, N1);
+
+    // The edge detection kernel from the challenge, not separable
+    float_type edge_kernel[K0*K1] = {-1,-1,-1,\
+                                -1, 8,-1,\
+                                -1,-1,-1};
+    benchmark("Edge kernel", edge_kernel, L0, R0, L1, R1, 
+        images_in, images_naive, images_out);
+
+    // A 7x7 binomial smoothing kernel, separable so it takes the fast path
+    const size_t K=7;
+    float_type binomial[K] = {1, 6, 15, 20, 15, 6, 1};
+    float_type smooth_kernel[K*K];
+    for (size_t k0=0; k0<K; k0++) {
+        for (size_t k1=0; k1<K; k1++) {
+            smooth_kernel[k0*K+k1] = binomial[k0]*binomial[k1]/4096.0f;
+        }
+    }
+    benchmark("Smoothing kernel", smooth_kernel, 3, 3, 3, 3, 
+        images_in, images_naive, images_out);
+
+    free(images_in);
+    free(images_naive);
+    free(images_out);
+
+    return 0;
+}
@@ -0,0 +1,516 @@
+///
+/// @file  bench_helper.hpp
+///
+/// @brief Native benchmark runner for OpenCL kernels, writes
+/// results that LocalOpt in local_opt.py can import.
+///
+/// Include this file after cl_helper.hpp.
+///
+/// Written by Dr. Toby Potter
+/// for the Commonwealth Scientific and Industrial Research Organisation of Australia (CSIRO).
+///
+
+#include <fstream>
+#include <sstream>
+
+/// Controls for warmup and adaptive repetition
+struct h_bench_config_t {
+    // Untimed runs before measuring each local size
+    size_t warmup;
+    // Runs are enqueued in batches of this many
+    size_t batch;
+    // Smallest and largest number of timed runs
+    size_t min_runs;
+    size_t max_runs;
+    // Stop when the 95% confidence interval is within this fraction of the mean
+    cl_double rel_ci;
+};
+
+/// Default benchmark controls
+h_bench_config_t h_bench_default_config() {
+    h_bench_config_t config;
+    config.warmup = 2;
+    config.batch = 5;
+    config.min_runs = 5;
+    config.max_runs = 100;
+    config.rel_ci = 0.02;
+    return config;
+}
+
+/// A registered kernel benchmark. prep_kernel has the same meaning as
+/// in h_optimise_local and is called once per local size.
+struct h_bench_t {
+    // Label in the results file
+    std::string label;
+    cl_kernel kernel;
+    size_t ndim;
+    size_t global_size[H_MAX_WORK_DIM];
+    // Local sizes to sweep along each dimension
+    std::vector<size_t> local0;
+    std::vector<size_t> local1;
+    std::vector<size_t> local2;
+    cl_int (*prep_kernel)(cl_kernel, size_t*, size_t*, size_t, void*);
+    void* prep_data;
+    // Floating point operations and compulsory bytes moved per run
+    cl_double flops;
+    cl_double bytes;
+    // Fixed time added to every measurement, for example a transpose the 
+    // kernel depends on, as pre-existing times are in h_optimise_local
+    cl_double offset_ms;
+};
+
+/// Statistics from timing one local size
+struct h_bench_stats_t {
+    cl_double mean_ms;
+    cl_double stdev_ms;
+    // Half-width of the 95% confidence interval of the mean
+    cl_double ci_ms;
+    size_t nruns;
+    bool converged;
+};
+
+/// Results for one benchmark over all local sizes, in LocalOpt order
+struct h_bench_result_t {
+    std::string label;
+    std::vector<size_t> local0;
+    std::vector<size_t> local1;
+    std::vector<size_t> local2;
+    std::vector<h_bench_stats_t> stats;
+    cl_double flops;
+    cl_double bytes;
+};
+
+/// Two-sided 95% Student t value for dof degrees of freedom
+cl_double h_bench_t95(size_t dof) {
+    const cl_double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (dof == 0) return nan("");
+    if (dof <= 30) return table[dof-1];
+    return 1.960;
+}
+
+/// Make a list of powers of two from 1 up to and including max_size
+std::vector<size_t> h_bench_powers_of_two(size_t max_size) {
+    std::vector<size_t> sizes;
+    for (size_t n=1; n<=max_size; n*=2) sizes.push_back(n);
+    return sizes;
+}
+
+/// Time a kernel at one local size, repeating until the confidence interval
+/// converges or max_runs is reached. Returns false if the kernel would not launch.
+bool h_bench_measure(
+        cl_command_queue command_queue,
+        h_bench_t* bench,
+        size_t* local_size,
+        const h_bench_config_t* config,
+        h_bench_stats_t* stats) {
+
+    stats->mean_ms = nan("");
+    stats->stdev_ms = nan("");
+    stats->ci_ms = nan("");
+    stats->nruns = 0;
+    stats->converged = false;
+
+    size_t global_size[H_MAX_WORK_DIM];
+    std::memcpy(global_size, bench->global_size, bench->ndim*sizeof(size_t));
+    h_fit_global_size(global_size, local_size, bench->ndim);
+
+    if (bench->prep_kernel != NULL) {
+        if (bench->prep_kernel(bench->kernel, local_size, global_size,
+                bench->ndim, bench->prep_data) != CL_SUCCESS) return false;
+    }
+
+    size_t capacity = std::max(config->warmup, config->batch);
+    h_event_batch_t* batch = h_create_event_batch(capacity);
+    cl_double* times_ms = new cl_double[capacity];
+
+    // Running mean and sum of squared differences
+    cl_double mean = 0.0, m2 = 0.0;
+    size_t n = 0;
+    bool launched = true;
+
+    // Warmup runs are enqueued and drained without keeping the times
+    for (size_t r=0; r<config->warmup+config->max_runs && launched; ) {
+        bool warming = (r < config->warmup);
+        size_t count = warming ? config->warmup : std::min(config->batch, config->max_runs-n);
+
+        for (size_t b=0; b<count; b++) {
+            cl_event event = NULL;
+            cl_int errcode = h_enqueue_kernel(command_queue, bench->kernel, local_size,
+                global_size, bench->ndim, 0, NULL, &event);
+            if (errcode != CL_SUCCESS) {
+                event = NULL;
+                launched = false;
+            }
+            h_event_batch_add(batch, event);
+        }
+        h_event_batch_drain(batch, times_ms);
+        r += count;
+        if (warming || !launched) continue;
+
+        for (size_t b=0; b<count; b++) {
+            n++;
+            cl_double delta = times_ms[b]-mean;
+            mean += delta/(cl_double)n;
+            m2 += delta*(times_ms[b]-mean);
+        }
+
+        if (n >= 2) {
+            stats->stdev_ms = sqrt(m2/(cl_double)(n-1));
+            stats->ci_ms = h_bench_t95(n-1)*stats->stdev_ms/sqrt((cl_double)n);
+        }
+        stats->mean_ms = mean;
+        stats->nruns = n;
+
+        if ((n >= config->min_runs) && (stats->ci_ms <= config->rel_ci*mean)) {
+            stats->converged = true;
+            break;
+        }
+    }
+
+    delete[] times_ms;
+    h_release_event_batch(batch);
+
+    if (!launched) {
+        stats->mean_ms = nan("");
+        stats->stdev_ms = nan("");
+        stats->ci_ms = nan("");
+    }
+    return launched;
+}
+
+/// Run a benchmark over every local size that fits the device and kernel
+h_bench_result_t h_bench_run(
+        cl_command_queue command_queue,
+        cl_device_id device,
+        h_bench_t* bench,
+        const h_bench_config_t* config) {
+
+    h_bench_result_t result;
+    result.label = bench->label;
+    result.local0 = bench->local0;
+    result.local1 = bench->local1;
+    result.local2 = bench->local2;
+    result.flops = bench->flops;
+    result.bytes = bench->bytes;
+
+    // Limits on the size of a work-group for this kernel
+    size_t max_work_group_size;
+    h_errchk(
+        clGetKernelWorkGroupInfo(bench->kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(size_t), &max_work_group_size, NULL),
+        "Max work-group size for a kernel"
+    );
+    size_t max_size[3];
+    h_errchk(
+        clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+            sizeof(max_size), max_size, NULL),
+        "Max size for work items"
+    );
+
+    for (size_t l0 : bench->local0) {
+        for (size_t l1 : bench->local1) {
+            for (size_t l2 : bench->local2) {
+                size_t local_size[] = {l0, l1, l2};
+                h_bench_stats_t stats;
+                bool valid = (l0*l1*l2 <= max_work_group_size);
+                for (size_t d=0; d<bench->ndim; d++) {
+                    valid = valid && (local_size[d] <= max_size[d]);
+                }
+                if (valid) {
+                    h_bench_measure(command_queue, bench, local_size, config, &stats);
+                    stats.mean_ms += bench->offset_ms;
+                } else {
+                    stats.mean_ms = nan("");
+                    stats.stdev_ms = nan("");
+                    stats.ci_ms = nan("");
+                    stats.nruns = 0;
+                    stats.converged = false;
+                }
+                result.stats.push_back(stats);
+            }
+        }
+    }
+    return result;
+}
+
+/// Index of the fastest (smallest=true) or slowest local size, -1 if none ran
+long h_bench_extreme(const h_bench_result_t* result, bool smallest) {
+    long index = -1;
+    for (size_t n=0; n<result->stats.size(); n++) {
+        cl_double t = result->stats[n].mean_ms;
+        if (std::isnan(t)) continue;
+        if ((index < 0) || (smallest ? (t < result->stats[index].mean_ms)
+                : (t > result->stats[index].mean_ms))) {
+            index = (long)n;
+        }
+    }
+    return index;
+}
+
+/// Format a number for JSON, Python's json module reads NaN
+std::string h_bench_json_number(cl_double value) {
+    if (std::isnan(value)) return "NaN";
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.17g", value);
+    return std::string(buffer);
+}
+
+/// Format a list of values for JSON
+template<typename T>
+std::string h_bench_json_list(const std::vector<T>& values) {
+    std::string s = "[";
+    for (size_t n=0; n<values.size(); n++) {
+        if (n > 0) s += ", ";
+        s += h_bench_json_number((cl_double)values[n]);
+    }
+    return s + "]";
+}
+
+/// Print a one-line summary of a benchmark result
+void h_bench_report(const h_bench_result_t* result) {
+    long best = h_bench_extreme(result, true);
+    if (best < 0) {
+        std::printf("%-40s no valid local size\n", result->label.c_str());
+        return;
+    }
+    const h_bench_stats_t* s = &result->stats[best];
+    size_t n1 = result->local1.size(), n2 = result->local2.size();
+    std::printf("%-40s %10.4f ms +/- %7.4f (%3zu runs%s) local (%zu,%zu,%zu) %9.2f GFLOP/s %9.2f GB/s\n",
+        result->label.c_str(), s->mean_ms, s->ci_ms, s->nruns, s->converged ? "" : ", unconverged",
+        result->local0[best/(n1*n2)], result->local1[(best/n2)%n1], result->local2[best%n2],
+        result->flops/(s->mean_ms*1.0e6), result->bytes/(s->mean_ms*1.0e6));
+}
+
+/// Write results as JSON with the keys LocalOpt.export_result produces,
+/// plus confidence intervals and derived throughput for the fastest local size
+void h_bench_write_json(const char* filename, const std::vector<h_bench_result_t>& results) {
+    std::ofstream out(filename);
+    if (!out) {
+        std::printf("Error, could not open %s for writing\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    out << "{";
+    bool first = true;
+    for (size_t r=0; r<results.size(); r++) {
+        const h_bench_result_t* result = &results[r];
+        size_t n1 = result->local1.size(), n2 = result->local2.size();
+
+        std::vector<cl_double> times_ms, times_stdev, times_ci, times_nruns;
+        for (const h_bench_stats_t& s : result->stats) {
+            times_ms.push_back(s.mean_ms);
+            times_stdev.push_back(s.stdev_ms);
+            times_ci.push_back(s.ci_ms);
+            times_nruns.push_back((cl_double)s.nruns);
+        }
+
+        long best = h_bench_extreme(result, true);
+        long worst = h_bench_extreme(result, false);
+        if (best < 0) continue;
+        const h_bench_stats_t* s_min = &result->stats[best];
+        const h_bench_stats_t* s_max = &result->stats[worst];
+
+        out << (first ? "" : ", ") << "\"" << h_json_escape(result->label) << "\": {";
+        first = false;
+        out << "\"min_ms\": " << h_bench_json_number(s_min->mean_ms);
+        out << ", \"std_ms\": " << h_bench_json_number(s_min->stdev_ms);
+        out << ", \"L0_min\": " << result->local0[best/(n1*n2)];
+        out << ", \"L1_min\": " << result->local1[(best/n2)%n1];
+        out << ", \"L2_min\": " << result->local2[best%n2];
+        out << ", \"max_ms\": " << h_bench_json_number(s_max->mean_ms);
+        out << ", \"std_ms_max\": " << h_bench_json_number(s_max->stdev_ms);
+        out << ", \"L0_max\": " << result->local0[worst/(n1*n2)];
+        out << ", \"L1_max\": " << result->local1[(worst/n2)%n1];
+        out << ", \"L2_max\": " << result->local2[worst%n2];
+        out << ", \"times_ms\": " << h_bench_json_list(times_ms);
+        out << ", \"times_stdev\": " << h_bench_json_list(times_stdev);
+        out << ", \"local0\": " << h_bench_json_list(result->local0);
+        out << ", \"local1\": " << h_bench_json_list(result->local1);
+        out << ", \"local2\": " << h_bench_json_list(result->local2);
+        out << ", \"times_ci\": " << h_bench_json_list(times_ci);
+        out << ", \"times_nruns\": " << h_bench_json_list(times_nruns);
+        out << ", \"ci_ms\": " << h_bench_json_number(s_min->ci_ms);
+        out << ", \"converged\": " << (s_min->converged ? "true" : "false");
+        out << ", \"flops\": " << h_bench_json_number(result->flops);
+        out << ", \"bytes\": " << h_bench_json_number(result->bytes);
+        out << ", \"gflops\": " << h_bench_json_number(result->flops/(s_min->mean_ms*1.0e6));
+        out << ", \"gbs\": " << h_bench_json_number(result->bytes/(s_min->mean_ms*1.0e6));
+        out << ", \"intensity\": " << h_bench_json_number(result->flops/result->bytes);
+        out << "}";
+    }
+    out << "}\n";
+}
+
+/// Numbers from each top-level entry of a results file, keyed on label then field
+typedef std::map<std::string, std::map<std::string, cl_double>> h_bench_summary_t;
+
+/// Skip whitespace in a JSON string
+void h_bench_json_space(const std::string& s, size_t* pos) {
+    while ((*pos < s.size()) && std::isspace((unsigned char)s[*pos])) (*pos)++;
+}
+
+/// Read a JSON string starting at the opening quote, decoding escapes
+/// so that labels written with h_json_escape read back unchanged
+std::string h_bench_json_string(const std::string& s, size_t* pos) {
+    std::string value;
+    assert(s[*pos] == '"');
+    for ((*pos)++; (*pos < s.size()) && (s[*pos] != '"'); (*pos)++) {
+        if ((s[*pos] != '\\') || (*pos+1 >= s.size())) {
+            value += s[*pos];
+            continue;
+        }
+        char c = s[++(*pos)];
+        if (c == 'n') {
+            value += '\n';
+        } else if (c == 't') {
+            value += '\t';
+        } else if (c == 'r') {
+            value += '\r';
+        } else if (c == 'b') {
+            value += '\b';
+        } else if (c == 'f') {
+            value += '\f';
+        } else if ((c == 'u') && (*pos+4 < s.size())) {
+            // Code points are written back as UTF-8, surrogate pairs are not combined
+            unsigned long code = std::strtoul(s.substr(*pos+1, 4).c_str(), NULL, 16);
+            *pos += 4;
+            if (code < 0x80) {
+                value += (char)code;
+            } else if (code < 0x800) {
+                value += (char)(0xC0 | (code >> 6));
+                value += (char)(0x80 | (code & 0x3F));
+            } else {
+                value += (char)(0xE0 | (code >> 12));
+                value += (char)(0x80 | ((code >> 6) & 0x3F));
+                value += (char)(0x80 | (code & 0x3F));
+            }
+        } else {
+            // Quote, backslash, and slash stand for themselves
+            value += c;
+        }
+    }
+    (*pos)++;
+    return value;
+}
+
+/// Skip over any JSON value, returning its number if it is a number
+cl_double h_bench_json_value(const std::string& s, size_t* pos) {
+    h_bench_json_space(s, pos);
+    char c = s[*pos];
+    if (c == '"') {
+        h_bench_json_string(s, pos);
+        return nan("");
+    }
+    if ((c == '[') || (c == '{')) {
+        // Skip to the matching bracket, strings may hold brackets
+        int depth = 0;
+        do {
+            if (s[*pos] == '"') {
+                h_bench_json_string(s, pos);
+                continue;
+            }
+            if ((s[*pos] == '[') || (s[*pos] == '{')) depth++;
+            if ((s[*pos] == ']') || (s[*pos] == '}')) depth--;
+            (*pos)++;
+        } while ((depth > 0) && (*pos < s.size()));
+        return nan("");
+    }
+    size_t start = *pos;
+    while ((*pos < s.size()) && (s[*pos] != ',') && (s[*pos] != '}')
+        && (s[*pos] != ']') && !std::isspace((unsigned char)s[*pos])) (*pos)++;
+    std::string token = s.substr(start, *pos-start);
+    if ((token == "NaN") || (token == "true") || (token == "false") || (token == "null")) {
+        return (token == "true") ? 1.0 : ((token == "false") ? 0.0 : nan(""));
+    }
+    return std::strtod(token.c_str(), NULL);
+}
+
+/// Read the scalar fields of every entry in a results file,
+/// either from this runner or from benchmark.py
+h_bench_summary_t h_bench_read_json(const char* filename) {
+    std::ifstream in(filename);
+    if (!in) {
+        std::printf("Error, could not open %s for reading\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    std::stringstream buffer;
+    buffer << in.rdbuf();
+    std::string s = buffer.str();
+
+    h_bench_summary_t summary;
+    size_t pos = 0;
+    h_bench_json_space(s, &pos);
+    assert(s[pos] == '{');
+    pos++;
+    while (pos < s.size()) {
+        h_bench_json_space(s, &pos);
+        if (s[pos] == '}') break;
+        if (s[pos] == ',') { pos++; continue; }
+        std::string label = h_bench_json_string(s, &pos);
+        h_bench_json_space(s, &pos);
+        assert(s[pos] == ':');
+        pos++;
+        h_bench_json_space(s, &pos);
+        assert(s[pos] == '{');
+        pos++;
+
+        // Fields of one entry
+        std::map<std::string, cl_double>& fields = summary[label];
+        while (pos < s.size()) {
+            h_bench_json_space(s, &pos);
+            if (s[pos] == '}') { pos++; break; }
+            if (s[pos] == ',') { pos++; continue; }
+            std::string key = h_bench_json_string(s, &pos);
+            h_bench_json_space(s, &pos);
+            assert(s[pos] == ':');
+            pos++;
+            cl_double value = h_bench_json_value(s, &pos);
+            if (!std::isnan(value)) fields[key] = value;
+        }
+    }
+    return summary;
+}
+
+/// Compare the fastest times in two results files. An entry regresses when it is
+/// more than threshold slower and the difference exceeds twice the combined
+/// standard deviation. Returns the number of regressions.
+size_t h_bench_diff(const char* base_file, const char* new_file, cl_double threshold) {
+    h_bench_summary_t base = h_bench_read_json(base_file);
+    h_bench_summary_t next = h_bench_read_json(new_file);
+    size_t nregressions = 0;
+
+    std::printf("%-40s %12s %12s %9s  %s\n", "label", "base (ms)", "new (ms)", "change", "status");
+    for (auto& entry : next) {
+        const std::string& label = entry.first;
+        if ((base.count(label) == 0) || (base[label].count("min_ms") == 0)) {
+            std::printf("%-40s %12s %12.4f %9s  new\n", label.c_str(), "-", entry.second["min_ms"], "-");
+            continue;
+        }
+        cl_double t_base = base[label]["min_ms"], t_new = entry.second["min_ms"];
+        cl_double sd_base = base[label].count("std_ms") ? base[label]["std_ms"] : 0.0;
+        cl_double sd_new = entry.second.count("std_ms") ? entry.second["std_ms"] : 0.0;
+        cl_double change = (t_new-t_base)/t_base;
+        cl_double noise = 2.0*sqrt(sd_base*sd_base+sd_new*sd_new);
+
+        const char* status = "same";
+        if ((change > threshold) && (t_new-t_base > noise)) {
+            status = "REGRESSION";
+            nregressions++;
+        } else if ((-change > threshold) && (t_base-t_new > noise)) {
+            status = "faster";
+        }
+        std::printf("%-40s %12.4f %12.4f %+8.1f%%  %s\n",
+            label.c_str(), t_base, t_new, 100.0*change, status);
+    }
+    for (auto& entry : base) {
+        if (next.count(entry.first) == 0) {
+            std::printf("%-40s %12.4f %12s %9s  missing\n", entry.first.c_str(), entry.second["min_ms"], "-", "-");
+        }
+    }
+    std::printf("%zu regressions\n", nregressions);
+    return nregressions;
+}
@@ -18,10 +18,26 @@
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
+#include <random>
 #include <cassert>
 #include <cstring>
 #include <cmath>
 #include <chrono>
+#include <string>
+#include <sys/stat.h>
+
+// Platform specific headers for creating directories
+#if defined(_WIN32) || defined(_WIN64)
+    #include <direct.h>
+    #include <process.h>
+#else
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+#endif
 
 /// Define target OpenCL version
 #define CL_TARGET_OPENCL_VERSION 300
@@ -177,9 +193,13 @@ cl_uint h_parse_args(int argc,
 }
 
 /// Explore available compute devices and create lists of contexts and devices for resources found.
-void h_acquire_devices(
-        // Input parameter
+/// If share_context is CL_TRUE then every device in a platform shares one context,
+/// otherwise every device gets its own context. In both cases contexts is as long as
+/// devices, and a shared context is retained once per device that uses it.
+void h_acquire_devices_mode(
+        // Input parameters
         cl_device_type device_type,
+        cl_bool share_context,
         // Output parameters
         cl_platform_id **platform_ids_out,
         cl_uint *num_platforms_out,
@@ -265,8 +285,35 @@ void h_acquire_devices(
                 device_ids_ptr,
                 NULL), "Filling devices");
             
+            if (share_context == CL_TRUE) {
+                // Context properties, this can be tricky
+                const cl_context_properties prop[] = { CL_CONTEXT_PLATFORM, 
+                                                      (cl_context_properties)platform_ids[n], 
+                                                      0 };
+
+                // Create one context with all devices in the platform
+                cl_context context = clCreateContext(
+                    prop,
+                    ndevs,
+                    device_ids_ptr,
+                    NULL,
+                    NULL,
+                    &errcode
+                );
+                h_errchk(errcode, "Creating a shared context");
+
+                // Every device gets a reference to the shared context
+                for (cl_uint c=0; c<ndevs; c++) {
+                    if (c>0) {
+                        h_errchk(clRetainContext(context), "Retaining a shared context");
+                    }
+                    *contexts_ptr = context;
+                    contexts_ptr++;
+                }
+            }
+
             // Create a context for every device found
-            for (cl_uint c=0; c<ndevs; c++ ) {
+            for (cl_uint c=0; (share_context != CL_TRUE) && (c<ndevs); c++ ) {
                 // Context properties, this can be tricky
                 const cl_context_properties prop[] = { CL_CONTEXT_PLATFORM, 
                                                       (cl_context_properties)platform_ids[n], 
@@ -305,6 +352,64 @@ void h_acquire_devices(
     *contexts_out = contexts;
 }
 
+/// Explore available compute devices and create lists of contexts and devices for resources found.
+/// Every device gets its own context.
+void h_acquire_devices(
+        // Input parameter
+        cl_device_type device_type,
+        // Output parameters
+        cl_platform_id **platform_ids_out,
+        cl_uint *num_platforms_out,
+        cl_device_id **device_ids_out,
+        cl_uint *num_devices_out, 
+        cl_context **contexts_out) {
+
+    h_acquire_devices_mode(
+        device_type,
+        CL_FALSE,
+        platform_ids_out,
+        num_platforms_out,
+        device_ids_out,
+        num_devices_out,
+        contexts_out
+    );
+}
+
+/// Explore available compute devices and create one context per platform,
+/// shared by all devices in that platform. Buffers created in a shared
+/// context may be used by every device in it, see h_migrate_buffers.
+void h_acquire_devices_shared(
+        // Input parameter
+        cl_device_type device_type,
+        // Output parameters
+        cl_platform_id **platform_ids_out,
+        cl_uint *num_platforms_out,
+        cl_device_id **device_ids_out,
+        cl_uint *num_devices_out, 
+        cl_context **contexts_out) {
+
+    h_acquire_devices_mode(
+        device_type,
+        CL_TRUE,
+        platform_ids_out,
+        num_platforms_out,
+        device_ids_out,
+        num_devices_out,
+        contexts_out
+    );
+}
+
+/// Find the index of the first device that uses the same context as device index,
+/// useful for sharing buffers between devices acquired with h_acquire_devices_shared.
+cl_uint h_context_owner(cl_context *contexts, cl_uint index) {
+    for (cl_uint n=0; n<index; n++) {
+        if (contexts[n] == contexts[index]) {
+            return n;
+        }
+    }
+    return index;
+}
+
 /// Get the OpenCL version that a compute device supports
 cl_float h_get_device_ver(cl_device_id device) {
     
@@ -427,15 +532,266 @@ cl_command_queue* h_create_command_queues(
 }
 
 
-/// Build a program for a single device and context
-cl_program h_build_program(const char* source, 
-                           cl_context context, 
+/// Directory for the on-disk program binary cache, NULL disables the cache.
+/// Initialised from the CL_HELPER_CACHE_DIR environment variable.
+const char* h_program_cache_dir = std::getenv("CL_HELPER_CACHE_DIR");
+
+/// Hit and miss statistics for the program binary cache
+struct h_program_cache_stats_t {
+    // Programs loaded from a cached binary
+    size_t hits;
+    // Programs that had to be built from source
+    size_t misses;
+    // Binaries written to the cache
+    size_t stores;
+    // Cached binaries that the implementation refused to load
+    size_t rejects;
+};
+
+/// Global statistics for the program binary cache
+h_program_cache_stats_t h_program_cache_stats = {0, 0, 0, 0};
+
+/// Enable the program binary cache in directory dir, or disable it with NULL
+void h_set_program_cache_dir(const char* dir) {
+    h_program_cache_dir = dir;
+}
+
+/// Print hit and miss statistics for the program binary cache
+void h_report_program_cache() {
+    std::printf("Program cache: %zu hits, %zu misses, %zu stores, %zu rejected\n",
+            h_program_cache_stats.hits,
+            h_program_cache_stats.misses,
+            h_program_cache_stats.stores,
+            h_program_cache_stats.rejects);
+}
+
+/// Update a 64-bit FNV-1a hash with nbytes of data
+cl_ulong h_hash_bytes(cl_ulong hash, const void* data, size_t nbytes) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t n=0; n<nbytes; n++) {
+        hash ^= (cl_ulong)bytes[n];
+        hash *= (cl_ulong)1099511628211UL;
+    }
+    return hash;
+}
+
+/// Update a 64-bit FNV-1a hash with a string, including the terminator
+cl_ulong h_hash_string(cl_ulong hash, const char* str) {
+    if (str == NULL) str = "";
+    return h_hash_bytes(hash, str, std::strlen(str)+1);
+}
+
+/// Fetch a string-valued property of a compute device
+std::string h_get_device_string(cl_device_id device, cl_device_info param) {
+    size_t nbytes;
+    h_errchk(
+        clGetDeviceInfo(device, param, 0, NULL, &nbytes),
+        "Device string size"
+    );
+
+    // Allocate memory for the string, with a NULL terminator
+    char* value = new char[nbytes+1];
+    value[nbytes] = '\0';
+    h_errchk(
+        clGetDeviceInfo(device, param, nbytes, value, NULL),
+        "Device string"
+    );
+
+    std::string result(value);
+    delete [] value;
+    return result;
+}
+
+/// Make the filename of a cached program binary. The key covers the source,
+/// the compiler options, and the name and driver version of the device.
+std::string h_program_cache_file(
+        const char* cache_dir,
+        const char* source,
+        cl_device_id device,
+        const char* compiler_options) {
+
+    // FNV-1a offset basis
+    cl_ulong hash = (cl_ulong)14695981039346656037UL;
+    hash = h_hash_string(hash, source);
+    hash = h_hash_string(hash, compiler_options);
+    hash = h_hash_string(hash, h_get_device_string(device, CL_DEVICE_NAME).c_str());
+    hash = h_hash_string(hash, h_get_device_string(device, CL_DEVICE_VERSION).c_str());
+    hash = h_hash_string(hash, h_get_device_string(device, CL_DRIVER_VERSION).c_str());
+
+    char filename[32];
+    std::snprintf(filename, sizeof(filename), "%016llx.bin", (unsigned long long)hash);
+    return std::string(cache_dir) + "/" + filename;
+}
+
+/// Try to create a program from a cached binary, returns NULL on failure
+cl_program h_load_program_binary(
+        const char* filename,
+        cl_context context,
+        cl_device_id device,
+        const char* compiler_options) {
+
+    // A missing file is just a cache miss
+    std::FILE *fp = std::fopen(filename, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    // Get the size of the binary
+    std::fseek(fp, 0, SEEK_END);
+    long nbytes_file = std::ftell(fp);
+    std::rewind(fp);
+    if (nbytes_file <= 0) {
+        std::fclose(fp);
+        return NULL;
+    }
+
+    // Read the binary into memory
+    size_t nbytes = (size_t)nbytes_file;
+    unsigned char* binary = (unsigned char*)malloc(nbytes);
+    size_t bytes_read = std::fread(binary, 1, nbytes, fp);
+    std::fclose(fp);
+    if (bytes_read != nbytes) {
+        free(binary);
+        return NULL;
+    }
+
+    // Turn the binary into a program
+    cl_int errcode, binary_status;
+    const unsigned char* binary_ptr = binary;
+    cl_program program = clCreateProgramWithBinary(
+        context,
+        1,
+        &device,
+        &nbytes,
+        &binary_ptr,
+        &binary_status,
+        &errcode
+    );
+    free(binary);
+
+    if ((errcode != CL_SUCCESS) || (binary_status != CL_SUCCESS)) {
+        if (program != NULL) clReleaseProgram(program);
+        h_program_cache_stats.rejects++;
+        return NULL;
+    }
+
+    // Binaries still need to be built before kernels can be made
+    errcode = clBuildProgram(program, 1, &device, compiler_options, NULL, NULL);
+    if (errcode != CL_SUCCESS) {
+        clReleaseProgram(program);
+        h_program_cache_stats.rejects++;
+        return NULL;
+    }
+
+    return program;
+}
+
+/// Save the binary of a built program for a device into the cache
+void h_save_program_binary(
+        const char* cache_dir,
+        const char* filename,
+        cl_program program,
+        cl_device_id device) {
+
+    // Make the cache directory, it may exist already
+#if defined(_WIN32) || defined(_WIN64)
+    _mkdir(cache_dir);
+#else
+    mkdir(cache_dir, 0755);
+#endif
+
+    // The program may be associated with several devices in the context
+    cl_uint num_devices;
+    h_errchk(
+        clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, NULL),
+        "Getting the number of program devices"
+    );
+
+    cl_device_id* devices = (cl_device_id*)calloc(num_devices, sizeof(cl_device_id));
+    size_t* binary_sizes = (size_t*)calloc(num_devices, sizeof(size_t));
+    unsigned char** binaries = (unsigned char**)calloc(num_devices, sizeof(unsigned char*));
+
+    h_errchk(
+        clGetProgramInfo(program, CL_PROGRAM_DEVICES,
+            num_devices*sizeof(cl_device_id), devices, NULL),
+        "Getting the program devices"
+    );
+    h_errchk(
+        clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+            num_devices*sizeof(size_t), binary_sizes, NULL),
+        "Getting the size of compiled binaries"
+    );
+
+    // Only fetch the binary for the device we built for
+    cl_uint index = num_devices;
+    for (cl_uint n=0; n<num_devices; n++) {
+        if ((devices[n] == device) && (binary_sizes[n] > 0)) {
+            index = n;
+            binaries[n] = (unsigned char*)malloc(binary_sizes[n]);
+        }
+    }
+
+    if (index < num_devices) {
+        h_errchk(
+            clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+                num_devices*sizeof(unsigned char*), binaries, NULL),
+            "Retrieving the compiled binaries"
+        );
+
+        // Write to a temporary file and rename,
+        // so that concurrent processes never see a partial binary
+#if defined(_WIN32) || defined(_WIN64)
+        int pid = _getpid();
+#else
+        int pid = (int)getpid();
+#endif
+        std::string temp_filename = std::string(filename) + "." + std::to_string(pid) + ".tmp";
+        std::FILE *fp = std::fopen(temp_filename.c_str(), "wb");
+        if (fp != NULL) {
+            size_t nwritten = std::fwrite(binaries[index], 1, binary_sizes[index], fp);
+            std::fclose(fp);
+
+            if ((nwritten == binary_sizes[index])
+                    && (std::rename(temp_filename.c_str(), filename) == 0)) {
+                h_program_cache_stats.stores++;
+            } else {
+                std::remove(temp_filename.c_str());
+            }
+        }
+        free(binaries[index]);
+    }
+
+    free(binaries);
+    free(binary_sizes);
+    free(devices);
+}
+
+/// Build a program for a single device and context.
+/// If h_program_cache_dir is set then program binaries are
+/// reused from, and saved to, the on-disk program cache.
+cl_program h_build_program(const char* source,
+                           cl_context context,
                            cl_device_id device,
                            const char* compiler_options) {
 
     // Error code for checking programs
     cl_int errcode;
 
+    // Look for the program in the binary cache
+    std::string cache_file;
+    if (h_program_cache_dir != NULL) {
+        cache_file = h_program_cache_file(h_program_cache_dir, source, device, compiler_options);
+        cl_program cached_program = h_load_program_binary(
+            cache_file.c_str(), context, device, compiler_options
+        );
+
+        if (cached_program != NULL) {
+            h_program_cache_stats.hits++;
+            return cached_program;
+        }
+        h_program_cache_stats.misses++;
+    }
+
     // Create a program from the source code
     cl_program program = clCreateProgramWithSource(
             context,
@@ -488,6 +844,11 @@ cl_program h_build_program(const char* source,
         exit(EXIT_FAILURE);
     }
 
+    // Save the binary for next time
+    if (h_program_cache_dir != NULL) {
+        h_save_program_binary(h_program_cache_dir, cache_file.c_str(), program, device);
+    }
+
     return program;
 }
 
@@ -553,6 +914,317 @@ cl_double h_get_event_time_ms(
     return elapsed;
 }
 
+/// A tagged event or host span recorded by the profiler
+struct h_profile_record_t {
+    // Event to profile, NULL for a host span
+    cl_event event;
+    // Name to show in the trace
+    std::string name;
+    // Track within the trace, usually the index of a command queue
+    int lane;
+    // Host time when the event was tagged, or the host span, in nanoseconds
+    cl_ulong host_start_ns;
+    cl_ulong host_end_ns;
+};
+
+/// Profiler that records events across command queues and 
+/// writes them out as a Chrome trace (chrome://tracing or Perfetto)
+struct h_profiler_t {
+    // Device whose clock the event timestamps use
+    cl_device_id device;
+    // Did clGetDeviceAndHostTimer succeed?
+    cl_bool has_device_timer;
+    // Offset that converts device timestamps to host timestamps, in nanoseconds
+    cl_long device_to_host_ns;
+    // Recorded events and host spans
+    std::vector<h_profile_record_t> records;
+    // Names for lanes
+    std::map<int, std::string> lane_names;
+};
+
+/// Current host time in nanoseconds, in the time base of the profiler
+cl_ulong h_profiler_host_ns(h_profiler_t* profiler) {
+#ifdef CL_VERSION_2_1
+    if (profiler->has_device_timer == CL_TRUE) {
+        cl_ulong host_ns;
+        if (clGetHostTimer(profiler->device, &host_ns) == CL_SUCCESS) {
+            return host_ns;
+        }
+    }
+#endif
+    return (cl_ulong)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Create a profiler for events on a device. Command queues 
+/// must have profiling enabled for their events to be recorded.
+h_profiler_t* h_create_profiler(cl_device_id device) {
+    h_profiler_t* profiler = new h_profiler_t();
+    profiler->device = device;
+    profiler->has_device_timer = CL_FALSE;
+    profiler->device_to_host_ns = 0;
+
+#ifdef CL_VERSION_2_1
+    // Correlate the device and host clocks, needs OpenCL 2.1
+    if (h_get_device_ver(device) >= 2.1f) {
+        cl_ulong device_ns, host_ns;
+        if (clGetDeviceAndHostTimer(device, &device_ns, &host_ns) == CL_SUCCESS) {
+            profiler->has_device_timer = CL_TRUE;
+            profiler->device_to_host_ns = (cl_long)host_ns - (cl_long)device_ns;
+        }
+    }
+#endif
+
+    return profiler;
+}
+
+/// Give a lane a name in the trace, for example the name of a command queue
+void h_profiler_name_lane(h_profiler_t* profiler, int lane, const char* name) {
+    profiler->lane_names[lane] = std::string(name);
+}
+
+/// Record an event in the profiler, the event is retained by the profiler
+void h_profiler_tag(h_profiler_t* profiler, cl_event event, const char* name, int lane) {
+    h_errchk(clRetainEvent(event), "Retaining a profiled event");
+
+    h_profile_record_t record;
+    record.event = event;
+    record.name = std::string(name);
+    record.lane = lane;
+    record.host_start_ns = h_profiler_host_ns(profiler);
+    record.host_end_ns = record.host_start_ns;
+    profiler->records.push_back(record);
+}
+
+/// Record a span of host activity, times are from h_profiler_host_ns
+void h_profiler_host_span(
+        h_profiler_t* profiler,
+        const char* name,
+        int lane,
+        cl_ulong host_start_ns,
+        cl_ulong host_end_ns) {
+
+    h_profile_record_t record;
+    record.event = NULL;
+    record.name = std::string(name);
+    record.lane = lane;
+    record.host_start_ns = host_start_ns;
+    record.host_end_ns = host_end_ns;
+    profiler->records.push_back(record);
+}
+
+/// Category of an event from its command type
+const char* h_profiler_category(cl_event event) {
+    cl_command_type command_type;
+    h_errchk(
+        clGetEventInfo(event, CL_EVENT_COMMAND_TYPE, sizeof(cl_command_type), &command_type, NULL),
+        "Getting the command type of an event"
+    );
+
+    switch (command_type) {
+        case CL_COMMAND_NDRANGE_KERNEL:
+        case CL_COMMAND_TASK:
+            return "kernel";
+        case CL_COMMAND_READ_BUFFER:
+        case CL_COMMAND_READ_BUFFER_RECT:
+        case CL_COMMAND_MAP_BUFFER:
+            return "download";
+        case CL_COMMAND_WRITE_BUFFER:
+        case CL_COMMAND_WRITE_BUFFER_RECT:
+        case CL_COMMAND_UNMAP_MEM_OBJECT:
+            return "upload";
+        case CL_COMMAND_COPY_BUFFER:
+        case CL_COMMAND_COPY_BUFFER_RECT:
+        case CL_COMMAND_FILL_BUFFER:
+        case CL_COMMAND_MIGRATE_MEM_OBJECTS:
+            return "copy";
+        default:
+            return "other";
+    }
+}
+
+/// Escape a string for use inside a JSON string literal
+std::string h_json_escape(const std::string& text) {
+    std::string escaped;
+    for (size_t n=0; n<text.size(); n++) {
+        unsigned char c = (unsigned char)text[n];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += (char)c;
+        } else if (c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += (char)c;
+        }
+    }
+    return escaped;
+}
+
+/// Write one complete ("X") event in Chrome trace format
+void h_profiler_write_span(
+        std::FILE* fp,
+        bool* first,
+        const char* name,
+        const char* category,
+        int pid,
+        int tid,
+        cl_double ts_us,
+        cl_double dur_us) {
+
+    std::fprintf(fp, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+        "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+        (*first) ? "" : ",", h_json_escape(name).c_str(), category, pid, tid, ts_us, dur_us);
+    *first = false;
+}
+
+/// Write an async ("b" and "e") event pair in Chrome trace format, these may overlap on a lane
+void h_profiler_write_async(
+        std::FILE* fp,
+        bool* first,
+        const char* name,
+        const char* category,
+        int pid,
+        int tid,
+        size_t id,
+        cl_double ts_us,
+        cl_double dur_us) {
+
+    const char phases[] = {'b', 'e'};
+    for (int p=0; p<2; p++) {
+        std::fprintf(fp, "%s\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%c\", \"id\": %zu, "
+            "\"pid\": %d, \"tid\": %d, \"ts\": %.3f}",
+            (*first) ? "" : ",", h_json_escape(name).c_str(), category, phases[p], id, 
+            pid, tid, ts_us+p*dur_us);
+        *first = false;
+    }
+}
+
+/// Write all recorded events to a Chrome trace JSON file. Execution of
+/// commands goes on the "Device" process, and host spans go on the "Host" process.
+/// The "Scheduling" process shows each command from QUEUED to SUBMIT 
+/// and from SUBMIT to START as separate spans.
+void h_profiler_write_chrome_trace(h_profiler_t* profiler, const char* filename) {
+
+    // Process ids in the trace
+    const int pid_host = 0, pid_device = 1, pid_scheduling = 2;
+
+    size_t nrecords = profiler->records.size();
+    if (nrecords == 0) return;
+
+    // Timestamps of each record in host nanoseconds (queued, submit, start, end)
+    std::vector<cl_ulong> stamps(4*nrecords, 0);
+
+    // Without a device timer, align the first event's queued time with the host
+    cl_long offset_ns = profiler->device_to_host_ns;
+    bool have_offset = (profiler->has_device_timer == CL_TRUE);
+
+    for (size_t n=0; n<nrecords; n++) {
+        h_profile_record_t* record = &profiler->records[n];
+
+        if (record->event == NULL) {
+            stamps[4*n+0] = record->host_start_ns;
+            stamps[4*n+1] = record->host_start_ns;
+            stamps[4*n+2] = record->host_start_ns;
+            stamps[4*n+3] = record->host_end_ns;
+            continue;
+        }
+
+        h_errchk(clWaitForEvents(1, &record->event), "Waiting on a profiled event");
+
+        const cl_profiling_info params[] = {
+            CL_PROFILING_COMMAND_QUEUED,
+            CL_PROFILING_COMMAND_SUBMIT,
+            CL_PROFILING_COMMAND_START,
+            CL_PROFILING_COMMAND_END
+        };
+
+        cl_ulong device_ns[4];
+        for (int p=0; p<4; p++) {
+            h_errchk(
+                clGetEventProfilingInfo(record->event, params[p], sizeof(cl_ulong), &device_ns[p], NULL),
+                "Fetching profiling information for a profiled event"
+            );
+        }
+
+        if (!have_offset) {
+            offset_ns = (cl_long)record->host_start_ns - (cl_long)device_ns[0];
+            have_offset = true;
+        }
+
+        for (int p=0; p<4; p++) {
+            stamps[4*n+p] = (cl_ulong)((cl_long)device_ns[p] + offset_ns);
+        }
+    }
+
+    // Make timestamps relative to the earliest one
+    cl_ulong t0 = stamps[0];
+    for (size_t n=0; n<4*nrecords; n++) {
+        t0 = std::min(t0, stamps[n]);
+    }
+
+    std::FILE *fp = std::fopen(filename, "w");
+    if (fp == NULL) {
+        std::printf("Error in writing file %s", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    std::fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    bool first = true;
+
+    // Names for processes and lanes
+    const char* process_names[] = {"Host", "Device", "Scheduling"};
+    for (int p=0; p<3; p++) {
+        std::fprintf(fp, "%s\n  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"%s\"}}", first ? "" : ",", p, process_names[p]);
+        first = false;
+
+        for (std::map<int, std::string>::iterator it = profiler->lane_names.begin();
+                it != profiler->lane_names.end(); it++) {
+            std::fprintf(fp, ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                "\"tid\": %d, \"args\": {\"name\": \"%s\"}}", p, it->first, 
+                h_json_escape(it->second).c_str());
+        }
+    }
+
+    for (size_t n=0; n<nrecords; n++) {
+        h_profile_record_t* record = &profiler->records[n];
+        cl_double queued_us = (cl_double)(stamps[4*n+0]-t0)*1.0e-3;
+        cl_double submit_us = (cl_double)(stamps[4*n+1]-t0)*1.0e-3;
+        cl_double start_us = (cl_double)(stamps[4*n+2]-t0)*1.0e-3;
+        cl_double end_us = (cl_double)(stamps[4*n+3]-t0)*1.0e-3;
+
+        if (record->event == NULL) {
+            h_profiler_write_span(fp, &first, record->name.c_str(), "host",
+                pid_host, record->lane, start_us, end_us-start_us);
+        } else {
+            const char* category = h_profiler_category(record->event);
+            h_profiler_write_span(fp, &first, record->name.c_str(), category,
+                pid_device, record->lane, start_us, end_us-start_us);
+            std::string queued_name = record->name + " (queued)";
+            std::string submitted_name = record->name + " (submitted)";
+            h_profiler_write_async(fp, &first, queued_name.c_str(), "queued",
+                pid_scheduling, record->lane, 2*n, queued_us, submit_us-queued_us);
+            h_profiler_write_async(fp, &first, submitted_name.c_str(), "submitted",
+                pid_scheduling, record->lane, 2*n+1, submit_us, start_us-submit_us);
+        }
+    }
+
+    std::fprintf(fp, "\n]}\n");
+    std::fclose(fp);
+}
+
+/// Release the profiler and the events it holds
+void h_release_profiler(h_profiler_t* profiler) {
+    for (size_t n=0; n<profiler->records.size(); n++) {
+        if (profiler->records[n].event != NULL) {
+            h_errchk(clReleaseEvent(profiler->records[n].event), "Releasing a profiled event");
+        }
+    }
+    delete profiler;
+}
+
 /// Enlarge global_size so that an integer number of local sizes fits within it in any dimension.
 void h_fit_global_size(const size_t* global_size, const size_t* local_size, size_t work_dim) {
     
@@ -635,6 +1307,79 @@ void* h_read_binary(const char* filename, size_t *nbytes) {
     return buffer;
 }
 
+/// Map a file into memory instead of reading it in, pages are 
+/// brought in on demand so the file may be larger than host memory.
+/// If writable is true the file is created or resized to *nbytes,
+/// otherwise the existing file is mapped read-only and *nbytes is set to its size.
+void* h_map_binary(const char* filename, size_t *nbytes, bool writable) {
+
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file = CreateFileA(filename, 
+        writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, 
+        FILE_SHARE_READ, NULL, writable ? OPEN_ALWAYS : OPEN_EXISTING, 
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::printf("Error in opening file %s", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (!writable) {
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        *nbytes = (size_t)size.QuadPart;
+    }
+
+    // The mapping extends a writable file to the requested size
+    unsigned long long size = (unsigned long long)(*nbytes);
+    HANDLE mapping = CreateFileMappingA(file, NULL, 
+        writable ? PAGE_READWRITE : PAGE_READONLY, 
+        (DWORD)(size >> 32), (DWORD)(size & 0xffffffff), NULL);
+    void* data = (mapping == NULL) ? NULL : MapViewOfFile(mapping, 
+        writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, *nbytes);
+
+    // The view keeps the file open
+    if (mapping != NULL) CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    int fd = open(filename, writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if (fd < 0) {
+        std::printf("Error in opening file %s", filename);
+        exit(EXIT_FAILURE);
+    }
+    if (writable) {
+        if (ftruncate(fd, (off_t)(*nbytes)) != 0) {
+            std::printf("Error in resizing file %s", filename);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        struct stat info;
+        fstat(fd, &info);
+        *nbytes = (size_t)info.st_size;
+    }
+
+    void* data = (*nbytes == 0) ? MAP_FAILED : mmap(NULL, *nbytes, 
+        writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+    
+    // The mapping keeps the file open
+    close(fd);
+    if (data == MAP_FAILED) data = NULL;
+#endif
+
+    if (data == NULL) {
+        std::printf("Error in mapping file %s", filename);
+        exit(EXIT_FAILURE);
+    }
+    return data;
+}
+
+/// Release a mapping made with h_map_binary, changes to a writable mapping are written back
+void h_unmap_binary(void* data, size_t nbytes) {
+#if defined(_WIN32) || defined(_WIN64)
+    UnmapViewOfFile(data);
+#else
+    munmap(data, nbytes);
+#endif
+}
+
 /// Report information on a compute device
 void h_report_on_device(cl_device_id device) {
 
@@ -768,29 +1513,487 @@ void h_report_on_device(cl_device_id device) {
 
 }
 
-/// Release command queues
-void h_release_command_queues(cl_command_queue *command_queues, cl_uint num_command_queues) {
-    // Finish and Release all command queues
-    for (cl_uint n = 0; n<num_command_queues; n++) {
-        // Wait for all commands in the 
-        // command queues to finish
-        h_errchk(
-            clFinish(command_queues[n]), 
-            "Finishing up command queues"
-        );
-        
-        // Now release the command queue
-        h_errchk(
-            clReleaseCommandQueue(command_queues[n]), 
-            "Releasing command queues"
-        );
-    }
-
-    // Now destroy the command queues
-    free(command_queues);
-}
+/// Migrate buffers in a shared context to the device of a command queue.
+/// Use CL_MIGRATE_MEM_OBJECT_HOST in flags to migrate back to the host,
+/// and CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED if the contents are not needed.
+void h_migrate_buffers(
+        cl_command_queue command_queue,
+        cl_mem *buffers,
+        cl_uint num_buffers,
+        cl_mem_migration_flags flags,
+        cl_uint num_events_in_wait_list,
+        const cl_event *event_wait_list,
+        cl_event *event) {
 
-/// Release devices and contexts
+    h_errchk(
+        clEnqueueMigrateMemObjects(
+            command_queue,
+            num_buffers,
+            buffers,
+            flags,
+            num_events_in_wait_list,
+            event_wait_list,
+            event
+        ),
+        "Migrating memory objects"
+    );
+}
+
+/// A ring of pinned host staging buffers for host <-> device transfers.
+/// Each slot is a CL_MEM_ALLOC_HOST_PTR buffer that stays mapped for the
+/// life of the ring, so transfers to and from it avoid a driver bounce copy.
+/// Slots are recycled once the last transfer that used them has completed.
+struct h_staging_ring_t {
+    // Command queue used to map and unmap the slots
+    cl_command_queue command_queue;
+    // Number of slots and the size of each slot
+    cl_uint num_slots;
+    size_t slot_bytes;
+    // Pinned buffers and their mapped host pointers
+    cl_mem* buffers;
+    void** host_ptrs;
+    // Last transfer to use each slot, NULL if the slot is free
+    cl_event* events;
+    // Host destination and size of a download waiting in each slot
+    void** pending_dst;
+    size_t* pending_bytes;
+    // Next slot to hand out
+    cl_uint next_slot;
+};
+
+/// Create a ring of num_slots pinned staging buffers, each of slot_bytes
+h_staging_ring_t* h_create_staging_ring(
+        cl_context context,
+        cl_command_queue command_queue,
+        cl_uint num_slots,
+        size_t slot_bytes) {
+
+    cl_int errcode;
+
+    h_staging_ring_t* ring = (h_staging_ring_t*)calloc(1, sizeof(h_staging_ring_t));
+    ring->command_queue = command_queue;
+    ring->num_slots = num_slots;
+    ring->slot_bytes = slot_bytes;
+    ring->buffers = (cl_mem*)calloc(num_slots, sizeof(cl_mem));
+    ring->host_ptrs = (void**)calloc(num_slots, sizeof(void*));
+    ring->events = (cl_event*)calloc(num_slots, sizeof(cl_event));
+    ring->pending_dst = (void**)calloc(num_slots, sizeof(void*));
+    ring->pending_bytes = (size_t*)calloc(num_slots, sizeof(size_t));
+    ring->next_slot = 0;
+
+    for (cl_uint n=0; n<num_slots; n++) {
+        // Allocate pinned memory
+        ring->buffers[n] = clCreateBuffer(
+            context,
+            CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+            slot_bytes,
+            NULL,
+            &errcode
+        );
+        h_errchk(errcode, "Creating a staging buffer");
+
+        // Map it once, the pointer is valid until the ring is released
+        ring->host_ptrs[n] = clEnqueueMapBuffer(
+            command_queue,
+            ring->buffers[n],
+            CL_TRUE,
+            CL_MAP_READ | CL_MAP_WRITE,
+            0,
+            slot_bytes,
+            0,
+            NULL,
+            NULL,
+            &errcode
+        );
+        h_errchk(errcode, "Mapping a staging buffer");
+    }
+
+    return ring;
+}
+
+/// Wait for the last transfer in a slot and finish any download waiting in it
+void h_staging_ring_wait_slot(h_staging_ring_t* ring, cl_uint slot) {
+    if (ring->events[slot] != NULL) {
+        h_errchk(clWaitForEvents(1, &ring->events[slot]), "Waiting on a staging slot");
+        h_errchk(clReleaseEvent(ring->events[slot]), "Releasing a staging event");
+        ring->events[slot] = NULL;
+    }
+
+    if (ring->pending_dst[slot] != NULL) {
+        std::memcpy(ring->pending_dst[slot], ring->host_ptrs[slot], ring->pending_bytes[slot]);
+        ring->pending_dst[slot] = NULL;
+        ring->pending_bytes[slot] = 0;
+    }
+}
+
+/// Hand out the next slot of the ring, waiting for it to be free.
+/// Returns the pinned host pointer for the slot.
+void* h_staging_ring_acquire(h_staging_ring_t* ring, cl_uint* slot) {
+    *slot = ring->next_slot;
+    ring->next_slot = (ring->next_slot+1) % ring->num_slots;
+    h_staging_ring_wait_slot(ring, *slot);
+    return ring->host_ptrs[*slot];
+}
+
+/// Record the transfer that uses a slot, the ring takes ownership of event
+void h_staging_ring_submit(h_staging_ring_t* ring, cl_uint slot, cl_event event) {
+    assert(ring->events[slot] == NULL);
+    ring->events[slot] = event;
+}
+
+/// Wait for all transfers in the ring to finish
+void h_staging_ring_flush(h_staging_ring_t* ring) {
+    for (cl_uint n=0; n<ring->num_slots; n++) {
+        h_staging_ring_wait_slot(ring, n);
+    }
+}
+
+/// Upload nbytes from host memory src to buffer at offset, through the staging ring.
+/// Returns as soon as src has been copied into pinned memory,
+/// use clFinish or h_staging_ring_flush to wait for the upload.
+void h_staging_write(
+        h_staging_ring_t* ring,
+        cl_command_queue command_queue,
+        cl_mem buffer,
+        size_t offset,
+        const void* src,
+        size_t nbytes) {
+
+    const char* src_bytes = (const char*)src;
+
+    for (size_t done=0; done<nbytes; done+=ring->slot_bytes) {
+        size_t chunk_bytes = std::min(ring->slot_bytes, nbytes-done);
+
+        // Copy the chunk into pinned memory
+        cl_uint slot;
+        void* pinned = h_staging_ring_acquire(ring, &slot);
+        std::memcpy(pinned, &src_bytes[done], chunk_bytes);
+
+        // Upload from pinned memory without blocking
+        cl_event event;
+        h_errchk(
+            clEnqueueWriteBuffer(
+                command_queue,
+                buffer,
+                CL_FALSE,
+                offset+done,
+                chunk_bytes,
+                pinned,
+                0,
+                NULL,
+                &event
+            ),
+            "Staged write to buffer"
+        );
+        h_staging_ring_submit(ring, slot, event);
+    }
+}
+
+/// Download nbytes from buffer at offset to host memory dst, through the staging ring.
+/// Downloads of later chunks overlap the copy out of earlier ones,
+/// and dst is filled when the function returns.
+void h_staging_read(
+        h_staging_ring_t* ring,
+        cl_command_queue command_queue,
+        cl_mem buffer,
+        size_t offset,
+        void* dst,
+        size_t nbytes) {
+
+    char* dst_bytes = (char*)dst;
+
+    for (size_t done=0; done<nbytes; done+=ring->slot_bytes) {
+        size_t chunk_bytes = std::min(ring->slot_bytes, nbytes-done);
+
+        // Getting a slot finishes any earlier download that used it
+        cl_uint slot;
+        void* pinned = h_staging_ring_acquire(ring, &slot);
+
+        // Download into pinned memory without blocking
+        cl_event event;
+        h_errchk(
+            clEnqueueReadBuffer(
+                command_queue,
+                buffer,
+                CL_FALSE,
+                offset+done,
+                chunk_bytes,
+                pinned,
+                0,
+                NULL,
+                &event
+            ),
+            "Staged read from buffer"
+        );
+        h_staging_ring_submit(ring, slot, event);
+
+        // Copy out of pinned memory when the slot is next needed
+        ring->pending_dst[slot] = &dst_bytes[done];
+        ring->pending_bytes[slot] = chunk_bytes;
+    }
+
+    // Finish the remaining downloads
+    h_staging_ring_flush(ring);
+}
+
+/// Release a staging ring and its pinned buffers
+void h_release_staging_ring(h_staging_ring_t* ring) {
+    h_staging_ring_flush(ring);
+
+    for (cl_uint n=0; n<ring->num_slots; n++) {
+        h_errchk(
+            clEnqueueUnmapMemObject(
+                ring->command_queue,
+                ring->buffers[n],
+                ring->host_ptrs[n],
+                0,
+                NULL,
+                NULL
+            ),
+            "Unmapping a staging buffer"
+        );
+    }
+    h_errchk(clFinish(ring->command_queue), "Finishing staging unmaps");
+
+    for (cl_uint n=0; n<ring->num_slots; n++) {
+        h_errchk(clReleaseMemObject(ring->buffers[n]), "Releasing a staging buffer");
+    }
+
+    free(ring->buffers);
+    free(ring->host_ptrs);
+    free(ring->events);
+    free(ring->pending_dst);
+    free(ring->pending_bytes);
+    free(ring);
+}
+
+/// Number of size classes in a buffer pool, class c holds blocks of 2^c bytes
+#define H_POOL_NUM_CLASSES 48
+
+/// A pool of device buffers for one context and device.
+/// Small blocks are carved out of large slabs with clCreateSubBuffer,
+/// large blocks get their own allocation. Released blocks are kept on
+/// a free list for their size class and handed out again.
+struct h_buffer_pool_t {
+    // Context that owns the buffers
+    cl_context context;
+    // Flags used to create the buffers
+    cl_mem_flags flags;
+    // Alignment in bytes of sub-buffer origins (CL_DEVICE_MEM_BASE_ADDR_ALIGN)
+    size_t align_bytes;
+    // Size of the slabs that small blocks are carved from
+    size_t slab_bytes;
+    // Slabs allocated so far
+    std::vector<cl_mem> slabs;
+    // Bytes already carved from the last slab
+    size_t slab_offset;
+    // Free blocks for each size class
+    std::vector<cl_mem> free_lists[H_POOL_NUM_CLASSES];
+    // Size class of every block handed out by the pool
+    std::map<cl_mem, int> classes;
+    // Blocks currently handed out, to catch a block released twice
+    std::set<cl_mem> in_use;
+    // Bytes in blocks currently handed out, and the high-water mark
+    size_t bytes_in_use;
+    size_t peak_bytes_in_use;
+    // Bytes allocated from the device, and the high-water mark
+    size_t bytes_reserved;
+    size_t peak_bytes_reserved;
+    // Number of calls to clCreateBuffer and clCreateSubBuffer
+    size_t num_device_allocs;
+    size_t num_sub_buffers;
+    // Number of acquires, and how many were served from a free list
+    size_t num_acquires;
+    size_t num_reuses;
+};
+
+/// Create a buffer pool for a context and device, 
+/// slab_bytes is the size of the slabs that small blocks are carved from
+h_buffer_pool_t* h_create_buffer_pool(
+        cl_context context,
+        cl_device_id device,
+        cl_mem_flags flags,
+        size_t slab_bytes) {
+
+    // Sub-buffer origins must be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN, given in bits
+    cl_uint align_bits;
+    h_errchk(
+        clGetDeviceInfo(device,
+                        CL_DEVICE_MEM_BASE_ADDR_ALIGN,
+                        sizeof(cl_uint),
+                        &align_bits,
+                        NULL),
+        "Base address alignment"
+    );
+
+    h_buffer_pool_t* pool = new h_buffer_pool_t();
+    pool->context = context;
+    pool->flags = flags;
+    pool->align_bytes = std::max((size_t)align_bits/8, (size_t)1);
+    pool->slab_bytes = slab_bytes;
+    pool->slab_offset = slab_bytes;
+    pool->bytes_in_use = 0;
+    pool->peak_bytes_in_use = 0;
+    pool->bytes_reserved = 0;
+    pool->peak_bytes_reserved = 0;
+    pool->num_device_allocs = 0;
+    pool->num_sub_buffers = 0;
+    pool->num_acquires = 0;
+    pool->num_reuses = 0;
+    return pool;
+}
+
+/// Find the size class for an allocation of nbytes
+int h_buffer_pool_class(h_buffer_pool_t* pool, size_t nbytes) {
+    size_t block_bytes = std::max(nbytes, pool->align_bytes);
+    int c = 0;
+    while (((size_t)1 << c) < block_bytes) {
+        c++;
+    }
+    assert(c < H_POOL_NUM_CLASSES);
+    return c;
+}
+
+/// Acquire a buffer of at least nbytes from the pool
+cl_mem h_buffer_pool_acquire(h_buffer_pool_t* pool, size_t nbytes) {
+
+    cl_int errcode;
+    int c = h_buffer_pool_class(pool, nbytes);
+    size_t block_bytes = (size_t)1 << c;
+    cl_mem buffer = NULL;
+
+    pool->num_acquires++;
+
+    if (!pool->free_lists[c].empty()) {
+        // Reuse a released block of the same size class
+        buffer = pool->free_lists[c].back();
+        pool->free_lists[c].pop_back();
+        pool->num_reuses++;
+    } else if (block_bytes <= pool->slab_bytes/4) {
+        // Round the origin up to the device alignment
+        size_t origin = pool->slab_offset;
+        if (origin % pool->align_bytes) {
+            origin = (origin/pool->align_bytes+1)*pool->align_bytes;
+        }
+
+        // Start a new slab if the block doesn't fit in the last one
+        if ((pool->slabs.empty()) || (origin+block_bytes > pool->slab_bytes)) {
+            cl_mem slab = clCreateBuffer(
+                pool->context,
+                pool->flags,
+                pool->slab_bytes,
+                NULL,
+                &errcode
+            );
+            h_errchk(errcode, "Creating a buffer pool slab");
+            pool->slabs.push_back(slab);
+            pool->bytes_reserved += pool->slab_bytes;
+            pool->num_device_allocs++;
+            origin = 0;
+        }
+
+        // Carve the block out of the slab
+        cl_buffer_region region = { origin, block_bytes };
+        buffer = clCreateSubBuffer(
+            pool->slabs.back(),
+            0,
+            CL_BUFFER_CREATE_TYPE_REGION,
+            &region,
+            &errcode
+        );
+        h_errchk(errcode, "Creating a sub-buffer from a buffer pool slab");
+        pool->slab_offset = origin+block_bytes;
+        pool->num_sub_buffers++;
+    } else {
+        // Large blocks get their own allocation
+        buffer = clCreateBuffer(
+            pool->context,
+            pool->flags,
+            block_bytes,
+            NULL,
+            &errcode
+        );
+        h_errchk(errcode, "Creating a buffer pool block");
+        pool->bytes_reserved += block_bytes;
+        pool->num_device_allocs++;
+    }
+
+    pool->classes[buffer] = c;
+    pool->in_use.insert(buffer);
+    pool->bytes_in_use += block_bytes;
+    pool->peak_bytes_in_use = std::max(pool->peak_bytes_in_use, pool->bytes_in_use);
+    pool->peak_bytes_reserved = std::max(pool->peak_bytes_reserved, pool->bytes_reserved);
+    return buffer;
+}
+
+/// Return a buffer to the pool. Commands that use the buffer must be
+/// complete, or enqueued ahead of any later use on an in-order queue.
+void h_buffer_pool_release(h_buffer_pool_t* pool, cl_mem buffer) {
+    std::map<cl_mem, int>::iterator it = pool->classes.find(buffer);
+    assert(it != pool->classes.end());
+
+    // A block released twice would end up on the free list twice
+    if (pool->in_use.erase(buffer) == 0) {
+        std::printf("Error, buffer %p was released to the pool twice\n", (void*)buffer);
+        exit(EXIT_FAILURE);
+    }
+
+    int c = it->second;
+    pool->free_lists[c].push_back(buffer);
+    pool->bytes_in_use -= (size_t)1 << c;
+}
+
+/// Report usage and high-water marks for a buffer pool
+void h_report_buffer_pool(h_buffer_pool_t* pool) {
+    std::printf("Buffer pool: %zu acquires, %zu reused (%.1f%%)\n",
+            pool->num_acquires,
+            pool->num_reuses,
+            100.0*(double)pool->num_reuses/(double)std::max(pool->num_acquires, (size_t)1));
+    std::printf("\t%20s %zu, %zu sub-buffers\n", "device allocations:",
+            pool->num_device_allocs, pool->num_sub_buffers);
+    std::printf("\t%20s %.3f MB (peak %.3f MB)\n", "bytes in use:",
+            pool->bytes_in_use/1.0e6, pool->peak_bytes_in_use/1.0e6);
+    std::printf("\t%20s %.3f MB (peak %.3f MB)\n", "bytes reserved:",
+            pool->bytes_reserved/1.0e6, pool->peak_bytes_reserved/1.0e6);
+}
+
+/// Release all buffers in the pool and the pool itself
+void h_release_buffer_pool(h_buffer_pool_t* pool) {
+    // Sub-buffers must be released before their slabs
+    for (std::map<cl_mem, int>::iterator it = pool->classes.begin(); 
+            it != pool->classes.end(); it++) {
+        h_errchk(clReleaseMemObject(it->first), "Releasing a buffer pool block");
+    }
+    for (size_t n=0; n<pool->slabs.size(); n++) {
+        h_errchk(clReleaseMemObject(pool->slabs[n]), "Releasing a buffer pool slab");
+    }
+    delete pool;
+}
+
+/// Release command queues
+void h_release_command_queues(cl_command_queue *command_queues, cl_uint num_command_queues) {
+    // Finish and Release all command queues
+    for (cl_uint n = 0; n<num_command_queues; n++) {
+        // Wait for all commands in the 
+        // command queues to finish
+        h_errchk(
+            clFinish(command_queues[n]), 
+            "Finishing up command queues"
+        );
+        
+        // Now release the command queue
+        h_errchk(
+            clReleaseCommandQueue(command_queues[n]), 
+            "Releasing command queues"
+        );
+    }
+
+    // Now destroy the command queues
+    free(command_queues);
+}
+
+/// Release devices and contexts, works for contexts from
+/// both h_acquire_devices and h_acquire_devices_shared
 void h_release_devices(
         cl_device_id *devices,
         cl_uint num_devices,
@@ -816,6 +2019,128 @@ void h_release_devices(
     free(platforms);
 }
 
+/// Maximum number of dimensions in a kernel launch
+#define H_MAX_WORK_DIM 3
+
+/// Enqueue a kernel without blocking or allocating memory on the heap.
+/// global_size is enlarged internally to fit an integer number of local sizes.
+/// Returns the error code from clEnqueueNDRangeKernel.
+cl_int h_enqueue_kernel(
+    cl_command_queue command_queue,
+    cl_kernel kernel,
+    const size_t *local_size,
+    const size_t *global_size,
+    size_t ndim,
+    cl_uint num_events_in_wait_list,
+    const cl_event *event_wait_list,
+    cl_event *event) {
+
+    // Sort out the global size in a stack copy
+    assert(ndim <= H_MAX_WORK_DIM);
+    size_t new_global[H_MAX_WORK_DIM];
+    std::memcpy(new_global, global_size, ndim*sizeof(size_t));
+    if (local_size != NULL) {
+        h_fit_global_size(new_global, local_size, ndim);
+    }
+
+    return clEnqueueNDRangeKernel(
+        command_queue,
+        kernel,
+        (cl_uint)ndim,
+        NULL,
+        new_global,
+        local_size,
+        num_events_in_wait_list,
+        event_wait_list,
+        event);
+}
+
+/// A batch of profiled events whose timings are collected together
+struct h_event_batch_t {
+    // Events in the batch, NULL marks a launch that failed
+    cl_event* events;
+    // Number of events the batch can hold
+    size_t capacity;
+    // Number of events in the batch
+    size_t count;
+};
+
+/// Create an event batch that holds up to capacity events
+h_event_batch_t* h_create_event_batch(size_t capacity) {
+    h_event_batch_t* batch = (h_event_batch_t*)calloc(1, sizeof(h_event_batch_t));
+    batch->events = (cl_event*)calloc(capacity, sizeof(cl_event));
+    batch->capacity = capacity;
+    batch->count = 0;
+    return batch;
+}
+
+/// Add an event to a batch, the batch takes ownership of the event.
+/// Returns the index of the event within the batch.
+size_t h_event_batch_add(h_event_batch_t* batch, cl_event event) {
+    assert(batch->count < batch->capacity);
+    batch->events[batch->count] = event;
+    return batch->count++;
+}
+
+/// Wait once for every event in the batch, then fill times_ms with the
+/// elapsed time of each event in milliseconds (NaN for failed launches).
+/// The events are released and the batch is emptied.
+void h_event_batch_drain(h_event_batch_t* batch, cl_double* times_ms) {
+
+    // Wait on the valid events with a single call
+    cl_event* valid = (cl_event*)calloc(std::max(batch->count, (size_t)1), sizeof(cl_event));
+    cl_uint num_valid = 0;
+    for (size_t n=0; n<batch->count; n++) {
+        if (batch->events[n] != NULL) {
+            valid[num_valid++] = batch->events[n];
+        }
+    }
+    if (num_valid > 0) {
+        h_errchk(clWaitForEvents(num_valid, valid), "Waiting on an event batch");
+    }
+    free(valid);
+
+    for (size_t n=0; n<batch->count; n++) {
+        cl_event event = batch->events[n];
+        if (event == NULL) {
+            if (times_ms != NULL) times_ms[n] = nan("");
+            continue;
+        }
+
+        if (times_ms != NULL) {
+            // Start and end times in nanoseconds
+            cl_ulong t1, t2;
+            h_errchk(
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                    sizeof(cl_ulong), &t1, NULL),
+                "Fetching start time for event"
+            );
+            h_errchk(
+                clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+                    sizeof(cl_ulong), &t2, NULL),
+                "Fetching end time for event"
+            );
+            times_ms[n] = (cl_double)(t2-t1)*(cl_double)1.0e-6;
+        }
+
+        h_errchk(clReleaseEvent(event), "Releasing a batched event");
+        batch->events[n] = NULL;
+    }
+
+    batch->count = 0;
+}
+
+/// Release an event batch, releasing any events left in it
+void h_release_event_batch(h_event_batch_t* batch) {
+    for (size_t n=0; n<batch->count; n++) {
+        if (batch->events[n] != NULL) {
+            h_errchk(clReleaseEvent(batch->events[n]), "Releasing a batched event");
+        }
+    }
+    free(batch->events);
+    free(batch);
+}
+
 /// Run a kernel
 cl_double h_run_kernel(
     cl_command_queue command_queue,
@@ -829,13 +2154,14 @@ cl_double h_run_kernel(
     void* prep_data
     ) {
     
-    // Sort out the global size
-    size_t *new_global = (size_t*)malloc(ndim*sizeof(size_t));
+    // Sort out the global size in a stack copy
+    assert(ndim <= H_MAX_WORK_DIM);
+    size_t new_global[H_MAX_WORK_DIM];
     std::memcpy(new_global, global_size, ndim*sizeof(size_t));
     h_fit_global_size(new_global, local_size, ndim);
     
     // Event management
-    cl_event kernel_event;
+    cl_event kernel_event = NULL;
     
     // How much time did the kernel take?
     cl_double elapsed_msec=0.0;
@@ -849,13 +2175,12 @@ cl_double h_run_kernel(
     }
     
     // Enqueue the kernel
-    cl_int errcode_kernel = clEnqueueNDRangeKernel(
+    cl_int errcode_kernel = h_enqueue_kernel(
         command_queue,
         kernel,
-        ndim,
-        NULL,
-        new_global,
         local_size,
+        new_global,
+        ndim,
         0,
         NULL,
         &kernel_event);
@@ -870,8 +2195,10 @@ cl_double h_run_kernel(
         elapsed_msec = nan("");
     }
     
-    // Free allocated memory
-    free(new_global);
+    // Release the event
+    if ((errcode_kernel==CL_SUCCESS) && (kernel_event!=NULL)) {
+        h_errchk(clReleaseEvent(kernel_event), "Releasing kernel event");
+    }
     
     return(elapsed_msec);
 }
@@ -979,9 +2306,17 @@ void h_optimise_local(
         size_t nbytes_output = nexperiments*npoints*sizeof(cl_double);
         cl_double* output_local = (cl_double*)malloc(nbytes_output);
         
-        // Array to store the statistical timings for each experiment
-        cl_double* experiment_msec = new cl_double[nstats];
+        // Array to store the statistical timings for all experiments
+        cl_double* experiment_msec = new cl_double[nexperiments*nstats];
+        
+        // Does each experiment have a valid local size?
+        int* valid_experiment = new int[nexperiments];
+        
+        // Batch of kernel events, so the queue stays full 
+        // and timings are collected in a single drain step
+        h_event_batch_t* batch = h_create_event_batch(nexperiments*nstats);
         
+        // Enqueue every experiment without waiting
         for (int n=0; n<nexperiments; n++) {
             // Run the application
             size_t work_group_size = 1;
@@ -995,35 +2330,74 @@ void h_optimise_local(
                 valid_size*=(temp_local_size[i]<=max_size[i]);
             }
             
-            // Average and standard deviation
-            cl_double avg=0.0, stdev=0.0;
+            valid_experiment[n] = ((work_group_size <= max_work_group_size) && (valid_size > 0));
             
-            if ((work_group_size <= max_work_group_size) && (valid_size > 0)) {
-                // Run the experiment nstats times and get statistical information
+            if (valid_experiment[n]) {
+                // Run the experiment nstats times
                 // Command queue must have profiling enabled 
                 
-                // Run function pointer here 
+                // Sort out the global size in a stack copy
+                size_t new_global[H_MAX_WORK_DIM];
+                std::memcpy(new_global, global_size, ndim*sizeof(size_t));
+                h_fit_global_size(new_global, temp_local_size, ndim);
+                
+                // Prepare the kernel once per experiment, arguments 
+                // are captured when each kernel is enqueued
+                cl_int errcode_prep = CL_SUCCESS;
+                if (prep_kernel!=NULL) {
+                    errcode_prep = prep_kernel(kernel, temp_local_size, new_global, ndim, prep_data);
+                }
+                
                 for (int s=0; s<nstats; s++) {
-                    experiment_msec[s] = h_run_kernel(
-                        command_queue,
-                        kernel,
-                        temp_local_size,
-                        global_size,
-                        ndim,
-                        CL_TRUE,
-                        prep_kernel,
-                        prep_data
-                    );
+                    cl_event kernel_event = NULL;
+                    cl_int errcode_kernel = errcode_prep;
+                    if (errcode_prep == CL_SUCCESS) {
+                        errcode_kernel = h_enqueue_kernel(
+                            command_queue,
+                            kernel,
+                            temp_local_size,
+                            new_global,
+                            ndim,
+                            0,
+                            NULL,
+                            &kernel_event
+                        );
+                    }
+                    
+                    // Failed launches are recorded as NULL events
+                    if (errcode_kernel != CL_SUCCESS) {
+                        kernel_event = NULL;
+                    }
+                    h_event_batch_add(batch, kernel_event);
                 }
-
+            } else {
+                // Keep the batch aligned with the experiments
+                for (int s=0; s<nstats; s++) {
+                    h_event_batch_add(batch, NULL);
+                }
+            }
+        }
+        
+        // Collect all timings at once
+        h_event_batch_drain(batch, experiment_msec);
+        h_release_event_batch(batch);
+        
+        for (int n=0; n<nexperiments; n++) {
+            // Timings for this experiment
+            cl_double* times_msec = &experiment_msec[n*nstats];
+            
+            // Average and standard deviation
+            cl_double avg=0.0, stdev=0.0;
+            
+            if (valid_experiment[n]) {
                 // Calculate the average and standard deviation
                 for (int s=0; s<nstats; s++) {
-                    avg+=experiment_msec[s]+prior_times;
+                    avg+=times_msec[s]+prior_times;
                 }
                 avg/=(cl_double)nstats;
                 
                 for (int s=0; s<nstats; s++) {
-                    stdev+=((experiment_msec[s]-avg)*(experiment_msec[s]-avg));
+                    stdev+=((times_msec[s]-avg)*(times_msec[s]-avg));
                 }
                 stdev/=(cl_double)nstats;
                 stdev=sqrt(stdev);
@@ -1041,6 +2415,7 @@ void h_optimise_local(
         h_write_binary(output_local, "output_local.dat", nbytes_output); 
                             
         delete[] experiment_msec;
+        delete[] valid_experiment;
         free(output_local);
         free(input_local);
     } else {
@@ -1061,3 +2436,870 @@ void h_optimise_local(
     
     delete[] max_size;
 }
+
+/// Compile-time definitions used to specialise a kernel, 
+/// kept sorted so the same set always gives the same options
+typedef std::map<std::string, long> h_defines_t;
+
+/// In-process cache of programs and kernels built from one source,
+/// one entry per distinct set of compiler options
+struct h_variant_cache_t {
+    cl_context context;
+    cl_device_id device;
+    const char* source;
+    // Options added in front of every variant
+    std::string base_options;
+    // Programs keyed on options, kernels keyed on options and kernel name
+    std::map<std::string, cl_program> programs;
+    std::map<std::string, cl_kernel> kernels;
+    // Lookups served from the cache, builds, and time spent building
+    size_t hits;
+    size_t misses;
+    cl_double build_ms;
+};
+
+/// Create a cache of specialised variants of a kernel source
+h_variant_cache_t* h_create_variant_cache(
+        cl_context context,
+        cl_device_id device,
+        const char* source,
+        const char* base_options) {
+
+    h_variant_cache_t* cache = new h_variant_cache_t();
+    cache->context = context;
+    cache->device = device;
+    cache->source = source;
+    cache->base_options = (base_options != NULL) ? std::string(base_options) : "";
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->build_ms = 0.0;
+    return cache;
+}
+
+/// Compiler options that inject a set of definitions as -D flags
+std::string h_variant_options(h_variant_cache_t* cache, const h_defines_t& defines) {
+    std::string options = cache->base_options;
+    for (h_defines_t::const_iterator it = defines.begin(); it != defines.end(); it++) {
+        options += " -D " + it->first + "=" + std::to_string(it->second);
+    }
+    return options;
+}
+
+/// Get a kernel built with the given compiler options, building the program on first use
+cl_kernel h_get_variant_options(
+        h_variant_cache_t* cache,
+        const char* kernel_name,
+        const std::string& options) {
+
+    std::string key = options + "|" + kernel_name;
+    if (cache->kernels.count(key) > 0) {
+        cache->hits++;
+        return cache->kernels[key];
+    }
+    cache->misses++;
+
+    // Several kernels may come from one program
+    if (cache->programs.count(options) == 0) {
+        auto t1 = std::chrono::high_resolution_clock::now();
+        cache->programs[options] = h_build_program(
+            cache->source, cache->context, cache->device, options.c_str()
+        );
+        auto t2 = std::chrono::high_resolution_clock::now();
+        cache->build_ms += (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+    }
+
+    cl_int errcode;
+    cl_kernel kernel = clCreateKernel(cache->programs[options], kernel_name, &errcode);
+    h_errchk(errcode, "Creating a specialised kernel");
+    cache->kernels[key] = kernel;
+    return kernel;
+}
+
+/// Get a kernel specialised with a set of definitions, building it on first use
+cl_kernel h_get_variant(
+        h_variant_cache_t* cache,
+        const char* kernel_name,
+        const h_defines_t& defines) {
+    return h_get_variant_options(cache, kernel_name, h_variant_options(cache, defines));
+}
+
+/// Report how well the variant cache is doing
+void h_report_variant_cache(h_variant_cache_t* cache) {
+    std::printf("Variant cache: %zu programs, %zu hits, %zu misses, %.3f ms building\n",
+        cache->programs.size(), cache->hits, cache->misses, cache->build_ms);
+}
+
+/// Release a variant cache and every program and kernel it built
+void h_release_variant_cache(h_variant_cache_t* cache) {
+    for (std::map<std::string, cl_kernel>::iterator it = cache->kernels.begin();
+            it != cache->kernels.end(); it++) {
+        h_errchk(clReleaseKernel(it->second), "Releasing a specialised kernel");
+    }
+    for (std::map<std::string, cl_program>::iterator it = cache->programs.begin();
+            it != cache->programs.end(); it++) {
+        h_errchk(clReleaseProgram(it->second), "Releasing a specialised program");
+    }
+    delete cache;
+}
+
+/// Search strategies for the autotuner
+enum h_tune_strategy_t {
+    // Every configuration the device can run whose work-group size is a multiple
+    // of the kernel's preferred work-group size multiple, with early abort of clearly slow ones
+    H_TUNE_GRID,
+    // A random sample of valid configurations, with early abort
+    H_TUNE_RANDOM,
+    // Successive halving, the slower half is dropped after each round
+    // and the number of runs for the survivors is doubled
+    H_TUNE_HALVING
+};
+
+/// A compile-time parameter of a kernel, passed to the compiler as -D name=value
+struct h_tune_param_t {
+    std::string name;
+    std::vector<long> values;
+};
+
+/// Search space for the autotuner
+struct h_tune_space_t {
+    // Number of dimensions in the kernel
+    size_t ndim;
+    // Candidate local sizes along each dimension
+    std::vector<size_t> local[H_MAX_WORK_DIM];
+    // Compile-time parameters of the kernel
+    std::vector<h_tune_param_t> params;
+};
+
+/// A point in the search space and its measured time
+struct h_tune_config_t {
+    size_t local_size[H_MAX_WORK_DIM];
+    // One value for each compile-time parameter
+    std::vector<long> values;
+    // Average kernel time in milliseconds, NaN if the configuration failed
+    cl_double time_ms;
+};
+
+/// Function to set kernel arguments for a configuration and fill in the 
+/// global size. Returns CL_SUCCESS or an OpenCL error code.
+typedef cl_int (*h_tune_prep_t)(
+    cl_kernel kernel, 
+    const h_tune_config_t* config, 
+    size_t* global_size, 
+    void* data);
+
+/// State of the autotuner for one kernel on one device
+struct h_tuner_t {
+    cl_context context;
+    cl_device_id device;
+    // Command queue with profiling enabled
+    cl_command_queue command_queue;
+    // Source, kernel name, and base compiler options
+    const char* source;
+    std::string kernel_name;
+    std::string compiler_options;
+    // Search space and the function to prepare a kernel
+    h_tune_space_t space;
+    h_tune_prep_t prep;
+    void* prep_data;
+    // Programs and kernels built so far, one variant per configuration
+    h_variant_cache_t* variants;
+    // Number of configurations measured, and how many were aborted early
+    size_t num_measured;
+    size_t num_aborted;
+};
+
+/// File used for the tuning database, initialised from CL_HELPER_TUNE_DB
+const char* h_tune_db_file = (std::getenv("CL_HELPER_TUNE_DB") != NULL) 
+    ? std::getenv("CL_HELPER_TUNE_DB") : "tuning.db";
+
+/// Create an autotuner for a kernel in source
+h_tuner_t* h_create_tuner(
+        cl_context context,
+        cl_device_id device,
+        cl_command_queue command_queue,
+        const char* source,
+        const char* kernel_name,
+        const char* compiler_options,
+        h_tune_space_t* space,
+        h_tune_prep_t prep,
+        void* prep_data) {
+
+    assert(space->ndim <= H_MAX_WORK_DIM);
+
+    h_tuner_t* tuner = new h_tuner_t();
+    tuner->context = context;
+    tuner->device = device;
+    tuner->command_queue = command_queue;
+    tuner->source = source;
+    tuner->kernel_name = std::string(kernel_name);
+    tuner->compiler_options = (compiler_options != NULL) ? std::string(compiler_options) : "";
+    tuner->space = *space;
+    tuner->prep = prep;
+    tuner->prep_data = prep_data;
+    tuner->variants = h_create_variant_cache(context, device, source, NULL);
+    tuner->num_measured = 0;
+    tuner->num_aborted = 0;
+    return tuner;
+}
+
+/// Compiler options for a configuration
+std::string h_tune_options(h_tuner_t* tuner, const h_tune_config_t* config) {
+    std::string options = tuner->compiler_options;
+    for (size_t p=0; p<tuner->space.params.size(); p++) {
+        options += " -D " + tuner->space.params[p].name + "=" + std::to_string(config->values[p]);
+    }
+    return options;
+}
+
+/// Get the kernel for a configuration, building it on first use
+cl_kernel h_tuner_get_kernel(h_tuner_t* tuner, const h_tune_config_t* config) {
+    return h_get_variant_options(
+        tuner->variants, tuner->kernel_name.c_str(), h_tune_options(tuner, config)
+    );
+}
+
+/// List every configuration in the search space that the device can run
+std::vector<h_tune_config_t> h_tune_enumerate(h_tuner_t* tuner) {
+    h_tune_space_t* space = &tuner->space;
+
+    // Device limits on the local size
+    size_t max_work_group_size;
+    h_errchk(
+        clGetDeviceInfo(tuner->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, 
+            sizeof(size_t), &max_work_group_size, NULL),
+        "Max number of work-items a workgroup."
+    );
+    cl_uint max_work_dims;
+    h_errchk(
+        clGetDeviceInfo(tuner->device, CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS, 
+            sizeof(cl_uint), &max_work_dims, NULL),
+        "Max number of dimensions for local size."
+    );
+    std::vector<size_t> max_size(max_work_dims);
+    h_errchk(
+        clGetDeviceInfo(tuner->device, CL_DEVICE_MAX_WORK_ITEM_SIZES, 
+            max_work_dims*sizeof(size_t), max_size.data(), NULL),
+        "Max size for work items."
+    );
+
+    // Number of choices along every axis of the space
+    std::vector<size_t> extents;
+    for (size_t d=0; d<space->ndim; d++) {
+        extents.push_back(space->local[d].size());
+    }
+    for (size_t p=0; p<space->params.size(); p++) {
+        extents.push_back(space->params[p].values.size());
+    }
+
+    size_t total = 1;
+    for (size_t a=0; a<extents.size(); a++) {
+        total *= extents[a];
+    }
+
+    std::vector<h_tune_config_t> configs;
+    for (size_t index=0; index<total; index++) {
+        h_tune_config_t config;
+        config.time_ms = nan("");
+        config.values.resize(space->params.size());
+
+        // Unravel the index along each axis, the last axis is fastest
+        size_t remainder = index;
+        for (size_t a=extents.size(); a-->0;) {
+            size_t i = remainder % extents[a];
+            remainder /= extents[a];
+            if (a < space->ndim) {
+                config.local_size[a] = space->local[a][i];
+            } else {
+                config.values[a-space->ndim] = space->params[a-space->ndim].values[i];
+            }
+        }
+
+        // Prune local sizes the device can't run
+        size_t work_group_size = 1;
+        bool valid = true;
+        for (size_t d=0; d<space->ndim; d++) {
+            work_group_size *= config.local_size[d];
+            valid = valid && (config.local_size[d] <= max_size[d]);
+        }
+        if (valid && (work_group_size <= max_work_group_size)) {
+            configs.push_back(config);
+        }
+    }
+
+    return configs;
+}
+
+/// Prune configurations whose work-group size is not a multiple of the preferred 
+/// work-group size multiple of their kernel, such work-groups leave part of a 
+/// wavefront or SIMD lane set idle. If nothing would survive, nothing is pruned
+std::vector<h_tune_config_t> h_tune_prune(h_tuner_t* tuner, const std::vector<h_tune_config_t>& configs) {
+    std::vector<h_tune_config_t> pruned;
+    for (const h_tune_config_t& config : configs) {
+        size_t multiple;
+        h_errchk(
+            clGetKernelWorkGroupInfo(h_tuner_get_kernel(tuner, &config), tuner->device, 
+                CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                sizeof(size_t), &multiple, NULL),
+            "Getting the preferred work-group size multiple"
+        );
+        size_t work_group_size = 1;
+        for (size_t d=0; d<tuner->space.ndim; d++) {
+            work_group_size *= config.local_size[d];
+        }
+        if (work_group_size % std::max(multiple, (size_t)1) == 0) {
+            pruned.push_back(config);
+        }
+    }
+
+    if (pruned.size() == 0) {
+        return configs;
+    }
+    std::printf("Pruned the grid from %zu to %zu configurations\n", configs.size(), pruned.size());
+    return pruned;
+}
+
+/// Time a configuration with nruns launches after one untimed warmup launch, returns 
+/// the average time in milliseconds. If abort_ms > 0 and the first timed run 
+/// is slower than abort_ms the remaining runs are skipped.
+cl_double h_tune_measure(
+        h_tuner_t* tuner, 
+        h_tune_config_t* config, 
+        size_t nruns, 
+        cl_double abort_ms) {
+
+    tuner->num_measured++;
+    cl_kernel kernel = h_tuner_get_kernel(tuner, config);
+
+    // The kernel itself may limit the work-group size
+    size_t kernel_work_group_size, work_group_size = 1;
+    h_errchk(
+        clGetKernelWorkGroupInfo(kernel, tuner->device, CL_KERNEL_WORK_GROUP_SIZE,
+            sizeof(size_t), &kernel_work_group_size, NULL),
+        "Getting the kernel work-group size"
+    );
+    for (size_t d=0; d<tuner->space.ndim; d++) {
+        work_group_size *= config->local_size[d];
+    }
+    if (work_group_size > kernel_work_group_size) {
+        config->time_ms = nan("");
+        return config->time_ms;
+    }
+
+    // Set arguments and get the global size
+    size_t global_size[H_MAX_WORK_DIM] = {1, 1, 1};
+    if (tuner->prep(kernel, config, global_size, tuner->prep_data) != CL_SUCCESS) {
+        config->time_ms = nan("");
+        return config->time_ms;
+    }
+
+    // Untimed warmup, so that the first timed run of a freshly built
+    // variant does not carry cold-start costs into the early abort test
+    cl_event warmup_event = NULL;
+    if (h_enqueue_kernel(tuner->command_queue, kernel, config->local_size, global_size,
+            tuner->space.ndim, 0, NULL, &warmup_event) != CL_SUCCESS) {
+        // For example too much local memory was requested
+        config->time_ms = nan("");
+        return config->time_ms;
+    }
+    h_errchk(clWaitForEvents(1, &warmup_event), "Waiting for a warmup run");
+    h_errchk(clReleaseEvent(warmup_event), "Releasing a warmup event");
+
+    h_event_batch_t* batch = h_create_event_batch(nruns);
+    cl_double* times_ms = new cl_double[nruns];
+    cl_double total_ms = 0.0;
+    size_t completed = 0;
+
+    for (size_t r=0; r<nruns; r++) {
+        cl_event event = NULL;
+        cl_int errcode = h_enqueue_kernel(
+            tuner->command_queue, kernel, config->local_size, global_size,
+            tuner->space.ndim, 0, NULL, &event
+        );
+        if (errcode != CL_SUCCESS) {
+            // For example too much local memory was requested
+            h_event_batch_drain(batch, NULL);
+            completed = 0;
+            break;
+        }
+        h_event_batch_add(batch, event);
+
+        // Check the first run for early abort
+        if ((r == 0) || (r == nruns-1)) {
+            size_t nbatch = batch->count;
+            h_event_batch_drain(batch, times_ms);
+            for (size_t n=0; n<nbatch; n++) {
+                total_ms += times_ms[n];
+            }
+            completed = r+1;
+
+            if ((r == 0) && (abort_ms > 0.0) && (times_ms[0] > abort_ms)) {
+                tuner->num_aborted++;
+                break;
+            }
+        }
+    }
+
+    h_release_event_batch(batch);
+    delete [] times_ms;
+
+    config->time_ms = (completed > 0) ? total_ms/(cl_double)completed : nan("");
+    return config->time_ms;
+}
+
+/// Key of a kernel, problem, base compiler options, and device in the tuning database.
+/// The options are part of the key since a configuration tuned under one set 
+/// of -D flags may be a poor choice under another
+std::string h_tune_db_key(h_tuner_t* tuner, const char* problem_key) {
+    // Tabs and newlines separate fields and lines in the file
+    std::string options = tuner->compiler_options;
+    std::replace_if(options.begin(), options.end(), 
+        [](char c) { return (c == '\t') || (c == '\n') || (c == '\r'); }, ' ');
+    return tuner->kernel_name + "|" + std::string(problem_key) + "|"
+        + options + "|"
+        + h_get_device_string(tuner->device, CL_DEVICE_NAME) + "|"
+        + h_get_device_string(tuner->device, CL_DRIVER_VERSION);
+}
+
+/// Look up a configuration in the tuning database, the last entry for a key wins
+bool h_tune_db_load(h_tuner_t* tuner, const char* problem_key, h_tune_config_t* config) {
+    std::FILE *fp = std::fopen(h_tune_db_file, "r");
+    if (fp == NULL) {
+        return false;
+    }
+
+    std::string key = h_tune_db_key(tuner, problem_key);
+    size_t nparams = tuner->space.params.size();
+    bool found = false;
+
+    // Lines are key<TAB>local sizes<TAB>parameter values<TAB>time_ms
+    char line[4096];
+    while (std::fgets(line, sizeof(line), fp) != NULL) {
+        std::string entry(line);
+        size_t tab0 = entry.find('\t');
+        if ((tab0 == std::string::npos) || (entry.substr(0, tab0) != key)) {
+            continue;
+        }
+        size_t tab1 = entry.find('\t', tab0+1);
+        size_t tab2 = entry.find('\t', tab1+1);
+        if ((tab1 == std::string::npos) || (tab2 == std::string::npos)) {
+            continue;
+        }
+
+        h_tune_config_t candidate;
+        candidate.values.resize(nparams);
+        bool valid = true;
+
+        // Parse the local sizes
+        const char* ptr = entry.c_str()+tab0+1;
+        for (size_t d=0; d<tuner->space.ndim; d++) {
+            char* end;
+            candidate.local_size[d] = (size_t)std::strtoul(ptr, &end, 10);
+            valid = valid && (end != ptr);
+            ptr = (*end == ',') ? end+1 : end;
+        }
+
+        // Parse the parameter values
+        ptr = entry.c_str()+tab1+1;
+        for (size_t p=0; p<nparams; p++) {
+            char* end;
+            candidate.values[p] = std::strtol(ptr, &end, 10);
+            valid = valid && (end != ptr);
+            ptr = (*end == ',') ? end+1 : end;
+        }
+
+        candidate.time_ms = std::atof(entry.c_str()+tab2+1);
+
+        if (valid) {
+            *config = candidate;
+            found = true;
+        }
+    }
+
+    std::fclose(fp);
+    return found;
+}
+
+/// Append a configuration to the tuning database
+void h_tune_db_store(h_tuner_t* tuner, const char* problem_key, const h_tune_config_t* config) {
+    std::FILE *fp = std::fopen(h_tune_db_file, "a");
+    if (fp == NULL) {
+        std::printf("Warning, could not write tuning database %s\n", h_tune_db_file);
+        return;
+    }
+
+    std::fprintf(fp, "%s\t", h_tune_db_key(tuner, problem_key).c_str());
+    for (size_t d=0; d<tuner->space.ndim; d++) {
+        std::fprintf(fp, "%s%zu", (d>0) ? "," : "", config->local_size[d]);
+    }
+    std::fprintf(fp, "\t");
+    for (size_t p=0; p<config->values.size(); p++) {
+        std::fprintf(fp, "%s%ld", (p>0) ? "," : "", config->values[p]);
+    }
+    std::fprintf(fp, "\t%.6f\n", config->time_ms);
+    std::fclose(fp);
+}
+
+/// Print a configuration
+void h_tune_report(h_tuner_t* tuner, const h_tune_config_t* config) {
+    std::printf("local size (");
+    for (size_t d=0; d<tuner->space.ndim; d++) {
+        std::printf("%s%zu", (d>0) ? "," : "", config->local_size[d]);
+    }
+    std::printf(")");
+    for (size_t p=0; p<config->values.size(); p++) {
+        std::printf(", %s=%ld", tuner->space.params[p].name.c_str(), config->values[p]);
+    }
+    std::printf(", %.3f ms\n", config->time_ms);
+}
+
+/// Is configuration a faster than configuration b? NaN times are never faster.
+bool h_tune_faster(const h_tune_config_t& a, const h_tune_config_t& b) {
+    if (std::isnan(a.time_ms)) return false;
+    if (std::isnan(b.time_ms)) return true;
+    return a.time_ms < b.time_ms;
+}
+
+/// Find the fastest configuration for a kernel. If use_db is CL_TRUE 
+/// and the tuning database has an entry for this kernel, problem, and device,
+/// it is used without searching. New results are added to the database.
+/// max_configs limits the number of configurations tried by H_TUNE_RANDOM 
+/// and H_TUNE_HALVING, use 0 for no limit.
+h_tune_config_t h_tune(
+        h_tuner_t* tuner,
+        h_tune_strategy_t strategy,
+        size_t nstats,
+        size_t max_configs,
+        const char* problem_key,
+        cl_bool use_db) {
+
+    h_tune_config_t best;
+
+    // Reuse an earlier result if we have one
+    if ((use_db == CL_TRUE) && h_tune_db_load(tuner, problem_key, &best)) {
+        std::printf("Loaded tuned configuration from %s: ", h_tune_db_file);
+        h_tune_report(tuner, &best);
+        return best;
+    }
+
+    std::vector<h_tune_config_t> configs = h_tune_enumerate(tuner);
+    assert(configs.size() > 0);
+    if (strategy == H_TUNE_GRID) {
+        configs = h_tune_prune(tuner, configs);
+    }
+
+    // Sample a random subset of the configurations, with a fixed seed
+    if ((strategy != H_TUNE_GRID) && (max_configs > 0) && (configs.size() > max_configs)) {
+        std::mt19937 gen(100);
+        std::shuffle(configs.begin(), configs.end(), gen);
+        configs.resize(max_configs);
+    }
+
+    // Configurations this much slower than the best are aborted early
+    const cl_double abort_factor = 2.0;
+
+    if (strategy == H_TUNE_HALVING) {
+        size_t nruns = 1;
+        while (configs.size() > 1) {
+            for (size_t n=0; n<configs.size(); n++) {
+                h_tune_measure(tuner, &configs[n], nruns, 0.0);
+            }
+            std::stable_sort(configs.begin(), configs.end(), h_tune_faster);
+
+            // Keep the faster half, with more runs each round
+            configs.resize((configs.size()+1)/2);
+            nruns = std::min(2*nruns, nstats);
+        }
+        h_tune_measure(tuner, &configs[0], nstats, 0.0);
+        best = configs[0];
+    } else {
+        best = configs[0];
+        best.time_ms = nan("");
+        for (size_t n=0; n<configs.size(); n++) {
+            cl_double abort_ms = std::isnan(best.time_ms) ? 0.0 : abort_factor*best.time_ms;
+            h_tune_measure(tuner, &configs[n], nstats, abort_ms);
+            if (h_tune_faster(configs[n], best)) {
+                best = configs[n];
+            }
+        }
+    }
+
+    std::printf("Measured %zu configurations, %zu aborted early\n", 
+            tuner->num_measured, tuner->num_aborted);
+    std::printf("Best configuration: ");
+    h_tune_report(tuner, &best);
+
+    if (!std::isnan(best.time_ms)) {
+        h_tune_db_store(tuner, problem_key, &best);
+    }
+
+    return best;
+}
+
+/// Release an autotuner and all the programs and kernels it built
+void h_release_tuner(h_tuner_t* tuner) {
+    h_release_variant_cache(tuner->variants);
+    delete tuner;
+}
+
+/// Source for the kernels that compare a result buffer against a reference
+const char* h_validate_source = R"(
+#ifdef H_USE_DOUBLE
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double h_real;
+#else
+typedef float h_real;
+#endif
+
+// Each work-group reduces part of the arrays to one set of partial results,
+// scratch_real is of size (3, L0), scratch_uint of size (2, L0)
+__kernel void h_compare(
+        __global const h_real* result,
+        __global const h_real* reference,
+        ulong n,
+        __local h_real* scratch_real,
+        __local uint* scratch_uint,
+        __global h_real* partial_real,
+        __global uint* partial_uint) {
+
+    size_t L0 = get_local_size(0);
+    size_t s0 = get_local_id(0);
+
+    // Maximum absolute difference, squared differences, squared reference
+    h_real max_diff = 0, sum_diff = 0, sum_ref = 0;
+    // Number of NaN and Inf values in the result
+    uint num_nan = 0, num_inf = 0;
+
+    for (size_t i = get_global_id(0); i < n; i += get_global_size(0)) {
+        h_real r = result[i];
+        h_real f = reference[i];
+        if (isnan(r)) {
+            num_nan++;
+        } else if (isinf(r)) {
+            num_inf++;
+        } else {
+            h_real d = fabs(r-f);
+            max_diff = fmax(max_diff, d);
+            sum_diff += d*d;
+            sum_ref += f*f;
+        }
+    }
+
+    scratch_real[s0] = max_diff;
+    scratch_real[L0+s0] = sum_diff;
+    scratch_real[2*L0+s0] = sum_ref;
+    scratch_uint[s0] = num_nan;
+    scratch_uint[L0+s0] = num_inf;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Tree reduction, L0 is a power of two
+    for (size_t stride = L0/2; stride > 0; stride /= 2) {
+        if (s0 < stride) {
+            scratch_real[s0] = fmax(scratch_real[s0], scratch_real[s0+stride]);
+            scratch_real[L0+s0] += scratch_real[L0+s0+stride];
+            scratch_real[2*L0+s0] += scratch_real[2*L0+s0+stride];
+            scratch_uint[s0] += scratch_uint[s0+stride];
+            scratch_uint[L0+s0] += scratch_uint[L0+s0+stride];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (s0 == 0) {
+        size_t g = get_group_id(0);
+        size_t G = get_num_groups(0);
+        partial_real[g] = scratch_real[0];
+        partial_real[G+g] = scratch_real[L0];
+        partial_real[2*G+g] = scratch_real[2*L0];
+        partial_uint[g] = scratch_uint[0];
+        partial_uint[G+g] = scratch_uint[L0];
+    }
+}
+)";
+
+/// Results of comparing a result buffer against a reference buffer
+struct h_validation_t {
+    // Maximum absolute difference (infinity norm)
+    cl_double max_error;
+    // L2 norm of the difference, and L2 norm of the reference
+    cl_double l2_error;
+    cl_double l2_reference;
+    // Number of NaN and Inf values in the result
+    cl_ulong num_nan;
+    cl_ulong num_inf;
+};
+
+/// Kernels and scratch space for comparing buffers on a device
+struct h_validator_t {
+    cl_context context;
+    cl_device_id device;
+    // Programs and kernels for float and double, double is NULL without fp64
+    cl_program programs[2];
+    cl_kernel kernels[2];
+    // Number of work-groups, and the work-group size of each kernel
+    size_t num_groups;
+    size_t local_size[2];
+    // Partial results from each work-group
+    cl_mem partial_real_d;
+    cl_mem partial_uint_d;
+};
+
+/// Create a validator for a device
+h_validator_t* h_create_validator(cl_context context, cl_device_id device) {
+    cl_int errcode;
+    h_validator_t* validator = new h_validator_t();
+    validator->context = context;
+    validator->device = device;
+
+    // Float kernel always, double kernel only if the device supports it
+    validator->programs[0] = h_build_program(h_validate_source, context, device, NULL);
+    validator->kernels[0] = clCreateKernel(validator->programs[0], "h_compare", &errcode);
+    h_errchk(errcode, "Creating the float validation kernel");
+
+    validator->programs[1] = NULL;
+    validator->kernels[1] = NULL;
+    std::string extensions = h_get_device_string(device, CL_DEVICE_EXTENSIONS);
+    if (extensions.find("cl_khr_fp64") != std::string::npos) {
+        validator->programs[1] = h_build_program(h_validate_source, context, device, "-D H_USE_DOUBLE");
+        validator->kernels[1] = clCreateKernel(validator->programs[1], "h_compare", &errcode);
+        h_errchk(errcode, "Creating the double validation kernel");
+    }
+
+    // Largest power of two work-group size up to 256 each kernel can use,
+    // the double kernel may be limited more by its registers
+    for (int k=0; k<2; k++) {
+        validator->local_size[k] = 1;
+        if (validator->kernels[k] == NULL) continue;
+        size_t kernel_work_group_size;
+        h_errchk(
+            clGetKernelWorkGroupInfo(validator->kernels[k], device, CL_KERNEL_WORK_GROUP_SIZE,
+                sizeof(size_t), &kernel_work_group_size, NULL),
+            "Getting the validation kernel work-group size"
+        );
+        while ((2*validator->local_size[k] <= kernel_work_group_size) && (validator->local_size[k] < 256)) {
+            validator->local_size[k] *= 2;
+        }
+    }
+
+    // A few work-groups per compute unit
+    cl_uint compute_units;
+    h_errchk(
+        clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+            sizeof(cl_uint), &compute_units, NULL),
+        "Getting the number of compute units"
+    );
+    validator->num_groups = std::min((size_t)4*compute_units, (size_t)1024);
+
+    // Room for doubles even when comparing floats
+    validator->partial_real_d = clCreateBuffer(context, CL_MEM_READ_WRITE,
+        3*validator->num_groups*sizeof(cl_double), NULL, &errcode);
+    h_errchk(errcode, "Creating the validation partial buffer");
+    validator->partial_uint_d = clCreateBuffer(context, CL_MEM_READ_WRITE,
+        2*validator->num_groups*sizeof(cl_uint), NULL, &errcode);
+    h_errchk(errcode, "Creating the validation count buffer");
+
+    return validator;
+}
+
+/// Compare n elements of result against reference on the device, only
+/// the partial results of each work-group are copied back to the host.
+/// Set is_double to CL_TRUE for buffers of doubles.
+h_validation_t h_validate(
+        h_validator_t* validator,
+        cl_command_queue command_queue,
+        cl_mem result,
+        cl_mem reference,
+        size_t n,
+        cl_bool is_double) {
+
+    cl_kernel kernel = validator->kernels[(is_double == CL_TRUE) ? 1 : 0];
+    assert(kernel != NULL);
+
+    size_t nbytes_real = (is_double == CL_TRUE) ? sizeof(cl_double) : sizeof(cl_float);
+    size_t L0 = validator->local_size[(is_double == CL_TRUE) ? 1 : 0];
+    size_t G = validator->num_groups;
+    cl_ulong n_ul = (cl_ulong)n;
+
+    H_ERRCHK(clSetKernelArg(kernel, 0, sizeof(cl_mem), &result));
+    H_ERRCHK(clSetKernelArg(kernel, 1, sizeof(cl_mem), &reference));
+    H_ERRCHK(clSetKernelArg(kernel, 2, sizeof(cl_ulong), &n_ul));
+    H_ERRCHK(clSetKernelArg(kernel, 3, 3*L0*nbytes_real, NULL));
+    H_ERRCHK(clSetKernelArg(kernel, 4, 2*L0*sizeof(cl_uint), NULL));
+    H_ERRCHK(clSetKernelArg(kernel, 5, sizeof(cl_mem), &validator->partial_real_d));
+    H_ERRCHK(clSetKernelArg(kernel, 6, sizeof(cl_mem), &validator->partial_uint_d));
+
+    size_t global_size = G*L0;
+    H_ERRCHK(
+        clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL,
+            &global_size, &L0, 0, NULL, NULL)
+    );
+
+    // Copy back the partial results
+    char* partial_real = (char*)calloc(3*G, nbytes_real);
+    cl_uint* partial_uint = (cl_uint*)calloc(2*G, sizeof(cl_uint));
+    H_ERRCHK(
+        clEnqueueReadBuffer(command_queue, validator->partial_real_d, CL_FALSE,
+            0, 3*G*nbytes_real, partial_real, 0, NULL, NULL)
+    );
+    H_ERRCHK(
+        clEnqueueReadBuffer(command_queue, validator->partial_uint_d, CL_TRUE,
+            0, 2*G*sizeof(cl_uint), partial_uint, 0, NULL, NULL)
+    );
+
+    // Finish the reduction on the host
+    h_validation_t validation = {0.0, 0.0, 0.0, 0, 0};
+    for (size_t g=0; g<G; g++) {
+        cl_double values[3];
+        for (size_t k=0; k<3; k++) {
+            if (is_double == CL_TRUE) {
+                values[k] = ((cl_double*)partial_real)[k*G+g];
+            } else {
+                values[k] = (cl_double)((cl_float*)partial_real)[k*G+g];
+            }
+        }
+        validation.max_error = std::fmax(validation.max_error, values[0]);
+        validation.l2_error += values[1];
+        validation.l2_reference += values[2];
+        validation.num_nan += partial_uint[g];
+        validation.num_inf += partial_uint[G+g];
+    }
+    validation.l2_error = std::sqrt(validation.l2_error);
+    validation.l2_reference = std::sqrt(validation.l2_reference);
+
+    free(partial_real);
+    free(partial_uint);
+
+    return validation;
+}
+
+/// Device-side counterpart of m_max_error, compares two buffers of 
+/// (len0, len1) elements and prints the maximum absolute difference
+cl_double h_max_error(
+        h_validator_t* validator,
+        cl_command_queue command_queue,
+        cl_mem result,
+        cl_mem reference,
+        size_t len0,
+        size_t len1,
+        cl_bool is_double) {
+
+    h_validation_t validation = h_validate(validator, command_queue, result, reference, len0*len1, is_double);
+
+    std::cout << "Maximum error (infinity norm) is: " << validation.max_error << "\n";
+    if (validation.num_nan + validation.num_inf > 0) {
+        std::cout << "Result has " << validation.num_nan << " NaN and " 
+            << validation.num_inf << " Inf values\n";
+    }
+    return validation.max_error;
+}
+
+/// Release a validator
+void h_release_validator(h_validator_t* validator) {
+    for (int k=0; k<2; k++) {
+        if (validator->kernels[k] != NULL) {
+            h_errchk(clReleaseKernel(validator->kernels[k]), "Releasing a validation kernel");
+            h_errchk(clReleaseProgram(validator->programs[k]), "Releasing a validation program");
+        }
+    }
+    h_errchk(clReleaseMemObject(validator->partial_real_d), "Releasing validation partials");
+    h_errchk(clReleaseMemObject(validator->partial_uint_d), "Releasing validation counts");
+    delete validator;
+}
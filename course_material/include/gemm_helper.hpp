@@ -0,0 +1,1155 @@
+///
+/// @file  gemm_helper.hpp
+///
+/// @brief Matrix multiplication (GEMM) kernels and host functions for OpenCL.
+///
+/// Include this file after cl_helper.hpp.
+///
+/// Written by Dr. Toby Potter
+/// for the Commonwealth Scientific and Industrial Research Organisation of Australia (CSIRO).
+///
+
+#include <deque>
+
+/// Side length of the square tiles used by mat_mult_general
+#define H_GEMM_TILE 16
+
+/// Whether an operand of h_gemm is used as stored or transposed
+enum h_gemm_op_t {H_GEMM_N=0, H_GEMM_T=1};
+
+/// Epilogue steps that h_gemm can fuse, combine with |
+enum h_gemm_epilogue_t {H_GEMM_NONE=0, H_GEMM_BIAS=1, H_GEMM_RELU=2, H_GEMM_SCALE=4};
+
+/// Source for the GEMM kernel family
+const char* h_gemm_source = R"(
+
+// Epilogue flags, these match h_gemm_epilogue_t
+#define H_GEMM_BIAS 1
+#define H_GEMM_RELU 2
+#define H_GEMM_SCALE 4
+
+// Batched matrix multiply, matrix b of the batch starts
+// b*stride elements into each buffer
+__kernel void mat_mult_batched_strided (
+                        __global float* A,
+                        __global float* B,
+                        __global float* C,
+                        unsigned int N1_A,
+                        unsigned int N0_C,
+                        unsigned int N1_C,
+                        unsigned int batch,
+                        ulong stride_A,
+                        ulong stride_B,
+                        ulong stride_C) {
+
+    // A is of size (batch, N0_C, N1_A)
+    // B is of size (batch, N1_A, N1_C)
+    // C is of size (batch, N0_C, N1_C)
+
+    // i0 and i1 represent the coordinates in Matrix C,
+    // b is the index within the batch
+    size_t i1=get_global_id(0); // Fastest dimension
+    size_t i0=get_global_id(1);
+    size_t b=get_global_id(2);
+
+    // Make sure we stay in bounds
+    if ((i0<N0_C) && (i1<N1_C) && (b<batch)) {
+        __global float* A_b = &A[b*stride_A];
+        __global float* B_b = &B[b*stride_B];
+
+        // Loop over columns of A and rows of B
+        float temp=0.0f;
+        for (size_t n=0; n<N1_A; n++) {
+            temp+=A_b[i0*N1_A+n]*B_b[n*N1_C+i1];
+        }
+
+        // Put the accumulated value into position
+        C[b*stride_C+i0*N1_C+i1]=temp;
+    }
+}
+
+// Batched matrix multiply where matrix b of the batch starts at
+// element offsets_A[b], offsets_B[b], offsets_C[b] of each buffer.
+// This is the buffer equivalent of an array of pointers.
+__kernel void mat_mult_batched_offsets (
+                        __global float* A,
+                        __global float* B,
+                        __global float* C,
+                        unsigned int N1_A,
+                        unsigned int N0_C,
+                        unsigned int N1_C,
+                        unsigned int batch,
+                        __global ulong* offsets_A,
+                        __global ulong* offsets_B,
+                        __global ulong* offsets_C) {
+
+    size_t i1=get_global_id(0); // Fastest dimension
+    size_t i0=get_global_id(1);
+    size_t b=get_global_id(2);
+
+    // Make sure we stay in bounds
+    if ((i0<N0_C) && (i1<N1_C) && (b<batch)) {
+        __global float* A_b = &A[offsets_A[b]];
+        __global float* B_b = &B[offsets_B[b]];
+
+        // Loop over columns of A and rows of B
+        float temp=0.0f;
+        for (size_t n=0; n<N1_A; n++) {
+            temp+=A_b[i0*N1_A+n]*B_b[n*N1_C+i1];
+        }
+
+        // Put the accumulated value into position
+        C[offsets_C[b]+i0*N1_C+i1]=temp;
+    }
+}
+// General matrix multiply C = alpha*op(A)*op(B) + beta*C,
+// followed by an optional epilogue, using local memory tiles.
+// op(A) is of size (N0_C, N1_A) and op(B) is of size (N1_A, N1_C).
+// With trans_A set A is stored as (N1_A, N0_C), with trans_B set
+// B is stored as (N1_C, N1_A). The epilogue adds bias[i1], multiplies
+// elementwise by scale[i0*N1_C+i1], then applies ReLU, in that order.
+// The work-group must be of size (H_GEMM_TILE, H_GEMM_TILE).
+__kernel void mat_mult_general (
+                        __global float* A,
+                        __global float* B,
+                        __global float* C,
+                        unsigned int N1_A,
+                        unsigned int N0_C,
+                        unsigned int N1_C,
+                        unsigned int trans_A,
+                        unsigned int trans_B,
+                        float alpha,
+                        float beta,
+                        unsigned int epilogue,
+                        __global float* bias,
+                        __global float* scale) {
+
+    // Tiles of op(A) and op(B), padded to avoid bank conflicts
+    __local float shared_A[H_GEMM_TILE][H_GEMM_TILE+1];
+    __local float shared_B[H_GEMM_TILE][H_GEMM_TILE+1];
+
+    // Local and global coordinates in C
+    size_t l1=get_local_id(0); // Fastest dimension
+    size_t l0=get_local_id(1);
+    size_t i1=get_global_id(0);
+    size_t i0=get_global_id(1);
+
+    // First row and column of C for this work-group
+    size_t g0=get_group_id(1)*H_GEMM_TILE;
+    size_t g1=get_group_id(0)*H_GEMM_TILE;
+
+    float temp=0.0f;
+
+    for (size_t k=0; k<N1_A; k+=H_GEMM_TILE) {
+
+        // Fill the tile of op(A), reading along the fastest
+        // dimension of A in memory so loads stay coalesced
+        if (trans_A) {
+            size_t row=g0+l1, col=k+l0;
+            shared_A[l1][l0] = ((row<N0_C) && (col<N1_A)) ? A[col*N0_C+row] : 0.0f;
+        } else {
+            size_t row=g0+l0, col=k+l1;
+            shared_A[l0][l1] = ((row<N0_C) && (col<N1_A)) ? A[row*N1_A+col] : 0.0f;
+        }
+
+        // Fill the tile of op(B) in the same manner
+        if (trans_B) {
+            size_t row=k+l1, col=g1+l0;
+            shared_B[l1][l0] = ((row<N1_A) && (col<N1_C)) ? B[col*N1_A+row] : 0.0f;
+        } else {
+            size_t row=k+l0, col=g1+l1;
+            shared_B[l0][l1] = ((row<N1_A) && (col<N1_C)) ? B[row*N1_C+col] : 0.0f;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        // Accumulate the contribution from this pair of tiles
+        for (size_t n=0; n<H_GEMM_TILE; n++) {
+            temp+=shared_A[l0][n]*shared_B[n][l1];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    // Make sure we stay in bounds
+    if ((i0<N0_C) && (i1<N1_C)) {
+        size_t offset=i0*N1_C+i1;
+
+        // C is not read when beta is zero, so it may hold anything
+        float value=alpha*temp;
+        if (beta!=0.0f) value+=beta*C[offset];
+
+        // Fused epilogue
+        if (epilogue & H_GEMM_BIAS) value+=bias[i1];
+        if (epilogue & H_GEMM_SCALE) value*=scale[offset];
+        if (epilogue & H_GEMM_RELU) value=fmax(value, 0.0f);
+
+        C[offset]=value;
+    }
+}
+)";
+
+/// Program and kernels of the GEMM family for one device
+struct h_gemm_t {
+    cl_context context;
+    cl_device_id device;
+    cl_program program;
+    cl_kernel batched_strided;
+    cl_kernel batched_offsets;
+    cl_kernel general;
+};
+
+/// Build the GEMM kernels for a device
+h_gemm_t* h_create_gemm(cl_context context, cl_device_id device, const char* compiler_options) {
+    cl_int errcode;
+    h_gemm_t* gemm = new h_gemm_t();
+    gemm->context = context;
+    gemm->device = device;
+
+    // Tile size is shared between the host and the kernels
+    std::string options = "-D H_GEMM_TILE=" + std::to_string(H_GEMM_TILE);
+    if (compiler_options != NULL) {
+        options += std::string(" ") + compiler_options;
+    }
+    gemm->program = h_build_program(h_gemm_source, context, device, options.c_str());
+
+    gemm->batched_strided = clCreateKernel(gemm->program, "mat_mult_batched_strided", &errcode);
+    h_errchk(errcode, "Creating the strided batched GEMM kernel");
+    gemm->batched_offsets = clCreateKernel(gemm->program, "mat_mult_batched_offsets", &errcode);
+    h_errchk(errcode, "Creating the offset batched GEMM kernel");
+    gemm->general = clCreateKernel(gemm->program, "mat_mult_general", &errcode);
+    h_errchk(errcode, "Creating the general GEMM kernel");
+
+    return gemm;
+}
+
+/// Round n up to a multiple of m, the local size 
+/// may be larger than a small problem
+size_t h_gemm_round_up(size_t n, size_t m) {
+    return ((n+m-1)/m)*m;
+}
+
+/// Choose a local size for a batch of small matrices,
+/// so that a work-group can span several matrices of the batch
+void h_gemm_batched_local_size(size_t N0_C, size_t N1_C, size_t batch, size_t* local_size) {
+
+    // Smallest power of two that covers each dimension, up to 16
+    local_size[0] = 1;
+    while ((local_size[0] < N1_C) && (local_size[0] < 16)) local_size[0] *= 2;
+    local_size[1] = 1;
+    while ((local_size[1] < N0_C) && (local_size[1] < 16)) local_size[1] *= 2;
+
+    // Fill up to 64 work-items with matrices from the batch
+    local_size[2] = 1;
+    while ((local_size[0]*local_size[1]*local_size[2] < 64) && (local_size[2] < batch)) {
+        local_size[2] *= 2;
+    }
+}
+
+/// Enqueue a strided batched multiplication C[b] = A[b]*B[b] for b in [0, batch)
+cl_int h_gemm_batched_strided(
+        h_gemm_t* gemm,
+        cl_command_queue command_queue,
+        cl_mem A,
+        cl_mem B,
+        cl_mem C,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C,
+        cl_uint batch,
+        cl_ulong stride_A,
+        cl_ulong stride_B,
+        cl_ulong stride_C,
+        cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list,
+        cl_event* event) {
+
+    cl_kernel kernel = gemm->batched_strided;
+    cl_int errcode = CL_SUCCESS;
+    errcode |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &A);
+    errcode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &B);
+    errcode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &C);
+    errcode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A);
+    errcode |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C);
+    errcode |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C);
+    errcode |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &batch);
+    errcode |= clSetKernelArg(kernel, 7, sizeof(cl_ulong), &stride_A);
+    errcode |= clSetKernelArg(kernel, 8, sizeof(cl_ulong), &stride_B);
+    errcode |= clSetKernelArg(kernel, 9, sizeof(cl_ulong), &stride_C);
+    if (errcode != CL_SUCCESS) return errcode;
+
+    size_t local_size[3];
+    h_gemm_batched_local_size(N0_C, N1_C, batch, local_size);
+    size_t global_size[] = {
+        h_gemm_round_up(N1_C, local_size[0]),
+        h_gemm_round_up(N0_C, local_size[1]),
+        h_gemm_round_up(batch, local_size[2])
+    };
+
+    return h_enqueue_kernel(command_queue, kernel, local_size, global_size, 3,
+        num_events_in_wait_list, event_wait_list, event);
+}
+
+/// Enqueue a batched multiplication where matrix b of the batch starts at
+/// element offsets_A[b], offsets_B[b], and offsets_C[b] of A, B, and C.
+/// The offsets are buffers of batch cl_ulong values.
+cl_int h_gemm_batched_offsets(
+        h_gemm_t* gemm,
+        cl_command_queue command_queue,
+        cl_mem A,
+        cl_mem B,
+        cl_mem C,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C,
+        cl_uint batch,
+        cl_mem offsets_A,
+        cl_mem offsets_B,
+        cl_mem offsets_C,
+        cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list,
+        cl_event* event) {
+
+    cl_kernel kernel = gemm->batched_offsets;
+    cl_int errcode = CL_SUCCESS;
+    errcode |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &A);
+    errcode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &B);
+    errcode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &C);
+    errcode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A);
+    errcode |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C);
+    errcode |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C);
+    errcode |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &batch);
+    errcode |= clSetKernelArg(kernel, 7, sizeof(cl_mem), &offsets_A);
+    errcode |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &offsets_B);
+    errcode |= clSetKernelArg(kernel, 9, sizeof(cl_mem), &offsets_C);
+    if (errcode != CL_SUCCESS) return errcode;
+
+    size_t local_size[3];
+    h_gemm_batched_local_size(N0_C, N1_C, batch, local_size);
+    size_t global_size[] = {
+        h_gemm_round_up(N1_C, local_size[0]),
+        h_gemm_round_up(N0_C, local_size[1]),
+        h_gemm_round_up(batch, local_size[2])
+    };
+
+    return h_enqueue_kernel(command_queue, kernel, local_size, global_size, 3,
+        num_events_in_wait_list, event_wait_list, event);
+}
+
+/// Enqueue C = alpha*op(A)*op(B) + beta*C followed by a fused epilogue.
+/// op(A) is (N0_C, N1_A) and op(B) is (N1_A, N1_C) after any transpose.
+/// bias holds N1_C values and scale holds N0_C*N1_C values,
+/// either may be NULL when the matching epilogue flag is not set.
+cl_int h_gemm(
+        h_gemm_t* gemm,
+        cl_command_queue command_queue,
+        h_gemm_op_t trans_A,
+        h_gemm_op_t trans_B,
+        cl_mem A,
+        cl_mem B,
+        cl_mem C,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C,
+        cl_float alpha,
+        cl_float beta,
+        cl_uint epilogue,
+        cl_mem bias,
+        cl_mem scale,
+        cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list,
+        cl_event* event) {
+
+    // Every buffer the epilogue touches must be present
+    if (((epilogue & H_GEMM_BIAS) && (bias == NULL)) ||
+        ((epilogue & H_GEMM_SCALE) && (scale == NULL))) {
+        return CL_INVALID_MEM_OBJECT;
+    }
+
+    cl_kernel kernel = gemm->general;
+    cl_uint op_A = (cl_uint)trans_A, op_B = (cl_uint)trans_B;
+    cl_int errcode = CL_SUCCESS;
+    errcode |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &A);
+    errcode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &B);
+    errcode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &C);
+    errcode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A);
+    errcode |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C);
+    errcode |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C);
+    errcode |= clSetKernelArg(kernel, 6, sizeof(cl_uint), &op_A);
+    errcode |= clSetKernelArg(kernel, 7, sizeof(cl_uint), &op_B);
+    errcode |= clSetKernelArg(kernel, 8, sizeof(cl_float), &alpha);
+    errcode |= clSetKernelArg(kernel, 9, sizeof(cl_float), &beta);
+    errcode |= clSetKernelArg(kernel, 10, sizeof(cl_uint), &epilogue);
+    errcode |= clSetKernelArg(kernel, 11, sizeof(cl_mem), &bias);
+    errcode |= clSetKernelArg(kernel, 12, sizeof(cl_mem), &scale);
+    if (errcode != CL_SUCCESS) return errcode;
+
+    size_t local_size[] = {H_GEMM_TILE, H_GEMM_TILE};
+    size_t global_size[] = {
+        h_gemm_round_up(N1_C, H_GEMM_TILE), 
+        h_gemm_round_up(N0_C, H_GEMM_TILE)
+    };
+
+    return h_enqueue_kernel(command_queue, kernel, local_size, global_size, 2,
+        num_events_in_wait_list, event_wait_list, event);
+}
+
+/// Release the GEMM kernels
+void h_release_gemm(h_gemm_t* gemm) {
+    h_errchk(clReleaseKernel(gemm->batched_strided), "Releasing a GEMM kernel");
+    h_errchk(clReleaseKernel(gemm->batched_offsets), "Releasing a GEMM kernel");
+    h_errchk(clReleaseKernel(gemm->general), "Releasing a GEMM kernel");
+    h_errchk(clReleaseProgram(gemm->program), "Releasing the GEMM program");
+    delete gemm;
+}
+
+/// Parameters of a generated GEMM kernel. A layout of H_GEMM_T means the operand 
+/// is stored transposed, so A is (N1_A, N0_C) and B is (N1_C, N1_A) in memory.
+struct h_gemm_gen_t {
+    const char* name;
+    h_gemm_op_t layout_A;
+    h_gemm_op_t layout_B;
+    // Stage blocks of A and/or B in local memory
+    bool local_A;
+    bool local_B;
+    // Elements of the inner dimension processed together
+    cl_uint vector_len;
+    // Register tile, each work-item computes reg0*reg1 elements of C
+    cl_uint reg0;
+    cl_uint reg1;
+    // Length of the chunk of the inner dimension per pass
+    cl_uint chunk_len;
+    // Double-buffer local blocks, or issue prefetch hints for unstaged operands
+    bool prefetch;
+};
+
+/// Named variants of the generated GEMM kernel, the driver selects from these
+const h_gemm_gen_t h_gemm_gen_variants[] = {
+    // name, layout_A, layout_B, local_A, local_B, vector_len, reg0, reg1, chunk_len, prefetch
+    {"naive", H_GEMM_N, H_GEMM_N, false, false, 1, 1, 1, 16, false},
+    {"naive_BT", H_GEMM_N, H_GEMM_T, false, false, 1, 1, 1, 16, false},
+    {"vector8_BT", H_GEMM_N, H_GEMM_T, false, false, 8, 1, 1, 32, false},
+    {"vector8_BT_prefetch", H_GEMM_N, H_GEMM_T, false, false, 8, 1, 1, 32, true},
+    {"local_A", H_GEMM_N, H_GEMM_N, true, false, 1, 1, 1, 16, false},
+    {"local_B", H_GEMM_N, H_GEMM_N, false, true, 1, 1, 1, 16, false},
+    {"local_AB", H_GEMM_N, H_GEMM_N, true, true, 1, 1, 1, 16, false},
+    {"local_AB_vector4", H_GEMM_N, H_GEMM_N, true, true, 4, 1, 1, 32, false},
+    {"local_AB_vector8", H_GEMM_N, H_GEMM_N, true, true, 8, 1, 1, 32, false},
+    {"local_AB_prefetch", H_GEMM_N, H_GEMM_N, true, true, 4, 1, 1, 32, true},
+    {"local_AB_reg2x2", H_GEMM_N, H_GEMM_N, true, true, 4, 2, 2, 16, false},
+    {"local_AB_reg4x4", H_GEMM_N, H_GEMM_N, true, true, 4, 4, 4, 16, false},
+    {"local_AB_reg2x2_prefetch", H_GEMM_N, H_GEMM_N, true, true, 4, 2, 2, 16, true},
+    {"AT_local_AB", H_GEMM_T, H_GEMM_N, true, true, 4, 1, 1, 32, false},
+    {"AT_BT_local_AB_reg2x2", H_GEMM_T, H_GEMM_T, true, true, 4, 2, 2, 16, false}
+};
+
+/// Number of named variants
+const size_t h_gemm_gen_nvariants = sizeof(h_gemm_gen_variants)/sizeof(h_gemm_gen_t);
+
+/// Find a named variant, returns NULL if there is no such variant
+const h_gemm_gen_t* h_gemm_gen_find(const char* name) {
+    for (size_t n=0; n<h_gemm_gen_nvariants; n++) {
+        if (std::strcmp(h_gemm_gen_variants[n].name, name)==0) return &h_gemm_gen_variants[n];
+    }
+    return NULL;
+}
+
+/// Bytes of local memory a generated kernel uses
+size_t h_gemm_gen_local_bytes(const h_gemm_gen_t* gen) {
+    size_t nbuf = gen->prefetch ? 2 : 1;
+    size_t rows = (gen->local_A ? gen->reg0 : 0) + (gen->local_B ? gen->reg1 : 0);
+    return nbuf*rows*H_GEMM_TILE*(gen->chunk_len+1)*sizeof(cl_float);
+}
+
+/// Generate OpenCL C for a GEMM variant. The kernel is called mat_mult_gen 
+/// and takes (A, B, C, N1_A, N0_C, N1_C), a work-group of H_GEMM_TILE*H_GEMM_TILE
+/// work-items computes a block of (H_GEMM_TILE*reg0, H_GEMM_TILE*reg1) elements of C.
+std::string h_gemm_generate(const h_gemm_gen_t* gen) {
+
+    cl_uint V = gen->vector_len, R0 = gen->reg0, R1 = gen->reg1, TK = gen->chunk_len;
+    assert(V==1 || V==2 || V==4 || V==8 || V==16);
+    assert(R0 > 0 && R1 > 0 && TK > 0 && TK % V == 0);
+
+    // Numbers as they appear in the source
+    std::string s_V = std::to_string(V), s_TK = std::to_string(TK), s_T = std::to_string(H_GEMM_TILE);
+    std::string s_R0 = std::to_string(R0), s_R1 = std::to_string(R1);
+    std::string s_BM = std::to_string(R0*H_GEMM_TILE), s_BN = std::to_string(R1*H_GEMM_TILE);
+    std::string s_NBUF = gen->prefetch ? "2" : "1";
+    std::string floatv = (V > 1) ? "float" + s_V : "float";
+
+    // Load V contiguous floats from a pointer
+    auto vload = [&](const std::string& ptr) {
+        return (V > 1) ? "vload" + s_V + "(0, " + ptr + ")" : "*(" + ptr + ")";
+    };
+
+    // Element (i0, k) of op(A) and (k, i1) of op(B)
+    std::string elem_A = (gen->layout_A == H_GEMM_N) ? "A[i0*N1_A+k]" : "A[k*N0_C+i0]";
+    std::string elem_B = (gen->layout_B == H_GEMM_N) ? "B[k*N1_C+i1]" : "B[i1*N1_A+k]";
+
+    std::string src = "// Generated GEMM variant " + std::string(gen->name) + "\n\n";
+
+    // Global loads of V elements along the inner dimension, zero past the edges
+    if (!gen->local_A) {
+        src += floatv + " load_A(__global float* A, uint i0, uint k, uint N1_A, uint N0_C) {\n";
+        if (gen->layout_A == H_GEMM_N) {
+            src += "    if (i0<N0_C && k+" + s_V + "<=N1_A) return " + vload("&A[i0*N1_A+k]") + ";\n";
+        }
+        src += "    " + floatv + " v = (" + floatv + ")(0.0f);\n";
+        src += "    float* v_f = (float*)&v;\n";
+        src += "    for (uint j=0; j<" + s_V + "; j++, k++) {\n";
+        src += "        if (i0<N0_C && k<N1_A) v_f[j] = " + elem_A + ";\n";
+        src += "    }\n    return v;\n}\n\n";
+    }
+    if (!gen->local_B) {
+        src += floatv + " load_B(__global float* B, uint k, uint i1, uint N1_A, uint N1_C) {\n";
+        if (gen->layout_B == H_GEMM_T) {
+            src += "    if (i1<N1_C && k+" + s_V + "<=N1_A) return " + vload("&B[i1*N1_A+k]") + ";\n";
+        }
+        src += "    " + floatv + " v = (" + floatv + ")(0.0f);\n";
+        src += "    float* v_f = (float*)&v;\n";
+        src += "    for (uint j=0; j<" + s_V + "; j++, k++) {\n";
+        src += "        if (i1<N1_C && k<N1_A) v_f[j] = " + elem_B + ";\n";
+        src += "    }\n    return v;\n}\n\n";
+    }
+
+    // Cooperative fills of a chunk into local memory, the index order 
+    // follows the layout in global memory so reads are coalesced
+    if (gen->local_A) {
+        src += "void fill_A(__global float* A, __local float (*shared)[" + s_TK + "+1],\n";
+        src += "        uint b0, uint c, uint lid, uint N1_A, uint N0_C) {\n";
+        src += "    for (uint idx=lid; idx<" + s_BM + "*" + s_TK + "; idx+=" + s_T + "*" + s_T + ") {\n";
+        if (gen->layout_A == H_GEMM_N) {
+            src += "        uint row = idx/" + s_TK + ", col = idx%" + s_TK + ";\n";
+        } else {
+            src += "        uint row = idx%" + s_BM + ", col = idx/" + s_BM + ";\n";
+        }
+        src += "        uint i0 = b0+row, k = c*" + s_TK + "+col;\n";
+        src += "        shared[row][col] = (i0<N0_C && k<N1_A) ? " + elem_A + " : 0.0f;\n";
+        src += "    }\n}\n\n";
+    }
+    if (gen->local_B) {
+        // Stored as (column of B, k) so the inner dimension is contiguous
+        src += "void fill_B(__global float* B, __local float (*shared)[" + s_TK + "+1],\n";
+        src += "        uint b1, uint c, uint lid, uint N1_A, uint N1_C) {\n";
+        src += "    for (uint idx=lid; idx<" + s_BN + "*" + s_TK + "; idx+=" + s_T + "*" + s_T + ") {\n";
+        if (gen->layout_B == H_GEMM_N) {
+            src += "        uint row = idx%" + s_BN + ", col = idx/" + s_BN + ";\n";
+        } else {
+            src += "        uint row = idx/" + s_TK + ", col = idx%" + s_TK + ";\n";
+        }
+        src += "        uint i1 = b1+row, k = c*" + s_TK + "+col;\n";
+        src += "        shared[row][col] = (i1<N1_C && k<N1_A) ? " + elem_B + " : 0.0f;\n";
+        src += "    }\n}\n\n";
+    }
+
+    src += "__kernel __attribute__((reqd_work_group_size(" + s_T + ", " + s_T + ", 1)))\n";
+    src += "void mat_mult_gen(__global float* A, __global float* B, __global float* C,\n";
+    src += "        unsigned int N1_A, unsigned int N0_C, unsigned int N1_C) {\n\n";
+    src += "    // Start of the block of C and position within the work-group\n";
+    src += "    uint b0 = get_group_id(1)*" + s_BM + ", b1 = get_group_id(0)*" + s_BN + ";\n";
+    src += "    uint s0 = get_local_id(1), s1 = get_local_id(0);\n";
+    src += "    uint lid = s0*" + s_T + "+s1;\n";
+    src += "    uint nchunks = (N1_A+" + s_TK + "-1)/" + s_TK + ";\n\n";
+    if (gen->local_A) {
+        src += "    __local float shared_A[" + s_NBUF + "][" + s_BM + "][" + s_TK + "+1];\n";
+    }
+    if (gen->local_B) {
+        src += "    __local float shared_B[" + s_NBUF + "][" + s_BN + "][" + s_TK + "+1];\n";
+    }
+    src += "\n    // Accumulators for the register tile\n";
+    src += "    " + floatv + " acc[" + s_R0 + "][" + s_R1 + "];\n";
+    src += "    for (uint r0=0; r0<" + s_R0 + "; r0++) {\n";
+    src += "        for (uint r1=0; r1<" + s_R1 + "; r1++) acc[r0][r1] = (" + floatv + ")(0.0f);\n";
+    src += "    }\n\n";
+
+    bool staged = gen->local_A || gen->local_B;
+    auto fill = [&](const std::string& indent, const std::string& chunk, const std::string& buf) {
+        std::string s;
+        if (gen->local_A) s += indent + "fill_A(A, shared_A[" + buf + "], b0, " + chunk + ", lid, N1_A, N0_C);\n";
+        if (gen->local_B) s += indent + "fill_B(B, shared_B[" + buf + "], b1, " + chunk + ", lid, N1_A, N1_C);\n";
+        return s;
+    };
+
+    if (staged && gen->prefetch) {
+        src += "    // Fill the first chunk, later chunks are filled one pass ahead\n";
+        src += fill("    ", "0", "0");
+        src += "    barrier(CLK_LOCAL_MEM_FENCE);\n\n";
+    }
+    src += "    for (uint c=0; c<nchunks; c++) {\n";
+    std::string buf = "0";
+    if (staged && gen->prefetch) {
+        buf = "c%2";
+        src += "        if (c+1<nchunks) {\n" + fill("            ", "c+1", "(c+1)%2") + "        }\n";
+    } else if (staged) {
+        src += fill("        ", "c", "0");
+        src += "        barrier(CLK_LOCAL_MEM_FENCE);\n";
+    }
+    if (gen->prefetch) {
+        // Hint the next chunk of operands read straight from global memory
+        if (!gen->local_A && gen->layout_A == H_GEMM_N) {
+            src += "        for (uint r0=0; r0<" + s_R0 + "; r0++) {\n";
+            src += "            uint i0 = b0+s0+r0*" + s_T + ";\n";
+            src += "            if (c+1<nchunks && i0<N0_C) prefetch(&A[i0*N1_A+(c+1)*" + s_TK 
+                + "], min((uint)" + s_TK + ", N1_A-(c+1)*" + s_TK + "));\n";
+            src += "        }\n";
+        }
+        if (!gen->local_B && gen->layout_B == H_GEMM_T) {
+            src += "        for (uint r1=0; r1<" + s_R1 + "; r1++) {\n";
+            src += "            uint i1 = b1+s1+r1*" + s_T + ";\n";
+            src += "            if (c+1<nchunks && i1<N1_C) prefetch(&B[i1*N1_A+(c+1)*" + s_TK 
+                + "], min((uint)" + s_TK + ", N1_A-(c+1)*" + s_TK + "));\n";
+            src += "        }\n";
+        }
+    }
+
+    src += "\n        #pragma unroll\n";
+    src += "        for (uint k=0; k<" + s_TK + "; k+=" + s_V + ") {\n";
+    src += "            " + floatv + " a[" + s_R0 + "], b[" + s_R1 + "];\n";
+    src += "            for (uint r0=0; r0<" + s_R0 + "; r0++) {\n";
+    if (gen->local_A) {
+        src += "                a[r0] = " + vload("&shared_A[" + buf + "][s0+r0*" + s_T + "][k]") + ";\n";
+    } else {
+        src += "                a[r0] = load_A(A, b0+s0+r0*" + s_T + ", c*" + s_TK + "+k, N1_A, N0_C);\n";
+    }
+    src += "            }\n";
+    src += "            for (uint r1=0; r1<" + s_R1 + "; r1++) {\n";
+    if (gen->local_B) {
+        src += "                b[r1] = " + vload("&shared_B[" + buf + "][s1+r1*" + s_T + "][k]") + ";\n";
+    } else {
+        src += "                b[r1] = load_B(B, c*" + s_TK + "+k, b1+s1+r1*" + s_T + ", N1_A, N1_C);\n";
+    }
+    src += "            }\n";
+    src += "            for (uint r0=0; r0<" + s_R0 + "; r0++) {\n";
+    src += "                for (uint r1=0; r1<" + s_R1 + "; r1++) acc[r0][r1] += a[r0]*b[r1];\n";
+    src += "            }\n";
+    src += "        }\n";
+    if (staged) {
+        src += "        barrier(CLK_LOCAL_MEM_FENCE);\n";
+    }
+    src += "    }\n\n";
+
+    src += "    // Sum the accumulators and store the register tile\n";
+    src += "    for (uint r0=0; r0<" + s_R0 + "; r0++) {\n";
+    src += "        for (uint r1=0; r1<" + s_R1 + "; r1++) {\n";
+    src += "            uint i0 = b0+s0+r0*" + s_T + ", i1 = b1+s1+r1*" + s_T + ";\n";
+    src += "            float* acc_f = (float*)&acc[r0][r1];\n";
+    src += "            float sum = 0.0f;\n";
+    src += "            for (uint j=0; j<" + s_V + "; j++) sum += acc_f[j];\n";
+    src += "            if (i0<N0_C && i1<N1_C) C[i0*N1_C+i1] = sum;\n";
+    src += "        }\n";
+    src += "    }\n}\n";
+
+    return src;
+}
+
+/// Build the program for a generated GEMM variant and create its kernel
+cl_kernel h_gemm_gen_build(
+        cl_context context,
+        cl_device_id device,
+        const h_gemm_gen_t* gen,
+        const char* compiler_options,
+        cl_program* program) {
+
+    std::string source = h_gemm_generate(gen);
+    *program = h_build_program(source.c_str(), context, device, compiler_options);
+
+    cl_int errcode;
+    cl_kernel kernel = clCreateKernel(*program, "mat_mult_gen", &errcode);
+    h_errchk(errcode, "Creating a generated GEMM kernel");
+    return kernel;
+}
+
+/// Enqueue a generated GEMM kernel, C = op(A)*op(B) with the layouts of the variant
+cl_int h_gemm_gen_enqueue(
+        cl_command_queue command_queue,
+        cl_kernel kernel,
+        const h_gemm_gen_t* gen,
+        cl_mem A,
+        cl_mem B,
+        cl_mem C,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C,
+        cl_uint num_events_in_wait_list,
+        const cl_event* event_wait_list,
+        cl_event* event) {
+
+    cl_int errcode = CL_SUCCESS;
+    errcode |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &A);
+    errcode |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &B);
+    errcode |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &C);
+    errcode |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &N1_A);
+    errcode |= clSetKernelArg(kernel, 4, sizeof(cl_uint), &N0_C);
+    errcode |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &N1_C);
+    if (errcode != CL_SUCCESS) return errcode;
+
+    // One work-group per block of C
+    size_t block0 = H_GEMM_TILE*gen->reg0, block1 = H_GEMM_TILE*gen->reg1;
+    size_t local_size[] = {H_GEMM_TILE, H_GEMM_TILE};
+    size_t global_size[] = {
+        h_gemm_round_up(N1_C, block1)/gen->reg1,
+        h_gemm_round_up(N0_C, block0)/gen->reg0
+    };
+
+    return h_enqueue_kernel(command_queue, kernel, local_size, global_size, 2,
+        num_events_in_wait_list, event_wait_list, event);
+}
+
+/// State and statistics for one device of the multi-device GEMM scheduler
+struct h_md_device_t {
+    cl_context context;
+    cl_device_id device;
+    // Kernels run on one queue while panels and tiles move on the other
+    cl_command_queue compute_queue;
+    cl_command_queue copy_queue;
+    h_gemm_t* gemm;
+    // Double-buffered blocks of A and B and tiles of C
+    cl_mem A_panel[2];
+    cl_mem B_panel[2];
+    cl_mem C_tile[2];
+    size_t capacity_A;
+    size_t capacity_B;
+    size_t capacity_C;
+    // Relative speed used to share out tiles, GFLOP/s once measured
+    cl_double throughput;
+    // Statistics from the last call to h_md_gemm
+    size_t ntiles;
+    size_t nstolen;
+    size_t nbytes_uploaded;
+    cl_double kernel_ms;
+    cl_double copy_ms;
+    cl_double flops;
+};
+
+/// Multi-device GEMM scheduler
+struct h_md_gemm_t {
+    std::vector<h_md_device_t> devices;
+    // Requested tile size of C, 0 chooses one from the problem size
+    size_t tile0;
+    size_t tile1;
+    // Cap on device memory used per device, 0 uses half of global memory
+    size_t max_device_bytes;
+    // Tile sizes along N0_C, N1_C, and N1_A chosen by the last call
+    size_t tile_used[3];
+    // Wall time of the last call in milliseconds
+    cl_double wall_ms;
+};
+
+/// Create a multi-device GEMM scheduler with one entry per device.
+/// Tile sizes of 0 let h_md_gemm choose them from the problem size.
+h_md_gemm_t* h_create_md_gemm(
+        cl_context* contexts,
+        cl_device_id* devices,
+        cl_uint num_devices,
+        size_t tile0,
+        size_t tile1) {
+
+    h_md_gemm_t* md = new h_md_gemm_t();
+    md->tile0 = tile0;
+    md->tile1 = tile1;
+    md->max_device_bytes = 0;
+    md->wall_ms = 0.0;
+
+    for (cl_uint n=0; n<num_devices; n++) {
+        h_md_device_t dev = {};
+        dev.context = contexts[n];
+        dev.device = devices[n];
+
+        // Two in-order queues with profiling for the utilisation report
+        cl_command_queue* queues = h_create_command_queues(
+            &dev.device, &dev.context, 1, 2, CL_FALSE, CL_TRUE);
+        dev.compute_queue = queues[0];
+        dev.copy_queue = queues[1];
+        free(queues);
+
+        dev.gemm = h_create_gemm(dev.context, dev.device, NULL);
+
+        // Rough first guess at relative speed, replaced by measurements
+        cl_uint compute_units, clock_mhz;
+        cl_device_type type;
+        h_errchk(clGetDeviceInfo(dev.device, CL_DEVICE_MAX_COMPUTE_UNITS, 
+            sizeof(cl_uint), &compute_units, NULL), "Getting compute units");
+        h_errchk(clGetDeviceInfo(dev.device, CL_DEVICE_MAX_CLOCK_FREQUENCY, 
+            sizeof(cl_uint), &clock_mhz, NULL), "Getting clock frequency");
+        h_errchk(clGetDeviceInfo(dev.device, CL_DEVICE_TYPE, 
+            sizeof(cl_device_type), &type, NULL), "Getting device type");
+        cl_double lanes = (type & CL_DEVICE_TYPE_GPU) ? 64.0 : 8.0;
+        dev.throughput = std::max(1.0, (cl_double)compute_units*(cl_double)clock_mhz*lanes);
+
+        md->devices.push_back(dev);
+    }
+
+    return md;
+}
+
+/// Make sure a pair of scratch buffers holds exactly nbytes each,
+/// so the working set never exceeds what the tile size asks for
+void h_md_reserve(cl_context context, cl_mem* buffer, size_t* capacity, size_t nbytes) {
+    if (*capacity == nbytes) return;
+    
+    cl_int errcode;
+    for (int s=0; s<2; s++) {
+        if (buffer[s] != NULL) {
+            h_errchk(clReleaseMemObject(buffer[s]), "Releasing a scheduler buffer");
+        }
+        buffer[s] = clCreateBuffer(context, CL_MEM_READ_WRITE, nbytes, NULL, &errcode);
+        h_errchk(errcode, "Creating a scheduler buffer");
+    }
+    *capacity = nbytes;
+}
+
+/// Take the next tile for device d, stealing from the back of the
+/// fullest queue when its own queue is empty. Returns false when no work remains.
+bool h_md_next_tile(std::vector<std::deque<size_t>>& queues, size_t d, size_t* tile, bool* stolen) {
+    bool found = false;
+
+    #pragma omp critical(h_md_gemm_queues)
+    {
+        if (!queues[d].empty()) {
+            *tile = queues[d].front();
+            queues[d].pop_front();
+            *stolen = false;
+            found = true;
+        } else {
+            // Victim is the device with the most work left
+            size_t victim = d;
+            for (size_t v=0; v<queues.size(); v++) {
+                if (queues[v].size() > queues[victim].size()) victim = v;
+            }
+            if (!queues[victim].empty()) {
+                *tile = queues[victim].back();
+                queues[victim].pop_back();
+                *stolen = true;
+                found = true;
+            }
+        }
+    }
+    
+    return found;
+}
+
+/// Duration of a profiled event in milliseconds, the event is released
+cl_double h_md_event_ms(cl_event event) {
+    cl_ulong t1, t2;
+    h_errchk(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, 
+        sizeof(cl_ulong), &t1, NULL), "Fetching start time for event");
+    h_errchk(clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, 
+        sizeof(cl_ulong), &t2, NULL), "Fetching end time for event");
+    h_errchk(clReleaseEvent(event), "Releasing an event");
+    return (cl_double)(t2-t1)*1.0e-6;
+}
+
+/// Drive one device of the scheduler until no tiles remain.
+/// Each tile of C accumulates over blocks of the inner dimension of length tilek.
+void h_md_gemm_worker(
+        h_md_gemm_t* md,
+        size_t d,
+        std::vector<std::deque<size_t>>& queues,
+        float* A_h,
+        float* B_h,
+        float* C_h,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C,
+        size_t tile0,
+        size_t tile1,
+        size_t tilek) {
+
+    h_md_device_t* dev = &md->devices[d];
+    size_t ntiles1 = (N1_C+tile1-1)/tile1;
+    size_t nblocksk = (N1_A+tilek-1)/tilek;
+
+    // Scratch space for the largest tile
+    h_md_reserve(dev->context, dev->A_panel, &dev->capacity_A, tile0*tilek*sizeof(float));
+    h_md_reserve(dev->context, dev->B_panel, &dev->capacity_B, tilek*tile1*sizeof(float));
+    h_md_reserve(dev->context, dev->C_tile, &dev->capacity_C, tile0*tile1*sizeof(float));
+
+    // Which block of A and B each slot holds,
+    // a panel is only uploaded when it changes
+    const size_t none = (size_t)-1;
+    size_t held_A[2] = {none, none};
+    size_t held_B[2] = {none, none};
+
+    // Last kernel to read each panel slot, and last download from each C slot
+    cl_event panel_done[2] = {NULL, NULL};
+    cl_event tile_done[2] = {NULL, NULL};
+
+    // Every event is kept until the end for timing, so the markers above stay valid
+    std::vector<cl_event> kernel_events, copy_events;
+
+    // Uploads in flight for the current and next step
+    cl_event uploads[2][2];
+    cl_uint nuploads[2] = {0, 0};
+
+    // Enqueue the uploads for block kb of a tile into a panel slot
+    auto upload = [&](size_t t, size_t kb, int s) {
+        size_t band = t/ntiles1, col = t%ntiles1;
+        size_t start0 = band*tile0, start1 = col*tile1, startk = kb*tilek;
+        size_t s0 = std::min(tile0, (size_t)N0_C-start0);
+        size_t s1 = std::min(tile1, (size_t)N1_C-start1);
+        size_t sk = std::min(tilek, (size_t)N1_A-startk);
+        cl_uint nwait = (panel_done[s] != NULL) ? 1 : 0;
+        cl_event* wait_list = nwait ? &panel_done[s] : NULL;
+        nuploads[s] = 0;
+
+        // Both panels are strided on the host and packed on the device
+        size_t key_A = band*nblocksk+kb;
+        if (held_A[s] != key_A) {
+            const size_t buffer_origin[] = {0, 0, 0};
+            const size_t host_origin[] = {startk*sizeof(float), start0, 0};
+            const size_t region[] = {sk*sizeof(float), s0, 1};
+            cl_event event;
+            h_errchk(clEnqueueWriteBufferRect(dev->copy_queue, dev->A_panel[s], CL_FALSE,
+                buffer_origin, host_origin, region, 
+                sk*sizeof(float), 0, N1_A*sizeof(float), 0,
+                A_h, nwait, wait_list, &event),
+                "Uploading a panel of A");
+            uploads[s][nuploads[s]++] = event;
+            copy_events.push_back(event);
+            held_A[s] = key_A;
+            dev->nbytes_uploaded += s0*sk*sizeof(float);
+        }
+
+        size_t key_B = col*nblocksk+kb;
+        if (held_B[s] != key_B) {
+            const size_t buffer_origin[] = {0, 0, 0};
+            const size_t host_origin[] = {start1*sizeof(float), startk, 0};
+            const size_t region[] = {s1*sizeof(float), sk, 1};
+            cl_event event;
+            h_errchk(clEnqueueWriteBufferRect(dev->copy_queue, dev->B_panel[s], CL_FALSE,
+                buffer_origin, host_origin, region, 
+                s1*sizeof(float), 0, N1_C*sizeof(float), 0,
+                B_h, nwait, wait_list, &event),
+                "Uploading a panel of B");
+            uploads[s][nuploads[s]++] = event;
+            copy_events.push_back(event);
+            held_B[s] = key_B;
+            dev->nbytes_uploaded += sk*s1*sizeof(float);
+        }
+    };
+
+    // Current step is block kb of tile, in panel slot p and C slot c
+    size_t tile, kb = 0;
+    bool stolen;
+    bool have_tile = h_md_next_tile(queues, d, &tile, &stolen);
+    int p = 0, c = 0;
+
+    if (have_tile) upload(tile, kb, p);
+
+    while (have_tile) {
+        if (kb == 0) {
+            dev->ntiles++;
+            if (stolen) dev->nstolen++;
+        }
+
+        // Work out the next step and start moving it while this one computes
+        size_t next_tile = tile, next_kb = kb+1;
+        bool have_next = true;
+        if (next_kb == nblocksk) {
+            next_kb = 0;
+            have_next = h_md_next_tile(queues, d, &next_tile, &stolen);
+        }
+        if (have_next) upload(next_tile, next_kb, 1-p);
+
+        size_t band = tile/ntiles1, col = tile%ntiles1;
+        size_t start0 = band*tile0, start1 = col*tile1;
+        cl_uint s0 = (cl_uint)std::min(tile0, (size_t)N0_C-start0);
+        cl_uint s1 = (cl_uint)std::min(tile1, (size_t)N1_C-start1);
+        cl_uint sk = (cl_uint)std::min(tilek, (size_t)N1_A-kb*tilek);
+
+        // The first block waits for the last read of its C tile,
+        // later blocks accumulate into it
+        cl_event wait_list[3];
+        cl_uint nwait = 0;
+        for (cl_uint n=0; n<nuploads[p]; n++) wait_list[nwait++] = uploads[p][n];
+        if ((kb == 0) && (tile_done[c] != NULL)) wait_list[nwait++] = tile_done[c];
+        nuploads[p] = 0;
+
+        cl_event kernel_event;
+        h_errchk(h_gemm(dev->gemm, dev->compute_queue, H_GEMM_N, H_GEMM_N,
+            dev->A_panel[p], dev->B_panel[p], dev->C_tile[c],
+            sk, s0, s1, 1.0f, (kb == 0) ? 0.0f : 1.0f, H_GEMM_NONE, NULL, NULL,
+            nwait, nwait ? wait_list : NULL, &kernel_event),
+            "Enqueueing a tile of the multi-device GEMM");
+        kernel_events.push_back(kernel_event);
+        panel_done[p] = kernel_event;
+        dev->flops += 2.0*(cl_double)s0*(cl_double)s1*(cl_double)sk;
+
+        // Copy a finished tile straight into its place in C
+        if (kb == nblocksk-1) {
+            const size_t buffer_origin[] = {0, 0, 0};
+            const size_t host_origin[] = {start1*sizeof(float), start0, 0};
+            const size_t region[] = {s1*sizeof(float), s0, 1};
+            cl_event download_event;
+            h_errchk(clEnqueueReadBufferRect(dev->copy_queue, dev->C_tile[c], CL_FALSE,
+                buffer_origin, host_origin, region, 
+                s1*sizeof(float), 0, N1_C*sizeof(float), 0,
+                C_h, 1, &kernel_event, &download_event),
+                "Downloading a tile of C");
+            copy_events.push_back(download_event);
+            tile_done[c] = download_event;
+            c = 1-c;
+        }
+        h_errchk(clFlush(dev->compute_queue), "Flushing the compute queue");
+        h_errchk(clFlush(dev->copy_queue), "Flushing the copy queue");
+
+        tile = next_tile;
+        kb = next_kb;
+        have_tile = have_next;
+        p = 1-p;
+    }
+
+    h_errchk(clFinish(dev->compute_queue), "Finishing the compute queue");
+    h_errchk(clFinish(dev->copy_queue), "Finishing the copy queue");
+
+    // Busy time on each queue
+    for (cl_event event : kernel_events) dev->kernel_ms += h_md_event_ms(event);
+    for (cl_event event : copy_events) dev->copy_ms += h_md_event_ms(event);
+}
+
+/// Bytes of device memory the scheduler uses for a tile size,
+/// panels and tiles are all double-buffered
+size_t h_md_working_set(size_t tile0, size_t tile1, size_t tilek) {
+    return 2*(tile0*tilek + tilek*tile1 + tile0*tile1)*sizeof(float);
+}
+
+/// Compute C = A*B for host matrices, sharing tiles of C between all devices
+/// of the scheduler. A is (N0_C, N1_A), B is (N1_A, N1_C), and C is (N0_C, N1_C).
+/// The matrices may be larger than device memory, for example files 
+/// mapped with h_map_binary, only panels and tiles are held on a device.
+void h_md_gemm(
+        h_md_gemm_t* md,
+        float* A_h,
+        float* B_h,
+        float* C_h,
+        cl_uint N1_A,
+        cl_uint N0_C,
+        cl_uint N1_C) {
+
+    size_t num_devices = md->devices.size();
+
+    // Memory available on every device, and the largest single buffer
+    size_t max_bytes = (size_t)-1, max_alloc = (size_t)-1;
+    for (h_md_device_t& dev : md->devices) {
+        cl_ulong global_mem, alloc_mem;
+        h_errchk(clGetDeviceInfo(dev.device, CL_DEVICE_GLOBAL_MEM_SIZE,
+            sizeof(cl_ulong), &global_mem, NULL), "Getting global memory size");
+        h_errchk(clGetDeviceInfo(dev.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+            sizeof(cl_ulong), &alloc_mem, NULL), "Getting maximum allocation size");
+        max_bytes = std::min(max_bytes, (size_t)global_mem/2);
+        max_alloc = std::min(max_alloc, (size_t)alloc_mem);
+    }
+    if (md->max_device_bytes > 0) max_bytes = std::min(max_bytes, md->max_device_bytes);
+
+    // Choose a tile size that gives every device several tiles to work on
+    size_t tile0 = md->tile0, tile1 = md->tile1, tilek = N1_A;
+    if ((tile0 == 0) || (tile1 == 0)) {
+        tile0 = std::min((size_t)1024, (size_t)N0_C);
+        tile1 = std::min((size_t)1024, (size_t)N1_C);
+        while (((N0_C+tile0-1)/tile0)*((N1_C+tile1-1)/tile1) < 4*num_devices) {
+            if ((tile0 >= tile1) && (tile0 > 2*H_GEMM_TILE)) {
+                tile0 /= 2;
+            } else if (tile1 > 2*H_GEMM_TILE) {
+                tile1 /= 2;
+            } else {
+                break;
+            }
+        }
+    }
+
+    // Shrink the tiles until the working set fits. Blocking the inner dimension 
+    // is cheapest, smaller tiles of C mean panels are uploaded more often
+    auto fits = [&]() {
+        return (h_md_working_set(tile0, tile1, tilek) <= max_bytes)
+            && (std::max(tile0, tile1)*tilek*sizeof(float) <= max_alloc)
+            && (tile0*tile1*sizeof(float) <= max_alloc);
+    };
+    while (!fits()) {
+        if (tilek > std::max((size_t)256, std::max(tile0, tile1))) {
+            tilek = h_gemm_round_up(tilek/2, H_GEMM_TILE);
+        } else if ((tile0 >= tile1) && (tile0 > H_GEMM_TILE)) {
+            tile0 = h_gemm_round_up(tile0/2, H_GEMM_TILE);
+        } else if (tile1 > H_GEMM_TILE) {
+            tile1 = h_gemm_round_up(tile1/2, H_GEMM_TILE);
+        } else if (tilek > H_GEMM_TILE) {
+            tilek = h_gemm_round_up(tilek/2, H_GEMM_TILE);
+        } else {
+            std::printf("Cannot fit the GEMM working set in %zu bytes\n", max_bytes);
+            exit(EXIT_FAILURE);
+        }
+    }
+    md->tile_used[0] = tile0;
+    md->tile_used[1] = tile1;
+    md->tile_used[2] = tilek;
+    size_t ntiles = ((N0_C+tile0-1)/tile0)*((N1_C+tile1-1)/tile1);
+
+    // Give each device a contiguous run of tiles in proportion to its throughput,
+    // neighbouring tiles share a panel of A
+    cl_double total_throughput = 0.0;
+    for (h_md_device_t& dev : md->devices) total_throughput += dev.throughput;
+    std::vector<std::deque<size_t>> queues(num_devices);
+    cl_double share = 0.0;
+    size_t t = 0;
+    for (size_t d=0; d<num_devices; d++) {
+        share += md->devices[d].throughput/total_throughput;
+        size_t end = (d == num_devices-1) ? ntiles : (size_t)std::round(share*ntiles);
+        for (; t<end; t++) queues[d].push_back(t);
+    }
+
+    // Reset the statistics
+    for (h_md_device_t& dev : md->devices) {
+        dev.ntiles = 0;
+        dev.nstolen = 0;
+        dev.nbytes_uploaded = 0;
+        dev.kernel_ms = 0.0;
+        dev.copy_ms = 0.0;
+        dev.flops = 0.0;
+    }
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+
+    // One host thread drives each device
+    #pragma omp parallel for num_threads((int)num_devices) schedule(static, 1)
+    for (size_t d=0; d<num_devices; d++) {
+        h_md_gemm_worker(md, d, queues, A_h, B_h, C_h, N1_A, N0_C, N1_C, tile0, tile1, tilek);
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    md->wall_ms = (cl_double)std::chrono::duration_cast<std::chrono::microseconds>(t2-t1).count()/1000.0;
+
+    // Measured speed guides the share of tiles next time
+    for (h_md_device_t& dev : md->devices) {
+        if (dev.kernel_ms > 0.0) dev.throughput = dev.flops/(dev.kernel_ms*1.0e6);
+    }
+}
+
+/// Report per-device utilisation from the last call to h_md_gemm
+void h_md_gemm_report(h_md_gemm_t* md) {
+    std::printf("Multi-device GEMM took %.3f ms with tiles of (%zu, %zu) and blocks of %zu, ",
+        md->wall_ms, md->tile_used[0], md->tile_used[1], md->tile_used[2]);
+    std::printf("%.1f MB per device\n", 
+        (cl_double)h_md_working_set(md->tile_used[0], md->tile_used[1], md->tile_used[2])/1.0e6);
+    std::printf("%6s %8s %8s %12s %12s %10s %10s %12s\n", "device", "tiles", "stolen",
+        "kernel (ms)", "copy (ms)", "busy (%)", "GFLOP/s", "upload (MB)");
+    for (size_t d=0; d<md->devices.size(); d++) {
+        h_md_device_t* dev = &md->devices[d];
+        cl_double busy = (md->wall_ms > 0.0) ? 100.0*dev->kernel_ms/md->wall_ms : 0.0;
+        cl_double gflops = (dev->kernel_ms > 0.0) ? dev->flops/(dev->kernel_ms*1.0e6) : 0.0;
+        std::printf("%6zu %8zu %8zu %12.3f %12.3f %10.1f %10.1f %12.1f\n", d, 
+            dev->ntiles, dev->nstolen, dev->kernel_ms, dev->copy_ms, busy, gflops, 
+            (cl_double)dev->nbytes_uploaded/1.0e6);
+    }
+}
+
+/// Release the multi-device GEMM scheduler
+void h_release_md_gemm(h_md_gemm_t* md) {
+    for (h_md_device_t& dev : md->devices) {
+        for (int s=0; s<2; s++) {
+            if (dev.A_panel[s] != NULL) h_errchk(clReleaseMemObject(dev.A_panel[s]), "Releasing a panel");
+            if (dev.B_panel[s] != NULL) h_errchk(clReleaseMemObject(dev.B_panel[s]), "Releasing a panel");
+            if (dev.C_tile[s] != NULL) h_errchk(clReleaseMemObject(dev.C_tile[s]), "Releasing a tile");
+        }
+        h_release_gemm(dev.gemm);
+        h_errchk(clReleaseCommandQueue(dev.compute_queue), "Releasing a command queue");
+        h_errchk(clReleaseCommandQueue(dev.copy_queue), "Releasing a command queue");
+    }
+    delete md;
+}
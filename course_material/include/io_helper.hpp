@@ -0,0 +1,484 @@
+///
+/// @file  io_helper.hpp
+///
+/// @brief Streaming writer that moves snapshots from staging
+/// memory to disk on a background thread while the host keeps
+/// enqueueing work. Uses POSIX pwrite, and O_DIRECT where it is available,
+/// or WriteFile at an explicit offset on Windows.
+///
+/// Include this file after cl_helper.hpp.
+///
+/// Written by Dr. Toby Potter
+/// for the Commonwealth Scientific and Industrial Research Organisation of Australia (CSIRO).
+///
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#if !(defined(_WIN32) || defined(_WIN64))
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+/// Bytes reserved for the header at the start of a snapshot file,
+/// a multiple of the block size so that O_DIRECT writes stay aligned
+#define H_SNAP_HEADER_BYTES 4096
+
+/// Alignment of staging memory, offsets, and sizes for O_DIRECT
+#define H_SNAP_ALIGN 4096
+
+/// Handle to an open snapshot file
+#if defined(_WIN32) || defined(_WIN64)
+typedef HANDLE h_snap_file_t;
+#define H_SNAP_NO_FILE INVALID_HANDLE_VALUE
+#else
+typedef int h_snap_file_t;
+#define H_SNAP_NO_FILE -1
+#endif
+
+/// Staging memory aligned to H_SNAP_ALIGN, release with h_snap_free
+void* h_snap_alloc(size_t nbytes) {
+#if defined(_WIN32) || defined(_WIN64)
+    return _aligned_malloc(nbytes, H_SNAP_ALIGN);
+#else
+    return aligned_alloc(H_SNAP_ALIGN, nbytes);
+#endif
+}
+
+/// Release memory from h_snap_alloc
+void h_snap_free(void* data) {
+#if defined(_WIN32) || defined(_WIN64)
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+/// Error code of the last failed file operation on this thread
+int h_snap_last_error() {
+#if defined(_WIN32) || defined(_WIN64)
+    return (int)GetLastError();
+#else
+    return errno;
+#endif
+}
+
+/// Readable form of an error code from h_snap_last_error
+std::string h_snap_error_string(int code) {
+#if defined(_WIN32) || defined(_WIN64)
+    return "Windows error " + std::to_string(code);
+#else
+    return std::strerror(code);
+#endif
+}
+
+/// Create or truncate a snapshot file for writing, returns H_SNAP_NO_FILE on failure.
+/// Direct I/O is only requested where O_DIRECT exists, Windows always goes through the cache
+h_snap_file_t h_snap_open(const char* filename, bool direct) {
+#if defined(_WIN32) || defined(_WIN64)
+    return CreateFileA(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (direct) flags |= O_DIRECT;
+#endif
+    return open(filename, flags, 0644);
+#endif
+}
+
+/// Close a snapshot file, returns 0 on success or the error code
+int h_snap_close(h_snap_file_t fd) {
+#if defined(_WIN32) || defined(_WIN64)
+    return CloseHandle(fd) ? 0 : (int)GetLastError();
+#else
+    return (close(fd) == 0) ? 0 : errno;
+#endif
+}
+
+/// Self-describing header at the start of a snapshot file,
+/// all fields are little-endian at fixed offsets
+struct h_snap_header_t {
+    // "WAVESNAP"
+    char magic[8];
+    // Version of the layout
+    cl_uint version;
+    // Offset of the first snapshot in the file
+    cl_uint header_bytes;
+    // Number of used entries in dims
+    cl_uint ndim;
+    // Type of each element, for example "float32"
+    char dtype[8];
+    cl_uint pad;
+    // Dimensions, slowest first, for example (nsnap, n0, n1)
+    cl_ulong dims[4];
+    // Time between snapshots
+    cl_double dt;
+    // Grid index of the first point kept, and the step between kept points,
+    // along the slow and fast axes of each snapshot
+    cl_uint origin[2];
+    cl_uint stride[2];
+};
+
+/// Fill a header for a run of snapshots of float32 values, each an (n0, n1) 
+/// region of the grid starting at (origin0, origin1) with strides (stride0, stride1)
+h_snap_header_t h_make_snap_header(
+        size_t nsnap, 
+        size_t n0, 
+        size_t n1, 
+        cl_double dt,
+        cl_uint origin0,
+        cl_uint origin1,
+        cl_uint stride0,
+        cl_uint stride1) {
+    
+    h_snap_header_t header;
+    std::memset(&header, 0, sizeof(h_snap_header_t));
+    std::memcpy(header.magic, "WAVESNAP", 8);
+    header.version = 2;
+    header.header_bytes = H_SNAP_HEADER_BYTES;
+    header.ndim = 3;
+    std::strncpy(header.dtype, "float32", 8);
+    header.dims[0] = nsnap;
+    header.dims[1] = n0;
+    header.dims[2] = n1;
+    header.dt = dt;
+    header.origin[0] = origin0;
+    header.origin[1] = origin1;
+    header.stride[0] = stride0;
+    header.stride[1] = stride1;
+    return header;
+}
+
+/// A snapshot that is waiting to be written
+struct h_snap_job_t {
+    // Staging slot that holds the snapshot
+    int slot;
+    // Position of the snapshot in the file
+    size_t index;
+    // Event that completes when the snapshot has arrived in the slot
+    cl_event event;
+};
+
+/// Background writer fed by a bounded set of staging slots
+struct h_snap_writer_t {
+    // File descriptor and whether it was opened with O_DIRECT
+    h_snap_file_t fd;
+    bool direct;
+    // Bytes in one snapshot and in one staging slot
+    size_t nbytes_snap;
+    size_t nbytes_slot;
+    // Staging memory
+    std::vector<void*> slots;
+    // Slots that the host may fill and snapshots that the writer must write
+    std::deque<int> free_slots;
+    std::deque<h_snap_job_t> pending;
+    std::mutex lock;
+    std::condition_variable pending_ready;
+    std::condition_variable slot_ready;
+    bool closing;
+    std::thread thread;
+    // Profiler that supplies the time base, may be NULL
+    h_profiler_t* profiler;
+    // Seconds the writer spent in pwrite and waiting for copies
+    cl_double write_s;
+    cl_double wait_copy_s;
+    // Seconds the host was blocked waiting for a free slot,
+    // and waiting for the writer to drain at the end
+    cl_double stall_s;
+    cl_double drain_s;
+    // Snapshots and bytes written, and the deepest the queue got
+    size_t nwritten;
+    size_t nbytes_written;
+    size_t max_pending;
+    // Spans of pwrite activity, and spans where the host was blocked on the writer
+    std::vector<std::pair<cl_ulong, cl_ulong>> spans;
+    std::vector<std::pair<cl_ulong, cl_ulong>> blocked;
+    // First error met by the writer thread, reported to the host by h_close_snap_writer.
+    // Once set, later snapshots are skipped but their slots are still handed back
+    int error;
+    std::string error_message;
+};
+
+/// Current time in nanoseconds, in the time base of the profiler if there is one
+cl_ulong h_snap_writer_ns(h_snap_writer_t* writer) {
+    if (writer->profiler != NULL) {
+        return h_profiler_host_ns(writer->profiler);
+    }
+    return (cl_ulong)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/// Write all bytes at an offset, retrying on short writes.
+/// Returns 0 on success or the error code of the failed write
+int h_pwrite_all(h_snap_file_t fd, const void* data, size_t nbytes, cl_ulong offset) {
+    const char* bytes = (const char*)data;
+    while (nbytes > 0) {
+#if defined(_WIN32) || defined(_WIN64)
+        // A synchronous handle still honours the offset in OVERLAPPED
+        OVERLAPPED overlapped = {};
+        overlapped.Offset = (DWORD)(offset & 0xffffffff);
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        DWORD chunk = (DWORD)std::min(nbytes, (size_t)1 << 30);
+        DWORD nwrote = 0;
+        if (!WriteFile(fd, bytes, chunk, &nwrote, &overlapped)) return (int)GetLastError();
+        if (nwrote == 0) return (int)ERROR_WRITE_FAULT;
+#else
+        ssize_t nwrote = pwrite(fd, bytes, nbytes, (off_t)offset);
+        if (nwrote < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+#endif
+        bytes += nwrote;
+        nbytes -= (size_t)nwrote;
+        offset += (cl_ulong)nwrote;
+    }
+    return 0;
+}
+
+/// Body of the writer thread
+void h_snap_writer_loop(h_snap_writer_t* writer) {
+    while (true) {
+        h_snap_job_t job;
+        {
+            std::unique_lock<std::mutex> guard(writer->lock);
+            writer->pending_ready.wait(guard, [writer]{
+                return writer->closing || !writer->pending.empty();
+            });
+            if (writer->pending.empty()) break;
+            job = writer->pending.front();
+            writer->pending.pop_front();
+        }
+
+        // Wait for the copy into the slot to finish. Errors are kept 
+        // for the host, exiting here would take the process down mid-step
+        cl_ulong t0 = h_snap_writer_ns(writer);
+        cl_int wait_code = clWaitForEvents(1, &job.event);
+        clReleaseEvent(job.event);
+        cl_ulong t1 = h_snap_writer_ns(writer);
+
+        // Write the snapshot to its place in the file
+        bool failed;
+        {
+            std::lock_guard<std::mutex> guard(writer->lock);
+            failed = (writer->error != 0);
+        }
+        int write_code = 0;
+        if (!failed && (wait_code == CL_SUCCESS)) {
+            cl_ulong offset = (cl_ulong)H_SNAP_HEADER_BYTES + (cl_ulong)job.index*(cl_ulong)writer->nbytes_snap;
+            write_code = h_pwrite_all(writer->fd, writer->slots[job.slot], writer->nbytes_snap, offset);
+        }
+        cl_ulong t2 = h_snap_writer_ns(writer);
+
+        // Hand the slot back to the host
+        {
+            std::lock_guard<std::mutex> guard(writer->lock);
+            if ((writer->error == 0) && (wait_code != CL_SUCCESS)) {
+                writer->error = wait_code;
+                writer->error_message = "Waiting for snapshot " + std::to_string(job.index) 
+                    + " to arrive, OpenCL error " + std::to_string(wait_code);
+            } else if ((writer->error == 0) && (write_code != 0)) {
+                writer->error = write_code;
+                writer->error_message = "Writing snapshot " + std::to_string(job.index) 
+                    + ", " + h_snap_error_string(write_code);
+            } else if (!failed) {
+                writer->wait_copy_s += (t1-t0)*1.0e-9;
+                writer->write_s += (t2-t1)*1.0e-9;
+                writer->nwritten++;
+                writer->nbytes_written += writer->nbytes_snap;
+                writer->spans.push_back(std::make_pair(t1, t2));
+            }
+            writer->free_slots.push_back(job.slot);
+        }
+        writer->slot_ready.notify_one();
+    }
+}
+
+/// Create a writer for snapshots of nbytes_snap bytes, with nslots staging slots.
+/// O_DIRECT is used when asked for and when the snapshot size is a multiple of H_SNAP_ALIGN,
+/// otherwise writes go through the page cache.
+h_snap_writer_t* h_create_snap_writer(
+        const char* filename,
+        const h_snap_header_t* header,
+        size_t nbytes_snap,
+        size_t nslots,
+        bool direct,
+        h_profiler_t* profiler) {
+
+    assert(nslots > 0);
+    h_snap_writer_t* writer = new h_snap_writer_t();
+    writer->nbytes_snap = nbytes_snap;
+    writer->nbytes_slot = ((nbytes_snap+H_SNAP_ALIGN-1)/H_SNAP_ALIGN)*H_SNAP_ALIGN;
+    writer->closing = false;
+    writer->profiler = profiler;
+    writer->write_s = 0.0;
+    writer->wait_copy_s = 0.0;
+    writer->stall_s = 0.0;
+    writer->drain_s = 0.0;
+    writer->nwritten = 0;
+    writer->nbytes_written = 0;
+    writer->max_pending = 0;
+    writer->error = 0;
+
+    // O_DIRECT needs every write to be a whole number of blocks
+    writer->direct = false;
+#ifdef O_DIRECT
+    if (direct && (nbytes_snap % H_SNAP_ALIGN == 0)) {
+        writer->fd = h_snap_open(filename, true);
+        writer->direct = (writer->fd != H_SNAP_NO_FILE);
+    } else if (direct) {
+        std::printf("Snapshots of %zu bytes are not a multiple of %d, not using O_DIRECT\n",
+            nbytes_snap, H_SNAP_ALIGN);
+    }
+#else
+    if (direct) {
+        std::printf("O_DIRECT is not available, writing through the page cache\n");
+    }
+#endif
+    if (!writer->direct) {
+        writer->fd = h_snap_open(filename, false);
+    }
+    if (writer->fd == H_SNAP_NO_FILE) {
+        std::printf("Error in opening file %s, %s\n", filename, 
+            h_snap_error_string(h_snap_last_error()).c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // Write the header padded out to a full block
+    void* header_block = h_snap_alloc(H_SNAP_HEADER_BYTES);
+    std::memset(header_block, 0, H_SNAP_HEADER_BYTES);
+    std::memcpy(header_block, header, sizeof(h_snap_header_t));
+    int write_code = h_pwrite_all(writer->fd, header_block, H_SNAP_HEADER_BYTES, 0);
+    h_snap_free(header_block);
+    if (write_code != 0) {
+        std::printf("Error in writing the header of %s, %s\n", filename, 
+            h_snap_error_string(write_code).c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    // Staging memory, aligned for O_DIRECT
+    for (size_t n=0; n<nslots; n++) {
+        void* slot = h_snap_alloc(writer->nbytes_slot);
+        if (slot == NULL) {
+            std::printf("Error in allocating %zu bytes of staging memory\n", writer->nbytes_slot);
+            exit(EXIT_FAILURE);
+        }
+        writer->slots.push_back(slot);
+        writer->free_slots.push_back((int)n);
+    }
+
+    writer->thread = std::thread(h_snap_writer_loop, writer);
+    return writer;
+}
+
+/// Get a free staging slot, blocks while every slot is in use
+int h_snap_writer_acquire(h_snap_writer_t* writer) {
+    cl_ulong t0 = h_snap_writer_ns(writer);
+    std::unique_lock<std::mutex> guard(writer->lock);
+    writer->slot_ready.wait(guard, [writer]{ return !writer->free_slots.empty(); });
+    int slot = writer->free_slots.front();
+    writer->free_slots.pop_front();
+    cl_ulong t1 = h_snap_writer_ns(writer);
+    writer->stall_s += (t1-t0)*1.0e-9;
+    writer->blocked.push_back(std::make_pair(t0, t1));
+    return slot;
+}
+
+/// Host memory behind a staging slot
+void* h_snap_writer_data(h_snap_writer_t* writer, int slot) {
+    return writer->slots[slot];
+}
+
+/// Queue the snapshot in a slot for writing once event has completed, the event is retained
+void h_snap_writer_submit(h_snap_writer_t* writer, int slot, size_t index, cl_event event) {
+    h_errchk(clRetainEvent(event), "Retaining a snapshot copy event");
+    {
+        std::lock_guard<std::mutex> guard(writer->lock);
+        h_snap_job_t job = { slot, index, event };
+        writer->pending.push_back(job);
+        writer->max_pending = std::max(writer->max_pending, writer->pending.size());
+    }
+    writer->pending_ready.notify_one();
+}
+
+/// Wait for every queued snapshot to be written and stop the writer thread.
+/// Returns 0 on success, or the first error the writer thread met after printing it
+int h_close_snap_writer(h_snap_writer_t* writer) {
+    cl_ulong t0 = h_snap_writer_ns(writer);
+    {
+        std::lock_guard<std::mutex> guard(writer->lock);
+        writer->closing = true;
+    }
+    writer->pending_ready.notify_one();
+    writer->thread.join();
+    int close_code = h_snap_close(writer->fd);
+    if ((close_code != 0) && (writer->error == 0)) {
+        writer->error = close_code;
+        writer->error_message = "Closing snapshot file, " + h_snap_error_string(close_code);
+    }
+    writer->fd = H_SNAP_NO_FILE;
+    cl_ulong t1 = h_snap_writer_ns(writer);
+    writer->drain_s = (t1-t0)*1.0e-9;
+    writer->blocked.push_back(std::make_pair(t0, t1));
+
+    if (writer->error != 0) {
+        std::printf("Error in snapshot writer, %s\n", writer->error_message.c_str());
+    }
+    return writer->error;
+}
+
+/// Add the writer's pwrite activity to a lane of the profiler, call after h_close_snap_writer
+void h_snap_writer_trace(h_snap_writer_t* writer, h_profiler_t* profiler, int lane) {
+    for (auto& span : writer->spans) {
+        h_profiler_host_span(profiler, "pwrite snapshot", lane, span.first, span.second);
+    }
+}
+
+/// Seconds of pwrite activity that happened while the host was blocked on the writer,
+/// both lists of spans are in time order
+cl_double h_snap_writer_exposed_s(h_snap_writer_t* writer) {
+    cl_ulong exposed_ns = 0;
+    size_t b = 0;
+    for (auto& span : writer->spans) {
+        while (b < writer->blocked.size() && writer->blocked[b].second <= span.first) b++;
+        for (size_t k = b; k < writer->blocked.size() && writer->blocked[k].first < span.second; k++) {
+            cl_ulong start = std::max(span.first, writer->blocked[k].first);
+            cl_ulong end = std::min(span.second, writer->blocked[k].second);
+            if (end > start) exposed_ns += end-start;
+        }
+    }
+    return exposed_ns*1.0e-9;
+}
+
+/// Report how much of the writer's time was hidden behind other work, call after h_close_snap_writer
+void h_report_snap_writer(h_snap_writer_t* writer) {
+    cl_double exposed_s = h_snap_writer_exposed_s(writer);
+    cl_double hidden = (writer->write_s > 0.0) ? 1.0-exposed_s/writer->write_s : 1.0;
+    std::printf("Snapshot writer (%s): %zu snapshots, %.2f MB in %.3f s (%.1f MB/s), %zu slots, deepest queue %zu\n",
+        writer->direct ? "O_DIRECT" : "buffered",
+        writer->nwritten,
+        writer->nbytes_written/1.0e6,
+        writer->write_s,
+        (writer->write_s > 0.0) ? writer->nbytes_written/1.0e6/writer->write_s : 0.0,
+        writer->slots.size(),
+        writer->max_pending);
+    std::printf("\twaiting on copies %.3f s, host stalled on slots %.3f s, drain after the loop %.3f s\n",
+        writer->wait_copy_s, writer->stall_s, writer->drain_s);
+    std::printf("\t%.3f s of write time was exposed to the host, %.1f%% was hidden behind compute and copies\n",
+        exposed_s, 100.0*hidden);
+}
+
+/// Free the staging memory of a closed writer
+void h_release_snap_writer(h_snap_writer_t* writer) {
+    assert(writer->fd == H_SNAP_NO_FILE);
+    for (void* slot : writer->slots) {
+        h_snap_free(slot);
+    }
+    delete writer;
+}
@@ -13,6 +13,11 @@
 #include <ctime>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 
 /// Fill a matrix with random numbers
 template<typename T>
@@ -74,9 +79,9 @@ void m_show_matrix(T* src, size_t N0, size_t N1) {
     std::cout << "\n";
 }
 
-/// Do matrix multiplication on the CPU
+/// Naive matrix multiplication on the CPU, kept as a reference
 template<typename T>
-void m_mat_mult(T* A, T* B, T* C, size_t N1_A, size_t N0_C, size_t N1_C) {
+void m_mat_mult_naive(T* A, T* B, T* C, size_t N1_A, size_t N0_C, size_t N1_C) {
     
     for (size_t i0=0; i0<N0_C; i0++) {
         for (size_t i1=0; i1<N1_C; i1++) {
@@ -94,6 +99,115 @@ void m_mat_mult(T* A, T* B, T* C, size_t N1_A, size_t N0_C, size_t N1_C) {
     }
 }
 
+// Block sizes for the blocked matrix multiplication,
+// a block of B (M_BLOCK_N1_A, M_BLOCK_N1_C) should fit in L2 cache
+#define M_BLOCK_N0_C 64
+#define M_BLOCK_N1_C 256
+#define M_BLOCK_N1_A 256
+
+// Size of the register tile of C computed by the micro-kernel
+#define M_TILE_N0 4
+#define M_TILE_N1 16
+
+/// Update a tile of C with rows [k0, k1) of B, 
+/// the register tile has size (M0, M1) and the actual tile (m0, m1)
+template<typename T, size_t M0, size_t M1>
+inline void m_mat_mult_tile(
+        T* A, T* B, T* C, 
+        size_t N1_A, size_t N1_C, 
+        size_t i0, size_t i1, 
+        size_t m0, size_t m1,
+        size_t k0, size_t k1) {
+
+    if ((m0 == M0) && (m1 == M1)) {
+        // Full tile, sizes known at compile time so 
+        // the accumulator stays in registers and the inner loop vectorises
+        T acc[M0][M1];
+        for (size_t r=0; r<M0; r++) {
+            for (size_t c=0; c<M1; c++) {
+                acc[r][c] = C[(i0+r)*N1_C+i1+c];
+            }
+        }
+
+        for (size_t n=k0; n<k1; n++) {
+            T* B_n = &B[n*N1_C+i1];
+            for (size_t r=0; r<M0; r++) {
+                T a = A[(i0+r)*N1_A+n];
+                #pragma omp simd
+                for (size_t c=0; c<M1; c++) {
+                    acc[r][c] += a*B_n[c];
+                }
+            }
+        }
+
+        for (size_t r=0; r<M0; r++) {
+            for (size_t c=0; c<M1; c++) {
+                C[(i0+r)*N1_C+i1+c] = acc[r][c];
+            }
+        }
+    } else {
+        // Partial tile at the edges of C
+        for (size_t r=0; r<m0; r++) {
+            for (size_t n=k0; n<k1; n++) {
+                T a = A[(i0+r)*N1_A+n];
+                T* B_n = &B[n*N1_C+i1];
+                T* C_r = &C[(i0+r)*N1_C+i1];
+                #pragma omp simd
+                for (size_t c=0; c<m1; c++) {
+                    C_r[c] += a*B_n[c];
+                }
+            }
+        }
+    }
+}
+
+/// Do matrix multiplication on the CPU, 
+/// blocked for cache, register tiled, and parallel with OpenMP
+template<typename T>
+void m_mat_mult(T* A, T* B, T* C, size_t N1_A, size_t N0_C, size_t N1_C) {
+
+    // Number of blocks along each dimension of C
+    size_t nblocks0 = N0_C/M_BLOCK_N0_C + ((N0_C % M_BLOCK_N0_C) ? 1 : 0);
+    size_t nblocks1 = N1_C/M_BLOCK_N1_C + ((N1_C % M_BLOCK_N1_C) ? 1 : 0);
+
+    // Each thread owns whole blocks of C
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (size_t b0=0; b0<nblocks0; b0++) {
+        for (size_t b1=0; b1<nblocks1; b1++) {
+            
+            // Extent of this block of C
+            size_t start0 = b0*M_BLOCK_N0_C;
+            size_t end0 = std::min(start0+M_BLOCK_N0_C, N0_C);
+            size_t start1 = b1*M_BLOCK_N1_C;
+            size_t end1 = std::min(start1+M_BLOCK_N1_C, N1_C);
+
+            // Zero the block
+            for (size_t i0=start0; i0<end0; i0++) {
+                for (size_t i1=start1; i1<end1; i1++) {
+                    C[i0*N1_C+i1] = 0;
+                }
+            }
+
+            // Loop over blocks of the inner dimension
+            for (size_t k0=0; k0<N1_A; k0+=M_BLOCK_N1_A) {
+                size_t k1 = std::min(k0+M_BLOCK_N1_A, N1_A);
+
+                // Loop over register tiles within the block
+                for (size_t i0=start0; i0<end0; i0+=M_TILE_N0) {
+                    for (size_t i1=start1; i1<end1; i1+=M_TILE_N1) {
+                        m_mat_mult_tile<T, M_TILE_N0, M_TILE_N1>(
+                            A, B, C, N1_A, N1_C, i0, i1,
+                            std::min((size_t)M_TILE_N0, end0-i0),
+                            std::min((size_t)M_TILE_N1, end1-i1),
+                            k0, k1
+                        );
+                    }
+                }
+            }
+        }
+    }
+}
+
 /// Do Hadamard (elementwise) matrix multiplication
 template<typename T>
 void m_hadamard(T* A, T* B, T* C, size_t N0_C, size_t N1_C) {
@@ -109,6 +223,97 @@ void m_hadamard(T* A, T* B, T* C, size_t N0_C, size_t N1_C) {
     }
 }
 
+/// Transpose src of size (N0, N1) into dst of size (N1, N0)
+template<typename T>
+void m_transpose(T* src, T* dst, size_t N0, size_t N1) {
+
+    for (size_t i0=0; i0<N0; i0++) {
+        for (size_t i1=0; i1<N1; i1++) {
+            dst[i1*N0+i0] = src[i0*N1+i1];
+        }
+    }
+}
+
+/// Convert a float to IEEE 754 half precision bits, rounding to nearest even
+inline uint16_t m_float_to_half(float value) {
+
+    uint32_t x;
+    std::memcpy(&x, &value, sizeof(uint32_t));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int32_t exp = (int32_t)((x >> 23) & 0xff);
+
+    // Infinity stays infinity, NaN stays a (quiet) NaN
+    if (exp == 0xff) {
+        return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 | (mant >> 13) : 0));
+    }
+
+    // Rebias the exponent from float to half
+    exp = exp - 127 + 15;
+
+    // Too large for half, round to infinity
+    if (exp >= 0x1f) return (uint16_t)(sign | 0x7c00);
+
+    // Subnormal half, or too small and rounds to zero
+    if (exp <= 0) {
+        if (exp < -10) return (uint16_t)sign;
+        mant |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exp);
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if ((rem > halfway) || ((rem == halfway) && (h & 1))) h++;
+        return (uint16_t)(sign | h);
+    }
+
+    // Normal half, a carry out of the mantissa correctly bumps the exponent
+    uint32_t h = sign | ((uint32_t)exp << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if ((rem > 0x1000) || ((rem == 0x1000) && (h & 1))) h++;
+    return (uint16_t)h;
+}
+
+/// Convert IEEE 754 half precision bits to a float
+inline float m_half_to_float(uint16_t value) {
+
+    uint32_t sign = ((uint32_t)value & 0x8000) << 16;
+    uint32_t exp = ((uint32_t)value >> 10) & 0x1f;
+    uint32_t mant = (uint32_t)value & 0x3ff;
+    uint32_t x;
+
+    if (exp == 0) {
+        // Zero or subnormal, value is mant*2^-24
+        float f = std::ldexp((float)mant, -24);
+        return sign ? -f : f;
+    } else if (exp == 0x1f) {
+        // Infinity or NaN
+        x = sign | 0x7f800000 | (mant << 13);
+    } else {
+        x = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &x, sizeof(float));
+    return f;
+}
+
+/// Convert a matrix to half precision storage
+template<typename T>
+void m_to_half(T* src, uint16_t* dst, size_t N0, size_t N1) {
+    for (size_t n=0; n<N0*N1; n++) {
+        dst[n] = m_float_to_half((float)src[n]);
+    }
+}
+
+/// Convert a matrix from half precision storage
+template<typename T>
+void m_from_half(uint16_t* src, T* dst, size_t N0, size_t N1) {
+    for (size_t n=0; n<N0*N1; n++) {
+        dst[n] = (T)m_half_to_float(src[n]);
+    }
+}
+
 /// Find the maximum absolute difference between two matrices
 template<typename T>
 T m_max_error(T* M0, T* M1, size_t N0, size_t N1) {
@@ -139,9 +344,9 @@ void m_residual(T* A, T* B, T* C, size_t N0, size_t N1) {
     }
 }
 
-/// Cross-correlation on the CPU
+/// Naive cross-correlation on the CPU, kept as a reference
 template<typename T>
-void m_xcorr(
+void m_xcorr_naive(
         T* dst, 
         T* src, 
         T* krn, 
@@ -178,4 +383,236 @@ void m_xcorr(
             dst[i0*len1_src+i1]=sum;
         }
     }
-}
\ No newline at end of file
+}
+
+/// Cross-correlate rows [start0, end0) of an image with a kernel, 
+/// the inner loop runs along a row so it vectorises
+template<typename T>
+inline void m_xcorr_rows(
+        T* dst, 
+        T* src, 
+        T* krn, 
+        size_t len1_src,
+        size_t K0,
+        size_t K1,
+        size_t pad0_l,
+        size_t pad1_l,
+        size_t pad1_r,
+        size_t start0,
+        size_t end0) {
+
+    // Interior columns of the output
+    size_t start1=pad1_l, end1=len1_src-pad1_r;
+
+    for (size_t i0=start0; i0<end0; i0++) {
+        T* dst_row=&dst[i0*len1_src];
+        for (size_t i1=start1; i1<end1; i1++) {
+            dst_row[i1]=0;
+        }
+
+        // Same summation order as the naive loop
+        for (size_t k0=0; k0<K0; k0++) {
+            for (size_t k1=0; k1<K1; k1++) {
+                T weight=krn[k0*K1+k1];
+                T* src_row=&src[(i0-pad0_l+k0)*len1_src+k1-pad1_l];
+                #pragma omp simd
+                for (size_t i1=start1; i1<end1; i1++) {
+                    dst_row[i1]+=weight*src_row[i1];
+                }
+            }
+        }
+    }
+}
+
+/// Check if a kernel of size (K0, K1) is separable (rank 1), 
+/// and if so find krn0 and krn1 such that krn[k0*K1+k1] = krn0[k0]*krn1[k1]
+template<typename T>
+bool m_separable(T* krn, size_t K0, size_t K1, T* krn0, T* krn1) {
+
+    // Find the largest element as the pivot
+    size_t p0=0, p1=0;
+    T max_abs=0;
+    for (size_t k0=0; k0<K0; k0++) {
+        for (size_t k1=0; k1<K1; k1++) {
+            if (std::fabs(krn[k0*K1+k1])>max_abs) {
+                max_abs=std::fabs(krn[k0*K1+k1]);
+                p0=k0;
+                p1=k1;
+            }
+        }
+    }
+
+    // Column through the pivot, and row through the pivot scaled by the pivot
+    T pivot=(max_abs>0) ? krn[p0*K1+p1] : (T)1;
+    for (size_t k0=0; k0<K0; k0++) {
+        krn0[k0]=krn[k0*K1+p1];
+    }
+    for (size_t k1=0; k1<K1; k1++) {
+        krn1[k1]=krn[p0*K1+k1]/pivot;
+    }
+
+    // Check the outer product reproduces the kernel to rounding error
+    T tol=16*std::numeric_limits<T>::epsilon()*max_abs;
+    for (size_t k0=0; k0<K0; k0++) {
+        for (size_t k1=0; k1<K1; k1++) {
+            if (std::fabs(krn[k0*K1+k1]-krn0[k0]*krn1[k1])>tol) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// Cross-correlation with a separable kernel, as a pass along rows with krn1
+/// followed by a pass along columns with krn0
+template<typename T>
+void m_xcorr_separable(
+        T* dst, 
+        T* src, 
+        T* krn0, 
+        T* krn1, 
+        size_t len0_src,
+        size_t len1_src, 
+        size_t pad0_l,
+        size_t pad0_r,
+        size_t pad1_l,
+        size_t pad1_r) {
+
+    size_t K0=pad0_l+pad0_r+1;
+    size_t K1=pad1_l+pad1_r+1;
+    size_t start1=pad1_l, end1=len1_src-pad1_r;
+
+    // Result of the row pass
+    T* temp=(T*)calloc(len0_src*len1_src, sizeof(T));
+
+    #pragma omp parallel
+    {
+        #pragma omp for schedule(static)
+        for (size_t i0=0; i0<len0_src; i0++) {
+            T* temp_row=&temp[i0*len1_src];
+            for (size_t k1=0; k1<K1; k1++) {
+                T weight=krn1[k1];
+                T* src_row=&src[i0*len1_src+k1-pad1_l];
+                #pragma omp simd
+                for (size_t i1=start1; i1<end1; i1++) {
+                    temp_row[i1]+=weight*src_row[i1];
+                }
+            }
+        }
+
+        #pragma omp for schedule(static)
+        for (size_t i0=pad0_l; i0<len0_src-pad0_r; i0++) {
+            T* dst_row=&dst[i0*len1_src];
+            for (size_t i1=start1; i1<end1; i1++) {
+                dst_row[i1]=0;
+            }
+            for (size_t k0=0; k0<K0; k0++) {
+                T weight=krn0[k0];
+                T* temp_row=&temp[(i0-pad0_l+k0)*len1_src];
+                #pragma omp simd
+                for (size_t i1=start1; i1<end1; i1++) {
+                    dst_row[i1]+=weight*temp_row[i1];
+                }
+            }
+        }
+    }
+
+    free(temp);
+}
+
+/// Cross-correlation on the CPU, parallel over rows with OpenMP. 
+/// Separable kernels automatically use two one-dimensional passes.
+template<typename T>
+void m_xcorr(
+        T* dst, 
+        T* src, 
+        T* krn, 
+        size_t len0_src,
+        size_t len1_src, 
+        size_t pad0_l,
+        size_t pad0_r,
+        size_t pad1_l,
+        size_t pad1_r) {
+
+    // Assuming row-major ordering
+    
+    // Size of the kernel
+    size_t K0=pad0_l+pad0_r+1;
+    size_t K1=pad1_l+pad1_r+1;
+    
+    // Make sure the sizes work ok
+    assert(len0_src>=K0);
+    assert(len1_src>=K1);    
+
+    // Fast path for separable kernels, only worthwhile when the 2D kernel 
+    // costs more than the extra pass over memory of the 1D kernels
+    T* krn0=(T*)calloc(K0, sizeof(T));
+    T* krn1=(T*)calloc(K1, sizeof(T));
+    bool separable=(K0*K1>2*(K0+K1)) && m_separable(krn, K0, K1, krn0, krn1);
+
+    if (separable) {
+        m_xcorr_separable(dst, src, krn0, krn1, len0_src, len1_src, pad0_l, pad0_r, pad1_l, pad1_r);
+    } else {
+        #pragma omp parallel for schedule(static)
+        for (size_t i0=pad0_l; i0<len0_src-pad0_r; i0++) {
+            m_xcorr_rows(dst, src, krn, len1_src, K0, K1, pad0_l, pad1_l, pad1_r, i0, i0+1);
+        }
+    }
+
+    free(krn0);
+    free(krn1);
+}
+
+/// Cross-correlation of a stack of nimages images, 
+/// each of size (len0_src, len1_src) and stored one after the other
+template<typename T>
+void m_xcorr_batch(
+        T* dst, 
+        T* src, 
+        T* krn, 
+        size_t nimages,
+        size_t len0_src,
+        size_t len1_src, 
+        size_t pad0_l,
+        size_t pad0_r,
+        size_t pad1_l,
+        size_t pad1_r) {
+
+    size_t K0=pad0_l+pad0_r+1;
+    size_t K1=pad1_l+pad1_r+1;
+    assert(len0_src>=K0);
+    assert(len1_src>=K1);    
+
+    size_t nelements_image=len0_src*len1_src;
+
+    T* krn0=(T*)calloc(K0, sizeof(T));
+    T* krn1=(T*)calloc(K1, sizeof(T));
+    bool separable=(K0*K1>2*(K0+K1)) && m_separable(krn, K0, K1, krn0, krn1);
+
+    if (separable) {
+        // Each image is parallel internally
+        for (size_t n=0; n<nimages; n++) {
+            m_xcorr_separable(
+                &dst[n*nelements_image], &src[n*nelements_image], krn0, krn1, 
+                len0_src, len1_src, pad0_l, pad0_r, pad1_l, pad1_r
+            );
+        }
+    } else {
+        // Share the rows of all images among threads
+        size_t nrows=len0_src-pad0_l-pad0_r;
+
+        #pragma omp parallel for collapse(2) schedule(static)
+        for (size_t n=0; n<nimages; n++) {
+            for (size_t r=0; r<nrows; r++) {
+                m_xcorr_rows(
+                    &dst[n*nelements_image], &src[n*nelements_image], krn, 
+                    len1_src, K0, K1, pad0_l, pad1_l, pad1_r, 
+                    pad0_l+r, pad0_l+r+1
+                );
+            }
+        }
+    }
+
+    free(krn0);
+    free(krn1);
+}
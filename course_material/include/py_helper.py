@@ -377,6 +377,55 @@ def plot_slices(images):
         n=(0, nslices-1, 1)
     )
 
+def load_snapshots(filename, dtype, shape, return_header=False):
+    """Load snapshots written by the snapshot writer in io_helper.hpp,
+    files without its header are read as raw arrays of the given shape.
+    With return_header=True a dictionary of the header is returned as well,
+    holding the time between snapshots and, from version 2 onwards, 
+    the origin and stride of the region of the grid that was kept"""
+    header_fields=[
+        ("version", "<u4"),
+        ("header_bytes", "<u4"),
+        ("ndim", "<u4"),
+        ("dtype", "S8"),
+        ("pad", "<u4"),
+        ("dims", "<u8", 4),
+        ("dt", "<f8")]
+    with open(filename, "rb") as fd:
+        magic=fd.read(8)
+        if magic==b"WAVESNAP":
+            version=int(np.fromfile(fd, dtype="<u4", count=1)[0])
+            if version>=2:
+                header_fields+=[
+                    ("origin", "<u4", 2),
+                    ("stride", "<u4", 2)]
+            fd.seek(8)
+            header=np.fromfile(fd, dtype=np.dtype(header_fields), count=1)[0]
+            ndim=int(header["ndim"])
+            dims=tuple(int(d) for d in header["dims"][:ndim])
+            fd.seek(int(header["header_bytes"]))
+            data=np.fromfile(fd, dtype=np.dtype(header["dtype"].decode("ascii")))
+            data=data.reshape(dims)
+            if not return_header:
+                return data
+            info={
+                "version" : version,
+                "dims" : dims,
+                "dt" : float(header["dt"]),
+                "origin" : (0, 0),
+                "stride" : (1, 1)}
+            if version>=2:
+                info["origin"]=tuple(int(n) for n in header["origin"])
+                info["stride"]=tuple(int(n) for n in header["stride"])
+            return data, info
+    
+    data=np.fromfile(filename, dtype=dtype)
+    nimages=int(data.size//np.prod(shape))
+    data=data.reshape((nimages,)+tuple(shape))
+    if return_header:
+        return data, None
+    return data
+
 def load_benchmark(filename):
     with open(filename, "r") as fd:
         result_json=" ".join(fd.readlines())